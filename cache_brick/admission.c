@@ -0,0 +1,232 @@
+/**
+ * Admission policies for the cache brick: decide whether a path that missed the
+ * cache is worth caching at all. The cache never evicts anything, so without a
+ * policy a single sequential scan (tar, backups) fills it with entries that are
+ * never looked at again.
+ *
+ * Every policy sees every miss. Available policies:
+ *
+ * - always: cache everything (the historical behaviour).
+ * - second-hit: cache a path the second time it misses. Remembered paths are
+ *   kept in a bitmap of hashes (a "doorkeeper") that is cleared periodically.
+ * - tinylfu: estimate the recent access frequency of every path in a count-min
+ *   sketch and cache it once that reaches ADMIT_THRESHOLD. All counters are
+ *   halved periodically, so old popularity fades.
+ */
+
+#include "cache_brick/admission.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+/** Number of rows (independent hash functions) in the count-min sketch. */
+#define SKETCH_DEPTH 4
+/** Estimated frequency at which tinylfu admits a path. */
+#define ADMIT_THRESHOLD 2
+/** Age after this many accesses per counter (or bit). */
+#define SAMPLE_FACTOR 8
+
+struct admission_policy {
+    const char *name;
+    /** Allocate the policy's state (in adm->data). Returns 0 on success. */
+    int (* init)(struct admission *adm);
+    /** Record an access to given hash and decide (1: admit). Locked. */
+    int (* admit)(struct admission *adm, uint64_t hash);
+};
+
+struct admission {
+    const struct admission_policy *policy;
+    /** Counters or bits, depending on the policy. */
+    void *data;
+    /** Width of the bitmap or of every row of the sketch. */
+    uint_t size;
+    /** Accesses since the last aging. */
+    uint_t samples;
+    kfs_mutex_t lock;
+};
+
+static int
+always_init(struct admission *adm)
+{
+    (void) adm;
+
+    KFS_ENTER();
+
+    KFS_RETURN(0);
+}
+
+static int
+always_admit(struct admission *adm, uint64_t hash)
+{
+    (void) adm;
+    (void) hash;
+
+    KFS_ENTER();
+
+    KFS_RETURN(1);
+}
+
+static int
+secondhit_init(struct admission *adm)
+{
+    KFS_ENTER();
+
+    adm->data = KFS_CALLOC((adm->size + 7) / 8, 1);
+
+    KFS_RETURN(adm->data == NULL ? -1 : 0);
+}
+
+static int
+secondhit_admit(struct admission *adm, uint64_t hash)
+{
+    uint8_t * const bits = adm->data;
+    const uint64_t bit = hash % adm->size;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    adm->samples += 1;
+    if (adm->samples > SAMPLE_FACTOR * adm->size) {
+        /* Forget everything: a full bitmap would admit anything. */
+        memset(bits, 0, (adm->size + 7) / 8);
+        adm->samples = 0;
+    }
+    ret = (bits[bit / 8] >> (bit % 8)) & 1;
+    bits[bit / 8] |= 1 << (bit % 8);
+
+    KFS_RETURN(ret);
+}
+
+static int
+tinylfu_init(struct admission *adm)
+{
+    KFS_ENTER();
+
+    adm->data = KFS_CALLOC(SKETCH_DEPTH * adm->size, sizeof(uint8_t));
+
+    KFS_RETURN(adm->data == NULL ? -1 : 0);
+}
+
+static int
+tinylfu_admit(struct admission *adm, uint64_t hash)
+{
+    uint8_t * const counters = adm->data;
+    uint8_t *counter = NULL;
+    uint_t estimate = UINT8_MAX;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    adm->samples += 1;
+    if (adm->samples > SAMPLE_FACTOR * adm->size) {
+        for (i = 0; i < SKETCH_DEPTH * adm->size; i++) {
+            counters[i] /= 2;
+        }
+        adm->samples = 0;
+    }
+    for (i = 0; i < SKETCH_DEPTH; i++) {
+        /* Derive the row hashes from both halves of the path hash. */
+        counter = &counters[i * adm->size +
+            ((hash >> 32) + i * (hash & 0xffffffff)) % adm->size];
+        if (*counter < UINT8_MAX) {
+            *counter += 1;
+        }
+        estimate = MIN(estimate, *counter);
+    }
+
+    KFS_RETURN(estimate >= ADMIT_THRESHOLD);
+}
+
+static const struct admission_policy policies[] = {
+    {"always", always_init, always_admit},
+    {"second-hit", secondhit_init, secondhit_admit},
+    {"tinylfu", tinylfu_init, tinylfu_admit},
+};
+
+/**
+ * Create an admission policy by name, tracking size entries. Returns NULL on
+ * failure (including unknown policies).
+ */
+struct admission *
+admission_new(const char *policy, uint_t size)
+{
+    struct admission *adm = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(policy != NULL && size > 0);
+    adm = KFS_MALLOC(sizeof(*adm));
+    if (adm == NULL) {
+        KFS_RETURN(NULL);
+    }
+    adm->policy = NULL;
+    for (i = 0; i < NUMELEM(policies); i++) {
+        if (strcmp(policies[i].name, policy) == 0) {
+            adm->policy = &policies[i];
+            break;
+        }
+    }
+    if (adm->policy == NULL) {
+        KFS_ERROR("Unknown admission policy: %s.", policy);
+        adm = KFS_FREE(adm);
+        KFS_RETURN(NULL);
+    }
+    adm->data = NULL;
+    adm->size = size;
+    adm->samples = 0;
+    ret = adm->policy->init(adm);
+    if (ret != 0) {
+        adm = KFS_FREE(adm);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&adm->lock);
+    if (ret != 0) {
+        adm->data = KFS_FREE(adm->data);
+        adm = KFS_FREE(adm);
+        KFS_RETURN(NULL);
+    }
+
+    KFS_RETURN(adm);
+}
+
+struct admission *
+admission_del(struct admission *adm)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(adm != NULL);
+    kfs_mutex_destroy(&adm->lock);
+    if (adm->data != NULL) {
+        adm->data = KFS_FREE(adm->data);
+    }
+    adm = KFS_FREE(adm);
+
+    KFS_RETURN(adm);
+}
+
+/**
+ * Record a cache miss for given path. Returns 1 if it should be cached, 0 if
+ * not.
+ */
+int
+admission_admit(struct admission *adm, const char *path)
+{
+    const uint64_t hash = kfs_strhash(path);
+    int ret = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&adm->lock);
+    ret = adm->policy->admit(adm, hash);
+    kfs_mutex_unlock(&adm->lock);
+
+    KFS_RETURN(ret);
+}
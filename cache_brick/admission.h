@@ -0,0 +1,12 @@
+#ifndef KFS_CACHE_BRICK_ADMISSION_H
+#define KFS_CACHE_BRICK_ADMISSION_H
+
+#include "kfs.h"
+
+struct admission;
+
+struct admission * admission_new(const char *policy, uint_t size);
+struct admission * admission_del(struct admission *adm);
+int admission_admit(struct admission *adm, const char *path);
+
+#endif
@@ -0,0 +1,578 @@
+/**
+ * Metadata index for the cache brick: a hash table from pathname to cached
+ * metadata, stored in a memory-mapped file. An alternative to storing the
+ * metadata in extended attributes on the cache brick: lookups are plain memory
+ * reads and the cache brick does not need to support xattrs at all.
+ *
+ * The table is open-addressed with linear probing over a bounded window. Slots
+ * are identified by a 64 bit hash of the pathname and verified by a second,
+ * independent hash. There is no way to enumerate paths, so an operation that
+ * changes many paths at once (renaming a directory) invalidates the entire
+ * index by bumping its generation: slots of an older generation are dead.
+ *
+ * Concurrency: writers are serialised by a mutex, readers take no lock at all.
+ * Every slot has a sequence number that is odd while the slot is being written
+ * to; readers retry (or give up) if it changed while they were copying.
+ *
+ * Crash consistency: the header has a "dirty" flag that is set while the index
+ * is open and cleared after a successful msync() on close. An index that is
+ * found dirty when it is opened is discarded entirely (by bumping the
+ * generation), so a crash can cost cached metadata but never corrupt it.
+ *
+ * The header also records which cache the index belongs to (struct
+ * index_owner). An index that is opened for another cache, or for the same one
+ * after it was wiped, is discarded the same way.
+ */
+
+#include "cache_brick/index.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#define INDEX_MAGIC 0x4b465349 /* "KFSI" */
+#define INDEX_VERSION 2
+/** Maximum number of slots looked at for one path. */
+#define INDEX_PROBE 16
+/** Maximum number of attempts to read a slot that is being written to. */
+#define INDEX_READ_RETRY 8
+
+/** Cached stat is valid. */
+#define SLOT_STAT 0x1
+/** The directory listing is completely cached. */
+#define SLOT_READDIR 0x2
+/** Slot was in use but has been invalidated. */
+#define SLOT_TOMBSTONE 0x4
+
+/**
+ * Start of the index file. All fields are in host byte order: the index is not
+ * meant to be moved between machines.
+ */
+struct index_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_slots;
+    /** Slots of any other generation are dead. */
+    uint64_t generation;
+    /** Non-zero while the index is in use. */
+    uint32_t dirty;
+    uint32_t reserved;
+    /** The cache this index describes. */
+    struct index_owner owner;
+};
+
+struct index_slot {
+    /** Odd while the slot is being written to. */
+    uint32_t seq;
+    uint32_t flags;
+    /** Hash of the pathname. 0 means this slot has never been used. */
+    uint64_t hash;
+    /** Second hash of the pathname, to tell colliding paths apart. */
+    uint64_t check;
+    uint64_t generation;
+    /** Metadata in serialise_stat() format (valid if SLOT_STAT is set). */
+    uint32_t stat[13];
+    uint32_t reserved;
+    /**
+     * Bitmap of cached data blocks. Reserved: this brick does not cache file
+     * contents (yet).
+     */
+    uint64_t blocks;
+};
+
+struct cache_index {
+    int fd;
+    /** The entire file: header followed by the slots. */
+    void *map;
+    size_t mapsize;
+    struct index_header *header;
+    struct index_slot *slots;
+    uint64_t num_slots;
+    /** Serialises all writers. */
+    kfs_mutex_t lock;
+};
+
+/**
+ * Primary hash of a pathname. Never returns 0 (that marks unused slots).
+ */
+static uint64_t
+hash_path(const char *path)
+{
+    uint64_t hash = 0;
+
+    KFS_ENTER();
+
+    hash = kfs_strhash(path);
+    if (hash == 0) {
+        hash = 1;
+    }
+
+    KFS_RETURN(hash);
+}
+
+/**
+ * A second, unrelated hash (djb2 variant, 64 bit).
+ */
+static uint64_t
+check_path(const char *path)
+{
+    uint64_t hash = 5381;
+
+    KFS_ENTER();
+
+    for (; *path != '\0'; path++) {
+        hash = (hash * 33) ^ (unsigned char) *path;
+    }
+
+    KFS_RETURN(hash);
+}
+
+/**
+ * Take a consistent snapshot of given slot into copy. Returns 0 on success, -1
+ * if the slot was being written to all the time.
+ */
+static int
+read_slot(const struct index_slot *slot, struct index_slot *copy)
+{
+    const volatile struct index_slot * const vslot = slot;
+    uint32_t seq = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < INDEX_READ_RETRY; i++) {
+        seq = vslot->seq;
+        if (seq % 2 != 0) {
+            continue;
+        }
+        kfs_memory_barrier();
+        memcpy(copy, slot, sizeof(*copy));
+        kfs_memory_barrier();
+        if (vslot->seq == seq) {
+            KFS_RETURN(0);
+        }
+    }
+
+    KFS_RETURN(-1);
+}
+
+/**
+ * Find the slot of given path and take a snapshot of it. Returns 0 if it was
+ * found, -1 if not.
+ */
+static int
+lookup(struct cache_index *idx, const char *path, struct index_slot *copy)
+{
+    const uint64_t hash = hash_path(path);
+    const uint64_t check = check_path(path);
+    const volatile uint64_t * const generation = &idx->header->generation;
+    uint64_t pos = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < INDEX_PROBE; i++) {
+        pos = (hash + i) % idx->num_slots;
+        ret = read_slot(&idx->slots[pos], copy);
+        if (ret != 0) {
+            continue;
+        }
+        if (copy->hash == 0) {
+            /* Never used: the path can not be further down. */
+            break;
+        }
+        if (copy->hash == hash && copy->check == check &&
+                copy->generation == *generation &&
+                (copy->flags & SLOT_TOMBSTONE) == 0) {
+            KFS_RETURN(0);
+        }
+    }
+
+    KFS_RETURN(-1);
+}
+
+/**
+ * Find the slot for given path, claiming a new one if it is not in the index
+ * yet (possibly evicting another path, in which case *evicted is set to 1).
+ * Caller must hold the lock.
+ */
+static struct index_slot *
+lookup_for_write(struct cache_index *idx, const char *path, int *evicted)
+{
+    const uint64_t hash = hash_path(path);
+    const uint64_t check = check_path(path);
+    const uint64_t generation = idx->header->generation;
+    struct index_slot *slot = NULL;
+    struct index_slot *freeslot = NULL;
+    uint64_t pos = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    *evicted = 0;
+    for (i = 0; i < INDEX_PROBE; i++) {
+        pos = (hash + i) % idx->num_slots;
+        slot = &idx->slots[pos];
+        if (slot->hash == 0) {
+            if (freeslot == NULL) {
+                freeslot = slot;
+            }
+            break;
+        }
+        if (slot->generation != generation ||
+                (slot->flags & SLOT_TOMBSTONE) != 0) {
+            if (freeslot == NULL) {
+                freeslot = slot;
+            }
+            continue;
+        }
+        if (slot->hash == hash && slot->check == check) {
+            KFS_RETURN(slot);
+        }
+    }
+    if (freeslot == NULL) {
+        /* Window is full: evict whatever lives at the home position. */
+        freeslot = &idx->slots[hash % idx->num_slots];
+        *evicted = 1;
+    }
+    slot = freeslot;
+    slot->seq += 1;
+    kfs_memory_barrier();
+    slot->flags = 0;
+    slot->hash = hash;
+    slot->check = check;
+    slot->generation = generation;
+    memset(slot->stat, 0, sizeof(slot->stat));
+    slot->blocks = 0;
+    kfs_memory_barrier();
+    slot->seq += 1;
+
+    KFS_RETURN(slot);
+}
+
+/**
+ * Get the cached metadata of given path. Returns 0 on success, -ENOENT if it is
+ * not in the index.
+ */
+int
+index_get_stat(struct cache_index *idx, const char *path, uint32_t intbuf[13])
+{
+    struct index_slot copy;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = lookup(idx, path, &copy);
+    if (ret != 0 || (copy.flags & SLOT_STAT) == 0) {
+        KFS_RETURN(-ENOENT);
+    }
+    memcpy(intbuf, copy.stat, sizeof(copy.stat));
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Store the metadata of given path. Returns 1 if another path had to be evicted
+ * from the index to make room, 0 otherwise.
+ */
+int
+index_set_stat(struct cache_index *idx, const char *path, const uint32_t
+        intbuf[13])
+{
+    struct index_slot *slot = NULL;
+    int evicted = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&idx->lock);
+    slot = lookup_for_write(idx, path, &evicted);
+    slot->seq += 1;
+    kfs_memory_barrier();
+    memcpy(slot->stat, intbuf, sizeof(slot->stat));
+    slot->flags |= SLOT_STAT;
+    kfs_memory_barrier();
+    slot->seq += 1;
+    kfs_mutex_unlock(&idx->lock);
+
+    KFS_RETURN(evicted);
+}
+
+/**
+ * Returns 1 if the directory listing of given path is completely cached, 0 if
+ * not.
+ */
+int
+index_get_readdir(struct cache_index *idx, const char *path)
+{
+    struct index_slot copy;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = lookup(idx, path, &copy);
+    if (ret != 0 || (copy.flags & SLOT_READDIR) == 0) {
+        KFS_RETURN(0);
+    }
+
+    KFS_RETURN(1);
+}
+
+/**
+ * Mark the listing of given directory as complete. Returns 1 if another path
+ * had to be evicted from the index to make room, 0 otherwise.
+ */
+int
+index_set_readdir(struct cache_index *idx, const char *path)
+{
+    struct index_slot *slot = NULL;
+    int evicted = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&idx->lock);
+    slot = lookup_for_write(idx, path, &evicted);
+    slot->seq += 1;
+    kfs_memory_barrier();
+    slot->flags |= SLOT_READDIR;
+    kfs_memory_barrier();
+    slot->seq += 1;
+    kfs_mutex_unlock(&idx->lock);
+
+    KFS_RETURN(evicted);
+}
+
+int
+index_clear_readdir(struct cache_index *idx, const char *path)
+{
+    struct index_slot copy;
+    struct index_slot *slot = NULL;
+    int evicted = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = lookup(idx, path, &copy);
+    if (ret != 0 || (copy.flags & SLOT_READDIR) == 0) {
+        KFS_RETURN(0);
+    }
+    kfs_mutex_lock(&idx->lock);
+    slot = lookup_for_write(idx, path, &evicted);
+    slot->seq += 1;
+    kfs_memory_barrier();
+    slot->flags &= ~SLOT_READDIR;
+    kfs_memory_barrier();
+    slot->seq += 1;
+    kfs_mutex_unlock(&idx->lock);
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Forget everything about given path.
+ */
+void
+index_invalidate(struct cache_index *idx, const char *path)
+{
+    struct index_slot copy;
+    struct index_slot *slot = NULL;
+    int evicted = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = lookup(idx, path, &copy);
+    if (ret != 0) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&idx->lock);
+    slot = lookup_for_write(idx, path, &evicted);
+    slot->seq += 1;
+    kfs_memory_barrier();
+    /* Keep the hash: later slots in this probe window must stay reachable. */
+    slot->flags = SLOT_TOMBSTONE;
+    kfs_memory_barrier();
+    slot->seq += 1;
+    kfs_mutex_unlock(&idx->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Forget everything about every path.
+ */
+void
+index_invalidate_all(struct cache_index *idx)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&idx->lock);
+    kfs_atomic_add(&idx->header->generation, 1);
+    kfs_mutex_unlock(&idx->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Initialise a fresh index file of given size.
+ */
+static int
+format_index(int fd, size_t mapsize, uint_t num_slots)
+{
+    struct index_header header;
+    ssize_t written = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = ftruncate(fd, 0);
+    if (ret == 0) {
+        /* Zero-filled: all slots are unused. */
+        ret = ftruncate(fd, mapsize);
+    }
+    if (ret != 0) {
+        KFS_RETURN(-errno);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = INDEX_MAGIC;
+    header.version = INDEX_VERSION;
+    header.num_slots = num_slots;
+    header.generation = 1;
+    written = pwrite(fd, &header, sizeof(header), 0);
+    if (written != sizeof(header)) {
+        KFS_RETURN(written == -1 ? -errno : -EIO);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Open (or create) the index at given filename for the cache identified by
+ * owner. If the existing index has another layout or belongs to another cache,
+ * it is discarded. Returns NULL on failure.
+ */
+struct cache_index *
+index_open(const char *filename, uint_t num_slots, const struct index_owner
+        *owner)
+{
+    struct cache_index *idx = NULL;
+    struct index_header header;
+    struct stat stbuf;
+    const size_t mapsize = sizeof(header) + num_slots *
+        sizeof(struct index_slot);
+    ssize_t nread = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(filename != NULL && num_slots > 0 && owner != NULL);
+    idx = KFS_MALLOC(sizeof(*idx));
+    if (idx == NULL) {
+        KFS_RETURN(NULL);
+    }
+    idx->fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (idx->fd == -1) {
+        KFS_ERROR("Could not open cache index %s: %s", filename,
+                strerror(errno));
+        idx = KFS_FREE(idx);
+        KFS_RETURN(NULL);
+    }
+    ret = fstat(idx->fd, &stbuf);
+    if (ret == 0) {
+        memset(&header, 0, sizeof(header));
+        nread = pread(idx->fd, &header, sizeof(header), 0);
+        if (nread != sizeof(header) || header.magic != INDEX_MAGIC ||
+                header.version != INDEX_VERSION ||
+                header.num_slots != num_slots ||
+                (size_t) stbuf.st_size != mapsize) {
+            if (stbuf.st_size != 0) {
+                KFS_INFO("Discarding cache index %s: unknown layout.",
+                        filename);
+            }
+            ret = format_index(idx->fd, mapsize, num_slots);
+        }
+    } else {
+        ret = -errno;
+    }
+    if (ret != 0) {
+        KFS_ERROR("Could not initialise cache index %s: %s", filename,
+                strerror(-ret));
+        close(idx->fd);
+        idx = KFS_FREE(idx);
+        KFS_RETURN(NULL);
+    }
+    idx->map = mmap(NULL, mapsize, PROT_READ | PROT_WRITE, MAP_SHARED,
+            idx->fd, 0);
+    if (idx->map == MAP_FAILED) {
+        KFS_ERROR("Could not map cache index %s: %s", filename,
+                strerror(errno));
+        close(idx->fd);
+        idx = KFS_FREE(idx);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&idx->lock);
+    if (ret != 0) {
+        munmap(idx->map, mapsize);
+        close(idx->fd);
+        idx = KFS_FREE(idx);
+        KFS_RETURN(NULL);
+    }
+    idx->mapsize = mapsize;
+    idx->header = idx->map;
+    idx->slots = (struct index_slot *) (idx->header + 1);
+    idx->num_slots = num_slots;
+    if (idx->header->dirty != 0) {
+        KFS_INFO("Cache index %s was not closed properly, discarding it.",
+                filename);
+        idx->header->generation += 1;
+    } else if (memcmp(&idx->header->owner, owner, sizeof(*owner)) != 0) {
+        if (idx->header->owner.dev != 0 || idx->header->owner.ino != 0) {
+            KFS_INFO("Cache index %s belongs to another cache, discarding "
+                    "it.", filename);
+        }
+        idx->header->generation += 1;
+    }
+    idx->header->owner = *owner;
+    idx->header->dirty = 1;
+    msync(idx->map, sizeof(*idx->header), MS_SYNC);
+
+    KFS_RETURN(idx);
+}
+
+/**
+ * Write everything to disk and close the index. Always returns NULL.
+ */
+struct cache_index *
+index_close(struct cache_index *idx)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(idx != NULL);
+    ret = msync(idx->map, idx->mapsize, MS_SYNC);
+    if (ret == 0) {
+        idx->header->dirty = 0;
+        ret = msync(idx->map, sizeof(*idx->header), MS_SYNC);
+    }
+    if (ret != 0) {
+        KFS_ERROR("Could not write cache index: %s", strerror(errno));
+    }
+    munmap(idx->map, idx->mapsize);
+    close(idx->fd);
+    kfs_mutex_destroy(&idx->lock);
+    idx = KFS_FREE(idx);
+
+    KFS_RETURN(idx);
+}
@@ -0,0 +1,36 @@
+#ifndef KFS_CACHE_BRICK_INDEX_H
+#define KFS_CACHE_BRICK_INDEX_H
+
+#include <stdint.h>
+
+#include "kfs.h"
+
+struct cache_index;
+
+/**
+ * Identity of the cache an index belongs to: the device and inode number of its
+ * root, and the inode number and creation time of a marker file in it (which
+ * disappears if the cache is wiped; inode numbers alone are reused).
+ */
+struct index_owner {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t marker;
+    /** Modification time of the marker, in nanoseconds. */
+    uint64_t marker_ns;
+};
+
+struct cache_index * index_open(const char *filename, uint_t num_slots, const
+        struct index_owner *owner);
+struct cache_index * index_close(struct cache_index *idx);
+int index_get_stat(struct cache_index *idx, const char *path, uint32_t
+        intbuf[13]);
+int index_set_stat(struct cache_index *idx, const char *path, const uint32_t
+        intbuf[13]);
+int index_get_readdir(struct cache_index *idx, const char *path);
+int index_set_readdir(struct cache_index *idx, const char *path);
+int index_clear_readdir(struct cache_index *idx, const char *path);
+void index_invalidate(struct cache_index *idx, const char *path);
+void index_invalidate_all(struct cache_index *idx);
+
+#endif
@@ -4,6 +4,25 @@
  *
  * Does not do any cache expiration, i.e.: if the file is cached, that copy is
  * always considered valid.
+ *
+ * Directory listings read from the source are passed to the caller right away;
+ * creating the corresponding nodes on the cache is done in the background by a
+ * pool of populating threads (option populate_threads, 0 to do it inline).
+ *
+ * Cached metadata (stat results, whether a directory listing is complete) is
+ * stored in extended attributes on the cache brick by default. With metadata =
+ * index it is kept in a memory-mapped index file instead (see index.c), which
+ * also works for cache bricks that do not support extended attributes.
+ *
+ * Paths that do not exist on the source can be remembered for a short while
+ * (negative_entries, negative_ttl). A directory whose listing is completely cached is trusted to
+ * know which of its entries do not exist, without asking the source.
+ *
+ * Whether a missed path or directory listing is cached at all is up to the
+ * admission policy (see admission.c); by default everything is cached.
+ *
+ * Statistics (hits, misses, fill times, etc) can be read from the virtual
+ * extended attribute user.com.kennyfs.brick.cache.stats of the root directory.
  */
 
 #define FUSE_USE_VERSION 29
@@ -12,20 +31,108 @@
 
 #include <errno.h>
 #include <fuse.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 
+#include "minini/minini.h"
+
 #include "kfs.h"
 #include "kfs_api.h"
 #include "kfs_misc.h"
+#include "kfs_threading.h"
+#include "kfs_workqueue.h"
+#include "cache_brick/admission.h"
+#include "cache_brick/index.h"
+#include "cache_brick/negative.h"
+#include "cache_brick/stats.h"
 
 #define LOCAL_XATTR_NS KFS_XATTR_NS ".brick.cache"
 
 #define KFS_XNAME(suffix) (LOCAL_XATTR_NS "." suffix)
 
+/** Default number of slots in the metadata index. */
+#define INDEX_SLOTS_DEFAULT 65536
+
+/** Default number of paths tracked by the admission policy. */
+#define ADMISSION_SIZE_DEFAULT 65536
+
+/** Default lifetime (in ms) of negative lookup cache entries. */
+#define NEGATIVE_TTL_DEFAULT 1000
+
+/**
+ * File in the root of the cache that ties the metadata index to it, see
+ * cache_owner(). Never shown in listings.
+ */
+#define INDEX_MARKER ".kfs_cache_index"
+
+/** Number of directory entries handed to a populating thread at once. */
+#define POPULATE_BATCH 128
+
+/**
+ * Global state of one cache brick.
+ *
+ * The subvolumes must remain the first member: operation handlers that only
+ * need the subvolumes treat co->priv as the array (source first, cache second).
+ */
+struct cache_state {
+    struct kfs_brick subvols[2];
+    /** Threads that populate the cache in the background. NULL: do it inline. */
+    struct kfs_workqueue *populate;
+    /** Metadata index. NULL: metadata is stored in xattrs on the cache. */
+    struct cache_index *index;
+    /** Paths known not to exist on the source. NULL: disabled. */
+    struct negative_cache *negative;
+    /** Decides what is worth caching. NULL: everything is. */
+    struct admission *admission;
+    struct cache_stats *stats;
+    /**
+     * Bumped (under the write lock) whenever a node may have disappeared from
+     * the source or from the cache. Population compares it against the value
+     * at the start of the listing (under the read lock) before it creates a
+     * node or marks a listing complete.
+     */
+    uint64_t changes;
+    kfs_rwlock_t changes_lock;
+};
+
+/**
+ * One directory listing whose entries are being stored on the cache. Shared by
+ * all batches of this listing: whoever drops the last reference marks the
+ * cached directory as complete (unless something failed) and frees it.
+ */
+struct populate_dir {
+    struct cache_state *state;
+    /** Private copy: the caller's context is gone by the time a batch runs. */
+    struct kfs_context co;
+    char *dirpath;
+    /** Value of state->changes when the listing was started. */
+    uint64_t changes;
+    /** Outstanding batches plus one for the open directory handle. */
+    uint_t refcount;
+    /** Set to 1 if any entry could not be cached. */
+    uint_t failure;
+    kfs_mutex_t lock;
+};
+
+/**
+ * A batch of entries from one directory listing, to be created on the cache.
+ * The names are stored back-to-back ('\0'-delimited) in one buffer.
+ */
+struct populate_batch {
+    struct populate_dir *dir;
+    char *names;
+    size_t names_used;
+    size_t names_size;
+    /** Length of the longest name in the batch (excluding '\0'). */
+    size_t maxnamelen;
+    uint_t num_entries;
+    mode_t modes[POPULATE_BATCH];
+};
+
 /**
  * Context needed by cache_readdir_filler() to communicate with cache_readdir().
  */
@@ -44,6 +151,22 @@ struct readdir_context {
     const char *dirpath;
     /** Set to 1 if any failure occured while caching (ie do not trust cache) */
     uint_t failure;
+    /** Set to 1 if the caller's buffer filled up before the end was reached. */
+    uint_t full;
+    /** Offset of the last entry accepted by the caller. */
+    off_t offset;
+    /** The listing these entries are cached for (NULL if out of memory). */
+    struct populate_dir *popdir;
+    /** Entries collected for the next populating job (NULL if none yet). */
+    struct populate_batch *batch;
+};
+
+/**
+ * Context of hide_marker_filler(): the caller's filler and its buffer.
+ */
+struct hide_marker_context {
+    fuse_fill_dir_t filler;
+    void *buf;
 };
 
 enum fh_type {
@@ -57,6 +180,12 @@ enum fh_type {
 struct dirfh_switch {
     uint64_t fh;
     enum fh_type type;
+    /** The listing being stored on the cache (FH_ORIG only, NULL: none). */
+    struct populate_dir *popdir;
+    /** Offset at which the next readdir() call continues the listing. */
+    off_t next_offset;
+    /** Set to 1 once the end of the listing has been handed to the caller. */
+    uint_t eof;
 };
 
 /**
@@ -109,8 +238,386 @@ versatile_mknod(struct kfs_brick *orig, struct kfs_brick *cache, const
     KFS_RETURN(ret);
 }
 
+/*
+ * Cached metadata. All of these take the context of a cache_brick operation
+ * (ie co->priv is the brick's global state).
+ */
+
+/**
+ * Get the cached metadata of given file. Returns 0 on success, < 0 if it is not
+ * cached.
+ */
+static int
+meta_get_stat(const kfs_context_t co, const char *path, struct stat *stbuf)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    uint32_t intbuf[13];
+    const size_t buflen = sizeof(intbuf);
+    char charbuf[buflen];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->index != NULL) {
+        ret = index_get_stat(state->index, path, intbuf);
+    } else {
+        KFS_DO_OPER(ret = , cache, getxattr, co, path, KFS_XNAME("stat"),
+                charbuf, buflen);
+        if (ret == buflen) {
+            memcpy(intbuf, charbuf, buflen);
+            ret = 0;
+        } else if (ret >= 0) {
+            /* There is no cached data of expected size. */
+            ret = -ENODATA;
+        }
+    }
+    if (ret == 0) {
+        stbuf = unserialise_stat(stbuf, intbuf);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Store the metadata of given file. Returns 0 on success, -errno on failure
+ * (-ENOENT: the file does not exist on the cache brick yet).
+ */
+static int
+meta_set_stat(const kfs_context_t co, const char *path, const struct stat
+        *stbuf)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    uint32_t intbuf[13];
+    const size_t buflen = sizeof(intbuf);
+    char charbuf[buflen];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    serialise_stat(intbuf, stbuf);
+    if (state->index != NULL) {
+        ret = index_set_stat(state->index, path, intbuf);
+        stats_add(state->stats, CNT_EVICTIONS, ret);
+        ret = 0;
+    } else {
+        memcpy(charbuf, intbuf, buflen);
+        KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("stat"),
+                charbuf, buflen, 0);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Returns 1 if the listing of given directory is completely cached, 0 if not.
+ */
+static int
+meta_get_readdir(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    char c = '\0';
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->index != NULL) {
+        ret = index_get_readdir(state->index, path);
+        KFS_RETURN(ret);
+    }
+    KFS_DO_OPER(ret = , cache, getxattr, co, path, KFS_XNAME("readdir"), &c, 1);
+
+    KFS_RETURN(ret == 0 && c == '\0');
+}
+
+/**
+ * Mark the listing of given directory as completely cached.
+ */
+static int
+meta_set_readdir(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->index != NULL) {
+        ret = index_set_readdir(state->index, path);
+        stats_add(state->stats, CNT_EVICTIONS, ret);
+        ret = 0;
+    } else {
+        KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("readdir"), "",
+                0, 0);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Mark the listing of given directory as incomplete.
+ */
+static int
+meta_clear_readdir(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->index != NULL) {
+        ret = index_clear_readdir(state->index, path);
+    } else {
+        KFS_DO_OPER(ret = , cache, removexattr, co, path,
+                KFS_XNAME("readdir"));
+        /* Not marked, or not cached at all. */
+        if (ret == -ENODATA || ret == -ENOENT) {
+            ret = 0;
+        }
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Forget all metadata of given path. Needed only for the index: xattrs
+ * disappear along with the cached node.
+ */
+static void
+meta_invalidate(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+
+    KFS_ENTER();
+
+    if (state->index != NULL) {
+        index_invalidate(state->index, path);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Update the metadata after a successful rename on the source. Xattrs move
+ * along with the cached node, but the index can not rename all paths below a
+ * directory: renaming a directory invalidates the entire index.
+ */
+static void
+meta_rename(const kfs_context_t co, const char *from, const char *to)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const subv = &state->subvols[0];
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->index == NULL) {
+        KFS_RETURN();
+    }
+    ret = meta_get_stat(co, from, &stbuf);
+    if (ret != 0) {
+        KFS_DO_OPER(ret = , subv, getattr, co, to, &stbuf);
+    }
+    if (ret != 0 || S_ISDIR(stbuf.st_mode)) {
+        index_invalidate_all(state->index);
+    } else {
+        index_invalidate(state->index, from);
+        index_invalidate(state->index, to);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * The directory containing given path, in a newly allocated buffer (NULL if out
+ * of memory). The parent of "/" is "/".
+ */
+static char *
+parent_path(const char *path)
+{
+    char *parent = NULL;
+    char *slash = NULL;
+
+    KFS_ENTER();
+
+    parent = kfs_strcpy(path);
+    if (parent == NULL) {
+        KFS_RETURN(NULL);
+    }
+    slash = strrchr(parent, '/');
+    if (slash == NULL || slash == parent) {
+        strcpy(parent, "/");
+    } else {
+        *slash = '\0';
+    }
+
+    KFS_RETURN(parent);
+}
+
+/**
+ * Returns 1 if given path is known not to exist on the source, without asking
+ * the source, 0 if that is unknown.
+ */
+static int
+known_absent(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    struct stat stbuf;
+    char *parent = NULL;
+    uint64_t ticket = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->negative == NULL) {
+        KFS_RETURN(0);
+    }
+    ticket = negative_begin(state->negative);
+    if (negative_lookup(state->negative, path)) {
+        stats_add(state->stats, CNT_NEGATIVE_HIT, 1);
+        KFS_RETURN(1);
+    }
+    if (strcmp(path, "/") == 0) {
+        KFS_RETURN(0);
+    }
+    parent = parent_path(path);
+    if (parent == NULL) {
+        KFS_RETURN(0);
+    }
+    /* A completely cached parent has a node for every entry on the cache. */
+    ret = meta_get_readdir(co, parent);
+    parent = KFS_FREE(parent);
+    if (ret == 0) {
+        KFS_RETURN(0);
+    }
+    KFS_DO_OPER(ret = , cache, getattr, co, path, &stbuf);
+    if (ret != -ENOENT) {
+        KFS_RETURN(0);
+    }
+    negative_add(state->negative, path, ticket);
+    stats_add(state->stats, CNT_NEGATIVE_HIT, 1);
+
+    KFS_RETURN(1);
+}
+
+/**
+ * Record a cache miss for given path and decide whether to cache it.
+ */
+static int
+admit(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (state->admission == NULL) {
+        KFS_RETURN(1);
+    }
+    ret = admission_admit(state->admission, path);
+    if (ret == 0) {
+        stats_add(state->stats, CNT_REJECTED, 1);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Record that a node may have disappeared, so that no listing that started
+ * before this recreates it on the cache or marks its parent complete. Call
+ * this before the node is removed from the cache.
+ */
+static void
+note_change(struct cache_state *state)
+{
+    KFS_ENTER();
+
+    kfs_rwlock_writelock(&state->changes_lock);
+    state->changes += 1;
+    kfs_rwlock_unlock(&state->changes_lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * The cache no longer has a node for every entry of the parent of given path:
+ * mark the cached listing of the parent as incomplete.
+ */
+static void
+parent_incomplete(const kfs_context_t co, const char *path)
+{
+    char *parent = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Keep running listings from marking the parent complete afterwards. */
+    note_change(co->priv);
+    parent = parent_path(path);
+    if (parent == NULL) {
+        ret = -ENOMEM;
+    } else {
+        ret = meta_clear_readdir(co, parent);
+        parent = KFS_FREE(parent);
+    }
+    if (ret != 0) {
+        KFS_ERROR("Corrupt cache: listing of parent of \"%s\" could not be "
+                "invalidated: %s", path, strerror(-ret));
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Bookkeeping after a node was created on the source. If it could not be
+ * created on the cache (cacheret != 0), the listing of its parent directory is
+ * no longer complete.
+ */
+static void
+node_created(const kfs_context_t co, const char *path, int cacheret)
+{
+    struct cache_state * const state = co->priv;
+
+    KFS_ENTER();
+
+    if (state->negative != NULL) {
+        negative_remove(state->negative, path);
+    }
+    if (cacheret != 0) {
+        parent_incomplete(co, path);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Remove a (non-directory) node from the cache that still exists on the source.
+ * Its parent is no longer completely cached. Returns 0 or -errno.
+ */
+static int
+drop_cached_node(const kfs_context_t co, const char *path)
+{
+    struct cache_state * const state = co->priv;
+    struct kfs_brick * const cache = &state->subvols[1];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    parent_incomplete(co, path);
+    meta_invalidate(co, path);
+    KFS_DO_OPER(ret = , cache, unlink, co, path);
+
+    KFS_RETURN(ret);
+}
+
 /**
- * Caches the result in extended attributes of the cache copy.
+ * Caches the result in the metadata store (extended attributes of the cache
+ * copy or the index).
  *
  * This is to prevent opening the can of worms that is manual setattr() on files
  * on different filesystems, if that is even possible at all.
@@ -131,41 +638,51 @@ versatile_mknod(struct kfs_brick *orig, struct kfs_brick *cache, const
 static int
 cache_getattr(const kfs_context_t co, const char *path, struct stat *stbuf)
 {
-    uint32_t intbuf[13];
-    const size_t buflen = sizeof(intbuf);
-    char charbuf[buflen];
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
     struct kfs_brick * const cache = subv + 1;
+    uint64_t start = 0;
+    uint64_t ticket = 0;
     int ret = 0;
     mode_t mode = 0;
 
     KFS_ENTER();
 
     /* Check if data is already cached. */
-    KFS_DO_OPER(ret = , cache, getxattr, co, path, KFS_XNAME("stat"), charbuf,
-            buflen);
-    if (ret == buflen) {
+    ret = meta_get_stat(co, path, stbuf);
+    if (ret == 0) {
         /* Success: the file metadata is cached. */
-        memcpy(intbuf, charbuf, buflen);
-        stbuf = unserialise_stat(stbuf, intbuf);
+        stats_add(state->stats, CNT_GETATTR_HIT, 1);
         KFS_RETURN(0);
     }
-    /* There is no cached data of expected size. */
+    if (known_absent(co, path)) {
+        KFS_RETURN(-ENOENT);
+    }
+    stats_add(state->stats, CNT_GETATTR_MISS, 1);
+    if (state->negative != NULL) {
+        ticket = negative_begin(state->negative);
+    }
     KFS_DO_OPER(ret = , subv, getattr, co, path, stbuf);
+    if (ret == -ENOENT && state->negative != NULL) {
+        negative_add(state->negative, path, ticket);
+    }
     if (ret != 0) {
         KFS_RETURN(ret);
     }
+    if (admit(co, path) == 0) {
+        /* Not (yet) worth caching. */
+        KFS_RETURN(0);
+    }
     /* But the file exists! Cache the metadata. */
-    serialise_stat(intbuf, stbuf);
-    memcpy(charbuf, intbuf, buflen);
-    KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("stat"), charbuf,
-            buflen, 0);
+    start = kfs_clock_ns();
+    ret = meta_set_stat(co, path, stbuf);
     switch (ret) {
     case 0:
         break;
     case -ENOTSUP:
         /* TODO: Disable all xattr operations from now on? */
         KFS_INFO("Caching enabled but extended attributes not supported.");
+        stats_add(state->stats, CNT_ERRORS, 1);
         break;
     case -ENOENT:
         /* The file does not exist. Create it and wait for next getattr call. */
@@ -177,8 +694,11 @@ cache_getattr(const kfs_context_t co, const char *path, struct stat *stbuf)
     default:
         KFS_INFO("Error while caching metadata of %s: %s.", path,
                 strerror(-ret));
+        stats_add(state->stats, CNT_ERRORS, 1);
         break;
     }
+    stats_add(state->stats, CNT_FILLS, 1);
+    stats_add(state->stats, CNT_FILL_NS, kfs_clock_ns() - start);
 
     /* Ignore return value of cache. */
     KFS_RETURN(0);
@@ -199,7 +719,7 @@ cache_readlink(const kfs_context_t co, const char *path, char *buf, size_t
     switch (ret) {
     case -EINVAL:
         /* The cache has this file but it is not a symlink. Delete it. */
-        KFS_DO_OPER(/**/, cache, unlink, co, path);
+        drop_cached_node(co, path);
         break;
     case 0:
         KFS_RETURN(ret);
@@ -243,6 +763,7 @@ cache_mknod(const kfs_context_t co, const char *path, mode_t mode, dev_t dev)
     if (ret != 0) {
         KFS_INFO("Error while caching new node: %s.", strerror(-ret));
     }
+    node_created(co, path, ret);
 
     /* Ignore the return value of the cache. */
     KFS_RETURN(0);
@@ -265,7 +786,7 @@ cache_truncate(const kfs_context_t co, const char *path, off_t offset)
     if (ret != 0 && ret != -ENOENT) {
         KFS_INFO("Error while truncating cached file: %s.", strerror(-ret));
         /* Only one recourse to keep cache coherent: remove the cached file. */
-        KFS_DO_OPER(ret = , cache, unlink, co, path);
+        ret = drop_cached_node(co, path);
         if (ret != 0) {
             KFS_ERROR("Corrupt cache: file \"%s\" could not be removed: %s",
                     path, strerror(-ret));
@@ -302,6 +823,8 @@ cache_unlink(const kfs_context_t co, const char *path)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
+    note_change(co->priv);
+    meta_invalidate(co, path);
     KFS_DO_OPER(ret = , cache, unlink, co, path);
     if (ret != 0 && ret != -ENOENT) {
         KFS_ERROR("Corrupt cache: file \"%s\" could not be removed: %s", path,
@@ -324,6 +847,8 @@ cache_rmdir(const kfs_context_t co, const char *path)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
+    note_change(co->priv);
+    meta_invalidate(co, path);
     KFS_DO_OPER(ret = , cache, rmdir, co, path);
     if (ret != 0) {
         KFS_ERROR("Corrupt cache: directory \"%s\" could not be removed: %s",
@@ -350,6 +875,7 @@ cache_symlink(const kfs_context_t co, const char *path1, const char *path2)
     if (ret != 0) {
         KFS_INFO("Error while caching symlink: %s.", strerror(-ret));
     }
+    node_created(co, path2, ret);
 
     KFS_RETURN(ret);
 }
@@ -357,6 +883,7 @@ cache_symlink(const kfs_context_t co, const char *path1, const char *path2)
 static int
 cache_rename(const kfs_context_t co, const char *from, const char *to)
 {
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
     struct kfs_brick * const cache = subv + 1;
     int ret = 0;
@@ -367,10 +894,17 @@ cache_rename(const kfs_context_t co, const char *from, const char *to)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
+    note_change(state);
+    meta_rename(co, from, to);
     KFS_DO_OPER(ret = , cache, rename, co, from, to);
     if (ret != 0 && ret != -ENOENT) {
         KFS_INFO("Error while caching file rename: %s.", strerror(-ret));
     }
+    /* Anything below a renamed directory may exist now. */
+    if (state->negative != NULL) {
+        negative_flush(state->negative);
+    }
+    node_created(co, to, ret);
 
     KFS_RETURN(ret);
 }
@@ -388,10 +922,12 @@ cache_link(const kfs_context_t co, const char *from, const char *to)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
+    note_change(co->priv);
     KFS_DO_OPER(ret = , cache, link, co, from, to);
     if (ret != 0 && ret != -ENOENT) {
         KFS_INFO("Error while caching hardlink: %s.", strerror(-ret));
     }
+    node_created(co, to, ret);
 
     KFS_RETURN(ret);
 }
@@ -400,10 +936,6 @@ static int
 cache_chmod(const kfs_context_t co, const char *path, mode_t mode)
 {
     struct kfs_brick * const subv = co->priv;
-    struct kfs_brick * const cache = subv + 1;
-    uint32_t intbuf[13];
-    const size_t buflen = sizeof(intbuf);
-    char charbuf[buflen];
     struct stat _stbuf;
     struct stat * const stbuf = &_stbuf;
     int ret = 0;
@@ -414,19 +946,18 @@ cache_chmod(const kfs_context_t co, const char *path, mode_t mode)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
-    /* Get the attributes of this file (reuse this module's getattr()). */
+    /*
+     * Only update metadata that is already cached: whether this file is worth
+     * caching at all is for admit() to decide, in getattr().
+     */
     co->priv = subv;
-    ret = cache_getattr(co, path, stbuf);
+    ret = meta_get_stat(co, path, stbuf);
     if (ret != 0) {
-        /* If getattr() fails this can not be cached (but chmod() succeeded). */
         KFS_RETURN(0);
     }
     /* Update those attributes. */
     stbuf->st_mode = mode;
-    serialise_stat(intbuf, stbuf);
-    memcpy(charbuf, intbuf, buflen);
-    KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("stat"), charbuf,
-            buflen, 0);
+    ret = meta_set_stat(co, path, stbuf);
     if (ret != 0) {
         KFS_INFO("Error while caching metadata: %s.", strerror(-ret));
     }
@@ -438,10 +969,6 @@ static int
 cache_chown(const kfs_context_t co, const char *path, uid_t uid, gid_t gid)
 {
     struct kfs_brick * const subv = co->priv;
-    struct kfs_brick * const cache = subv + 1;
-    uint32_t intbuf[13];
-    const size_t buflen = sizeof(intbuf);
-    char charbuf[buflen];
     struct stat _stbuf;
     struct stat * const stbuf = &_stbuf;
     int ret = 0;
@@ -452,20 +979,16 @@ cache_chown(const kfs_context_t co, const char *path, uid_t uid, gid_t gid)
     if (ret != 0) {
         KFS_RETURN(ret);
     }
-    /* Get the attributes of this file (reuse this module's getattr()). */
+    /* Only update metadata that is already cached (see chmod()). */
     co->priv = subv;
-    ret = cache_getattr(co, path, stbuf);
+    ret = meta_get_stat(co, path, stbuf);
     if (ret != 0) {
-        /* If getattr() fails this can not be cached (still return 0). */
         KFS_RETURN(0);
     }
     /* Update those attributes. */
     stbuf->st_uid = uid;
     stbuf->st_gid = gid;
-    serialise_stat(intbuf, stbuf);
-    memcpy(charbuf, intbuf, buflen);
-    KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("stat"), charbuf,
-            buflen, 0);
+    ret = meta_set_stat(co, path, stbuf);
     if (ret != 0) {
         KFS_INFO("Error while caching metadata: %s.", strerror(-ret));
     }
@@ -477,12 +1000,17 @@ static int
 cache_read(const kfs_context_t co, const char *path, char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
     int ret = 0;
 
     KFS_ENTER();
 
+    /* File contents are not cached (yet): always read from the source. */
     KFS_DO_OPER(ret = , subv, read, co, path, buf, size, offset, fi);
+    if (ret > 0) {
+        stats_add(state->stats, CNT_READ_BYTES_SOURCE, ret);
+    }
 
     KFS_RETURN(ret);
 }
@@ -575,15 +1103,34 @@ cache_setxattr(const kfs_context_t co, const char *path, const char *name,
     KFS_RETURN(ret);
 }
 
+/**
+ * The statistics are available as a virtual attribute of the root directory;
+ * everything else is passed through to the source.
+ */
 static int
 cache_getxattr(const kfs_context_t co, const char *path, const char *name, char
         *value, size_t size)
 {
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
+    char buf[1024];
+    size_t len = 0;
     int ret = 0;
 
     KFS_ENTER();
 
+    if (strcmp(path, "/") == 0 && strcmp(name, KFS_XNAME("stats")) == 0) {
+        len = stats_format(state->stats, buf, sizeof(buf));
+        KFS_ASSERT(len < sizeof(buf));
+        if (size == 0) {
+            KFS_RETURN(len);
+        }
+        if (size < len) {
+            KFS_RETURN(-ERANGE);
+        }
+        memcpy(value, buf, len);
+        KFS_RETURN(len);
+    }
     KFS_DO_OPER(ret = , subv, getxattr, co, path, name, value, size);
 
     KFS_RETURN(ret);
@@ -637,19 +1184,91 @@ cache_mkdir(const kfs_context_t co, const char *path, mode_t mode)
     if (ret != 0) {
         KFS_INFO("Error while caching new dir: %s.", strerror(-ret));
     }
+    node_created(co, path, ret);
 
     KFS_RETURN(0);
 }
 
+/**
+ * Drop a reference to a directory being populated. The last one out marks the
+ * cached copy of the directory as complete, if all went well.
+ */
+static void
+populate_dir_release(struct populate_dir *dir, uint_t failure)
+{
+    uint_t refcount = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&dir->lock);
+    dir->failure |= failure;
+    KFS_ASSERT(dir->refcount > 0);
+    dir->refcount -= 1;
+    refcount = dir->refcount;
+    kfs_mutex_unlock(&dir->lock);
+    if (refcount != 0) {
+        KFS_RETURN();
+    }
+    if (dir->failure == 0) {
+        kfs_rwlock_readlock(&dir->state->changes_lock);
+        if (dir->state->changes == dir->changes) {
+            /* All entries were properly processed. */
+            meta_set_readdir(&dir->co, dir->dirpath);
+        }
+        kfs_rwlock_unlock(&dir->state->changes_lock);
+    }
+    kfs_mutex_destroy(&dir->lock);
+    dir->dirpath = KFS_FREE(dir->dirpath);
+    dir = KFS_FREE(dir);
+
+    KFS_RETURN();
+}
+
+static struct populate_dir *
+new_populate_dir(struct cache_state *state, const kfs_context_t co, const char
+        *dirpath)
+{
+    struct populate_dir *dir = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    dir = KFS_MALLOC(sizeof(*dir));
+    if (dir == NULL) {
+        KFS_RETURN(NULL);
+    }
+    dir->dirpath = kfs_strcpy(dirpath);
+    if (dir->dirpath == NULL) {
+        dir = KFS_FREE(dir);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&dir->lock);
+    if (ret != 0) {
+        dir->dirpath = KFS_FREE(dir->dirpath);
+        dir = KFS_FREE(dir);
+        KFS_RETURN(NULL);
+    }
+    dir->state = state;
+    dir->co = *co;
+    dir->co.priv = state;
+    dir->refcount = 1;
+    dir->failure = 0;
+    kfs_rwlock_readlock(&state->changes_lock);
+    dir->changes = state->changes;
+    kfs_rwlock_unlock(&state->changes_lock);
+
+    KFS_RETURN(dir);
+}
+
 static int
 cache_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
         *fi)
 {
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
     struct kfs_brick * const cache = subv + 1;
     struct dirfh_switch *fh = NULL;
-    char c = '\0';
-    int ret = 0;
+    int ret = -1;
 
     KFS_ENTER();
 
@@ -657,13 +1276,16 @@ cache_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
     if (fh == NULL) {
         KFS_RETURN(-ENOMEM);
     }
-    KFS_DO_OPER(ret = , cache, getxattr, co, path, KFS_XNAME("readdir"), &c, 1);
-    if (ret == 0 && c == '\0') {
+    fh->popdir = NULL;
+    fh->next_offset = 0;
+    fh->eof = 0;
+    if (meta_get_readdir(co, path)) {
         /** The whole dir is already cached, no need to open the source. */
         KFS_DO_OPER(ret = , cache, opendir, co, path, fi);
         if (ret == 0) {
             fh->type = FH_CACHE;
             fh->fh = fi->fh;
+            stats_add(state->stats, CNT_READDIR_CACHE, 1);
         } else {
             KFS_INFO("Error while opening cached dir: %s", strerror(-ret));
         }
@@ -673,6 +1295,11 @@ cache_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
         if (ret == 0) {
             fh->type = FH_ORIG;
             fh->fh = fi->fh;
+            if (admit(co, path)) {
+                /* NULL (out of memory) just means: do not populate. */
+                fh->popdir = new_populate_dir(state, co, path);
+            }
+            stats_add(state->stats, CNT_READDIR_SOURCE, 1);
         }
     }
     memcpy(&fi->fh, &fh, sizeof(fh));
@@ -680,10 +1307,179 @@ cache_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
     KFS_RETURN(ret);
 }
 
+static struct populate_batch *
+new_populate_batch(struct populate_dir *dir)
+{
+    struct populate_batch *batch = NULL;
+
+    KFS_ENTER();
+
+    batch = KFS_MALLOC(sizeof(*batch));
+    if (batch == NULL) {
+        KFS_RETURN(NULL);
+    }
+    batch->names_size = 16 * POPULATE_BATCH;
+    batch->names = KFS_MALLOC(batch->names_size);
+    if (batch->names == NULL) {
+        batch = KFS_FREE(batch);
+        KFS_RETURN(NULL);
+    }
+    batch->names_used = 0;
+    batch->maxnamelen = 0;
+    batch->num_entries = 0;
+    batch->dir = dir;
+
+    KFS_RETURN(batch);
+}
+
+static struct populate_batch *
+del_populate_batch(struct populate_batch *batch)
+{
+    KFS_ENTER();
+
+    batch->names = KFS_FREE(batch->names);
+    batch = KFS_FREE(batch);
+
+    KFS_RETURN(batch);
+}
+
+/**
+ * Add an entry to given batch. Returns 0 on success, -1 on memory error.
+ */
+static int
+populate_batch_add(struct populate_batch *batch, const char *name, mode_t mode)
+{
+    const size_t namelen = strlen(name);
+    size_t newsize = 0;
+    char *newnames = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(batch->num_entries < POPULATE_BATCH);
+    if (batch->names_used + namelen + 1 > batch->names_size) {
+        newsize = MAX(2 * batch->names_size, batch->names_used + namelen + 1);
+        newnames = KFS_REALLOC(batch->names, newsize);
+        if (newnames == NULL) {
+            KFS_RETURN(-1);
+        }
+        batch->names = newnames;
+        batch->names_size = newsize;
+    }
+    memcpy(batch->names + batch->names_used, name, namelen + 1);
+    batch->names_used += namelen + 1;
+    batch->maxnamelen = MAX(batch->maxnamelen, namelen);
+    batch->modes[batch->num_entries] = mode;
+    batch->num_entries += 1;
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Create all nodes of a batch on the cache and release the batch. Executed by a
+ * populating thread (or inline if there are none).
+ */
+static void
+populate_batch_run(void *arg)
+{
+    struct populate_batch *batch = arg;
+    struct populate_dir * const dir = batch->dir;
+    struct cache_state * const state = dir->state;
+    const size_t dirlen = strlen(dir->dirpath);
+    /* Batches of one listing run concurrently: each needs its own context. */
+    struct kfs_context co = dir->co;
+    const char *name = NULL;
+    char *fullpath = NULL;
+    uint64_t start = 0;
+    uint_t failure = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    start = kfs_clock_ns();
+    /* One buffer for all paths: only the entry name changes. */
+    fullpath = KFS_MALLOC(dirlen + 1 + batch->maxnamelen + 1);
+    if (fullpath == NULL) {
+        failure = 1;
+    } else {
+        memcpy(fullpath, dir->dirpath, dirlen);
+        if (dirlen == 0 || fullpath[dirlen - 1] != '/') {
+            fullpath[dirlen] = '/';
+        } else {
+            /* The root directory: do not double the slash. */
+            KFS_ASSERT(dirlen == 1);
+            fullpath[0] = '/';
+        }
+        name = batch->names;
+        for (i = 0; i < batch->num_entries; i++) {
+            strcpy(fullpath + (dirlen == 1 ? 1 : dirlen + 1), name);
+            /*
+             * Entries may have been removed since they were listed: do not
+             * bring them back. Removals bump the counter before they touch
+             * the cache, so checking and creating under the read lock is
+             * enough.
+             */
+            kfs_rwlock_readlock(&state->changes_lock);
+            if (state->changes != dir->changes) {
+                kfs_rwlock_unlock(&state->changes_lock);
+                failure = 1;
+                break;
+            }
+            ret = versatile_mknod(&state->subvols[0], &state->subvols[1],
+                    &co, fullpath, batch->modes[i]);
+            kfs_rwlock_unlock(&state->changes_lock);
+            if (ret != 0 && ret != -EEXIST) {
+                failure = 1;
+                stats_add(state->stats, CNT_ERRORS, 1);
+            }
+            name += strlen(name) + 1;
+        }
+        fullpath = KFS_FREE(fullpath);
+    }
+    stats_add(state->stats, CNT_FILLS, batch->num_entries);
+    stats_add(state->stats, CNT_FILL_NS, kfs_clock_ns() - start);
+    batch = del_populate_batch(batch);
+    populate_dir_release(dir, failure);
+
+    KFS_RETURN();
+}
+
+/**
+ * Hand the collected batch of entries (if any) over to the populating threads.
+ */
+static void
+populate_flush(struct readdir_context *rd_co)
+{
+    struct cache_state * const state = rd_co->kfs_context->priv;
+    struct populate_batch *batch = rd_co->batch;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (batch == NULL) {
+        KFS_RETURN();
+    }
+    rd_co->batch = NULL;
+    kfs_mutex_lock(&batch->dir->lock);
+    batch->dir->refcount += 1;
+    kfs_mutex_unlock(&batch->dir->lock);
+    ret = -1;
+    if (state->populate != NULL) {
+        ret = kfs_workqueue_push(state->populate, populate_batch_run, batch);
+    }
+    if (ret != 0) {
+        /* No threads, or no memory to queue it: do it right here. */
+        populate_batch_run(batch);
+    }
+
+    KFS_RETURN();
+}
+
 /**
  * Wrapper around the caller's readdir callback (the "filler" function). It
  * passes all operations through and sets a flag if the filler indicates that
  * its buffer is full, so that the readdir() operation handler knows about it.
+ * Every entry that is passed to the caller is queued for creation on the cache.
  */
 static int
 cache_readdir_filler(void *buf, const char *name, const struct stat *stbuf,
@@ -691,32 +1487,56 @@ cache_readdir_filler(void *buf, const char *name, const struct stat *stbuf,
 {
     struct readdir_context * const rd_co = buf;
     int ret = 0;
-    char *fullpath = NULL;
+    int tmp = 0;
 
     KFS_ENTER();
 
     ret = rd_co->filler(rd_co->buf, name, stbuf, offset);
-    if (ret == 0) {
-        /* NOTE: If this is/becomes a bottleneck, here are some optimisations:
-         * - Use one buffer, only realloc if too small.
-         * - Put dirname + '/' in there once, only update entry name.
-         *
-         * TODO: check if it is a bottleneck.
-         */
-        fullpath = kfs_sprintf("%s/%s", rd_co->dirpath, name);
-        if (fullpath == NULL) {
+    if (ret != 0) {
+        /* Buffer is full: the next call continues from here. */
+        rd_co->full = 1;
+        KFS_RETURN(ret);
+    }
+    rd_co->offset = offset;
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        KFS_RETURN(ret);
+    }
+    if (rd_co->popdir == NULL || stbuf == NULL) {
+        rd_co->failure = 1;
+        KFS_RETURN(ret);
+    }
+    if (rd_co->batch == NULL) {
+        rd_co->batch = new_populate_batch(rd_co->popdir);
+        if (rd_co->batch == NULL) {
             rd_co->failure = 1;
-        } else {
-            ret = versatile_mknod(rd_co->orig_brick, rd_co->cache_brick,
-                    rd_co->kfs_context, fullpath, (stbuf->st_mode & S_IFMT));
-            fullpath = KFS_FREE(fullpath);
-            if (ret == -1) {
-                rd_co->failure = 1;
-            }
+            KFS_RETURN(ret);
         }
-    } else {
-        /* Buffer is full. */
+    }
+    tmp = populate_batch_add(rd_co->batch, name, stbuf->st_mode & S_IFMT);
+    if (tmp != 0) {
         rd_co->failure = 1;
+    } else if (rd_co->batch->num_entries == POPULATE_BATCH) {
+        populate_flush(rd_co);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Filler for listings of the cached root directory that leaves out the index
+ * marker.
+ */
+static int
+hide_marker_filler(void *buf, const char *name, const struct stat *stbuf,
+        off_t offset)
+{
+    struct hide_marker_context * const hm_co = buf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (strcmp(name, INDEX_MARKER) != 0) {
+        ret = hm_co->filler(hm_co->buf, name, stbuf, offset);
     }
 
     KFS_RETURN(ret);
@@ -726,23 +1546,23 @@ cache_readdir_filler(void *buf, const char *name, const struct stat *stbuf,
  * List directory contents. If this directory has the extended attribute
  * "readdir" (in this namespace), with no contents, the cached directory is read
  * instead. Otherwise (if there is no such attribute or if it has any contents),
- * the source directory is read, the cached directory is updated and the
- * "readdir" attribute is set to an empty string.
- * 
- * TODO: There is still room for a subtle bug: if this function is called
- * "asynchronously" (i.e.: multiple times, but not with incrementing offsets),
- * it might reach the end of the directory before having all the contents. It
- * will not recognise this situation and (for this and every following call)
- * consider the directory entries properly cached, meaning some entries will not
- * be visible to the caller.
+ * the source directory is read and the cached directory is updated in the
+ * background. Once that is done, the "readdir" attribute is set to an empty
+ * string.
+ *
+ * One listing may take several calls. The directory is only marked complete
+ * when the handle is released, after the end was reached by calls that each
+ * continued where the previous one stopped and after all batches have run.
  */
 static int
 cache_readdir(const kfs_context_t co, const char *path, void *buf,
         fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
+    struct cache_state * const state = co->priv;
     struct kfs_brick * const subv = co->priv;
     struct kfs_brick * const cache = subv + 1;
     struct readdir_context rd_context;
+    struct hide_marker_context hm_context;
     struct dirfh_switch *fh = NULL;
     int ret = 0;
 
@@ -753,23 +1573,46 @@ cache_readdir(const kfs_context_t co, const char *path, void *buf,
     KFS_ASSERT(fh != NULL);
     if (fh->type == FH_CACHE) {
         /* Read from cache. */
-        KFS_DO_OPER(ret = , cache, readdir, co, path, buf, filler, offset, fi);
+        if (state->index != NULL && strcmp(path, "/") == 0) {
+            hm_context.filler = filler;
+            hm_context.buf = buf;
+            KFS_DO_OPER(ret = , cache, readdir, co, path, &hm_context,
+                    hide_marker_filler, offset, fi);
+        } else {
+            KFS_DO_OPER(ret = , cache, readdir, co, path, buf, filler, offset,
+                    fi);
+        }
         KFS_RETURN(ret);
     }
     KFS_ASSERT(fh->type == FH_ORIG);
     rd_context.filler = filler;
     rd_context.buf = buf;
     rd_context.failure = 0;
+    rd_context.full = 0;
+    rd_context.offset = offset;
     rd_context.orig_brick = subv;
     rd_context.cache_brick = cache;
     rd_context.kfs_context = co;
     rd_context.dirpath = path;
+    rd_context.popdir = fh->popdir;
+    rd_context.batch = NULL;
+    /* Skipping or repeating part of the listing: entries may be missed. */
+    if (offset != fh->next_offset) {
+        rd_context.failure = 1;
+    }
     KFS_DO_OPER(ret = , subv, readdir, co, path, &rd_context,
             cache_readdir_filler, offset, fi);
-    if (ret == 0 && rd_context.failure == 0) {
-        /* All entries were properly processed. */
-        KFS_DO_OPER(/**/, cache, setxattr, co, path, KFS_XNAME("readdir"), "",
-                0, 0);
+    if (rd_context.popdir != NULL) {
+        populate_flush(&rd_context);
+        if (ret != 0 || rd_context.failure) {
+            kfs_mutex_lock(&rd_context.popdir->lock);
+            rd_context.popdir->failure = 1;
+            kfs_mutex_unlock(&rd_context.popdir->lock);
+        }
+        fh->next_offset = rd_context.offset;
+        if (ret == 0 && !rd_context.full) {
+            fh->eof = 1;
+        }
     }
 
     KFS_RETURN(ret);
@@ -794,6 +1637,10 @@ cache_releasedir(const kfs_context_t co, const char *path, struct fuse_file_info
     } else {
         KFS_ASSERT(fh->type == FH_ORIG);
         KFS_DO_OPER(ret = , subv, releasedir, co, path, fi);
+        if (fh->popdir != NULL) {
+            /* Marked complete once all batches are done as well. */
+            populate_dir_release(fh->popdir, !fh->eof);
+        }
     }
     fh = KFS_FREE(fh);
 
@@ -846,6 +1693,7 @@ cache_create(const kfs_context_t co, const char *path, mode_t mode, struct
     if (ret != 0) {
         KFS_INFO("Error while caching new file: %s.", strerror(-ret));
     }
+    node_created(co, path, ret);
 
     KFS_RETURN(0);
 }
@@ -897,10 +1745,6 @@ cache_utimens(const kfs_context_t co, const char *path, const struct timespec
         tvnano[2])
 {
     struct kfs_brick * const subv = co->priv;
-    struct kfs_brick * const cache = subv + 1;
-    uint32_t intbuf[13];
-    const size_t buflen = sizeof(intbuf);
-    char charbuf[buflen];
     struct stat _stbuf;
     struct stat * const stbuf = &_stbuf;
     int ret = 0;
@@ -911,20 +1755,16 @@ cache_utimens(const kfs_context_t co, const char *path, const struct timespec
     if (ret != 0) {
         KFS_RETURN(ret);
     }
-    /* Get the attributes of this file (reuse this module's getattr()). */
+    /* Only update metadata that is already cached (see chmod()). */
     co->priv = subv;
-    ret = cache_getattr(co, path, stbuf);
+    ret = meta_get_stat(co, path, stbuf);
     if (ret != 0) {
-        /* If getattr() fails this can not be cached (but utimens succeeded). */
         KFS_RETURN(0);
     }
     /* Update those attributes. */
     stbuf->st_atime = tvnano[0].tv_sec;
     stbuf->st_mtime = tvnano[1].tv_sec;
-    serialise_stat(intbuf, stbuf);
-    memcpy(charbuf, intbuf, buflen);
-    KFS_DO_OPER(ret = , cache, setxattr, co, path, KFS_XNAME("stat"), charbuf,
-            buflen, 0);
+    ret = meta_set_stat(co, path, stbuf);
     if (ret != 0) {
         KFS_INFO("Error while caching metadata: %s.", strerror(-ret));
     }
@@ -978,6 +1818,36 @@ cache_poll(const kfs_context_t co, const char *path, struct fuse_file_info *fi,
 }
 #endif
 
+static int
+cache_fallocate(const kfs_context_t co, const char *path, int mode, off_t
+        offset, off_t len, struct fuse_file_info *fi)
+{
+    struct kfs_brick * const subv = co->priv;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_DO_OPER(ret = , subv, fallocate, co, path, mode, offset, len, fi);
+
+    KFS_RETURN(ret);
+}
+
+static int
+cache_copy_file_range(const kfs_context_t co, const char *path_in, struct
+        fuse_file_info *fi_in, off_t offset_in, const char *path_out, struct
+        fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    struct kfs_brick * const subv = co->priv;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_DO_OPER(ret = , subv, copy_file_range, co, path_in, fi_in, offset_in,
+            path_out, fi_out, offset_out, size, flags);
+
+    KFS_RETURN(ret);
+}
+
 static const struct kfs_operations handlers = {
     .getattr = cache_getattr,
     .readlink = cache_readlink,
@@ -1017,8 +1887,80 @@ static const struct kfs_operations handlers = {
     .ioctl = cache_ioctl,
     .poll = cache_poll,
 #endif
+    .fallocate = cache_fallocate,
+    .copy_file_range = cache_copy_file_range,
 };
 
+/**
+ * Free the global state and everything in it. Always returns NULL.
+ */
+static struct cache_state *
+del_state(struct cache_state *state)
+{
+    KFS_ENTER();
+
+    /* Finishes all pending population first. */
+    if (state->populate != NULL) {
+        state->populate = kfs_workqueue_del(state->populate);
+    }
+    if (state->index != NULL) {
+        state->index = index_close(state->index);
+    }
+    if (state->negative != NULL) {
+        state->negative = negative_del(state->negative);
+    }
+    if (state->admission != NULL) {
+        state->admission = admission_del(state->admission);
+    }
+    if (state->stats != NULL) {
+        state->stats = stats_del(state->stats);
+    }
+    kfs_rwlock_destroy(&state->changes_lock);
+    state = KFS_FREE(state);
+
+    KFS_RETURN(state);
+}
+
+/**
+ * Identify the cache that the metadata index belongs to: the root of the cache
+ * and the index marker in it, which is created if it does not exist. Returns 0
+ * on success, -errno on failure.
+ */
+static int
+cache_owner(struct cache_state *state, struct index_owner *owner)
+{
+    struct kfs_brick * const cache = &state->subvols[1];
+    struct kfs_context co = {.uid = 0, .gid = 0, .priv = state};
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_DO_OPER(ret = , cache, getattr, &co, "/", &stbuf);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    owner->dev = stbuf.st_dev;
+    owner->ino = stbuf.st_ino;
+    KFS_DO_OPER(ret = , cache, getattr, &co, "/" INDEX_MARKER, &stbuf);
+    if (ret == -ENOENT) {
+        KFS_DO_OPER(ret = , cache, mknod, &co, "/" INDEX_MARKER, S_IFREG |
+                PERM0600, 0);
+        if (ret == 0) {
+            KFS_DO_OPER(ret = , cache, getattr, &co, "/" INDEX_MARKER,
+                    &stbuf);
+        }
+    }
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    owner->marker = stbuf.st_ino;
+    owner->marker_ns = (uint64_t) stbuf.st_mtim.tv_sec * 1000000000ULL +
+        stbuf.st_mtim.tv_nsec;
+
+    KFS_RETURN(0);
+}
+
 /**
  * Global initialization. Requires exactly two subvolumes: the first one is the
  * origin, the second one is the cache.
@@ -1027,10 +1969,16 @@ static void *
 kfs_cache_init(const char *conffile, const char *section, size_t num_subvolumes,
         const struct kfs_brick subvolumes[])
 {
-    (void) conffile;
-    (void) section;
-
-    struct kfs_brick *subvols_cpy = NULL;
+    struct cache_state *state = NULL;
+    struct index_owner owner;
+    char *metadata = NULL;
+    char *policy = NULL;
+    char *index_path = NULL;
+    long num_threads = 0;
+    long index_slots = 0;
+    long negative_entries = 0;
+    long negative_ttl = 0;
+    long admission_size = 0;
 
     KFS_ENTER();
 
@@ -1039,13 +1987,96 @@ kfs_cache_init(const char *conffile, const char *section, size_t num_subvolumes,
         KFS_ERROR("Exactly two subvolumes required by brick %s.", section);
         KFS_RETURN(NULL);
     }
-    subvols_cpy = KFS_MALLOC(sizeof(*subvols_cpy) * 2);
-    if (subvols_cpy == NULL) {
+    num_threads = ini_getl(section, "populate_threads", 1, conffile);
+    index_slots = ini_getl(section, "index_slots", INDEX_SLOTS_DEFAULT,
+            conffile);
+    negative_entries = ini_getl(section, "negative_entries", 0, conffile);
+    negative_ttl = ini_getl(section, "negative_ttl", NEGATIVE_TTL_DEFAULT,
+            conffile);
+    admission_size = ini_getl(section, "admission_size", ADMISSION_SIZE_DEFAULT,
+            conffile);
+    if (num_threads < 0 || index_slots <= 0 || (unsigned long) index_slots >
+            UINT_MAX || negative_entries < 0 || negative_ttl < 0 ||
+            admission_size <= 0) {
+        KFS_ERROR("Illegal numeric option value in brick %s.", section);
+        KFS_RETURN(NULL);
+    }
+    state = KFS_MALLOC(sizeof(*state));
+    if (state == NULL) {
+        KFS_RETURN(NULL);
+    }
+    if (kfs_rwlock_init(&state->changes_lock) != 0) {
+        state = KFS_FREE(state);
         KFS_RETURN(NULL);
     }
-    subvols_cpy = memcpy(subvols_cpy, subvolumes, sizeof(*subvols_cpy) * 2);
+    memcpy(state->subvols, subvolumes, sizeof(state->subvols));
+    state->changes = 0;
+    state->populate = NULL;
+    state->index = NULL;
+    state->negative = NULL;
+    state->admission = NULL;
+    state->stats = stats_new();
+    if (state->stats == NULL) {
+        state = del_state(state);
+        KFS_RETURN(NULL);
+    }
+    metadata = kfs_ini_gets(conffile, section, "metadata");
+    if (metadata != NULL && strcmp(metadata, "index") == 0) {
+        index_path = kfs_ini_gets(conffile, section, "index_path");
+        if (index_path == NULL) {
+            KFS_ERROR("Brick %s: metadata = index requires index_path.",
+                    section);
+        } else if (cache_owner(state, &owner) != 0) {
+            KFS_ERROR("Brick %s: could not identify the cache for the "
+                    "metadata index.", section);
+            index_path = KFS_FREE(index_path);
+        } else {
+            state->index = index_open(index_path, index_slots, &owner);
+            index_path = KFS_FREE(index_path);
+        }
+        if (state->index == NULL) {
+            metadata = KFS_FREE(metadata);
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    } else if (metadata != NULL && strcmp(metadata, "xattr") != 0) {
+        KFS_ERROR("Unknown metadata store for brick %s: %s.", section,
+                metadata);
+        metadata = KFS_FREE(metadata);
+        state = del_state(state);
+        KFS_RETURN(NULL);
+    }
+    if (metadata != NULL) {
+        metadata = KFS_FREE(metadata);
+    }
+    policy = kfs_ini_gets(conffile, section, "admission");
+    if (policy != NULL && strcmp(policy, "always") != 0) {
+        state->admission = admission_new(policy, admission_size);
+        if (state->admission == NULL) {
+            policy = KFS_FREE(policy);
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (policy != NULL) {
+        policy = KFS_FREE(policy);
+    }
+    if (negative_entries > 0 && negative_ttl > 0) {
+        state->negative = negative_new(negative_entries, negative_ttl);
+        if (state->negative == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (num_threads > 0) {
+        state->populate = kfs_workqueue_new(num_threads);
+        if (state->populate == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
 
-    KFS_RETURN(subvols_cpy);
+    KFS_RETURN(state);
 }
 
 /*
@@ -1067,7 +2098,7 @@ kfs_cache_halt(void *private_data)
 {
     KFS_ENTER();
 
-    private_data = KFS_FREE(private_data);
+    private_data = del_state(private_data);
 
     KFS_RETURN();
 }
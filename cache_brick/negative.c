@@ -0,0 +1,216 @@
+/**
+ * Negative lookup cache: remembers for a limited time which paths do not exist
+ * on the source, so repeated probes for missing files (include paths, module
+ * search paths) need not go to the source every time.
+ *
+ * A fixed-size, direct-mapped table of paths: a new entry simply replaces
+ * whatever was in its slot. Every operation that creates a path must remove it
+ * from this table. A lookup that found nothing on the source may race with
+ * such an operation, so it is only added if nothing was removed since it began
+ * (see negative_begin()).
+ */
+
+#include "cache_brick/negative.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+struct negative_entry {
+    /** The path that does not exist (NULL if none), and its hash. */
+    char *path;
+    uint64_t hash;
+    /** kfs_clock_ns() value after which this entry is void. */
+    uint64_t expiry;
+    /** Entries of any other generation are void. */
+    uint64_t generation;
+};
+
+struct negative_cache {
+    struct negative_entry *entries;
+    uint_t num_entries;
+    uint64_t ttl_ns;
+    uint64_t generation;
+    /** Incremented by every removal and every flush. */
+    uint64_t changes;
+    kfs_mutex_t lock;
+};
+
+/**
+ * Create a negative cache of given size, whose entries live for ttl_ms
+ * milliseconds. Returns NULL on failure.
+ */
+struct negative_cache *
+negative_new(uint_t num_entries, uint_t ttl_ms)
+{
+    struct negative_cache *nc = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(num_entries > 0);
+    nc = KFS_MALLOC(sizeof(*nc));
+    if (nc == NULL) {
+        KFS_RETURN(NULL);
+    }
+    /* Zero-filled: generation 0 is never current. */
+    nc->entries = KFS_CALLOC(num_entries, sizeof(*nc->entries));
+    if (nc->entries == NULL) {
+        nc = KFS_FREE(nc);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&nc->lock);
+    if (ret != 0) {
+        nc->entries = KFS_FREE(nc->entries);
+        nc = KFS_FREE(nc);
+        KFS_RETURN(NULL);
+    }
+    nc->num_entries = num_entries;
+    nc->ttl_ns = (uint64_t) ttl_ms * 1000000;
+    nc->generation = 1;
+    nc->changes = 0;
+
+    KFS_RETURN(nc);
+}
+
+struct negative_cache *
+negative_del(struct negative_cache *nc)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(nc != NULL);
+    kfs_mutex_destroy(&nc->lock);
+    for (i = 0; i < nc->num_entries; i++) {
+        if (nc->entries[i].path != NULL) {
+            nc->entries[i].path = KFS_FREE(nc->entries[i].path);
+        }
+    }
+    nc->entries = KFS_FREE(nc->entries);
+    nc = KFS_FREE(nc);
+
+    KFS_RETURN(nc);
+}
+
+/**
+ * Returns 1 if given path is known not to exist, 0 otherwise.
+ */
+int
+negative_lookup(struct negative_cache *nc, const char *path)
+{
+    const uint64_t hash = kfs_strhash(path);
+    const uint64_t now = kfs_clock_ns();
+    struct negative_entry *entry = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    entry = &nc->entries[hash % nc->num_entries];
+    kfs_mutex_lock(&nc->lock);
+    ret = entry->hash == hash && entry->generation == nc->generation &&
+        entry->expiry > now && strcmp(entry->path, path) == 0;
+    kfs_mutex_unlock(&nc->lock);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Call this before asking the source about a path. Pass the result to
+ * negative_add() if it does not exist.
+ */
+uint64_t
+negative_begin(struct negative_cache *nc)
+{
+    uint64_t changes = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&nc->lock);
+    changes = nc->changes;
+    kfs_mutex_unlock(&nc->lock);
+
+    KFS_RETURN(changes);
+}
+
+/**
+ * Remember that given path does not exist, unless something may have been
+ * created since negative_begin() returned ticket.
+ */
+void
+negative_add(struct negative_cache *nc, const char *path, uint64_t ticket)
+{
+    const uint64_t hash = kfs_strhash(path);
+    const uint64_t now = kfs_clock_ns();
+    struct negative_entry *entry = NULL;
+    char *copy = NULL;
+    char *old = NULL;
+
+    KFS_ENTER();
+
+    copy = kfs_strcpy(path);
+    if (copy == NULL) {
+        KFS_RETURN();
+    }
+    entry = &nc->entries[hash % nc->num_entries];
+    kfs_mutex_lock(&nc->lock);
+    if (nc->changes == ticket) {
+        old = entry->path;
+        entry->path = copy;
+        entry->hash = hash;
+        entry->expiry = now + nc->ttl_ns;
+        entry->generation = nc->generation;
+    } else {
+        /* It may have been created meanwhile. */
+        old = copy;
+    }
+    kfs_mutex_unlock(&nc->lock);
+    if (old != NULL) {
+        old = KFS_FREE(old);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Forget that given path does not exist (call this when it is created).
+ */
+void
+negative_remove(struct negative_cache *nc, const char *path)
+{
+    const uint64_t hash = kfs_strhash(path);
+    struct negative_entry *entry = NULL;
+
+    KFS_ENTER();
+
+    entry = &nc->entries[hash % nc->num_entries];
+    kfs_mutex_lock(&nc->lock);
+    nc->changes += 1;
+    if (entry->hash == hash && entry->path != NULL && strcmp(entry->path,
+                path) == 0) {
+        entry->generation = 0;
+    }
+    kfs_mutex_unlock(&nc->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Forget all entries.
+ */
+void
+negative_flush(struct negative_cache *nc)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&nc->lock);
+    nc->generation += 1;
+    nc->changes += 1;
+    kfs_mutex_unlock(&nc->lock);
+
+    KFS_RETURN();
+}
@@ -0,0 +1,19 @@
+#ifndef KFS_CACHE_BRICK_NEGATIVE_H
+#define KFS_CACHE_BRICK_NEGATIVE_H
+
+#include <stdint.h>
+
+#include "kfs.h"
+
+struct negative_cache;
+
+struct negative_cache * negative_new(uint_t num_entries, uint_t ttl_ms);
+struct negative_cache * negative_del(struct negative_cache *nc);
+int negative_lookup(struct negative_cache *nc, const char *path);
+uint64_t negative_begin(struct negative_cache *nc);
+void negative_add(struct negative_cache *nc, const char *path, uint64_t
+        ticket);
+void negative_remove(struct negative_cache *nc, const char *path);
+void negative_flush(struct negative_cache *nc);
+
+#endif
@@ -0,0 +1,222 @@
+/**
+ * Statistics of the cache brick. Every thread counts in its own block of
+ * counters, so counting never contends; readers add up all blocks. Blocks of
+ * threads that exit are folded into a running total.
+ *
+ * Counters are read without synchronisation: the totals are a snapshot that
+ * can be slightly off while operations are in progress, which is fine for
+ * statistics.
+ */
+
+#include "cache_brick/stats.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_threading.h"
+
+/** Names as reported to the user, indexed by enum cache_counter. */
+static const char * const stat_names[CNT_MAX_] = {
+    [CNT_GETATTR_HIT] = "getattr_hits",
+    [CNT_GETATTR_MISS] = "getattr_misses",
+    [CNT_NEGATIVE_HIT] = "negative_hits",
+    [CNT_READDIR_CACHE] = "readdir_cache",
+    [CNT_READDIR_SOURCE] = "readdir_source",
+    [CNT_READ_BYTES_CACHE] = "read_bytes_cache",
+    [CNT_READ_BYTES_SOURCE] = "read_bytes_source",
+    [CNT_FILLS] = "fills",
+    [CNT_FILL_NS] = "fill_ns",
+    [CNT_REJECTED] = "admission_rejects",
+    [CNT_EVICTIONS] = "evictions",
+    [CNT_ERRORS] = "errors",
+};
+
+struct stats_block {
+    uint64_t counters[CNT_MAX_];
+    struct cache_stats *owner;
+    struct stats_block *next;
+    struct stats_block *prev;
+};
+
+struct cache_stats {
+    kfs_threadkey_t key;
+    /** Blocks of all live threads. */
+    struct stats_block *blocks;
+    /** Sum of the blocks of threads that have exited. */
+    uint64_t retired[CNT_MAX_];
+    /** Protects the list and the retired counters. */
+    kfs_mutex_t lock;
+};
+
+/**
+ * Thread destructor: fold the block of an exiting thread into the total.
+ */
+static void
+retire_block(void *arg)
+{
+    struct stats_block *block = arg;
+    struct cache_stats * const st = block->owner;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&st->lock);
+    for (i = 0; i < CNT_MAX_; i++) {
+        st->retired[i] += block->counters[i];
+    }
+    if (block->prev == NULL) {
+        st->blocks = block->next;
+    } else {
+        block->prev->next = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    kfs_mutex_unlock(&st->lock);
+    block = KFS_FREE(block);
+
+    KFS_RETURN();
+}
+
+/**
+ * The counters of the calling thread, created on first use. NULL if out of
+ * memory.
+ */
+static struct stats_block *
+get_block(struct cache_stats *st)
+{
+    struct stats_block *block = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    block = kfs_threadkey_get(st->key);
+    if (block != NULL) {
+        KFS_RETURN(block);
+    }
+    block = KFS_CALLOC(1, sizeof(*block));
+    if (block == NULL) {
+        KFS_RETURN(NULL);
+    }
+    block->owner = st;
+    ret = kfs_threadkey_set(st->key, block);
+    if (ret != 0) {
+        block = KFS_FREE(block);
+        KFS_RETURN(NULL);
+    }
+    kfs_mutex_lock(&st->lock);
+    block->next = st->blocks;
+    block->prev = NULL;
+    if (st->blocks != NULL) {
+        st->blocks->prev = block;
+    }
+    st->blocks = block;
+    kfs_mutex_unlock(&st->lock);
+
+    KFS_RETURN(block);
+}
+
+struct cache_stats *
+stats_new(void)
+{
+    struct cache_stats *st = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    st = KFS_CALLOC(1, sizeof(*st));
+    if (st == NULL) {
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&st->lock);
+    if (ret != 0) {
+        st = KFS_FREE(st);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_threadkey_init(&st->key, retire_block);
+    if (ret != 0) {
+        kfs_mutex_destroy(&st->lock);
+        st = KFS_FREE(st);
+        KFS_RETURN(NULL);
+    }
+
+    KFS_RETURN(st);
+}
+
+struct cache_stats *
+stats_del(struct cache_stats *st)
+{
+    struct stats_block *block = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(st != NULL);
+    /* No destructors are called for this key after this. */
+    kfs_threadkey_destroy(st->key);
+    while (st->blocks != NULL) {
+        block = st->blocks;
+        st->blocks = block->next;
+        block = KFS_FREE(block);
+    }
+    kfs_mutex_destroy(&st->lock);
+    st = KFS_FREE(st);
+
+    KFS_RETURN(st);
+}
+
+/**
+ * Add n to given counter.
+ */
+void
+stats_add(struct cache_stats *st, enum cache_counter cnt, uint64_t n)
+{
+    struct stats_block *block = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cnt < CNT_MAX_);
+    block = get_block(st);
+    if (block != NULL) {
+        block->counters[cnt] += n;
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Write all statistics as text ("name=value" lines) to buf, like snprintf():
+ * returns the length of the full text, excluding the terminating '\0', even if
+ * it did not fit.
+ */
+size_t
+stats_format(struct cache_stats *st, char *buf, size_t size)
+{
+    uint64_t totals[CNT_MAX_];
+    const struct stats_block *block = NULL;
+    size_t len = 0;
+    int ret = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&st->lock);
+    memcpy(totals, st->retired, sizeof(totals));
+    for (block = st->blocks; block != NULL; block = block->next) {
+        for (i = 0; i < CNT_MAX_; i++) {
+            totals[i] += block->counters[i];
+        }
+    }
+    kfs_mutex_unlock(&st->lock);
+    for (i = 0; i < CNT_MAX_; i++) {
+        ret = snprintf(buf + MIN(len, size), size - MIN(len, size),
+                "%s=%llu\n", stat_names[i], (unsigned long long) totals[i]);
+        KFS_ASSERT(ret >= 0);
+        len += ret;
+    }
+
+    KFS_RETURN(len);
+}
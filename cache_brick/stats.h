@@ -0,0 +1,33 @@
+#ifndef KFS_CACHE_BRICK_STATS_H
+#define KFS_CACHE_BRICK_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kfs.h"
+
+/** Everything that is counted. Keep in sync with stat_names in stats.c. */
+enum cache_counter {
+    CNT_GETATTR_HIT,
+    CNT_GETATTR_MISS,
+    CNT_NEGATIVE_HIT,
+    CNT_READDIR_CACHE,
+    CNT_READDIR_SOURCE,
+    CNT_READ_BYTES_CACHE,
+    CNT_READ_BYTES_SOURCE,
+    CNT_FILLS,
+    CNT_FILL_NS,
+    CNT_REJECTED,
+    CNT_EVICTIONS,
+    CNT_ERRORS,
+    CNT_MAX_,
+};
+
+struct cache_stats;
+
+struct cache_stats * stats_new(void);
+struct cache_stats * stats_del(struct cache_stats *st);
+void stats_add(struct cache_stats *st, enum cache_counter cnt, uint64_t n);
+size_t stats_format(struct cache_stats *st, char *buf, size_t size);
+
+#endif
@@ -104,6 +104,17 @@ struct kfs_operations {
     int (*poll) (kfs_context_t, const char *, struct fuse_file_info *, struct
             fuse_pollhandle *ph, uint_t *reventsp);
 #endif
+    int (*fallocate) (kfs_context_t, const char *, int mode, off_t offset,
+            off_t len, struct fuse_file_info *);
+    /**
+     * Copy size bytes from one open file to another within the brick, like
+     * copy_file_range(2): returns the number of bytes copied, which may be
+     * less (0 at the end of the input file). -EXDEV or -ENOSYS mean the caller
+     * has to copy the data itself, with read and write.
+     */
+    int (*copy_file_range) (kfs_context_t, const char *, struct fuse_file_info
+            *, off_t, const char *, struct fuse_file_info *, off_t, size_t,
+            int flags);
 };
 
 struct kfs_brick {
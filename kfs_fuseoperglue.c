@@ -617,6 +617,45 @@ root_poll(const char *p, struct fuse_file_info *f, struct fuse_pollhandle *h,
 }
 #endif
 
+#if FUSE_VERSION >= 29
+static int
+root_fallocate(const char *p, int m, off_t o, off_t l, struct fuse_file_info
+        *f)
+{
+    struct kfs_context co;
+    int r = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(p != NULL);
+    KFS_ASSERT(p[0] == '/');
+    kfs_init_context(&co);
+    r = oper->fallocate(&co, p, m, o, l, f);
+
+    KFS_RETURN(r);
+}
+#endif
+
+/* FUSE only passes copy_file_range() on since version 3.4. */
+#if FUSE_VERSION >= 34
+static ssize_t
+root_copy_file_range(const char *p1, struct fuse_file_info *f1, off_t o1,
+        const char *p2, struct fuse_file_info *f2, off_t o2, size_t s, int i)
+{
+    struct kfs_context co;
+    int r = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(p1 != NULL && p2 != NULL);
+    KFS_ASSERT(p1[0] == '/' && p2[0] == '/');
+    kfs_init_context(&co);
+    r = oper->copy_file_range(&co, p1, f1, o1, p2, f2, o2, s, i);
+
+    KFS_RETURN(r);
+}
+#endif
+
 /**
  * The first operation invoked by FUSE is init(). Its return value is stored as
  * the priv field of the fuse context. KennyFS does it differently: init() is
@@ -675,6 +714,12 @@ static const struct fuse_operations fuse_oper = {
     .poll = root_poll,
     .flag_nullpath_ok = 0,
 #endif
+#if FUSE_VERSION >= 29
+    .fallocate = root_fallocate,
+#endif
+#if FUSE_VERSION >= 34
+    .copy_file_range = root_copy_file_range,
+#endif
 };
 
 /**
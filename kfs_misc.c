@@ -6,6 +6,7 @@
 #include <stdarg.h>
 #include <stdint.h>
 #include <sys/stat.h>
+#include <time.h>
 /* For sleep(). */
 #include <unistd.h>
 
@@ -312,3 +313,41 @@ unserialise_stat(struct stat * const stbuf, const uint32_t intbuf[13])
 
     KFS_RETURN(stbuf);
 }
+
+/**
+ * Hash a string (FNV-1a, 64 bit). Not cryptographically secure.
+ */
+uint64_t
+kfs_strhash(const char *str)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(str != NULL);
+    for (; *str != '\0'; str++) {
+        hash ^= (unsigned char) *str;
+        hash *= 0x100000001b3ULL;
+    }
+
+    KFS_RETURN(hash);
+}
+
+/**
+ * Monotonic clock in nanoseconds, for measuring intervals (the epoch is
+ * arbitrary).
+ */
+uint64_t
+kfs_clock_ns(void)
+{
+    struct timespec ts;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = clock_gettime(CLOCK_MONOTONIC, &ts);
+    KFS_ASSERT(ret == 0);
+    (void) ret;
+
+    KFS_RETURN((uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
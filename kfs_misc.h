@@ -28,5 +28,7 @@ char * kfs_sprintf(const char *fmt, ...);
 char * kfs_stripspaces(char *buf, size_t len);
 uint32_t * serialise_stat(uint32_t intbuf[13], const struct stat *stbuf);
 struct stat * unserialise_stat(struct stat *stbuf, const uint32_t intbuf[13]);
+uint64_t kfs_strhash(const char *str);
+uint64_t kfs_clock_ns(void);
 
 #endif
@@ -112,3 +112,12 @@ int nosys_poll(const kfs_context_t c, const char *p, struct
 { (void) c; (void) p; (void) f; (void) h; (void) u; KFS_ENTER();
     KFS_RETURN(-ENOSYS); }
 #endif
+int nosys_fallocate(const kfs_context_t c, const char *p, int i, off_t o1,
+        off_t o2, struct fuse_file_info *f)
+{ (void) c; (void) p; (void) i; (void) o1; (void) o2; (void) f; KFS_ENTER();
+    KFS_RETURN(-ENOSYS); }
+int nosys_copy_file_range(const kfs_context_t c, const char *p1, struct
+        fuse_file_info *f1, off_t o1, const char *p2, struct fuse_file_info
+        *f2, off_t o2, size_t s, int i)
+{ (void) c; (void) p1; (void) f1; (void) o1; (void) p2; (void) f2; (void) o2;
+    (void) s; (void) i; KFS_ENTER(); KFS_RETURN(-ENOSYS); }
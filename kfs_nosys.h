@@ -58,5 +58,10 @@ int nosys_ioctl(const kfs_context_t c, const char *p, int i, void *v,
 int nosys_poll(const kfs_context_t c, const char *p, struct
         fuse_file_info *f, struct fuse_pollhandle *h, uint_t *u);
 #endif
+int nosys_fallocate(const kfs_context_t c, const char *p, int i, off_t o1,
+        off_t o2, struct fuse_file_info *f);
+int nosys_copy_file_range(const kfs_context_t c, const char *p1, struct
+        fuse_file_info *f1, off_t o1, const char *p2, struct fuse_file_info
+        *f2, off_t o2, size_t s, int i);
 
 #endif
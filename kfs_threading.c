@@ -9,8 +9,11 @@
 
 #include "kfs_threading.h"
 
+#include <errno.h>
+#include <stdint.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "kfs_logging.h"
 
@@ -97,6 +100,158 @@ kfs_rwlock_destroy(kfs_rwlock_t *lock)
     KFS_RETURN();
 }
 
+void
+kfs_mutex_lock(kfs_mutex_t *mutex)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(mutex != NULL);
+    ret = pthread_mutex_lock(mutex);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+void
+kfs_mutex_unlock(kfs_mutex_t *mutex)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(mutex != NULL);
+    ret = pthread_mutex_unlock(mutex);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+int
+kfs_mutex_init(kfs_mutex_t *mutex)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(mutex != NULL);
+    ret = pthread_mutex_init(mutex, NULL);
+
+    KFS_RETURN(ret);
+}
+
+void
+kfs_mutex_destroy(kfs_mutex_t *mutex)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(mutex != NULL);
+    ret = pthread_mutex_destroy(mutex);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+void
+kfs_cond_wait(kfs_cond_t *cond, kfs_mutex_t *mutex)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL && mutex != NULL);
+    ret = pthread_cond_wait(cond, mutex);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+/**
+ * Like kfs_cond_wait(), but give up after timeout_ns nanoseconds. Returns 0 if
+ * woken up, -ETIMEDOUT if the time ran out.
+ */
+int
+kfs_cond_timedwait(kfs_cond_t *cond, kfs_mutex_t *mutex, uint64_t timeout_ns)
+{
+    struct timespec abstime;
+    uint64_t nsec = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL && mutex != NULL);
+    ret = clock_gettime(CLOCK_REALTIME, &abstime);
+    work_or_die(ret == 0 ? 0 : errno);
+    nsec = abstime.tv_nsec + timeout_ns;
+    abstime.tv_sec += nsec / 1000000000;
+    abstime.tv_nsec = nsec % 1000000000;
+    ret = pthread_cond_timedwait(cond, mutex, &abstime);
+    if (ret == ETIMEDOUT) {
+        KFS_RETURN(-ETIMEDOUT);
+    }
+    work_or_die(ret);
+
+    KFS_RETURN(0);
+}
+
+void
+kfs_cond_signal(kfs_cond_t *cond)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL);
+    ret = pthread_cond_signal(cond);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+void
+kfs_cond_broadcast(kfs_cond_t *cond)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL);
+    ret = pthread_cond_broadcast(cond);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+int
+kfs_cond_init(kfs_cond_t *cond)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL);
+    ret = pthread_cond_init(cond, NULL);
+
+    KFS_RETURN(ret);
+}
+
+void
+kfs_cond_destroy(kfs_cond_t *cond)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(cond != NULL);
+    ret = pthread_cond_destroy(cond);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
 kfs_threadid_t
 kfs_getthreadid(void)
 {
@@ -108,3 +263,93 @@ kfs_getthreadid(void)
 
     KFS_RETURN(id);
 }
+
+/**
+ * Start a new thread running func(arg). Returns 0 on success, an error number
+ * on failure (unlike the other functions in this file, this is a failure that
+ * callers are expected to handle).
+ */
+int
+kfs_thread_create(kfs_threadid_t *id, void *(*func)(void *), void *arg)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id != NULL && func != NULL);
+    ret = pthread_create(id, NULL, func, arg);
+
+    KFS_RETURN(ret);
+}
+
+void
+kfs_thread_join(kfs_threadid_t id)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = pthread_join(id, NULL);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+/**
+ * Create a key for thread-specific values. The destructor (if not NULL) is
+ * called with the value of every thread that exits while its value is not
+ * NULL. Returns 0 on success, an error number on failure.
+ */
+int
+kfs_threadkey_init(kfs_threadkey_t *key, void (*destructor)(void *))
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(key != NULL);
+    ret = pthread_key_create(key, destructor);
+
+    KFS_RETURN(ret);
+}
+
+void
+kfs_threadkey_destroy(kfs_threadkey_t key)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = pthread_key_delete(key);
+    work_or_die(ret);
+
+    KFS_RETURN();
+}
+
+void *
+kfs_threadkey_get(kfs_threadkey_t key)
+{
+    void *value = NULL;
+
+    KFS_ENTER();
+
+    value = pthread_getspecific(key);
+
+    KFS_RETURN(value);
+}
+
+/**
+ * Set the value of given key for the calling thread. Returns 0 on success, an
+ * error number on failure.
+ */
+int
+kfs_threadkey_set(kfs_threadkey_t key, const void *value)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = pthread_setspecific(key, value);
+
+    KFS_RETURN(ret);
+}
@@ -2,11 +2,30 @@
 #define KFS_THREADING_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 #define KFS_RWLOCK_INITIALIZER PTHREAD_RWLOCK_INITIALIZER
+#define KFS_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define KFS_COND_INITIALIZER PTHREAD_COND_INITIALIZER
 
 typedef pthread_rwlock_t kfs_rwlock_t;
+typedef pthread_mutex_t kfs_mutex_t;
+typedef pthread_cond_t kfs_cond_t;
 typedef pthread_t kfs_threadid_t;
+typedef pthread_key_t kfs_threadkey_t;
+
+/*
+ * Atomic operations on integers and pointers (add and cas imply a full barrier,
+ * load and store only order the accesses before a store with those after the
+ * load that sees it).
+ */
+#define kfs_memory_barrier() __sync_synchronize()
+#define kfs_atomic_add(ptr, val) __sync_add_and_fetch((ptr), (val))
+#define kfs_atomic_cas(ptr, oldval, newval) \
+    __sync_bool_compare_and_swap((ptr), (oldval), (newval))
+#define kfs_atomic_load(ptr) __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define kfs_atomic_store(ptr, val) \
+    __atomic_store_n((ptr), (val), __ATOMIC_RELEASE)
 
 void kfs_rwlock_readlock(kfs_rwlock_t *lock);
 void kfs_rwlock_writelock(kfs_rwlock_t *lock);
@@ -14,6 +33,23 @@ void kfs_rwlock_unlock(kfs_rwlock_t *lock);
 int kfs_rwlock_init(kfs_rwlock_t *lock);
 void kfs_rwlock_destroy(kfs_rwlock_t *lock);
 /* TODO: kfs_rwlock_islocked()? */
+void kfs_mutex_lock(kfs_mutex_t *mutex);
+void kfs_mutex_unlock(kfs_mutex_t *mutex);
+int kfs_mutex_init(kfs_mutex_t *mutex);
+void kfs_mutex_destroy(kfs_mutex_t *mutex);
+void kfs_cond_wait(kfs_cond_t *cond, kfs_mutex_t *mutex);
+int kfs_cond_timedwait(kfs_cond_t *cond, kfs_mutex_t *mutex, uint64_t
+        timeout_ns);
+void kfs_cond_signal(kfs_cond_t *cond);
+void kfs_cond_broadcast(kfs_cond_t *cond);
+int kfs_cond_init(kfs_cond_t *cond);
+void kfs_cond_destroy(kfs_cond_t *cond);
 kfs_threadid_t kfs_getthreadid(void);
+int kfs_thread_create(kfs_threadid_t *id, void *(*func)(void *), void *arg);
+void kfs_thread_join(kfs_threadid_t id);
+int kfs_threadkey_init(kfs_threadkey_t *key, void (*destructor)(void *));
+void kfs_threadkey_destroy(kfs_threadkey_t key);
+void * kfs_threadkey_get(kfs_threadkey_t key);
+int kfs_threadkey_set(kfs_threadkey_t key, const void *value);
 
 #endif
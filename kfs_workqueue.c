@@ -0,0 +1,186 @@
+/**
+ * A simple work queue: a fixed pool of threads executing jobs in FIFO order.
+ *
+ * Bricks use this to get work out of the way of the thread that is serving the
+ * caller, e.g. populating a cache or updating multiple subvolumes at once.
+ * There is no notion of job results: a job that wants to report back to its
+ * submitter must arrange that itself, through its argument.
+ */
+
+#include "kfs_workqueue.h"
+
+#include <errno.h>
+#include <string.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_threading.h"
+
+struct kfs_job {
+    struct kfs_job *next;
+    kfs_job_f func;
+    void *arg;
+};
+
+struct kfs_workqueue {
+    /** Pending jobs: taken from the head, added to the tail. */
+    struct kfs_job *head;
+    struct kfs_job *tail;
+    kfs_threadid_t *threads;
+    uint_t num_threads;
+    /** Set once the queue is being deleted: threads exit when it is empty. */
+    uint_t stopping;
+    /** Protects all of the above. */
+    kfs_mutex_t lock;
+    /** Signalled whenever a job is added or the queue is stopping. */
+    kfs_cond_t cond;
+};
+
+/**
+ * Main loop of every thread in the pool.
+ */
+static void *
+worker(void *arg)
+{
+    struct kfs_workqueue * const wq = arg;
+    struct kfs_job *job = NULL;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&wq->lock);
+    for (;;) {
+        while (wq->head == NULL && wq->stopping == 0) {
+            kfs_cond_wait(&wq->cond, &wq->lock);
+        }
+        job = wq->head;
+        if (job == NULL) {
+            /* Stopping and nothing left to do. */
+            break;
+        }
+        wq->head = job->next;
+        if (wq->head == NULL) {
+            wq->tail = NULL;
+        }
+        kfs_mutex_unlock(&wq->lock);
+        job->func(job->arg);
+        job = KFS_FREE(job);
+        kfs_mutex_lock(&wq->lock);
+    }
+    kfs_mutex_unlock(&wq->lock);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Create a new work queue served by the given number of threads. Returns NULL
+ * on failure.
+ */
+struct kfs_workqueue *
+kfs_workqueue_new(uint_t num_threads)
+{
+    struct kfs_workqueue *wq = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(num_threads > 0);
+    wq = KFS_CALLOC(1, sizeof(*wq));
+    if (wq == NULL) {
+        KFS_RETURN(NULL);
+    }
+    wq->threads = KFS_CALLOC(num_threads, sizeof(*wq->threads));
+    if (wq->threads == NULL) {
+        wq = KFS_FREE(wq);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&wq->lock);
+    if (ret != 0) {
+        wq->threads = KFS_FREE(wq->threads);
+        wq = KFS_FREE(wq);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_cond_init(&wq->cond);
+    if (ret != 0) {
+        kfs_mutex_destroy(&wq->lock);
+        wq->threads = KFS_FREE(wq->threads);
+        wq = KFS_FREE(wq);
+        KFS_RETURN(NULL);
+    }
+    for (i = 0; i < num_threads; i++) {
+        ret = kfs_thread_create(&wq->threads[i], worker, wq);
+        if (ret != 0) {
+            KFS_ERROR("Could not start worker thread: %s", strerror(ret));
+            break;
+        }
+        wq->num_threads += 1;
+    }
+    if (wq->num_threads != num_threads) {
+        wq = kfs_workqueue_del(wq);
+        KFS_RETURN(NULL);
+    }
+
+    KFS_RETURN(wq);
+}
+
+/**
+ * Schedule job(arg) for execution by one of the threads. Returns 0 on success,
+ * -ENOMEM if the job could not be queued (it will not be executed).
+ */
+int
+kfs_workqueue_push(struct kfs_workqueue *wq, kfs_job_f func, void *arg)
+{
+    struct kfs_job *job = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(wq != NULL && func != NULL);
+    job = KFS_MALLOC(sizeof(*job));
+    if (job == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    job->next = NULL;
+    job->func = func;
+    job->arg = arg;
+    kfs_mutex_lock(&wq->lock);
+    KFS_ASSERT(wq->stopping == 0);
+    if (wq->tail == NULL) {
+        wq->head = job;
+    } else {
+        wq->tail->next = job;
+    }
+    wq->tail = job;
+    kfs_cond_signal(&wq->cond);
+    kfs_mutex_unlock(&wq->lock);
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Execute all pending jobs, stop the threads and free all resources. Pushing
+ * jobs while (or after) this is called is not allowed.
+ */
+struct kfs_workqueue *
+kfs_workqueue_del(struct kfs_workqueue *wq)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(wq != NULL);
+    kfs_mutex_lock(&wq->lock);
+    wq->stopping = 1;
+    kfs_cond_broadcast(&wq->cond);
+    kfs_mutex_unlock(&wq->lock);
+    for (i = 0; i < wq->num_threads; i++) {
+        kfs_thread_join(wq->threads[i]);
+    }
+    KFS_ASSERT(wq->head == NULL);
+    kfs_cond_destroy(&wq->cond);
+    kfs_mutex_destroy(&wq->lock);
+    wq->threads = KFS_FREE(wq->threads);
+    wq = KFS_FREE(wq);
+
+    KFS_RETURN(wq);
+}
@@ -0,0 +1,15 @@
+#ifndef KFS_WORKQUEUE_H
+#define KFS_WORKQUEUE_H
+
+#include "kfs.h"
+
+/** A job executed by one of the threads of a work queue. */
+typedef void (* kfs_job_f)(void *arg);
+
+struct kfs_workqueue;
+
+struct kfs_workqueue * kfs_workqueue_new(uint_t num_threads);
+int kfs_workqueue_push(struct kfs_workqueue *wq, kfs_job_f job, void *arg);
+struct kfs_workqueue * kfs_workqueue_del(struct kfs_workqueue *wq);
+
+#endif
@@ -0,0 +1,742 @@
+/**
+ * Dirty log for the mirror brick: remembers what changed while a subvolume was
+ * out, so that bringing it back only takes copying that, not the entire tree.
+ *
+ * As long as some subvolume is inactive, every modification adds the path it
+ * touched to a table in memory: for writes and truncates with the byte ranges
+ * that changed, for everything else as a changed entry (or tree, for the target
+ * of a rename). The table is emptied when the last inactive subvolume is back.
+ *
+ * If the log has a file, the table is also appended to it, and the set of
+ * inactive subvolumes is kept in its header: a subvolume that was out when the
+ * brick went down stays out when it comes up again, and is then brought back
+ * with the log that was read from the file. Appending is not flushed; instead,
+ * the header says whether the brick was shut down cleanly, and if not, the log
+ * is not trusted and those subvolumes get a full resync.
+ *
+ * The log is also given up on (for every subvolume that is out at the time) if
+ * the table grows beyond its maximum number of paths, or the file beyond a
+ * multiple of that in records: past that point a full resync is not much more
+ * work anyway.
+ */
+
+#include "mirror_brick/dirtylog.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#define DIRTYLOG_MAGIC 0x4b465344 /* "KFSD" */
+#define DIRTYLOG_VERSION 1
+/** Size of the header, records are appended after it. */
+#define DIRTYLOG_HEADER 512
+/** Ranges kept per file: more are merged into one. */
+#define DIRTYLOG_RANGES 8
+/** Records per path in the table the file may grow to before giving up. */
+#define DIRTYLOG_RECORDS 8
+
+/**
+ * Start of the dirty log file. All fields are in host byte order: the log is
+ * not meant to be moved between machines.
+ */
+struct dirtylog_header {
+    uint32_t magic;
+    uint32_t version;
+    /** Non-zero if the brick was shut down cleanly. */
+    uint32_t clean;
+    uint32_t reserved;
+    /** Bitmap of subvolumes that are out. */
+    uint64_t inactive;
+    /** Bitmap of subvolumes whose changes are all in the log. */
+    uint64_t valid;
+};
+
+/** Fixed part of a record, followed by the pathname (without '\0'). */
+struct record_head {
+    uint32_t what;
+    uint32_t pathlen;
+    uint64_t offset;
+    uint64_t size;
+};
+
+struct dirty_entry {
+    struct dirty_entry *next;
+    uint_t what;
+    /** Non-zero if all data in the file must be considered changed. */
+    uint_t whole;
+    uint_t num_ranges;
+    struct dirty_range ranges[DIRTYLOG_RANGES];
+    char path[];
+};
+
+struct dirtylog {
+    /** -1 if the log is only kept in memory. */
+    int fd;
+    /** End of the file: where the next record goes. */
+    off_t end;
+    uint64_t num_records;
+    uint_t max_entries;
+    uint_t num_entries;
+    uint_t num_buckets;
+    struct dirty_entry **buckets;
+    uint64_t inactive;
+    uint64_t valid;
+    /** Non-zero if the log was given up on until the next fresh start. */
+    uint_t overflow;
+    /** Non-zero while inactive is, for dirtylog_is_tracking(). */
+    uint_t tracking;
+    /** Non-zero if the file says the brick was shut down cleanly. */
+    uint_t was_clean;
+    /** Protects everything above. */
+    kfs_mutex_t lock;
+};
+
+/**
+ * Write the header. If clean is set, the records in the file can be trusted the
+ * next time it is opened. Returns 0 on success, -errno on error.
+ */
+static int
+write_header(struct dirtylog *dl, uint_t clean)
+{
+    struct dirtylog_header header;
+    ssize_t written = 0;
+
+    KFS_ENTER();
+
+    if (dl->fd == -1) {
+        KFS_RETURN(0);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = DIRTYLOG_MAGIC;
+    header.version = DIRTYLOG_VERSION;
+    header.clean = clean;
+    header.inactive = dl->inactive;
+    header.valid = dl->overflow ? 0 : dl->valid;
+    written = pwrite(dl->fd, &header, sizeof(header), 0);
+    if (written != sizeof(header)) {
+        KFS_RETURN(written == -1 ? -errno : -EIO);
+    }
+    if (fdatasync(dl->fd) != 0) {
+        KFS_RETURN(-errno);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Forget all entries and records.
+ */
+static void
+clear_log(struct dirtylog *dl)
+{
+    struct dirty_entry *entry = NULL;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < dl->num_buckets; i++) {
+        while (dl->buckets[i] != NULL) {
+            entry = dl->buckets[i];
+            dl->buckets[i] = entry->next;
+            entry = KFS_FREE(entry);
+        }
+    }
+    dl->num_entries = 0;
+    dl->num_records = 0;
+    dl->end = DIRTYLOG_HEADER;
+    if (dl->fd != -1 && ftruncate(dl->fd, dl->end) != 0) {
+        KFS_ERROR("Could not truncate mirror dirty log: %s", strerror(errno));
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Give up on the log: every subvolume that is out now needs a full resync.
+ */
+static void
+overflow_log(struct dirtylog *dl, const char *why)
+{
+    KFS_ENTER();
+
+    KFS_INFO("Giving up on the mirror dirty log (%s), ejected subvolumes "
+            "will be resynchronised in full.", why);
+    dl->overflow = 1;
+    dl->valid = 0;
+    clear_log(dl);
+    if (write_header(dl, 0) != 0) {
+        KFS_ERROR("Could not write mirror dirty log header.");
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Add the range [offset, end) to an entry, merging it with every range it
+ * overlaps or touches.
+ */
+static void
+add_range(struct dirty_entry *entry, uint64_t offset, uint64_t end)
+{
+    struct dirty_range *r = NULL;
+    uint_t i = 0;
+    uint_t n = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < entry->num_ranges; i++) {
+        r = &entry->ranges[i];
+        if (r->offset <= end && offset <= r->end) {
+            offset = MIN(offset, r->offset);
+            end = MAX(end, r->end);
+        } else {
+            entry->ranges[n++] = *r;
+        }
+    }
+    if (n == DIRTYLOG_RANGES) {
+        /* Out of room: cover all of them with one range. */
+        for (i = 0; i < n; i++) {
+            offset = MIN(offset, entry->ranges[i].offset);
+            end = MAX(end, entry->ranges[i].end);
+        }
+        n = 0;
+    }
+    entry->ranges[n].offset = offset;
+    entry->ranges[n].end = end;
+    entry->num_ranges = n + 1;
+
+    KFS_RETURN();
+}
+
+/**
+ * Add a change to the table. Returns 0 on success, -ENOSPC if the table is
+ * full, -ENOMEM if out of memory.
+ */
+static int
+add_entry(struct dirtylog *dl, const char *path, uint_t what, uint64_t offset,
+        uint64_t size)
+{
+    struct dirty_entry *entry = NULL;
+    const size_t pathlen = strlen(path);
+    const uint_t bucket = kfs_strhash(path) % dl->num_buckets;
+
+    KFS_ENTER();
+
+    for (entry = dl->buckets[bucket]; entry != NULL; entry = entry->next) {
+        if (strcmp(entry->path, path) == 0) {
+            break;
+        }
+    }
+    if (entry == NULL) {
+        if (dl->num_entries == dl->max_entries) {
+            KFS_RETURN(-ENOSPC);
+        }
+        entry = KFS_MALLOC(sizeof(*entry) + pathlen + 1);
+        if (entry == NULL) {
+            KFS_RETURN(-ENOMEM);
+        }
+        entry->what = 0;
+        entry->whole = 0;
+        entry->num_ranges = 0;
+        memcpy(entry->path, path, pathlen + 1);
+        entry->next = dl->buckets[bucket];
+        dl->buckets[bucket] = entry;
+        dl->num_entries += 1;
+    }
+    entry->what |= what;
+    if ((what & DIRTY_DATA) && size != 0 && !entry->whole) {
+        if (offset + size < offset) {
+            entry->whole = 1;
+        } else {
+            add_range(entry, offset, offset + size);
+        }
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Append a change to the file. Returns 0 on success, -errno on error.
+ */
+static int
+append_record(struct dirtylog *dl, const char *path, uint_t what, uint64_t
+        offset, uint64_t size)
+{
+    char buf[sizeof(struct record_head) + PATH_MAX];
+    struct record_head head;
+    ssize_t written = 0;
+
+    KFS_ENTER();
+
+    if (dl->fd == -1) {
+        KFS_RETURN(0);
+    }
+    head.what = what;
+    head.pathlen = strlen(path);
+    head.offset = offset;
+    head.size = size;
+    if (head.pathlen >= PATH_MAX) {
+        KFS_RETURN(-ENAMETOOLONG);
+    }
+    memcpy(buf, &head, sizeof(head));
+    memcpy(buf + sizeof(head), path, head.pathlen);
+    written = pwrite(dl->fd, buf, sizeof(head) + head.pathlen, dl->end);
+    if (written != (ssize_t) (sizeof(head) + head.pathlen)) {
+        KFS_RETURN(written == -1 ? -errno : -EIO);
+    }
+    dl->end += written;
+    dl->num_records += 1;
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Rebuild the table from the records in the file. Returns 0 on success, -errno
+ * on error.
+ */
+static int
+read_records(struct dirtylog *dl)
+{
+    char path[PATH_MAX];
+    struct record_head head;
+    ssize_t nread = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    for (;;) {
+        nread = pread(dl->fd, &head, sizeof(head), dl->end);
+        if (nread == 0) {
+            break;
+        }
+        if (nread != sizeof(head) || head.pathlen >= PATH_MAX) {
+            KFS_RETURN(nread == -1 ? -errno : -EIO);
+        }
+        nread = pread(dl->fd, path, head.pathlen, dl->end + sizeof(head));
+        if (nread != (ssize_t) head.pathlen) {
+            KFS_RETURN(nread == -1 ? -errno : -EIO);
+        }
+        path[head.pathlen] = '\0';
+        ret = add_entry(dl, path, head.what, head.offset, head.size);
+        if (ret != 0) {
+            KFS_RETURN(ret);
+        }
+        dl->end += sizeof(head) + head.pathlen;
+        dl->num_records += 1;
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Read the header (and records, if they can be trusted) of an existing dirty
+ * log file. Returns 0 on success, -EINVAL if the file is not a dirty log, any
+ * other -errno on error.
+ */
+static int
+load_log(struct dirtylog *dl, const char *filename)
+{
+    struct dirtylog_header header;
+    ssize_t nread = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    memset(&header, 0, sizeof(header));
+    nread = pread(dl->fd, &header, sizeof(header), 0);
+    if (nread != sizeof(header) || header.magic != DIRTYLOG_MAGIC ||
+            header.version != DIRTYLOG_VERSION) {
+        KFS_ERROR("%s is not a mirror dirty log, refusing to touch it.",
+                filename);
+        KFS_RETURN(-EINVAL);
+    }
+    dl->inactive = header.inactive;
+    dl->valid = header.valid & header.inactive;
+    dl->was_clean = header.clean != 0;
+    if (dl->inactive == 0) {
+        KFS_RETURN(0);
+    }
+    if (!header.clean) {
+        KFS_INFO("The mirror brick was not shut down cleanly, ejected "
+                "subvolumes will be resynchronised in full.");
+        dl->valid = 0;
+        dl->overflow = 1;
+        clear_log(dl);
+        KFS_RETURN(0);
+    }
+    ret = read_records(dl);
+    if (ret != 0) {
+        KFS_INFO("Could not read mirror dirty log %s: %s", filename,
+                strerror(-ret));
+        dl->valid = 0;
+        dl->overflow = 1;
+        clear_log(dl);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Open (or create) the dirty log at given filename, or one that is only kept
+ * in memory if filename is NULL. At most max_entries paths are tracked. A file
+ * that is not a dirty log is never overwritten. Returns NULL on failure.
+ */
+struct dirtylog *
+dirtylog_open(const char *filename, uint_t max_entries)
+{
+    struct dirtylog *dl = NULL;
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(max_entries > 0);
+    dl = KFS_MALLOC(sizeof(*dl));
+    if (dl == NULL) {
+        KFS_RETURN(NULL);
+    }
+    dl->fd = -1;
+    dl->end = DIRTYLOG_HEADER;
+    dl->num_records = 0;
+    dl->max_entries = max_entries;
+    dl->num_entries = 0;
+    dl->num_buckets = max_entries;
+    dl->inactive = 0;
+    dl->valid = 0;
+    dl->overflow = 0;
+    dl->was_clean = 0;
+    dl->buckets = KFS_CALLOC(dl->num_buckets, sizeof(*dl->buckets));
+    if (dl->buckets == NULL) {
+        dl = KFS_FREE(dl);
+        KFS_RETURN(NULL);
+    }
+    if (filename != NULL) {
+        dl->fd = open(filename, O_RDWR | O_CREAT, 0600);
+        if (dl->fd == -1) {
+            KFS_ERROR("Could not open mirror dirty log %s: %s", filename,
+                    strerror(errno));
+            ret = -errno;
+        } else if (fstat(dl->fd, &stbuf) != 0) {
+            ret = -errno;
+        } else if (stbuf.st_size != 0) {
+            ret = load_log(dl, filename);
+        } else {
+            /* New: nothing can have been lost. */
+            dl->was_clean = 1;
+        }
+        if (ret == 0 && dl->inactive == 0) {
+            clear_log(dl);
+        }
+        if (ret == 0) {
+            /* Not clean until dirtylog_close(). */
+            ret = write_header(dl, 0);
+        }
+    }
+    if (ret == 0) {
+        ret = kfs_mutex_init(&dl->lock);
+    }
+    if (ret != 0) {
+        if (ret != -EINVAL && dl->fd != -1) {
+            KFS_ERROR("Could not initialise mirror dirty log %s: %s",
+                    filename, strerror(-ret));
+        }
+        dl->inactive = 0;
+        clear_log(dl);
+        if (dl->fd != -1) {
+            close(dl->fd);
+        }
+        dl->buckets = KFS_FREE(dl->buckets);
+        dl = KFS_FREE(dl);
+        KFS_RETURN(NULL);
+    }
+    dl->tracking = dl->inactive != 0;
+
+    KFS_RETURN(dl);
+}
+
+/**
+ * Close the dirty log, marking the file as shut down cleanly. Always returns
+ * NULL.
+ */
+struct dirtylog *
+dirtylog_close(struct dirtylog *dl)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(dl != NULL);
+    if (dl->fd != -1) {
+        ret = write_header(dl, 1);
+        if (ret != 0) {
+            KFS_ERROR("Could not write mirror dirty log header: %s",
+                    strerror(-ret));
+        }
+        close(dl->fd);
+        dl->fd = -1;
+    }
+    clear_log(dl);
+    kfs_mutex_destroy(&dl->lock);
+    dl->buckets = KFS_FREE(dl->buckets);
+    dl = KFS_FREE(dl);
+
+    KFS_RETURN(dl);
+}
+
+/**
+ * Bitmap of the subvolumes that were out when the log was last closed.
+ */
+uint64_t
+dirtylog_get_inactive(struct dirtylog *dl)
+{
+    uint64_t inactive = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&dl->lock);
+    inactive = dl->inactive;
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN(inactive);
+}
+
+/**
+ * Non-zero if the log has a file that says the brick was shut down cleanly the
+ * last time (or was just created).
+ */
+uint_t
+dirtylog_was_clean(struct dirtylog *dl)
+{
+    KFS_ENTER();
+
+    KFS_RETURN(dl->was_clean);
+}
+
+/**
+ * Non-zero if modifications must be passed to dirtylog_add(). Cheap enough to
+ * call for every one.
+ */
+uint_t
+dirtylog_is_tracking(struct dirtylog *dl)
+{
+    KFS_ENTER();
+
+    KFS_RETURN(kfs_atomic_load(&dl->tracking));
+}
+
+/**
+ * Non-zero if the log holds every change subvolume id missed.
+ */
+uint_t
+dirtylog_is_valid(struct dirtylog *dl, uint_t id)
+{
+    uint_t valid = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id < DIRTYLOG_MAX_SUBVOLS);
+    kfs_mutex_lock(&dl->lock);
+    valid = !dl->overflow && (dl->valid >> id & 1);
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN(valid);
+}
+
+/**
+ * Subvolume id is out: track every modification from now on. Must be called
+ * before the modifications stop going to the subvolume.
+ */
+void
+dirtylog_eject(struct dirtylog *dl, uint_t id)
+{
+    const uint64_t bit = (uint64_t) 1 << id;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id < DIRTYLOG_MAX_SUBVOLS);
+    kfs_mutex_lock(&dl->lock);
+    if (dl->inactive & bit) {
+        kfs_mutex_unlock(&dl->lock);
+        KFS_RETURN();
+    }
+    if (dl->inactive == 0) {
+        /* Fresh start. */
+        clear_log(dl);
+        dl->overflow = 0;
+    }
+    dl->inactive |= bit;
+    if (!dl->overflow) {
+        dl->valid |= bit;
+    }
+    kfs_atomic_store(&dl->tracking, 1);
+    if (write_header(dl, 0) != 0) {
+        KFS_ERROR("Could not write mirror dirty log header.");
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Subvolume id missed changes the log does not have: it needs a full resync.
+ */
+void
+dirtylog_invalidate(struct dirtylog *dl, uint_t id)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(id < DIRTYLOG_MAX_SUBVOLS);
+    kfs_mutex_lock(&dl->lock);
+    dl->valid &= ~((uint64_t) 1 << id);
+    if (write_header(dl, 0) != 0) {
+        KFS_ERROR("Could not write mirror dirty log header.");
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Subvolume id is back and up to date. The log is emptied if it was the last
+ * one that was out.
+ */
+void
+dirtylog_admit(struct dirtylog *dl, uint_t id)
+{
+    const uint64_t bit = (uint64_t) 1 << id;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id < DIRTYLOG_MAX_SUBVOLS);
+    kfs_mutex_lock(&dl->lock);
+    dl->inactive &= ~bit;
+    dl->valid &= ~bit;
+    if (dl->inactive == 0) {
+        kfs_atomic_store(&dl->tracking, 0);
+        clear_log(dl);
+        dl->overflow = 0;
+    }
+    if (write_header(dl, 0) != 0) {
+        KFS_ERROR("Could not write mirror dirty log header.");
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Record a change: what is one of the DIRTY_* flags, offset and size are the
+ * range that changed for DIRTY_DATA. A truncate is a DIRTY_DATA change of size
+ * 0: the size of the file is always compared when it is brought back.
+ */
+void
+dirtylog_add(struct dirtylog *dl, const char *path, uint_t what, uint64_t
+        offset, uint64_t size)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&dl->lock);
+    if (dl->inactive == 0 || dl->overflow) {
+        kfs_mutex_unlock(&dl->lock);
+        KFS_RETURN();
+    }
+    ret = add_entry(dl, path, what, offset, size);
+    if (ret == 0) {
+        ret = append_record(dl, path, what, offset, size);
+        if (ret != 0) {
+            KFS_ERROR("Could not append to mirror dirty log: %s",
+                    strerror(-ret));
+        }
+    }
+    if (ret == -ENOSPC) {
+        overflow_log(dl, "too many changed paths");
+    } else if (ret != 0) {
+        overflow_log(dl, strerror(-ret));
+    } else if (dl->num_records > (uint64_t) dl->max_entries *
+            DIRTYLOG_RECORDS) {
+        overflow_log(dl, "too many changes");
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+static int
+compare_entries(const void *a, const void *b)
+{
+    const struct dirty_entry * const *x = a;
+    const struct dirty_entry * const *y = b;
+
+    return strcmp((*x)->path, (*y)->path);
+}
+
+/**
+ * Call fn for every changed path, in sorted order (a directory before what is
+ * in it). Works on a copy of the table: changes added meanwhile are not
+ * included. Returns 0 if fn returned 0 for every path, what it returned
+ * otherwise, -errno on error.
+ */
+int
+dirtylog_replay(struct dirtylog *dl, dirtylog_fn fn, void *arg)
+{
+    struct dirty_entry **entries = NULL;
+    struct dirty_entry *entry = NULL;
+    size_t size = 0;
+    uint_t n = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&dl->lock);
+    if (dl->num_entries == 0) {
+        kfs_mutex_unlock(&dl->lock);
+        KFS_RETURN(0);
+    }
+    entries = KFS_CALLOC(dl->num_entries, sizeof(*entries));
+    if (entries == NULL) {
+        kfs_mutex_unlock(&dl->lock);
+        KFS_RETURN(-ENOMEM);
+    }
+    for (i = 0; i < dl->num_buckets && ret == 0; i++) {
+        for (entry = dl->buckets[i]; entry != NULL; entry = entry->next) {
+            size = sizeof(*entry) + strlen(entry->path) + 1;
+            entries[n] = KFS_MALLOC(size);
+            if (entries[n] == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+            memcpy(entries[n], entry, size);
+            n += 1;
+        }
+    }
+    kfs_mutex_unlock(&dl->lock);
+    if (ret == 0) {
+        qsort(entries, n, sizeof(*entries), compare_entries);
+    }
+    for (i = 0; i < n; i++) {
+        entry = entries[i];
+        if (ret == 0) {
+            ret = fn(arg, entry->path, entry->what, entry->whole ? NULL :
+                    entry->ranges, entry->num_ranges);
+        }
+        entries[i] = KFS_FREE(entry);
+    }
+    entries = KFS_FREE(entries);
+
+    KFS_RETURN(ret);
+}
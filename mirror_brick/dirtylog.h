@@ -0,0 +1,49 @@
+#ifndef KFS_MIRROR_BRICK_DIRTYLOG_H
+#define KFS_MIRROR_BRICK_DIRTYLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+
+/** Maximum number of subvolumes a dirty log can track. */
+#define DIRTYLOG_MAX_SUBVOLS 64
+
+/** The entry itself changed (created, removed, metadata). */
+#define DIRTY_ENTRY 0x1
+/** The entry and everything below it changed (renamed into place). */
+#define DIRTY_TREE 0x2
+/** Data in the file changed, see the ranges. */
+#define DIRTY_DATA 0x4
+
+/** Byte range [offset, end) of a file. */
+struct dirty_range {
+    uint64_t offset;
+    uint64_t end;
+};
+
+struct dirtylog;
+
+/**
+ * Called by dirtylog_replay() for every changed path. If DIRTY_DATA is set in
+ * what, ranges holds num_ranges changed ranges, or is NULL if the entire file
+ * must be considered changed. Returns 0 to go on, anything else to stop.
+ */
+typedef int (*dirtylog_fn)(void *arg, const char *path, uint_t what, const
+        struct dirty_range *ranges, uint_t num_ranges);
+
+struct dirtylog * dirtylog_open(const char *filename, uint_t max_entries);
+struct dirtylog * dirtylog_close(struct dirtylog *dl);
+uint64_t dirtylog_get_inactive(struct dirtylog *dl);
+uint_t dirtylog_was_clean(struct dirtylog *dl);
+uint_t dirtylog_is_tracking(struct dirtylog *dl);
+uint_t dirtylog_is_valid(struct dirtylog *dl, uint_t id);
+void dirtylog_eject(struct dirtylog *dl, uint_t id);
+void dirtylog_invalidate(struct dirtylog *dl, uint_t id);
+void dirtylog_admit(struct dirtylog *dl, uint_t id);
+void dirtylog_add(struct dirtylog *dl, const char *path, uint_t what, uint64_t
+        offset, uint64_t size);
+int dirtylog_replay(struct dirtylog *dl, dirtylog_fn fn, void *arg);
+
+#endif
@@ -0,0 +1,515 @@
+/**
+ * Intent journal for the mirror brick: an alternative to reading back every
+ * region before it is overwritten (to be able to roll back a write that failed
+ * on some subvolumes).
+ *
+ * Before a write is sent to the subvolumes, a record "writing size bytes at
+ * offset of path" is written to the journal and flushed to disk. When the write
+ * is done everywhere, the record is cleared again. A subvolume where the write
+ * failed is not rolled back but marked dirty in the record, which is then kept.
+ *
+ * Every record that is still there when the journal is opened describes a range
+ * where the subvolumes may disagree: either the brick went down in the middle
+ * of the write (nobody knows which subvolumes have the new data), or some
+ * subvolumes are known to lack it. journal_replay() hands them to the mirror
+ * brick to copy the range from a good subvolume to the others.
+ *
+ * The file consists of a header block followed by a fixed number of slots of
+ * one block each. A record is written with one pwrite() and carries a checksum:
+ * a record that was torn by a crash is ignored, which is safe because the data
+ * write only starts after its record has been flushed.
+ *
+ * Concurrency: every write owns one slot from journal_begin() to journal_end(),
+ * only slot allocation is serialised by a mutex.
+ */
+
+#include "mirror_brick/journal.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#define JOURNAL_MAGIC 0x4b46534a /* "KFSJ" */
+#define JOURNAL_VERSION 1
+/** Size of the header and of every slot. */
+#define JOURNAL_BLOCK 4096
+
+/** Slot is not in use. */
+#define RECORD_FREE 0
+/** A write is in progress (or was, when the brick went down). */
+#define RECORD_PENDING 1
+/** The write failed on some subvolumes, see the dirty field. */
+#define RECORD_DIRTY 2
+
+/**
+ * Start of the journal file. All fields are in host byte order: the journal is
+ * not meant to be moved between machines.
+ */
+struct journal_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_slots;
+};
+
+/** Fixed part of a record, followed by the pathname. */
+struct record_head {
+    uint32_t state;
+    /** Length of the pathname (excluding '\0'). */
+    uint32_t pathlen;
+    uint64_t seq;
+    uint64_t offset;
+    uint64_t size;
+    /** Bitmap of subvolumes that lack the data (RECORD_DIRTY only). */
+    uint64_t dirty;
+    /** See record_check(). */
+    uint64_t check;
+};
+
+/** Longest pathname that fits in a slot. */
+#define RECORD_MAXPATH (JOURNAL_BLOCK - sizeof(struct record_head) - 1)
+
+struct journal {
+    int fd;
+    uint64_t num_slots;
+    /** Copy of the fixed part of every record. */
+    struct record_head *heads;
+    /** Non-zero for every slot that is in use. */
+    uint8_t *used;
+    uint64_t num_used;
+    /** Slots that are kept until the next replay. */
+    uint64_t num_dirty;
+    /** Where to start looking for a free slot. */
+    uint64_t next;
+    uint64_t seq;
+    /** Protects everything above except heads (owned by the slot's user). */
+    kfs_mutex_t lock;
+    /** Signalled when a slot is freed. */
+    kfs_cond_t freed;
+};
+
+/**
+ * Checksum over everything in a record that does not change after it was
+ * first written.
+ */
+static uint64_t
+record_check(const struct record_head *head, const char *path)
+{
+    uint64_t check = 0;
+
+    KFS_ENTER();
+
+    check = kfs_strhash(path);
+    check ^= head->seq * 0x9e3779b97f4a7c15ULL;
+    check ^= head->offset * 0xc2b2ae3d27d4eb4fULL;
+    check ^= head->size * 0x165667b19e3779f9ULL;
+    check ^= head->pathlen;
+
+    KFS_RETURN(check);
+}
+
+static off_t
+slot_offset(uint64_t slot)
+{
+    return (off_t) (slot + 1) * JOURNAL_BLOCK;
+}
+
+/**
+ * Write the fixed part of given slot's record (and the pathname, if not NULL)
+ * and flush it to disk if sync is set.
+ */
+static int
+write_record(struct journal *j, uint64_t slot, const char *path, uint_t sync)
+{
+    char buf[JOURNAL_BLOCK];
+    const struct record_head * const head = &j->heads[slot];
+    size_t size = sizeof(*head);
+    ssize_t written = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    memcpy(buf, head, sizeof(*head));
+    if (path != NULL) {
+        memcpy(buf + sizeof(*head), path, head->pathlen + 1);
+        size += head->pathlen + 1;
+    }
+    written = pwrite(j->fd, buf, size, slot_offset(slot));
+    if (written != (ssize_t) size) {
+        KFS_RETURN(written == -1 ? -errno : -EIO);
+    }
+    if (sync) {
+        ret = fdatasync(j->fd);
+        if (ret != 0) {
+            KFS_RETURN(-errno);
+        }
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Return given slot to the pool of free slots.
+ */
+static void
+free_slot(struct journal *j, uint64_t slot)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&j->lock);
+    KFS_ASSERT(j->used[slot]);
+    j->used[slot] = 0;
+    j->num_used -= 1;
+    kfs_cond_signal(&j->freed);
+    kfs_mutex_unlock(&j->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Initialise a fresh journal file with given number of slots.
+ */
+static int
+format_journal(int fd, uint64_t num_slots)
+{
+    struct journal_header header;
+    ssize_t written = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = ftruncate(fd, 0);
+    if (ret == 0) {
+        /* Zero-filled: all slots are free. */
+        ret = ftruncate(fd, (num_slots + 1) * JOURNAL_BLOCK);
+    }
+    if (ret != 0) {
+        KFS_RETURN(-errno);
+    }
+    memset(&header, 0, sizeof(header));
+    header.magic = JOURNAL_MAGIC;
+    header.version = JOURNAL_VERSION;
+    header.num_slots = num_slots;
+    written = pwrite(fd, &header, sizeof(header), 0);
+    if (written != sizeof(header)) {
+        KFS_RETURN(written == -1 ? -errno : -EIO);
+    }
+    ret = fsync(fd);
+    if (ret != 0) {
+        KFS_RETURN(-errno);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Open (or create) the journal at given filename. An existing journal keeps its
+ * own number of slots. A file that is not a journal is never overwritten: it
+ * could be one with records that must be replayed. Returns NULL on failure.
+ */
+struct journal *
+journal_open(const char *filename, uint_t num_slots)
+{
+    struct journal *j = NULL;
+    struct journal_header header;
+    struct stat stbuf;
+    ssize_t nread = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(filename != NULL && num_slots > 0);
+    j = KFS_MALLOC(sizeof(*j));
+    if (j == NULL) {
+        KFS_RETURN(NULL);
+    }
+    j->fd = open(filename, O_RDWR | O_CREAT, 0600);
+    if (j->fd == -1) {
+        KFS_ERROR("Could not open mirror journal %s: %s", filename,
+                strerror(errno));
+        j = KFS_FREE(j);
+        KFS_RETURN(NULL);
+    }
+    ret = fstat(j->fd, &stbuf);
+    if (ret != 0) {
+        ret = -errno;
+    } else if (stbuf.st_size == 0) {
+        ret = format_journal(j->fd, num_slots);
+        header.num_slots = num_slots;
+    } else {
+        memset(&header, 0, sizeof(header));
+        nread = pread(j->fd, &header, sizeof(header), 0);
+        if (nread != sizeof(header) || header.magic != JOURNAL_MAGIC ||
+                header.version != JOURNAL_VERSION || header.num_slots == 0 ||
+                (uint64_t) stbuf.st_size < (header.num_slots + 1) *
+                JOURNAL_BLOCK) {
+            KFS_ERROR("%s is not a mirror journal, refusing to touch it.",
+                    filename);
+            ret = -EINVAL;
+        } else if (header.num_slots != num_slots) {
+            KFS_INFO("Mirror journal %s has %llu slots, not changing that.",
+                    filename, (unsigned long long) header.num_slots);
+        }
+    }
+    if (ret != 0) {
+        if (ret != -EINVAL) {
+            KFS_ERROR("Could not initialise mirror journal %s: %s", filename,
+                    strerror(-ret));
+        }
+        close(j->fd);
+        j = KFS_FREE(j);
+        KFS_RETURN(NULL);
+    }
+    j->num_slots = header.num_slots;
+    j->heads = KFS_CALLOC(j->num_slots, sizeof(*j->heads));
+    j->used = KFS_CALLOC(j->num_slots, sizeof(*j->used));
+    if (j->heads == NULL || j->used == NULL) {
+        ret = -ENOMEM;
+    } else {
+        ret = kfs_mutex_init(&j->lock);
+        if (ret == 0) {
+            ret = kfs_cond_init(&j->freed);
+            if (ret != 0) {
+                kfs_mutex_destroy(&j->lock);
+            }
+        }
+    }
+    if (ret != 0) {
+        if (j->heads != NULL) {
+            j->heads = KFS_FREE(j->heads);
+        }
+        if (j->used != NULL) {
+            j->used = KFS_FREE(j->used);
+        }
+        close(j->fd);
+        j = KFS_FREE(j);
+        KFS_RETURN(NULL);
+    }
+    j->num_used = 0;
+    j->num_dirty = 0;
+    j->next = 0;
+    j->seq = 0;
+
+    KFS_RETURN(j);
+}
+
+/**
+ * Close the journal. Records that are still there are replayed the next time
+ * it is opened. Always returns NULL.
+ */
+struct journal *
+journal_close(struct journal *j)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(j != NULL);
+    KFS_ASSERT(j->num_used == j->num_dirty);
+    if (fsync(j->fd) != 0) {
+        KFS_ERROR("Could not write mirror journal: %s", strerror(errno));
+    }
+    close(j->fd);
+    kfs_cond_destroy(&j->freed);
+    kfs_mutex_destroy(&j->lock);
+    j->used = KFS_FREE(j->used);
+    j->heads = KFS_FREE(j->heads);
+    j = KFS_FREE(j);
+
+    KFS_RETURN(j);
+}
+
+/**
+ * Call fn for every record in the journal, in no particular order. A record is
+ * cleared if fn returns 0 and kept (occupying its slot until the next replay)
+ * otherwise. Must be called once, right after journal_open(), before
+ * any other thread uses the journal. Returns 0 on success, -errno on error.
+ */
+int
+journal_replay(struct journal *j, journal_replay_fn fn, void *arg)
+{
+    char buf[JOURNAL_BLOCK];
+    struct record_head head;
+    const char *path = NULL;
+    uint64_t slot = 0;
+    uint_t num_replayed = 0;
+    uint_t keep = 0;
+    ssize_t nread = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(j->num_used == 0);
+    for (slot = 0; slot < j->num_slots; slot++) {
+        nread = pread(j->fd, buf, sizeof(buf), slot_offset(slot));
+        if (nread != sizeof(buf)) {
+            KFS_RETURN(nread == -1 ? -errno : -EIO);
+        }
+        memcpy(&head, buf, sizeof(head));
+        if (head.state == RECORD_FREE) {
+            continue;
+        }
+        path = buf + sizeof(head);
+        keep = 0;
+        if (head.pathlen > RECORD_MAXPATH || path[head.pathlen] != '\0' ||
+                strlen(path) != head.pathlen ||
+                record_check(&head, path) != head.check) {
+            KFS_INFO("Ignoring torn mirror journal record in slot %llu.",
+                    (unsigned long long) slot);
+        } else if (head.state != RECORD_PENDING &&
+                head.state != RECORD_DIRTY) {
+            KFS_INFO("Ignoring mirror journal record of unknown type %u.",
+                    head.state);
+        } else {
+            if (head.seq > j->seq) {
+                j->seq = head.seq;
+            }
+            num_replayed += 1;
+            ret = fn(arg, path, head.offset, head.size,
+                    head.state == RECORD_DIRTY ? head.dirty : 0);
+            keep = ret != 0;
+        }
+        j->heads[slot] = head;
+        if (keep) {
+            KFS_ERROR("Could not repair `%s' (%llu bytes at %llu) on all "
+                    "subvolumes, keeping its journal record.", path,
+                    (unsigned long long) head.size,
+                    (unsigned long long) head.offset);
+            j->used[slot] = 1;
+            j->num_used += 1;
+            j->num_dirty += 1;
+            ret = 0;
+        } else {
+            j->heads[slot].state = RECORD_FREE;
+            ret = write_record(j, slot, NULL, 0);
+        }
+        if (ret != 0) {
+            KFS_RETURN(ret);
+        }
+    }
+    if (fdatasync(j->fd) != 0) {
+        KFS_RETURN(-errno);
+    }
+    if (num_replayed != 0) {
+        KFS_INFO("Replayed %u records from the mirror journal.",
+                num_replayed);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Record the intent to write size bytes at offset of path and flush it to disk.
+ * Blocks while all slots are in use. Returns the slot to pass to the other
+ * journal_*() functions, or -errno on error: -ENAMETOOLONG if the path does not
+ * fit in a record, -ENOSPC if every slot is held by a dirty record.
+ */
+int
+journal_begin(struct journal *j, const char *path, off_t offset, size_t size)
+{
+    struct record_head *head = NULL;
+    const size_t pathlen = strlen(path);
+    uint64_t slot = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (pathlen > RECORD_MAXPATH) {
+        KFS_RETURN(-ENAMETOOLONG);
+    }
+    kfs_mutex_lock(&j->lock);
+    while (j->num_used == j->num_slots) {
+        if (j->num_dirty == j->num_slots) {
+            kfs_mutex_unlock(&j->lock);
+            KFS_RETURN(-ENOSPC);
+        }
+        kfs_cond_wait(&j->freed, &j->lock);
+    }
+    for (slot = j->next; j->used[slot]; slot = (slot + 1) % j->num_slots) {
+        /* There is a free slot, so this terminates. */
+    }
+    j->used[slot] = 1;
+    j->num_used += 1;
+    j->next = (slot + 1) % j->num_slots;
+    j->seq += 1;
+    head = &j->heads[slot];
+    head->seq = j->seq;
+    kfs_mutex_unlock(&j->lock);
+    head->state = RECORD_PENDING;
+    head->pathlen = pathlen;
+    head->offset = offset;
+    head->size = size;
+    head->dirty = 0;
+    head->check = record_check(head, path);
+    ret = write_record(j, slot, path, 1);
+    if (ret != 0) {
+        KFS_ERROR("Could not write to the mirror journal: %s",
+                strerror(-ret));
+        free_slot(j, slot);
+        KFS_RETURN(ret);
+    }
+
+    KFS_RETURN(slot);
+}
+
+/**
+ * Mark the subvolumes in given bitmap as lacking the data of the write in given
+ * slot and flush that to disk. The record is kept after journal_end(). Returns
+ * 0 on success, -errno on error.
+ */
+int
+journal_dirty(struct journal *j, int slot, uint64_t dirty)
+{
+    struct record_head * const head = &j->heads[slot];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(slot >= 0 && (uint64_t) slot < j->num_slots);
+    head->state = RECORD_DIRTY;
+    head->dirty |= dirty;
+    ret = write_record(j, slot, NULL, 1);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * The write in given slot is done. Its record is cleared, unless some
+ * subvolumes were marked dirty.
+ */
+void
+journal_end(struct journal *j, int slot)
+{
+    struct record_head * const head = &j->heads[slot];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(slot >= 0 && (uint64_t) slot < j->num_slots);
+    if (head->state == RECORD_DIRTY) {
+        kfs_mutex_lock(&j->lock);
+        j->num_dirty += 1;
+        kfs_mutex_unlock(&j->lock);
+        KFS_RETURN();
+    }
+    /*
+     * No need to flush this: if it gets lost, the range is copied between
+     * subvolumes that are already identical.
+     */
+    head->state = RECORD_FREE;
+    ret = write_record(j, slot, NULL, 0);
+    if (ret != 0) {
+        KFS_ERROR("Could not clear mirror journal record: %s",
+                strerror(-ret));
+    }
+    free_slot(j, slot);
+
+    KFS_RETURN();
+}
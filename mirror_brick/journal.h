@@ -0,0 +1,32 @@
+#ifndef KFS_MIRROR_BRICK_JOURNAL_H
+#define KFS_MIRROR_BRICK_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+
+/** Maximum number of subvolumes a journal can track. */
+#define JOURNAL_MAX_SUBVOLS 64
+
+struct journal;
+
+/**
+ * Called by journal_replay() for every write that was not completed. If dirty
+ * is 0, it is not known which subvolumes have the new data; otherwise bit i is
+ * set for every subvolume i that is known to lack it. Returns 0 if the range
+ * is consistent again, anything else to keep the record.
+ */
+typedef int (*journal_replay_fn)(void *arg, const char *path, off_t offset,
+        size_t size, uint64_t dirty);
+
+struct journal * journal_open(const char *filename, uint_t num_slots);
+struct journal * journal_close(struct journal *j);
+int journal_replay(struct journal *j, journal_replay_fn fn, void *arg);
+int journal_begin(struct journal *j, const char *path, off_t offset, size_t
+        size);
+int journal_dirty(struct journal *j, int slot, uint64_t dirty);
+void journal_end(struct journal *j, int slot);
+
+#endif
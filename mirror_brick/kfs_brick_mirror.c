@@ -71,10 +71,18 @@
  * failed brick asap."
  *
  * This results in an approach where handlers get a list of all active
- * subvolumes once (at the beginning) and sequentially go through it. This does
- * widen the gap between checking and using, but it does allow a strict
- * rollback. Furthermore, since that gap is potentially infinite in the absence
- * of a lock, anyway, this "downside" is less absolute than it seems.
+ * subvolumes once (at the beginning) and hand the operation to all of them at
+ * the same time (see fanout()): the first subvolume is handled by the calling
+ * thread, the others by a pool of worker threads. The caller waits for all of
+ * them, so an operation takes as long as the slowest subvolume instead of the
+ * sum of all of them. This does widen the gap between checking and using, but
+ * it does allow a strict rollback. Furthermore, since that gap is potentially
+ * infinite in the absence of a lock, anyway, this "downside" is less absolute
+ * than it seems.
+ *
+ * With write_quorum, the caller only waits for that many subvolumes and the
+ * others finish in the background (see fanout_quorum()): an operation takes as
+ * long as the write_quorum-th fastest subvolume. This gives up the rollback.
  *
  *
  * == ERROR HANDLING ==
@@ -85,9 +93,10 @@
  * not be saved anymore. Typically, operation handlers come in three flavours:
  *
  * - Read only: the only apparent relevance in this subject is inconsistency.
- *   For now, this module just assumes every node is in sync if it is available.
- *   Of course, it would be much nicer to at least allow dynamic detection of
- *   inconsistencies, if not consolidation: TODO.
+ *   By default, this module just assumes every node is in sync if it is
+ *   available. With read_quorum, the metadata of several of them is compared
+ *   and the majority wins, which at least allows dynamic detection of
+ *   inconsistencies. Consolidation would be nicer still: TODO.
  *
  * - Add new stuff: creating new files, directories, appending data, etc.
  *   Failure of any subvolume to do this can be handled by simply performing the
@@ -127,8 +136,11 @@
  * to do when a significant part of the subvolumes seem to be failing beyond
  * possibility of recovery. The definitive answer is that this depends entirely
  * on factors that can not be extracted through the available API. Roughly, this
- * is a matter of availability versus consistency. TODO: this should be a
- * configuration variable (with a sensible, general, default).
+ * is a matter of availability versus consistency, so it is up to the
+ * configuration: by default, the mirror carries on for as long as one
+ * subvolume is left. With write_quorum, modifications fail (-EROFS) when fewer
+ * subvolumes than that are active, and an operation that does not succeed on
+ * that many fails (-EIO) even if it did succeed on some.
  *
  * The general idea that this portrays is that mirroring multiple subvolumes
  * correctly (!), notably including error handling of corner cases, requires a
@@ -234,6 +246,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <fuse.h>
+#include <limits.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -246,6 +259,11 @@
 #include "kfs_logging.h"
 #include "kfs_misc.h"
 #include "kfs_threading.h"
+#include "kfs_workqueue.h"
+#include "minini/minini.h"
+#include "mirror_brick/dirtylog.h"
+#include "mirror_brick/journal.h"
+#include "mirror_brick/readpolicy.h"
 
 /**
  * Globals for the entire brick, all operations always.
@@ -255,10 +273,21 @@
  *
  * - read-only after initialisation (state.C.*) (never modify these post-init!)
  *
- * - require rwlock to read/write (state.L.*)
+ * - require the lock to modify (state.L.*), see below for reading
  *
  * - the rest (state.*), use common sense here (and elsewhere too, if possible)
  *
+ * The set of active subvolumes (L.active) is an immutable snapshot. Readers
+ * fetch the current one with get_active_set() without any locking and can keep
+ * using it for as long as they like. A change (update_active_set()) publishes
+ * a snapshot under the lock, atomically. Snapshots are kept until the brick is
+ * halted, because there is no telling who is still looking at them, but a
+ * change to a state that was seen before (like every failed resync attempt)
+ * publishes the existing snapshot again: there is at most one for every
+ * distinct state, however many changes there are. A change that needs a new
+ * snapshot fails if there is no memory for it, and so does the operation that
+ * needed it.
+ *
  * The lock is intended for protection of the L struct only and should not be
  * held accross operations (release and re-acquire).
  */
@@ -267,18 +296,170 @@ struct mirror_state {
     struct {
         struct kfs_brick *subvols;
         uint_t num_subvols;
+        /** Executes operations on all but the first subvolume (may be NULL). */
+        struct kfs_workqueue *pool;
+        /** Chooses the subvolume for read-only operations. */
+        struct readpolicy *readpolicy;
+        /** Reads of at least this many bytes are striped (0: never). */
+        size_t stripe_threshold;
+        /** Hedge reads slower than this latency percentile (0: never). */
+        uint_t hedge_percentile;
+        /** Runs the attempts of hedged operations, see hedge(). */
+        struct kfs_workqueue *hedge_pool;
+        /** Attempts that may be queued or running on hedge_pool. */
+        uint_t hedge_threads;
+        /** Maximum percentage of hedged operations. */
+        uint_t hedge_budget;
+        /** Intent journal for writes (NULL: back up before writing). */
+        struct journal *journal;
+        /** Nanoseconds between resync attempts (0: never resync). */
+        uint64_t resync_interval;
+        /** Maximum resync speed in bytes per second (0: no limit). */
+        uint64_t resync_bandwidth;
+        /** What changed while subvolumes were out (NULL: not tracked). */
+        struct dirtylog *dirty;
+        /**
+         * Subvolumes with a lower id are written synchronously, the others
+         * are replicas (see repl_thread()).
+         */
+        uint_t num_sync;
+        /** Writers wait while the replicas lag this many bytes behind. */
+        uint64_t max_lag_bytes;
+        /** Or while the oldest queued modification is this old (ns). */
+        uint64_t max_lag;
+        /** Modifications complete once this many subvolumes have them. */
+        uint_t write_quorum;
+        /** Compare the metadata on this many subvolumes (1: do not). */
+        uint_t read_quorum;
     } C;
-    /** Acquire .lock before accessing these elements. */
+    /** Acquire .lock before changing these elements. */
     struct {
-        uint_t num_active_subvols;
-        /** For every subvolume: 1 if active, 0 if inactive. */
-        uint_t *subvol_active;
+        /** Current snapshot, read with get_active_set(). */
+        struct active_set *active;
+        /** Most recently created snapshot, the others are linked by prev. */
+        struct active_set *newest;
     } L;
-    /** Lock that must be acquired to access/manipulate this struct. */
-    kfs_rwlock_t lock;
+    /** Lock that must be acquired to manipulate the L struct. */
+    kfs_mutex_t lock;
+    /** Hedging budget: only accessed through atomic operations. */
+    struct {
+        /** Hedgeable operations in the current window. */
+        uint_t ops;
+        /** Extra requests sent in the current window. */
+        uint_t hedges;
+        /** Attempts queued or running on the hedge pool. */
+        uint_t running;
+        /** Protects the hedging counts of all filehandles. */
+        kfs_mutex_t lock;
+        /** Broadcast when the count of a filehandle drops to 0. */
+        kfs_cond_t idle;
+    } hedge;
+    /** Background resynchronisation, see resync_thread(). */
+    struct {
+        kfs_threadid_t thread;
+        /**
+         * Held for reading by every modification while the resync thread is
+         * running, for writing by that thread while it copies something.
+         */
+        kfs_rwlock_t lock;
+        /**
+         * Held by the resync thread while it waits for the lock, so that new
+         * modifications queue up behind it instead of starving it. See
+         * resync_exclusive().
+         */
+        kfs_mutex_t gate;
+        /** Protects stop. */
+        kfs_mutex_t stoplock;
+        kfs_cond_t stopcond;
+        uint_t stop;
+        /** Set if a modification could not be applied to the subvolume. */
+        uint_t again;
+        /** Progress, only for display. */
+        uint_t pass;
+        uint64_t files;
+        uint64_t bytes;
+        uint64_t started;
+    } resync;
+    /** Replication queue, see repl_thread(). */
+    struct {
+        kfs_threadid_t thread;
+        /** Protects everything below except from. */
+        kfs_mutex_t lock;
+        /** Broadcast whenever an entry is added or removed. */
+        kfs_cond_t changed;
+        struct repl_entry *head;
+        struct repl_entry *tail;
+        uint64_t num_queued;
+        uint64_t bytes_queued;
+        /** Sequence number of the last entry. */
+        uint64_t seq;
+        uint_t stop;
+        /** Per subvolume: entries up to this one were applied otherwise. */
+        uint64_t *from;
+    } repl;
+    /**
+     * Per subvolume: the modifications it was sent, in order (NULL without
+     * write_quorum). See fanout_quorum().
+     */
+    struct lane *lanes;
+    /**
+     * Open files. Not every caller passes the path along with a filehandle
+     * (the TCP server never does), but the journal, the replication queue and
+     * the dirty log need it. See fh_path().
+     */
+    struct {
+        /** Protects the list and the paths in it. */
+        kfs_mutex_t lock;
+        struct mirror_fh *head;
+    } files;
+};
+
+/**
+ * Snapshot of the active subvolumes. Never modified once published.
+ */
+struct active_set {
+    uint_t num_active;
+    /** The snapshot created before this one (NULL for the first). */
+    struct active_set *prev;
+    /** For every subvolume: its SUBVOL_* state. */
+    uint8_t *map;
+    /**
+     * The subvolume being resynchronised (NO_SUBVOL if none). It is inactive,
+     * but receives all modifications.
+     */
+    uint_t resync;
+    /** Ids of the active (not replica) subvolumes, in ascending order. */
+    uint_t ids[];
 };
-/* Macros get two hungarian underscores for clarity: */
-#define L__IS_ACTIVE(state, id) ((state)->L.subvol_active[(id)])
+
+/** Invalid subvolume id. */
+#define NO_SUBVOL ((uint_t) -1)
+
+/** States of a subvolume in an active set. */
+#define SUBVOL_INACTIVE 0
+#define SUBVOL_ACTIVE 1
+/** Fed asynchronously from the replication queue, never read from. */
+#define SUBVOL_REPLICA 2
+
+/** Striped reads are divided on multiples of this many bytes. */
+#define STRIPE_ALIGN 4096
+/** Larger reads are never hedged (every attempt needs its own buffer). */
+#define HEDGE_MAX_READ (1024 * 1024)
+/** The hedging budget is enforced over windows of this many operations. */
+#define HEDGE_WINDOW 10000
+/** Default number of threads for hedged operations. */
+#define HEDGE_THREADS_DEFAULT 8
+/** Default number of writes that can be in the journal at the same time. */
+#define JOURNAL_SLOTS_DEFAULT 64
+/** Default number of changed paths the dirty log keeps track of. */
+#define DIRTY_MAX_DEFAULT 65536
+/** Default maximum lag of the replicas, in bytes and in seconds. */
+#define MAX_LAG_BYTES_DEFAULT (64 * 1024 * 1024)
+#define MAX_LAG_SECONDS_DEFAULT 10
+/** Ranges are copied between subvolumes in chunks of at most this size. */
+#define COPY_CHUNK (128 * 1024)
+/** Virtual attribute of the root directory with the state of the subvolumes. */
+#define STATUS_XATTR KFS_XATTR_NS ".brick.mirror.status"
 
 /**
  * State associated with operations on one file/dir between open/release calls.
@@ -294,6 +475,16 @@ struct mirror_fh {
     /* File-handle associated with each subvolume on this session. */
     uint64_t *subvols_fh;
     uint_t num_subvols;
+    /**
+     * Hedged attempts still using subvols_fh (protected by the hedge lock of
+     * the state). They can outlive the read that started them.
+     */
+    uint_t hedging;
+    /** The path it was opened with, updated by mirror_rename(). */
+    char *path;
+    /** List of open files of the state. */
+    struct mirror_fh *prev;
+    struct mirror_fh *next;
 #if 0 // TODO: is this necessary?
     /** Lock that must be acquired to access/manipulate this struct. */
     kfs_rwlock_t lock = KFS_RWLOCK_INITIALIZER;
@@ -336,103 +527,74 @@ C_get_subvol_by_ID(struct mirror_state * const state, uint_t id)
 }
 
 /**
- * Returns 1 if given ID corresponds to an active subvolume in this brick.
+ * Allocate an active subvolume set for n subvolumes, all inactive.
  */
-static uint_t
-is_active(struct mirror_state * const state, uint_t id)
+static struct active_set *
+new_active_set(uint_t n)
 {
-    uint_t active = 0;
+    struct active_set *set = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(state != NULL);
-    KFS_ASSERT(id < C_get_num_subvols(state));
+    set = KFS_MALLOC(sizeof(*set) + n * sizeof(set->ids[0]) + n);
+    if (set == NULL) {
+        KFS_RETURN(NULL);
+    }
+    set->num_active = 0;
+    set->prev = NULL;
+    set->resync = NO_SUBVOL;
+    set->map = (uint8_t *) &set->ids[n];
+    memset(set->map, 0, n);
+
+    KFS_RETURN(set);
+}
 
-    kfs_rwlock_readlock(&state->lock);
-    active = L__IS_ACTIVE(state, id);
-    kfs_rwlock_unlock(&state->lock);
+/**
+ * Get the current set of active subvolumes. Lock-free, the result remains valid
+ * until the brick is halted (but it may be outdated by then).
+ */
+static inline const struct active_set *
+get_active_set(struct mirror_state * const state)
+{
+    KFS_ASSERT(state != NULL);
 
-    KFS_RETURN(active);
+    return kfs_atomic_load(&state->L.active);
 }
 
 /**
- * Get n subvolumes that are active.
- *
- * Starts at the first brick in the list, goes on until the last.
- *
- * Puts at most n ids of available subvolumes in the ids array The return value
- * is the actual number of subvolume ids stored in the array.
- *
- * Note that this function does not actually 'allocate' any resources, the
- * subvolumes are never notified that they have been selected. This is purely a
- * glorified macro that selects some ids from a pool of available bricks.
+ * Returns 1 if given ID corresponds to an active subvolume in this brick.
  */
 static uint_t
-get_some_active_subvols(struct mirror_state * const state, uint_t *ids,
-        uint_t n)
+is_active(struct mirror_state * const state, uint_t id)
 {
-    const uint_t num_subvols = C_get_num_subvols(state);
-    uint_t i = 0;
-    uint_t id = 0;
-
     KFS_ENTER();
 
     KFS_ASSERT(state != NULL);
-    KFS_ASSERT(ids != NULL);
-    KFS_ASSERT(num_subvols > 0);
-    KFS_ASSERT(n <= num_subvols);
-
-    kfs_rwlock_writelock(&state->lock);
-    n = MIN(n, state->L.num_active_subvols);
-    for (id = 0, i = 0; i < n && id < num_subvols; id++) {
-        /* Get the next active subvolume. */
-        if (L__IS_ACTIVE(state, id) == 0) {
-            continue;
-        }
-        ids[i] = id;
-        i += 1;
-    }
-    kfs_rwlock_unlock(&state->lock);
-
-    if (i == 0) {
-        KFS_ERROR("No more active subvolumes available in this mirror brick!");
-    }
+    KFS_ASSERT(id < C_get_num_subvols(state));
 
-    KFS_RETURN(i);
+    KFS_RETURN(get_active_set(state)->map[id] == SUBVOL_ACTIVE);
 }
 
 /**
- * Get the IDs of all active subvolumes in a freshly allocated array.
+ * Returns 1 if subvolume id is a replica when it is not out.
  *
- * Do not forget to FREE(). Returns the amount of active subvolumes in the array
- * (0 on error).
+ * Only accesses `constant' elements of the state.
  */
-static uint_t
-get_all_active_subvols(struct mirror_state * const state, uint_t **buf)
+static inline uint_t
+C_is_replica(struct mirror_state * const state, uint_t id)
 {
-    const uint_t num_subvols = C_get_num_subvols(state);
-    uint_t *ids = NULL;
-    uint_t ret = 0;
-
-    KFS_ENTER();
-
-    KFS_ASSERT(num_subvols > 0);
-    ids = KFS_MALLOC(num_subvols * sizeof(*ids));
-    if (ids == NULL) {
-        KFS_RETURN(0);
-    }
-    ret = get_some_active_subvols(state, ids, num_subvols);
-    /* If ret == 0 (no active subvols): realloc(ids, 0) ~= free(ids). */
-    KFS_ASSERT(ret <= num_subvols);
-    /* Free unused memory. No need for check, given new_size <= old_size. */
-    ids = KFS_REALLOC(ids, ret * sizeof(*ids));
-    *buf = ids;
+    KFS_ASSERT(state != NULL);
 
-    KFS_RETURN(ret);
+    return id >= state->C.num_sync;
 }
 
+static uint_t lane_readers(struct mirror_state * const state, const uint_t
+        *ids, const uint64_t *fhs, uint_t n, uint_t *rids, uint64_t *rfhs);
+static void lane_drop(struct mirror_state * const state, uint_t id);
+
 /**
- * No-hassle subvolume getter: just get one, any, active subvolume for reading.
+ * No-hassle subvolume getter: get one active subvolume for reading, as chosen
+ * by the read policy.
  *
  * Returns a pointer to the subvolume on success, NULL on error. If the idp
  * argument is not NULL, the id of the subvolume is stored in it on succesful
@@ -441,806 +603,3948 @@ get_all_active_subvols(struct mirror_state * const state, uint_t **buf)
 static struct kfs_brick *
 get_one_reader(struct mirror_state * const state, uint_t *idp)
 {
-    struct kfs_brick *brick = NULL;
-    uint_t *my_idp = NULL;
+    const struct active_set * const set = get_active_set(state);
+    uint_t ids[set->num_active + 1];
     uint_t id = 0;
     uint_t n = 0;
 
     KFS_ENTER();
 
-    if (idp == NULL) {
-        my_idp = &id;
-    } else {
-        my_idp = idp;
-    }
-    n = get_some_active_subvols(state, my_idp, 1);
-    if (n == 0) {
-        brick = NULL;
-    } else {
-        KFS_ASSERT(n == 1);
-        KFS_ASSERT(*my_idp <= C_get_num_subvols(state));
-        brick = C_get_subvol_by_ID(state, *my_idp);
+    if (set->num_active == 0) {
+        KFS_ERROR("No more active subvolumes available in this mirror brick!");
+        KFS_RETURN(NULL);
     }
-
-    KFS_RETURN(brick);
-}
-
-static void
-eject_subvolume(struct mirror_state * const state, uint_t id)
-{
-    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
-
-    KFS_ENTER();
-
-    kfs_rwlock_writelock(&state->lock);
-    /* Maybe some other thread already ejected this volume. */
-    if (L__IS_ACTIVE(state, id) == 1) {
-        KFS_ASSERT(state->L.num_active_subvols > 0);
-        KFS_ERROR("Unable to deal with the errors in subvolume #%u:%s, "
-                "resorting to drastic measures: eject from mirror array.",
-                id + 1, subv->name);
-        L__IS_ACTIVE(state, id) = 0;
-        state->L.num_active_subvols -= 1;
-        if (state->L.num_active_subvols == 0) {
-            KFS_ERROR("No more active subvolumes for this mirror brick.");
-        }
+    n = lane_readers(state, set->ids, NULL, set->num_active, ids, NULL);
+    id = ids[readpolicy_pick(state->C.readpolicy, ids, n)];
+    if (idp != NULL) {
+        *idp = id;
     }
-    kfs_rwlock_unlock(&state->lock);
 
-    KFS_RETURN();
+    KFS_RETURN(C_get_subvol_by_ID(state, id));
 }
 
 /**
- * Create new freshly allocated file handle, initialised and ready for use.
+ * Publish a new set of active subvolumes in which subvolume id has given
+ * SUBVOL_* state and is being resynchronised or not (the one that was being
+ * resynchronised before, if that is another one, stays that way). Returns the
+ * old state of the subvolume as (receiving modifications ? 1 : 0) | (resync ?
+ * 2 : 0), where an active subvolume and a replica receive modifications, or
+ * -ENOMEM if there was no memory for a new snapshot (nothing changed then).
  *
- * If the num_subvols argument is 0, no initialisation is done, just the
- * filehandle itself is allocated. Returns NULL on memory error. Do not forget
- * to call del_fh() on this!
+ * The dirty log (if any) starts tracking a subvolume before it stops receiving
+ * modifications, and stops after it receives them again.
  */
-static struct mirror_fh *
-new_fh(uint_t num_subvols)
+static int
+update_active_set(struct mirror_state * const state, uint_t id, uint_t active,
+        uint_t resync)
 {
-    struct mirror_fh *my_fh = NULL;
-    uint64_t *subvols_fh = NULL;
-    uint_t *ids = NULL;
+    const uint_t num_subvols = C_get_num_subvols(state);
+    struct active_set *cur = NULL;
+    struct active_set *next = NULL;
+    uint8_t map[num_subvols];
+    uint_t next_resync = NO_SUBVOL;
+    int old = 0;
+    uint_t i = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(num_subvols > 0);
-    my_fh = KFS_MALLOC(sizeof(*my_fh));
-    if (my_fh != NULL) {
-        subvols_fh = KFS_MALLOC(num_subvols * sizeof(*subvols_fh));
-        if (subvols_fh != NULL) {
-            my_fh->subvols_fh = subvols_fh;
-            ids = KFS_MALLOC(num_subvols * sizeof(*ids));
-            if (ids != NULL) {
-                my_fh->subvols_id = ids;
-                my_fh->num_subvols = num_subvols;
-                KFS_RETURN(my_fh);
+    kfs_mutex_lock(&state->lock);
+    cur = state->L.active;
+    old = (cur->map[id] ? 1 : 0) | (cur->resync == id ? 2 : 0);
+    if (cur->map[id] == active && (cur->resync == id) == (resync != 0)) {
+        kfs_mutex_unlock(&state->lock);
+        KFS_RETURN(old);
+    }
+    memcpy(map, cur->map, num_subvols);
+    map[id] = active;
+    if (resync) {
+        next_resync = id;
+    } else if (cur->resync != id) {
+        next_resync = cur->resync;
+    }
+    /* Reuse the snapshot of this state if there is one. */
+    for (next = state->L.newest; next != NULL; next = next->prev) {
+        if (next->resync == next_resync && memcmp(next->map, map,
+                    num_subvols) == 0) {
+            break;
+        }
+    }
+    if (next == NULL) {
+        next = new_active_set(num_subvols);
+        if (next == NULL) {
+            kfs_mutex_unlock(&state->lock);
+            KFS_ERROR("Out of memory while changing the state of subvolume "
+                    "%s.", C_get_subvol_by_ID(state, id)->name);
+            KFS_RETURN(-ENOMEM);
+        }
+        memcpy(next->map, map, num_subvols);
+        for (i = 0; i < num_subvols; i++) {
+            if (next->map[i] == SUBVOL_ACTIVE) {
+                next->ids[next->num_active] = i;
+                next->num_active += 1;
             }
-            subvols_fh = KFS_FREE(subvols_fh);
         }
-        my_fh = KFS_FREE(my_fh);
+        next->resync = next_resync;
+        next->prev = state->L.newest;
+        state->L.newest = next;
+    }
+    if (state->C.dirty != NULL && (old & 1) && !active) {
+        dirtylog_eject(state->C.dirty, id);
     }
+    kfs_atomic_store(&state->L.active, next);
+    if (state->C.dirty != NULL && !(old & 1) && active) {
+        dirtylog_admit(state->C.dirty, id);
+    }
+    kfs_mutex_unlock(&state->lock);
 
-    KFS_RETURN(NULL);
+    KFS_RETURN(old);
 }
 
 /**
- * Clean up and delete filehandle created with new_fh.
+ * Stop using subvolume id. Returns 0 on success (or if it was out already),
+ * -errno if it could not be ejected: it is then still in use and out of sync,
+ * so the caller must fail the operation that caused this.
  */
-static struct mirror_fh *
-del_fh(struct mirror_fh *fh)
+static int
+eject_subvolume(struct mirror_state * const state, uint_t id)
 {
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
+    int old = 0;
+
     KFS_ENTER();
 
-    KFS_ASSERT(fh != NULL);
-    /* If subvols_... == NULL then num_subvols == 0. */
-    KFS_ASSERT(fh->subvols_fh != NULL || fh->num_subvols == 0);
-    KFS_ASSERT(fh->subvols_id != NULL || fh->num_subvols == 0);
-    if (fh->subvols_fh != NULL) {
-        fh->subvols_fh = KFS_FREE(fh->subvols_fh);
+    old = update_active_set(state, id, SUBVOL_INACTIVE, 0);
+    if (old < 0) {
+        KFS_ERROR("Could not eject subvolume #%u:%s, it may be out of sync.",
+                id + 1, subv->name);
+        KFS_RETURN(old);
     }
-    if (fh->subvols_id != NULL) {
-        fh->subvols_id = KFS_FREE(fh->subvols_id);
+    /* Maybe some other thread already ejected this volume. */
+    if ((old & 1) == 0) {
+        KFS_RETURN(0);
+    }
+    lane_drop(state, id);
+    KFS_ERROR("Unable to deal with the errors in subvolume #%u:%s, "
+            "resorting to drastic measures: eject from mirror array.",
+            id + 1, subv->name);
+    if (get_active_set(state)->num_active == 0) {
+        KFS_ERROR("No more active subvolumes for this mirror brick.");
     }
-    fh = KFS_FREE(fh);
 
-    KFS_RETURN(fh);
+    KFS_RETURN(0);
 }
 
+/*
+ * Fan-out: executing one operation on many subvolumes at once.
+ */
+
+/** Every operation that fanout() can execute. */
+enum mirror_opid {
+    MOP_GETATTR,
+    MOP_READLINK,
+    MOP_MKNOD,
+    MOP_MKDIR,
+    MOP_UNLINK,
+    MOP_RMDIR,
+    MOP_SYMLINK,
+    MOP_RENAME,
+    MOP_LINK,
+    MOP_CHMOD,
+    MOP_CHOWN,
+    MOP_TRUNCATE,
+    MOP_OPEN,
+    MOP_READ,
+    MOP_WRITE,
+    MOP_FLUSH,
+    MOP_RELEASE,
+    MOP_FSYNC,
+    MOP_SETXATTR,
+    MOP_UTIMENS,
+    MOP_FALLOCATE,
+};
+
 /**
- * Lock a (region of) a file.
- *
- * It is specified at the top of this file because other handlers use it.
- * However, it is not implemented (always returns ENOSYS): TODO.
+ * An operation and its arguments. Only the members used by the operation need
+ * to be set, see apply_op().
  */
-static int
-mirror_lock(const kfs_context_t co, const char *path, struct fuse_file_info *fi,
-        int cmd, struct flock *lock)
-{
-    (void) co;
-    (void) path;
-    (void) fi;
-    (void) cmd;
-    (void) lock;
+struct mirror_op {
+    enum mirror_opid id;
+    /** Short description for error messages. */
+    const char *what;
+    const char *path;
+    /** Second path (symlink, rename, link). */
+    const char *path2;
+    mode_t mode;
+    dev_t dev;
+    uid_t uid;
+    gid_t gid;
+    off_t offset;
+    const char *buf;
+    /** Destination buffer (readlink, read). */
+    char *out;
+    /** Destination (getattr). */
+    struct stat *st;
+    size_t size;
+    const char *name;
+    int flags;
+    const struct timespec *tvnano;
+};
 
-    KFS_ENTER();
+/**
+ * An operation being executed on a number of subvolumes.
+ */
+struct fanout {
+    struct mirror_state *state;
+    /** Copied by every job: KFS_DO_OPER() modifies the context. */
+    struct kfs_context co;
+    /** One operation for all subvolumes, or one for each (see num_ops). */
+    const struct mirror_op *op;
+    uint_t num_ops;
+    /** Template for the filehandle-based operations (NULL for the others). */
+    const struct fuse_file_info *fi;
+    const uint_t *ids;
+    /** In: filehandle per subvolume (if fi != NULL). Out: the new one. */
+    uint64_t *fhs;
+    /** Out: return value per subvolume. */
+    int *rets;
+    /** Number of jobs that have not finished yet. */
+    uint_t pending;
+    kfs_mutex_t lock;
+    kfs_cond_t done;
+};
 
-    KFS_RETURN(-ENOSYS);
-}
+struct fanout_job {
+    struct fanout *fo;
+    uint_t i;
+};
 
 /**
- * Lock this file or accept pending locks.
- *
- * Used to protect from race conditions in the backup, operate, rollback
- * process, where a concurrent thread might update a file inbetween, causing a
- * rollback to outdated data.
- *
- * Returns 0 when a new lock is acquired, 1 when an existing lock was
- * encountered, -1 on error.
+ * Execute an operation on one subvolume.
  */
 static int
-ensure_lock(kfs_context_t co, const char *path, off_t offset, size_t size,
-        struct fuse_file_info *fi, struct flock *lock)
+apply_op(struct kfs_brick *subv, kfs_context_t co, const struct mirror_op *op,
+        struct fuse_file_info *fi)
 {
-    uint64_t fh_backup = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    lock->l_type = F_WRLCK;
-    lock->l_whence = SEEK_SET; /* API requirement. */
-    lock->l_start = offset;
-    lock->l_len = size;
-    fh_backup = fi->fh; /* mirror_lock() might spoil this */
-    ret = mirror_lock(co, path, fi, F_SETLK, lock);
-    fi->fh = fh_backup;
-    switch (-ret) {
-    case 0:
-        /* Successfully acquired my own lock. */
-        ret = 0;
-    case EACCES:
-    case EAGAIN:
-        /* Some other process acquired the lock. Hope they called this func. */
-        ret = 1;
+    switch (op->id) {
+    case MOP_GETATTR:
+        KFS_DO_OPER(ret = , subv, getattr, co, op->path, op->st);
+        break;
+    case MOP_READLINK:
+        KFS_DO_OPER(ret = , subv, readlink, co, op->path, op->out, op->size);
+        break;
+    case MOP_MKNOD:
+        KFS_DO_OPER(ret = , subv, mknod, co, op->path, op->mode, op->dev);
+        break;
+    case MOP_MKDIR:
+        KFS_DO_OPER(ret = , subv, mkdir, co, op->path, op->mode);
+        break;
+    case MOP_UNLINK:
+        KFS_DO_OPER(ret = , subv, unlink, co, op->path);
+        break;
+    case MOP_RMDIR:
+        KFS_DO_OPER(ret = , subv, rmdir, co, op->path);
+        break;
+    case MOP_SYMLINK:
+        KFS_DO_OPER(ret = , subv, symlink, co, op->path, op->path2);
+        break;
+    case MOP_RENAME:
+        KFS_DO_OPER(ret = , subv, rename, co, op->path, op->path2);
+        break;
+    case MOP_LINK:
+        KFS_DO_OPER(ret = , subv, link, co, op->path, op->path2);
+        break;
+    case MOP_CHMOD:
+        KFS_DO_OPER(ret = , subv, chmod, co, op->path, op->mode);
+        break;
+    case MOP_CHOWN:
+        KFS_DO_OPER(ret = , subv, chown, co, op->path, op->uid, op->gid);
+        break;
+    case MOP_TRUNCATE:
+        KFS_DO_OPER(ret = , subv, truncate, co, op->path, op->offset);
+        break;
+    case MOP_OPEN:
+        KFS_DO_OPER(ret = , subv, open, co, op->path, fi);
+        break;
+    case MOP_READ:
+        KFS_DO_OPER(ret = , subv, read, co, op->path, op->out, op->size,
+                op->offset, fi);
+        break;
+    case MOP_WRITE:
+        KFS_DO_OPER(ret = , subv, write, co, op->path, op->buf, op->size,
+                op->offset, fi);
+        /* API requirement. */
+        KFS_ASSERT(ret < 0 || (size_t) ret == op->size);
+        break;
+    case MOP_FLUSH:
+        KFS_DO_OPER(ret = , subv, flush, co, op->path, fi);
+        break;
+    case MOP_RELEASE:
+        KFS_DO_OPER(ret = , subv, release, co, op->path, fi);
+        break;
+    case MOP_FSYNC:
+        KFS_DO_OPER(ret = , subv, fsync, co, op->path, op->flags, fi);
+        break;
+    case MOP_SETXATTR:
+        KFS_DO_OPER(ret = , subv, setxattr, co, op->path, op->name, op->buf,
+                op->size, op->flags);
+        break;
+    case MOP_UTIMENS:
+        KFS_DO_OPER(ret = , subv, utimens, co, op->path, op->tvnano);
+        break;
+    case MOP_FALLOCATE:
+        KFS_DO_OPER(ret = , subv, fallocate, co, op->path, op->flags,
+                op->offset, op->size, fi);
         break;
-    /* TODO: What about EDEADLK? */
     default:
-        ret = -1;
+        KFS_ASSERT(0 && "Illegal mirror operation.");
+        ret = -ENOSYS;
         break;
     }
 
     KFS_RETURN(ret);
 }
 
-static int
-mirror_getattr(const kfs_context_t co, const char *path, struct stat *stbuf)
+/**
+ * Execute the operation of a fan-out on subvolume number i.
+ */
+static void
+fanout_exec(struct fanout *fo, uint_t i)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    int ret = 0;
+    struct kfs_brick * const subv = C_get_subvol_by_ID(fo->state, fo->ids[i]);
+    const struct mirror_op * const op = &fo->op[fo->num_ops == 1 ? 0 : i];
+    struct readpolicy * const rp = fo->state->C.readpolicy;
+    struct kfs_context co = fo->co;
+    struct fuse_file_info fi;
+    uint64_t start = 0;
 
     KFS_ENTER();
 
-    subv = get_one_reader(state, NULL);
-    if (subv == NULL) {
-        KFS_RETURN(-ENOSUBVOLS);
+    if (op->id == MOP_READ) {
+        start = readpolicy_start(rp, fo->ids[i]);
+    }
+    if (fo->fi != NULL) {
+        fi = *fo->fi;
+        fi.fh = fo->fhs[i];
+        fo->rets[i] = apply_op(subv, &co, op, &fi);
+        fo->fhs[i] = fi.fh;
+    } else {
+        fo->rets[i] = apply_op(subv, &co, op, NULL);
+    }
+    if (op->id == MOP_READ) {
+        readpolicy_done(rp, fo->ids[i], start, MAX(fo->rets[i], 0));
     }
-    KFS_DO_OPER(ret = , subv, getattr, co, path, stbuf);
 
-    KFS_RETURN(ret);
+    KFS_RETURN();
 }
 
-static int
-mirror_readlink(const kfs_context_t co, const char *path, char *buf, size_t
-        size)
+/**
+ * Execute one job of a fan-out and notify the waiting thread. Runs on any
+ * thread.
+ */
+static void
+fanout_run(void *arg)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    int ret = 0;
+    struct fanout_job * const job = arg;
+    struct fanout * const fo = job->fo;
 
     KFS_ENTER();
 
-    subv = get_one_reader(state, NULL);
-    if (subv == NULL) {
-        KFS_RETURN(-ENOSUBVOLS);
+    fanout_exec(fo, job->i);
+    kfs_mutex_lock(&fo->lock);
+    fo->pending -= 1;
+    if (fo->pending == 0) {
+        kfs_cond_signal(&fo->done);
     }
-    KFS_DO_OPER(ret = , subv, readlink, co, path, buf, size);
+    kfs_mutex_unlock(&fo->lock);
 
-    KFS_RETURN(ret);
+    KFS_RETURN();
 }
 
-static int
-mirror_mknod(const kfs_context_t co, const char *path, mode_t mode, dev_t dev)
+/**
+ * Like fanout(), but with either one operation for all subvolumes (num_ops ==
+ * 1) or one for each of them (num_ops == n).
+ */
+static void
+fanout_ops(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, uint_t num_ops, const struct fuse_file_info *fi,
+        const uint_t *ids, uint64_t *fhs, int *rets, uint_t n)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
+    struct fanout fo;
+    struct fanout_job jobs[n];
     uint_t i = 0;
-    uint_t n = 0;
-    int tmp = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, mknod, co, path, mode, dev);
-        if (ret != 0) {
-            /* An error occurred: try to rollback. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, unlink, co, path);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `new file' "
-                        "operation by deleting it: could not delete `%s' from "
-                        "node `%s': %s", path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
+    KFS_ASSERT(fi == NULL || fhs != NULL);
+    KFS_ASSERT(num_ops == 1 || num_ops == n);
+    if (n == 0) {
+        KFS_RETURN();
+    }
+    fo.state = state;
+    fo.co = *co;
+    fo.op = op;
+    fo.num_ops = num_ops;
+    fo.fi = fi;
+    fo.ids = ids;
+    fo.fhs = fhs;
+    fo.rets = rets;
+    fo.pending = n;
+    if (state->C.pool == NULL || n == 1) {
+        ret = -1;
+    } else {
+        ret = kfs_mutex_init(&fo.lock);
+        if (ret == 0) {
+            ret = kfs_cond_init(&fo.done);
+            if (ret != 0) {
+                kfs_mutex_destroy(&fo.lock);
+            }
+        }
+    }
+    if (ret != 0) {
+        /* Sequentially, on this thread. */
+        for (i = 0; i < n; i++) {
+            fanout_exec(&fo, i);
+        }
+        KFS_RETURN();
+    }
+    for (i = 0; i < n; i++) {
+        jobs[i].fo = &fo;
+        jobs[i].i = i;
+    }
+    /* The first one is done by this thread while the others are underway. */
+    for (i = 1; i < n; i++) {
+        ret = kfs_workqueue_push(state->C.pool, fanout_run, &jobs[i]);
+        if (ret != 0) {
+            fanout_run(&jobs[i]);
+        }
+    }
+    fanout_run(&jobs[0]);
+    kfs_mutex_lock(&fo.lock);
+    while (fo.pending != 0) {
+        kfs_cond_wait(&fo.done, &fo.lock);
+    }
+    kfs_mutex_unlock(&fo.lock);
+    kfs_cond_destroy(&fo.done);
+    kfs_mutex_destroy(&fo.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Execute op on all n given subvolumes at the same time and wait until every
+ * one of them is done. The return value of every subvolume is stored in rets.
+ *
+ * If fi is not NULL, every subvolume gets its own copy of it with fh set to the
+ * corresponding element of fhs, which is updated after the operation.
+ */
+static void
+fanout(struct mirror_state * const state, const kfs_context_t co, const struct
+        mirror_op *op, const struct fuse_file_info *fi, const uint_t *ids,
+        uint64_t *fhs, int *rets, uint_t n)
+{
+    KFS_ENTER();
+
+    fanout_ops(state, co, op, 1, fi, ids, fhs, rets, n);
+
+    KFS_RETURN();
+}
+
+/**
+ * Execute op on all given subvolumes at once and deal with partial failure:
+ *
+ * - If it succeeded everywhere, return the result of the first subvolume.
+ *
+ * - If it failed everywhere, return the error of the first subvolume.
+ *
+ * - If it failed on some subvolumes: if an undo operation is given, execute
+ *   that on all subvolumes where op succeeded (ejecting those where undo fails)
+ *   and return the first error. Without undo, the first subvolume decides: if
+ *   it failed there, eject those where it succeeded and return that error,
+ *   otherwise eject all failed subvolumes and return its result.
+ *
+ * See fanout() for fi and fhs.
+ */
+static int
+fanout_all(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, const struct mirror_op *undo, const struct
+        fuse_file_info *fi, const uint_t *ids, uint64_t *fhs, uint_t n)
+{
+    int rets[n];
+    int undorets[n];
+    uint_t undoids[n];
+    uint64_t undofhs[n];
+    struct kfs_brick *subv = NULL;
+    uint_t num_failed = 0;
+    uint_t num_undo = 0;
+    uint_t i = 0;
+    int firsterr = 0;
+    int firstok = 0;
+
+    KFS_ENTER();
+
+    if (n == 0) {
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    fanout(state, co, op, fi, ids, fhs, rets, n);
+    for (i = 0; i < n; i++) {
+        if (rets[i] < 0) {
+            if (num_failed == 0) {
+                firsterr = rets[i];
+            }
+            num_failed += 1;
+        } else {
+            if (num_undo == 0) {
+                firstok = rets[i];
+            }
+            undoids[num_undo] = ids[i];
+            if (fhs != NULL) {
+                undofhs[num_undo] = fhs[i];
+            }
+            num_undo += 1;
+        }
+    }
+    if (num_failed == 0) {
+        KFS_RETURN(firstok);
+    }
+    if (num_failed == n) {
+        KFS_RETURN(firsterr);
+    }
+    if (undo == NULL && rets[0] < 0) {
+        /*
+         * It failed on the first subvolume: that is the result. The ones where
+         * it worked disagree with it now and can not be rolled back.
+         */
+        for (i = 1; i < n; i++) {
+            if (rets[i] >= 0) {
+                subv = C_get_subvol_by_ID(state, ids[i]);
+                KFS_ERROR("Operation `%s' on `%s' failed on the first node "
+                        "but not on node `%s'. Rollback impossible, dropping "
+                        "node and continuing with the rest.", op->what,
+                        op->path, subv->name);
+                eject_subvolume(state, ids[i]);
+            }
+        }
+        KFS_RETURN(rets[0]);
+    }
+    if (undo == NULL) {
+        for (i = 0; i < n; i++) {
+            if (rets[i] < 0) {
+                subv = C_get_subvol_by_ID(state, ids[i]);
+                KFS_ERROR("Operation `%s' on `%s' failed on node `%s': %s. "
+                        "Rollback impossible, dropping node and continuing "
+                        "with the rest.", op->what, op->path, subv->name,
+                        strerror(-rets[i]));
+                if (eject_subvolume(state, ids[i]) != 0) {
+                    /* It is still in use: do not pretend all is well. */
+                    firstok = -EIO;
                 }
             }
+        }
+        KFS_RETURN(firstok);
+    }
+    /* Roll back all subvolumes where it did work. */
+    fanout(state, co, undo, fi, undoids, fhs == NULL ? NULL : undofhs,
+            undorets, num_undo);
+    for (i = 0; i < num_undo; i++) {
+        if (undorets[i] < 0) {
+            subv = C_get_subvol_by_ID(state, undoids[i]);
+            KFS_ERROR("While trying to roll back a failed `%s' operation on "
+                    "`%s': could not undo it on node `%s': %s", op->what,
+                    op->path, subv->name, strerror(-undorets[i]));
+            eject_subvolume(state, undoids[i]);
+        }
+    }
+
+    KFS_RETURN(firsterr);
+}
+
+/**
+ * Get the ids and filehandles of the subvolumes of this session that are still
+ * active. Returns how many there are.
+ */
+static uint_t
+get_active_fh_subvols(struct mirror_state * const state, const struct
+        mirror_fh *my_fh, uint_t *ids, uint64_t *fhs)
+{
+    uint_t i = 0;
+    uint_t n = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < my_fh->num_subvols; i++) {
+        if (is_active(state, my_fh->subvols_id[i])) {
+            ids[n] = my_fh->subvols_id[i];
+            fhs[n] = my_fh->subvols_fh[i];
+            n += 1;
+        }
+    }
+
+    KFS_RETURN(n);
+}
+
+/**
+ * Start a modification: while subvolumes are being resynchronised, it must not
+ * overlap with the resync thread copying something. See resync_thread().
+ */
+static void
+resync_enter(struct mirror_state * const state)
+{
+    KFS_ENTER();
+
+    if (state->C.resync_interval != 0) {
+        kfs_mutex_lock(&state->resync.gate);
+        kfs_mutex_unlock(&state->resync.gate);
+        kfs_rwlock_readlock(&state->resync.lock);
+    }
+
+    KFS_RETURN();
+}
+
+static void
+resync_leave(struct mirror_state * const state)
+{
+    KFS_ENTER();
+
+    if (state->C.resync_interval != 0) {
+        kfs_rwlock_unlock(&state->resync.lock);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Acquire the resync lock for writing (release with kfs_rwlock_unlock()). Only
+ * the modifications that are already running are waited for: new ones wait at
+ * the gate in resync_enter() until the lock is acquired.
+ */
+static void
+resync_exclusive(struct mirror_state * const state)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&state->resync.gate);
+    kfs_rwlock_writelock(&state->resync.lock);
+    kfs_mutex_unlock(&state->resync.gate);
+
+    KFS_RETURN();
+}
+
+/**
+ * Apply a modification that returned ret on the active subvolumes to the
+ * subvolume that is being resynchronised as well (if any, and if it did not
+ * fail). Must be called between resync_enter() and resync_leave().
+ *
+ * Errors that only mean that the resync thread has not got to this part of the
+ * tree yet make it do another pass. Any other error stops the resync.
+ */
+static void
+resync_forward(struct mirror_state * const state, const kfs_context_t co,
+        const struct mirror_op *op, int ret)
+{
+    const uint_t id = get_active_set(state)->resync;
+    struct kfs_brick *subv = NULL;
+    struct mirror_op fop = {.id = MOP_OPEN, .what = "open", .path = op->path};
+    struct fuse_file_info fi;
+
+    KFS_ENTER();
+
+    if (ret < 0 || id == NO_SUBVOL) {
+        KFS_RETURN();
+    }
+    if (op->path == NULL) {
+        /* Can not be opened there: let the next pass copy it. */
+        kfs_atomic_store(&state->resync.again, 1);
+        KFS_RETURN();
+    }
+    subv = C_get_subvol_by_ID(state, id);
+    if (op->id == MOP_WRITE || op->id == MOP_FALLOCATE) {
+        /* The filehandles of the session do not include this subvolume. */
+        memset(&fi, 0, sizeof(fi));
+        fi.flags = O_WRONLY;
+        ret = apply_op(subv, co, &fop, &fi);
+        if (ret == 0) {
+            ret = apply_op(subv, co, op, &fi);
+            fop.id = MOP_RELEASE;
+            fop.what = "release";
+            apply_op(subv, co, &fop, &fi);
+        }
+    } else {
+        ret = apply_op(subv, co, op, NULL);
+    }
+    switch (-ret) {
+    case ENOENT:
+    case EEXIST:
+    case ENOTEMPTY:
+    case ENOTDIR:
+    case EISDIR:
+        kfs_atomic_store(&state->resync.again, 1);
+        break;
+    default:
+        if (ret < 0) {
+            KFS_ERROR("Operation `%s' on `%s' failed on node `%s' while "
+                    "resynchronising it: %s. Giving up.", op->what, op->path,
+                    subv->name, strerror(-ret));
+            if (update_active_set(state, id, SUBVOL_INACTIVE, 0) < 0) {
+                /* Still included: at least have the next pass copy it. */
+                kfs_atomic_store(&state->resync.again, 1);
+            }
+        }
+        break;
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Add a modification to the dirty log while it is tracking. Failed ones are
+ * added as well: they may have been applied on some subvolumes. Must be called
+ * between resync_enter() and resync_leave().
+ */
+static void
+dirty_track(struct mirror_state * const state, const struct mirror_op *op)
+{
+    struct dirtylog * const dl = state->C.dirty;
+
+    KFS_ENTER();
+
+    if (dl == NULL || !dirtylog_is_tracking(dl)) {
+        KFS_RETURN();
+    }
+    if (op->path == NULL) {
+        /* No telling what changed. */
+        dirtylog_add(dl, "/", DIRTY_TREE, 0, 0);
+        KFS_RETURN();
+    }
+    switch (op->id) {
+    case MOP_WRITE:
+    case MOP_FALLOCATE:
+        dirtylog_add(dl, op->path, DIRTY_DATA, op->offset, op->size);
+        break;
+    case MOP_TRUNCATE:
+        dirtylog_add(dl, op->path, DIRTY_DATA, op->offset, 0);
+        break;
+    case MOP_RENAME:
+        dirtylog_add(dl, op->path, DIRTY_ENTRY, 0, 0);
+        dirtylog_add(dl, op->path2, DIRTY_TREE, 0, 0);
+        break;
+    case MOP_SYMLINK:
+    case MOP_LINK:
+        dirtylog_add(dl, op->path2, DIRTY_ENTRY, 0, 0);
+        break;
+    default:
+        dirtylog_add(dl, op->path, DIRTY_ENTRY, 0, 0);
+        break;
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Copy len bytes from src to *p and advance *p. Returns the copy, or NULL if
+ * src is NULL.
+ */
+static const char *
+data_copy(char **p, const char *src, size_t len)
+{
+    char * const dst = *p;
+
+    KFS_ENTER();
+
+    if (src == NULL) {
+        KFS_RETURN(NULL);
+    }
+    memcpy(dst, src, len);
+    *p += len;
+
+    KFS_RETURN(dst);
+}
+
+/**
+ * Number of bytes op_copy() needs for the paths, name and data of a
+ * modification.
+ */
+static size_t
+op_data_size(const struct mirror_op *op)
+{
+    size_t size = 0;
+
+    KFS_ENTER();
+
+    size += op->path == NULL ? 0 : strlen(op->path) + 1;
+    size += op->path2 == NULL ? 0 : strlen(op->path2) + 1;
+    size += op->name == NULL ? 0 : strlen(op->name) + 1;
+    size += op->buf == NULL ? 0 : op->size;
+
+    KFS_RETURN(size);
+}
+
+/**
+ * Copy modification op to dst, so that it can outlive the caller: everything it
+ * refers to is copied to data (op_data_size() bytes) and tv.
+ */
+static void
+op_copy(struct mirror_op *dst, struct timespec *tv, char *data, const struct
+        mirror_op *op)
+{
+    KFS_ENTER();
+
+    *dst = *op;
+    dst->path = data_copy(&data, op->path, op->path == NULL ? 0 :
+            strlen(op->path) + 1);
+    dst->path2 = data_copy(&data, op->path2, op->path2 == NULL ? 0 :
+            strlen(op->path2) + 1);
+    dst->name = data_copy(&data, op->name, op->name == NULL ? 0 :
+            strlen(op->name) + 1);
+    dst->buf = data_copy(&data, op->buf, op->buf == NULL ? 0 : op->size);
+    if (op->tvnano != NULL) {
+        memcpy(tv, op->tvnano, 2 * sizeof(*tv));
+        dst->tvnano = tv;
+    }
+
+    KFS_RETURN();
+}
+
+/*
+ * Asynchronous replication: modifications complete once the synchronous
+ * subvolumes have them, the replicas are fed from a queue.
+ */
+
+/** A modification waiting to be applied to the replicas. */
+struct repl_entry {
+    struct repl_entry *next;
+    uint64_t seq;
+    /** When it was queued (kfs_clock_ns()). */
+    uint64_t queued;
+    /** Data bytes, for the lag. */
+    size_t bytes;
+    uid_t uid;
+    gid_t gid;
+    /** Points into tv and data for everything it refers to. */
+    struct mirror_op op;
+    struct timespec tv[2];
+    char data[];
+};
+
+/** A file the replication thread has open on a replica. */
+struct repl_target {
+    char *path;
+    struct fuse_file_info fi;
+};
+
+/**
+ * Wait while the replicas lag too far behind. Must be called before
+ * resync_enter(): the replication thread may need the resync lock to catch up.
+ */
+static void
+repl_throttle(struct mirror_state * const state)
+{
+    const struct repl_entry *head = NULL;
+
+    KFS_ENTER();
+
+    if (state->C.num_sync == C_get_num_subvols(state)) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&state->repl.lock);
+    for (;;) {
+        head = state->repl.head;
+        if (head == NULL || state->repl.stop) {
+            break;
+        }
+        if ((state->C.max_lag_bytes == 0 || state->repl.bytes_queued <
+                    state->C.max_lag_bytes) && (state->C.max_lag == 0 ||
+                    kfs_clock_ns() - head->queued < state->C.max_lag)) {
+            break;
+        }
+        kfs_cond_wait(&state->repl.changed, &state->repl.lock);
+    }
+    kfs_mutex_unlock(&state->repl.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Drop replica id: it is resynchronised like any other ejected subvolume.
+ * Everything still queued for it goes to the dirty log, which only started
+ * tracking now. Must be called between resync_enter() and resync_leave().
+ */
+static void
+repl_drop(struct mirror_state * const state, uint_t id)
+{
+    const struct repl_entry *e = NULL;
+
+    KFS_ENTER();
+
+    eject_subvolume(state, id);
+    kfs_mutex_lock(&state->repl.lock);
+    for (e = state->repl.head; e != NULL; e = e->next) {
+        dirty_track(state, &e->op);
+    }
+    kfs_mutex_unlock(&state->repl.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Queue a modification that succeeded on the synchronous subvolumes for the
+ * replicas. Must be called between resync_enter() and resync_leave(), before
+ * dirty_track() (see repl_drop()).
+ */
+static void
+repl_enqueue(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op)
+{
+    const uint_t num_subvols = C_get_num_subvols(state);
+    const struct active_set * const set = get_active_set(state);
+    struct repl_entry *e = NULL;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = state->C.num_sync; i < num_subvols; i++) {
+        if (set->map[i] == SUBVOL_REPLICA) {
             break;
         }
     }
-    ids = KFS_FREE(ids);
+    if (i == num_subvols) {
+        KFS_RETURN();
+    }
+    if (op->path == NULL) {
+        /* Should not happen: open files have their path (see fh_path()). */
+        KFS_ERROR("Can not queue `%s' without a path for the replicas.",
+                op->what);
+    } else {
+        e = KFS_MALLOC(sizeof(*e) + op_data_size(op));
+        if (e == NULL) {
+            KFS_ERROR("Out of memory queueing `%s' on `%s' for the replicas.",
+                    op->what, op->path);
+        }
+    }
+    if (e == NULL) {
+        for (i = state->C.num_sync; i < num_subvols; i++) {
+            if (set->map[i] == SUBVOL_REPLICA) {
+                repl_drop(state, i);
+            }
+        }
+        KFS_RETURN();
+    }
+    e->next = NULL;
+    e->bytes = op->buf == NULL ? 0 : op->size;
+    e->uid = co->uid;
+    e->gid = co->gid;
+    op_copy(&e->op, e->tv, e->data, op);
+    kfs_mutex_lock(&state->repl.lock);
+    state->repl.seq += 1;
+    e->seq = state->repl.seq;
+    e->queued = kfs_clock_ns();
+    if (state->repl.tail == NULL) {
+        state->repl.head = e;
+    } else {
+        state->repl.tail->next = e;
+    }
+    state->repl.tail = e;
+    state->repl.num_queued += 1;
+    state->repl.bytes_queued += e->bytes;
+    kfs_cond_broadcast(&state->repl.changed);
+    kfs_mutex_unlock(&state->repl.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Release the file the replication thread has open on subvolume id, if any.
+ */
+static void
+repl_close(struct mirror_state * const state, struct repl_target *t, uint_t id)
+{
+    struct kfs_context co = {.uid = 0, .gid = 0, .priv = state};
+    struct mirror_op op = {.id = MOP_RELEASE, .what = "release"};
+
+    KFS_ENTER();
+
+    if (t->path != NULL) {
+        op.path = t->path;
+        apply_op(C_get_subvol_by_ID(state, id), &co, &op, &t->fi);
+        t->path = KFS_FREE(t->path);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Apply a queued modification to replica id. Writes (and fallocates) go through
+ * a file that is kept open for as long as they are to the same file. Returns 0
+ * on success, -errno on error.
+ */
+static int
+repl_apply(struct mirror_state * const state, struct repl_target *t, uint_t
+        id, const struct repl_entry *e)
+{
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
+    struct kfs_context co = {.uid = e->uid, .gid = e->gid, .priv = state};
+    struct mirror_op op = {.id = MOP_OPEN, .what = "open"};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (e->op.id != MOP_WRITE && e->op.id != MOP_FALLOCATE) {
+        repl_close(state, t, id);
+        KFS_RETURN(apply_op(subv, &co, &e->op, NULL));
+    }
+    if (t->path != NULL && strcmp(t->path, e->op.path) != 0) {
+        repl_close(state, t, id);
+    }
+    if (t->path == NULL) {
+        memset(&t->fi, 0, sizeof(t->fi));
+        t->fi.flags = O_WRONLY;
+        op.path = e->op.path;
+        ret = apply_op(subv, &co, &op, &t->fi);
+        if (ret != 0) {
+            KFS_RETURN(ret);
+        }
+        t->path = KFS_MALLOC(strlen(e->op.path) + 1);
+        if (t->path == NULL) {
+            op.id = MOP_RELEASE;
+            op.what = "release";
+            apply_op(subv, &co, &op, &t->fi);
+            KFS_RETURN(-ENOMEM);
+        }
+        strcpy(t->path, e->op.path);
+    }
+    ret = apply_op(subv, &co, &e->op, &t->fi);
+
+    KFS_RETURN(ret < 0 ? ret : 0);
+}
+
+/**
+ * Replication thread: applies every queued modification, in order, to the
+ * replicas. A replica is only read from by the resync thread, never to serve
+ * reads: it may lag behind. Writers wait in repl_throttle() while the lag is
+ * too large. A replica on which a modification fails is dropped and
+ * resynchronised; afterwards, it skips what was queued before it was back
+ * (see repl_admit()).
+ *
+ * When the brick is halted, the queue is drained first. If the brick went
+ * down without that, the replicas are resynchronised when it starts again.
+ */
+static void *
+repl_thread(void *arg)
+{
+    struct mirror_state * const state = arg;
+    const uint_t num_subvols = C_get_num_subvols(state);
+    struct repl_target targets[num_subvols];
+    struct repl_entry *e = NULL;
+    uint_t id = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    memset(targets, 0, sizeof(targets));
+    kfs_mutex_lock(&state->repl.lock);
+    for (;;) {
+        while (state->repl.head == NULL && !state->repl.stop) {
+            kfs_cond_wait(&state->repl.changed, &state->repl.lock);
+        }
+        e = state->repl.head;
+        if (e == NULL) {
+            break;
+        }
+        kfs_mutex_unlock(&state->repl.lock);
+        for (id = state->C.num_sync; id < num_subvols; id++) {
+            if (get_active_set(state)->map[id] != SUBVOL_REPLICA ||
+                    e->seq <= kfs_atomic_load(&state->repl.from[id])) {
+                repl_close(state, &targets[id], id);
+                continue;
+            }
+            ret = repl_apply(state, &targets[id], id, e);
+            if (ret != 0) {
+                KFS_ERROR("Operation `%s' on `%s' failed on replica `%s': "
+                        "%s.", e->op.what, e->op.path,
+                        C_get_subvol_by_ID(state, id)->name, strerror(-ret));
+                repl_close(state, &targets[id], id);
+                resync_enter(state);
+                repl_drop(state, id);
+                resync_leave(state);
+            }
+        }
+        kfs_mutex_lock(&state->repl.lock);
+        state->repl.head = e->next;
+        if (state->repl.head == NULL) {
+            state->repl.tail = NULL;
+        }
+        state->repl.num_queued -= 1;
+        state->repl.bytes_queued -= e->bytes;
+        kfs_cond_broadcast(&state->repl.changed);
+        e = KFS_FREE(e);
+        if (state->repl.head == NULL) {
+            /* Idle: do not keep files open. */
+            kfs_mutex_unlock(&state->repl.lock);
+            for (id = state->C.num_sync; id < num_subvols; id++) {
+                repl_close(state, &targets[id], id);
+            }
+            kfs_mutex_lock(&state->repl.lock);
+        }
+    }
+    kfs_mutex_unlock(&state->repl.lock);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Make subvolume id, which was just resynchronised, receive modifications
+ * again: as an active subvolume, or as a replica that skips everything queued
+ * so far (it got that from the resync). Must be called with the resync lock
+ * held for writing. Returns 0 on success, -errno on failure.
+ */
+static int
+repl_admit(struct mirror_state * const state, uint_t id)
+{
+    uint64_t seq = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (!C_is_replica(state, id)) {
+        ret = update_active_set(state, id, SUBVOL_ACTIVE, 0);
+        KFS_RETURN(MIN(ret, 0));
+    }
+    kfs_mutex_lock(&state->repl.lock);
+    seq = state->repl.seq;
+    kfs_mutex_unlock(&state->repl.lock);
+    kfs_atomic_store(&state->repl.from[id], seq);
+    ret = update_active_set(state, id, SUBVOL_REPLICA, 0);
+
+    KFS_RETURN(MIN(ret, 0));
+}
+
+/**
+ * Start the replication thread. Returns 0 on success, -errno on error.
+ */
+static int
+repl_start(struct mirror_state * const state)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    state->repl.head = NULL;
+    state->repl.tail = NULL;
+    state->repl.num_queued = 0;
+    state->repl.bytes_queued = 0;
+    state->repl.seq = 0;
+    state->repl.stop = 0;
+    state->repl.from = KFS_CALLOC(C_get_num_subvols(state),
+            sizeof(*state->repl.from));
+    if (state->repl.from == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    ret = kfs_mutex_init(&state->repl.lock);
+    if (ret == 0) {
+        ret = kfs_cond_init(&state->repl.changed);
+        if (ret == 0) {
+            ret = kfs_thread_create(&state->repl.thread, repl_thread, state);
+            if (ret == 0) {
+                KFS_RETURN(0);
+            }
+            kfs_cond_destroy(&state->repl.changed);
+        }
+        kfs_mutex_destroy(&state->repl.lock);
+    }
+    state->repl.from = KFS_FREE(state->repl.from);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Stop the replication thread once it has emptied the queue, and wait for it.
+ * The resync thread must still be running: replicas may need resync. The
+ * queue itself is cleaned up by repl_free().
+ */
+static void
+repl_stop(struct mirror_state * const state)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&state->repl.lock);
+    state->repl.stop = 1;
+    kfs_cond_broadcast(&state->repl.changed);
+    kfs_mutex_unlock(&state->repl.lock);
+    kfs_thread_join(state->repl.thread);
+    KFS_ASSERT(state->repl.head == NULL);
+
+    KFS_RETURN();
+}
+
+/**
+ * Clean up the replication queue after repl_stop() and resync_stop().
+ */
+static void
+repl_free(struct mirror_state * const state)
+{
+    KFS_ENTER();
+
+    kfs_cond_destroy(&state->repl.changed);
+    kfs_mutex_destroy(&state->repl.lock);
+    state->repl.from = KFS_FREE(state->repl.from);
+
+    KFS_RETURN();
+}
+
+/*
+ * Write quorum: modifications complete once write_quorum subvolumes have them,
+ * the others catch up in the background.
+ */
+
+struct quorum;
+
+/** A quorum modification for one subvolume. */
+struct quorum_job {
+    struct quorum_job *next;
+    struct quorum *q;
+    uint_t id;
+    uint64_t fh;
+    /** One of QJOB_*, protected by the lock of q. */
+    uint_t status;
+    int ret;
+};
+
+#define QJOB_QUEUED 0
+#define QJOB_DONE 1
+/** Not executed: the subvolume was ejected before it got to it. */
+#define QJOB_SKIPPED 2
+
+/**
+ * A modification sent to a number of subvolumes, with a private copy of
+ * everything it refers to. Shared by the caller and all jobs, the last one to
+ * let go frees it.
+ */
+struct quorum {
+    struct mirror_state *state;
+    struct kfs_context co;
+    struct mirror_op op;
+    struct timespec tv[2];
+    struct fuse_file_info fi;
+    uint_t use_fi;
+    uint_t finished;
+    uint_t succeeded;
+    /** Set when the caller returns: from then on, jobs deal with failure. */
+    uint_t abandoned;
+    /** Unfinished jobs plus one for the caller. */
+    uint_t refs;
+    kfs_mutex_t lock;
+    kfs_cond_t done;
+    struct quorum_job *jobs;
+    /** The jobs, followed by the data of op. */
+    char data[];
+};
+
+/**
+ * The quorum modifications sent to one subvolume, applied one at a time in the
+ * order they were sent by a job of the fanout pool that runs while there are
+ * any.
+ */
+struct lane {
+    struct mirror_state *state;
+    kfs_mutex_t lock;
+    /** Broadcast when the lane runs empty. */
+    kfs_cond_t idle;
+    struct quorum_job *head;
+    struct quorum_job *tail;
+    /** Set while a job of the pool works through the lane. */
+    uint_t running;
+    /** Queued and in progress. Read without the lock. */
+    uint_t pending;
+};
+
+static void
+quorum_put(struct quorum *q)
+{
+    uint_t refs = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&q->lock);
+    q->refs -= 1;
+    refs = q->refs;
+    kfs_mutex_unlock(&q->lock);
+    if (refs != 0) {
+        KFS_RETURN();
+    }
+    kfs_cond_destroy(&q->done);
+    kfs_mutex_destroy(&q->lock);
+    q = KFS_FREE(q);
+
+    KFS_RETURN();
+}
+
+/**
+ * Number of modifications subvolume id has been sent but did not finish yet.
+ */
+static uint_t
+lane_pending(struct mirror_state * const state, uint_t id)
+{
+    KFS_ENTER();
+
+    if (state->lanes == NULL) {
+        KFS_RETURN(0);
+    }
+
+    KFS_RETURN(kfs_atomic_load(&state->lanes[id].pending));
+}
+
+/**
+ * Wait until subvolume id finished every modification it was sent.
+ */
+static void
+lane_wait(struct mirror_state * const state, uint_t id)
+{
+    struct lane *lane = NULL;
+
+    KFS_ENTER();
+
+    if (state->lanes == NULL) {
+        KFS_RETURN();
+    }
+    lane = &state->lanes[id];
+    kfs_mutex_lock(&lane->lock);
+    while (lane->pending != 0) {
+        kfs_cond_wait(&lane->idle, &lane->lock);
+    }
+    kfs_mutex_unlock(&lane->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Wait until the n given subvolumes finished every modification they were
+ * sent: before they are used for something that is not a quorum modification.
+ */
+static void
+lanes_wait(struct mirror_state * const state, const uint_t *ids, uint_t n)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < n; i++) {
+        lane_wait(state, ids[i]);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Subvolume id was just ejected: the modifications still queued for it will
+ * not be applied, they go to the dirty log (which only started tracking now).
+ */
+static void
+lane_drop(struct mirror_state * const state, uint_t id)
+{
+    const struct quorum_job *job = NULL;
+    struct lane *lane = NULL;
+
+    KFS_ENTER();
+
+    if (state->lanes == NULL) {
+        KFS_RETURN();
+    }
+    lane = &state->lanes[id];
+    kfs_mutex_lock(&lane->lock);
+    for (job = lane->head; job != NULL; job = job->next) {
+        dirty_track(state, &job->q->op);
+    }
+    kfs_mutex_unlock(&lane->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Apply one quorum modification and report to whoever is interested. If it
+ * fails after the caller returned, the subvolume is ejected.
+ */
+static void
+quorum_exec(struct quorum_job *job)
+{
+    struct quorum * const q = job->q;
+    struct mirror_state * const state = q->state;
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, job->id);
+    struct kfs_context co = q->co;
+    struct fuse_file_info fi = q->fi;
+    uint_t status = QJOB_SKIPPED;
+    uint_t abandoned = 0;
+    int ret = -ENOSUBVOLS;
+
+    KFS_ENTER();
+
+    if (is_active(state, job->id)) {
+        fi.fh = job->fh;
+        ret = apply_op(subv, &co, &q->op, q->use_fi ? &fi : NULL);
+        status = QJOB_DONE;
+    }
+    kfs_mutex_lock(&q->lock);
+    job->ret = ret;
+    job->status = status;
+    q->finished += 1;
+    if (ret >= 0) {
+        q->succeeded += 1;
+    }
+    abandoned = q->abandoned;
+    kfs_cond_signal(&q->done);
+    kfs_mutex_unlock(&q->lock);
+    if (abandoned && status == QJOB_DONE && ret < 0) {
+        KFS_ERROR("Operation `%s' on `%s' failed on node `%s' after it "
+                "completed on enough others: %s. Dropping node.", q->op.what,
+                q->op.path, subv->name, strerror(-ret));
+        eject_subvolume(state, job->id);
+        dirty_track(state, &q->op);
+    }
+    quorum_put(q);
+
+    KFS_RETURN();
+}
+
+/**
+ * Work through a lane until it is empty. Runs on the fanout pool.
+ */
+static void
+lane_run(void *arg)
+{
+    struct lane * const lane = arg;
+    struct quorum_job *job = NULL;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&lane->lock);
+    while (lane->head != NULL) {
+        job = lane->head;
+        lane->head = job->next;
+        if (lane->head == NULL) {
+            lane->tail = NULL;
+        }
+        kfs_mutex_unlock(&lane->lock);
+        quorum_exec(job);
+        kfs_mutex_lock(&lane->lock);
+        kfs_atomic_add(&lane->pending, (uint_t) -1);
+    }
+    lane->running = 0;
+    kfs_cond_broadcast(&lane->idle);
+    kfs_mutex_unlock(&lane->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Queue a quorum modification on the lane of its subvolume.
+ */
+static void
+lane_push(struct mirror_state * const state, struct quorum_job *job)
+{
+    struct lane * const lane = &state->lanes[job->id];
+    uint_t start = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    job->next = NULL;
+    kfs_mutex_lock(&lane->lock);
+    if (lane->tail == NULL) {
+        lane->head = job;
+    } else {
+        lane->tail->next = job;
+    }
+    lane->tail = job;
+    kfs_atomic_add(&lane->pending, 1);
+    start = !lane->running;
+    lane->running = 1;
+    kfs_mutex_unlock(&lane->lock);
+    if (start) {
+        ret = kfs_workqueue_push(state->C.pool, lane_run, lane);
+        if (ret != 0) {
+            lane_run(lane);
+        }
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Execute a modification on the n given subvolumes (see fanout() for fi and
+ * fhs) and return as soon as write_quorum of them have it, with the result of
+ * the first of those. The others finish in the background: every subvolume
+ * gets its modifications in order, through its own lane. A subvolume where it
+ * fails while it succeeded elsewhere is ejected, whenever that turns out.
+ *
+ * There is no rollback. With fewer than write_quorum active subvolumes nothing
+ * is attempted and the result is -EROFS. If the quorum can not be reached the
+ * result is the first error, or -EIO if it did succeed somewhere.
+ */
+static int
+fanout_quorum(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, const struct fuse_file_info *fi, const uint_t
+        *ids, const uint64_t *fhs, uint_t n)
+{
+    const uint_t need = state->C.write_quorum;
+    struct quorum *q = NULL;
+    const struct quorum_job *job = NULL;
+    uint_t failed[n];
+    int errors[n];
+    uint_t num_failed = 0;
+    uint_t succeeded = 0;
+    /* Set if a failed subvolume could not be ejected. */
+    uint_t stuck = 0;
+    uint_t i = 0;
+    int firsterr = 0;
+    int firstok = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (n == 0) {
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    if (n < need) {
+        KFS_RETURN(-EROFS);
+    }
+    q = KFS_CALLOC(1, sizeof(*q) + n * sizeof(*q->jobs) + op_data_size(op));
+    if (q == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    ret = kfs_mutex_init(&q->lock);
+    if (ret != 0) {
+        q = KFS_FREE(q);
+        KFS_RETURN(-ret);
+    }
+    ret = kfs_cond_init(&q->done);
+    if (ret != 0) {
+        kfs_mutex_destroy(&q->lock);
+        q = KFS_FREE(q);
+        KFS_RETURN(-ret);
+    }
+    q->state = state;
+    q->co = *co;
+    q->jobs = (struct quorum_job *) q->data;
+    op_copy(&q->op, q->tv, q->data + n * sizeof(*q->jobs), op);
+    if (fi != NULL) {
+        q->fi = *fi;
+        q->use_fi = 1;
+    }
+    q->refs = n + 1;
+    for (i = 0; i < n; i++) {
+        q->jobs[i].q = q;
+        q->jobs[i].id = ids[i];
+        q->jobs[i].fh = fhs == NULL ? 0 : fhs[i];
+        q->jobs[i].status = QJOB_QUEUED;
+    }
+    for (i = 0; i < n; i++) {
+        lane_push(state, &q->jobs[i]);
+    }
+    kfs_mutex_lock(&q->lock);
+    while (q->succeeded < need && q->finished < n) {
+        kfs_cond_wait(&q->done, &q->lock);
+    }
+    q->abandoned = 1;
+    succeeded = q->succeeded;
+    for (i = 0; i < n; i++) {
+        job = &q->jobs[i];
+        if (job->status == QJOB_QUEUED) {
+            continue;
+        }
+        if (job->ret >= 0) {
+            if (firstok == 0) {
+                firstok = job->ret;
+            }
+            continue;
+        }
+        if (firsterr == 0) {
+            firsterr = job->ret;
+        }
+        if (job->status == QJOB_DONE) {
+            failed[num_failed] = job->id;
+            errors[num_failed] = job->ret;
+            num_failed += 1;
+        }
+    }
+    kfs_mutex_unlock(&q->lock);
+    if (succeeded != 0) {
+        for (i = 0; i < num_failed; i++) {
+            KFS_ERROR("Operation `%s' on `%s' failed on node `%s': %s. "
+                    "Rollback impossible, dropping node and continuing with "
+                    "the rest.", op->what, op->path, C_get_subvol_by_ID(state,
+                        failed[i])->name, strerror(-errors[i]));
+            if (eject_subvolume(state, failed[i]) != 0) {
+                /* It is still in use: do not pretend all is well. */
+                stuck = 1;
+            }
+        }
+    }
+    quorum_put(q);
+    if (succeeded >= need && !stuck) {
+        KFS_RETURN(firstok);
+    }
+
+    KFS_RETURN(succeeded == 0 ? firsterr : -EIO);
+}
+
+/**
+ * The subvolumes among the n given ones (with their filehandles, if fhs is not
+ * NULL) that finished every modification they were sent, stored in rids and
+ * rfhs (which may be ids and fhs): the only ones that may serve reads. If there
+ * are none, this waits for the first one. Returns how many there are.
+ */
+static uint_t
+lane_readers(struct mirror_state * const state, const uint_t *ids, const
+        uint64_t *fhs, uint_t n, uint_t *rids, uint64_t *rfhs)
+{
+    uint_t m = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < n; i++) {
+        if (lane_pending(state, ids[i]) == 0) {
+            rids[m] = ids[i];
+            if (fhs != NULL) {
+                rfhs[m] = fhs[i];
+            }
+            m += 1;
+        }
+    }
+    if (m == 0 && n != 0) {
+        lane_wait(state, ids[0]);
+        rids[0] = ids[0];
+        if (fhs != NULL) {
+            rfhs[0] = fhs[0];
+        }
+        m = 1;
+    }
+
+    KFS_RETURN(m);
+}
+
+/**
+ * Set up a lane for every subvolume. Returns 0 on success, -errno on error.
+ */
+static int
+lanes_start(struct mirror_state * const state)
+{
+    const uint_t num_subvols = C_get_num_subvols(state);
+    struct lane *lane = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    state->lanes = KFS_CALLOC(num_subvols, sizeof(*state->lanes));
+    if (state->lanes == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    for (i = 0; i < num_subvols; i++) {
+        lane = &state->lanes[i];
+        lane->state = state;
+        ret = kfs_mutex_init(&lane->lock);
+        if (ret != 0) {
+            break;
+        }
+        ret = kfs_cond_init(&lane->idle);
+        if (ret != 0) {
+            kfs_mutex_destroy(&lane->lock);
+            break;
+        }
+    }
+    if (ret == 0) {
+        KFS_RETURN(0);
+    }
+    while (i-- > 0) {
+        kfs_cond_destroy(&state->lanes[i].idle);
+        kfs_mutex_destroy(&state->lanes[i].lock);
+    }
+    state->lanes = KFS_FREE(state->lanes);
+
+    KFS_RETURN(-ret);
+}
+
+/**
+ * Clean up the lanes. They must be empty and the fanout pool must be gone.
+ */
+static void
+lanes_free(struct mirror_state * const state)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < C_get_num_subvols(state); i++) {
+        KFS_ASSERT(state->lanes[i].head == NULL);
+        kfs_cond_destroy(&state->lanes[i].idle);
+        kfs_mutex_destroy(&state->lanes[i].lock);
+    }
+    state->lanes = KFS_FREE(state->lanes);
+
+    KFS_RETURN();
+}
+
+/**
+ * Execute a path-based modification on all active subvolumes (see fanout_all(),
+ * or fanout_quorum() with write_quorum) and on the subvolume that is being
+ * resynchronised, if any, and queue it for the replicas.
+ */
+static int
+fanout_active(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, const struct mirror_op *undo)
+{
+    const struct active_set *set = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    repl_throttle(state);
+    resync_enter(state);
+    set = get_active_set(state);
+    if (state->lanes != NULL) {
+        ret = fanout_quorum(state, co, op, NULL, set->ids, NULL,
+                set->num_active);
+    } else {
+        ret = fanout_all(state, co, op, undo, NULL, set->ids, NULL,
+                set->num_active);
+    }
+    if (ret >= 0) {
+        repl_enqueue(state, co, op);
+    }
+    dirty_track(state, op);
+    resync_forward(state, co, op, ret);
+    resync_leave(state);
+
+    KFS_RETURN(ret);
+}
+
+/*
+ * Hedged reads: if a read-only operation takes longer than usual, send it to a
+ * second subvolume as well and use whichever answer comes first.
+ */
+
+struct hedge;
+
+/** One subvolume working on a hedged operation. */
+struct hedge_attempt {
+    struct hedge *h;
+    uint_t id;
+    uint64_t fh;
+    /* Private destinations: the loser can finish after the caller returned. */
+    struct stat st;
+    char *buf;
+    int ret;
+};
+
+/**
+ * A hedged operation. Shared by the caller and all attempts, the last one to
+ * let go frees it.
+ */
+struct hedge {
+    struct mirror_state *state;
+    struct kfs_context co;
+    /** The operation, with a private copy of the path. */
+    struct mirror_op op;
+    struct fuse_file_info fi;
+    uint_t use_fi;
+    /** The session whose filehandles the attempts use (NULL without fi). */
+    struct mirror_fh *owner;
+    struct hedge_attempt att[2];
+    uint_t launched;
+    uint_t finished;
+    /** Index of the first succesful attempt, -1 while there is none. */
+    int winner;
+    /** Running attempts plus one for the caller. */
+    uint_t refs;
+    kfs_mutex_t lock;
+    kfs_cond_t done;
+};
+
+static void
+hedge_put(struct hedge *h)
+{
+    uint_t refs = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&h->lock);
+    h->refs -= 1;
+    refs = h->refs;
+    kfs_mutex_unlock(&h->lock);
+    if (refs != 0) {
+        KFS_RETURN();
+    }
+    for (i = 0; i < 2; i++) {
+        if (h->att[i].buf != NULL) {
+            h->att[i].buf = KFS_FREE(h->att[i].buf);
+        }
+    }
+    if (h->op.path != NULL) {
+        h->op.path = KFS_FREE((char *) h->op.path);
+    }
+    kfs_cond_destroy(&h->done);
+    kfs_mutex_destroy(&h->lock);
+    h = KFS_FREE(h);
+
+    KFS_RETURN();
+}
+
+/**
+ * Count an attempt that is about to use the filehandles of my_fh (if any).
+ */
+static void
+hedge_track(struct mirror_state * const state, struct mirror_fh *my_fh)
+{
+    KFS_ENTER();
+
+    if (my_fh != NULL) {
+        kfs_mutex_lock(&state->hedge.lock);
+        my_fh->hedging += 1;
+        kfs_mutex_unlock(&state->hedge.lock);
+    }
+
+    KFS_RETURN();
+}
+
+static void
+hedge_untrack(struct mirror_state * const state, struct mirror_fh *my_fh)
+{
+    KFS_ENTER();
+
+    if (my_fh != NULL) {
+        kfs_mutex_lock(&state->hedge.lock);
+        KFS_ASSERT(my_fh->hedging > 0);
+        my_fh->hedging -= 1;
+        if (my_fh->hedging == 0) {
+            kfs_cond_broadcast(&state->hedge.idle);
+        }
+        kfs_mutex_unlock(&state->hedge.lock);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Wait until no hedged attempt uses the filehandles of my_fh anymore: before
+ * they are closed.
+ */
+static void
+hedges_wait(struct mirror_state * const state, struct mirror_fh *my_fh)
+{
+    KFS_ENTER();
+
+    if (state->C.hedge_percentile == 0) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&state->hedge.lock);
+    while (my_fh->hedging != 0) {
+        kfs_cond_wait(&state->hedge.idle, &state->hedge.lock);
+    }
+    kfs_mutex_unlock(&state->hedge.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Execute one attempt of a hedged operation. Runs on any thread.
+ */
+static void
+hedge_run(void *arg)
+{
+    struct hedge_attempt * const att = arg;
+    struct hedge * const h = att->h;
+    struct readpolicy * const rp = h->state->C.readpolicy;
+    struct kfs_brick * const subv = C_get_subvol_by_ID(h->state, att->id);
+    struct kfs_context co = h->co;
+    struct mirror_op op = h->op;
+    struct fuse_file_info fi = h->fi;
+    uint64_t start = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    op.out = att->buf;
+    op.st = &att->st;
+    fi.fh = att->fh;
+    start = readpolicy_start(rp, att->id);
+    ret = apply_op(subv, &co, &op, h->use_fi ? &fi : NULL);
+    readpolicy_done(rp, att->id, start, op.id == MOP_READ ? MAX(ret, 0) : 0);
+    hedge_untrack(h->state, h->owner);
+    kfs_atomic_add(&h->state->hedge.running, (uint_t) -1);
+    kfs_mutex_lock(&h->lock);
+    att->ret = ret;
+    h->finished += 1;
+    if (ret >= 0 && h->winner < 0) {
+        h->winner = att - h->att;
+    }
+    kfs_cond_signal(&h->done);
+    kfs_mutex_unlock(&h->lock);
+    hedge_put(h);
+
+    KFS_RETURN();
+}
+
+/**
+ * Check (and charge) the hedging budget. Returns 1 if another request may be
+ * sent.
+ */
+static int
+hedge_allowed(struct mirror_state * const state)
+{
+    const uint_t ops = state->hedge.ops;
+    const uint_t hedges = state->hedge.hedges;
+
+    KFS_ENTER();
+
+    if ((uint64_t) hedges * 100 >= (uint64_t) ops * state->C.hedge_budget) {
+        KFS_RETURN(0);
+    }
+    kfs_atomic_add(&state->hedge.hedges, 1);
+
+    KFS_RETURN(1);
+}
+
+/**
+ * Start an attempt on the hedge pool. Returns 0 on success, or -EAGAIN if all
+ * its threads are taken: a stuck subvolume must not make everybody wait for
+ * attempts queued behind it.
+ */
+static int
+hedge_launch(struct mirror_state * const state, struct hedge_attempt *att)
+{
+    struct hedge * const h = att->h;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (kfs_atomic_add(&state->hedge.running, 1) > state->C.hedge_threads) {
+        kfs_atomic_add(&state->hedge.running, (uint_t) -1);
+        KFS_RETURN(-EAGAIN);
+    }
+    hedge_track(state, h->owner);
+    ret = kfs_workqueue_push(state->C.hedge_pool, hedge_run, att);
+    if (ret != 0) {
+        hedge_untrack(state, h->owner);
+        kfs_atomic_add(&state->hedge.running, (uint_t) -1);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Execute a hedged operation on subvolume ids[primary], falling back to
+ * ids[secondary] if that does not answer within delay_ns. Returns 1 if the
+ * operation could not be started (the caller should do it the normal way),
+ * otherwise the result of the operation, with its output copied to op->out or
+ * op->st.
+ */
+static int
+hedge(struct mirror_state * const state, const kfs_context_t co, const struct
+        mirror_op *op, const struct fuse_file_info *fi, const uint_t *ids,
+        const uint64_t *fhs, uint_t primary, uint_t secondary, uint64_t
+        delay_ns)
+{
+    struct hedge *h = NULL;
+    struct hedge_attempt *att = NULL;
+    uint_t timedout = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    h = KFS_CALLOC(1, sizeof(*h));
+    if (h == NULL) {
+        KFS_RETURN(1);
+    }
+    ret = kfs_mutex_init(&h->lock);
+    if (ret != 0) {
+        h = KFS_FREE(h);
+        KFS_RETURN(1);
+    }
+    ret = kfs_cond_init(&h->done);
+    if (ret != 0) {
+        kfs_mutex_destroy(&h->lock);
+        h = KFS_FREE(h);
+        KFS_RETURN(1);
+    }
+    /* From here on, hedge_put() cleans up. */
+    h->refs = 1;
+    h->op = *op;
+    h->op.path = kfs_strcpy(op->path);
+    if (h->op.path == NULL) {
+        hedge_put(h);
+        KFS_RETURN(1);
+    }
+    for (i = 0; i < 2; i++) {
+        h->att[i].h = h;
+        h->att[i].id = ids[i == 0 ? primary : secondary];
+        h->att[i].fh = fhs == NULL ? 0 : fhs[i == 0 ? primary : secondary];
+        if (op->out != NULL) {
+            h->att[i].buf = KFS_MALLOC(MAX(op->size, 1));
+            if (h->att[i].buf == NULL) {
+                hedge_put(h);
+                KFS_RETURN(1);
+            }
+        }
+    }
+    h->state = state;
+    h->co = *co;
+    if (fi != NULL) {
+        h->fi = *fi;
+        h->use_fi = 1;
+        KFS_ASSERT(sizeof(h->owner) <= sizeof(fi->fh));
+        memcpy(&h->owner, &fi->fh, sizeof(h->owner));
+    }
+    h->winner = -1;
+    h->launched = 1;
+    h->refs = 2;
+    ret = hedge_launch(state, &h->att[0]);
+    if (ret != 0) {
+        h->refs = 1;
+        hedge_put(h);
+        KFS_RETURN(1);
+    }
+    kfs_mutex_lock(&h->lock);
+    while (h->winner < 0 && h->finished < h->launched) {
+        if (timedout) {
+            kfs_cond_wait(&h->done, &h->lock);
+            continue;
+        }
+        ret = kfs_cond_timedwait(&h->done, &h->lock, delay_ns);
+        if (ret != -ETIMEDOUT) {
+            continue;
+        }
+        /* Too slow: try another subvolume (if the budget allows it). */
+        timedout = 1;
+        if (hedge_allowed(state) == 0) {
+            continue;
+        }
+        h->launched += 1;
+        h->refs += 1;
+        ret = hedge_launch(state, &h->att[1]);
+        if (ret != 0) {
+            h->launched -= 1;
+            h->refs -= 1;
+        }
+    }
+    if (h->winner >= 0) {
+        att = &h->att[h->winner];
+    } else {
+        att = &h->att[0];
+    }
+    ret = att->ret;
+    if (ret >= 0) {
+        if (op->st != NULL) {
+            *op->st = att->st;
+        }
+        if (op->out != NULL) {
+            memcpy(op->out, att->buf, op->id == MOP_READ ? (size_t) ret :
+                    op->size);
+        }
+    }
+    kfs_mutex_unlock(&h->lock);
+    hedge_put(h);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Returns 1 if two answers to a getattr or readlink (see read_voted()) are the
+ * same. Times are not compared: they are not kept the same on all subvolumes,
+ * neither is the size of a directory.
+ */
+static uint_t
+same_answer(const struct mirror_op *a, int reta, const struct mirror_op *b,
+        int retb)
+{
+    const struct stat * const sa = a->st;
+    const struct stat * const sb = b->st;
+
+    KFS_ENTER();
+
+    if (reta != retb) {
+        KFS_RETURN(0);
+    }
+    if (reta < 0) {
+        KFS_RETURN(1);
+    }
+    if (a->id == MOP_READLINK) {
+        KFS_RETURN(strncmp(a->out, b->out, a->size) == 0);
+    }
+
+    KFS_RETURN(sa->st_mode == sb->st_mode && sa->st_uid == sb->st_uid &&
+            sa->st_gid == sb->st_gid && (S_ISDIR(sa->st_mode) ||
+                sa->st_size == sb->st_size));
+}
+
+/**
+ * Execute a getattr or readlink on read_quorum of the n given subvolumes at the
+ * same time, starting with ids[first], and compare the answers. If they differ,
+ * the answer most of them agree on is used (the first one of those if there is
+ * a tie) and the difference is reported. Returns 1 if the operation could not
+ * be started (the caller should do it the normal way), otherwise its result.
+ */
+static int
+read_voted(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, const uint_t *ids, uint_t n, uint_t first)
+{
+    const uint_t m = MIN(n, state->C.read_quorum);
+    struct mirror_op ops[m];
+    struct stat sts[m];
+    uint_t qids[m];
+    uint_t votes[m];
+    int rets[m];
+    char *bufs = NULL;
+    uint_t best = 0;
+    uint_t i = 0;
+    uint_t j = 0;
+
+    KFS_ENTER();
+
+    if (op->id == MOP_READLINK) {
+        bufs = KFS_MALLOC(MAX(m * op->size, 1));
+        if (bufs == NULL) {
+            KFS_RETURN(1);
+        }
+    }
+    for (i = 0; i < m; i++) {
+        qids[i] = ids[(first + i) % n];
+        ops[i] = *op;
+        ops[i].st = &sts[i];
+        ops[i].out = bufs == NULL ? NULL : bufs + i * op->size;
+    }
+    fanout_ops(state, co, ops, m, NULL, qids, NULL, rets, m);
+    for (i = 0; i < m; i++) {
+        votes[i] = 0;
+        for (j = 0; j < m; j++) {
+            votes[i] += same_answer(&ops[i], rets[i], &ops[j], rets[j]);
+        }
+        if (votes[i] > votes[best]) {
+            best = i;
+        }
+    }
+    if (votes[best] != m) {
+        KFS_WARNING("Subvolumes disagree about `%s' (%s): using the answer of "
+                "%u out of %u, from `%s'.", op->path, op->what, votes[best], m,
+                C_get_subvol_by_ID(state, qids[best])->name);
+    }
+    if (rets[best] >= 0) {
+        if (op->id == MOP_READLINK) {
+            memcpy(op->out, ops[best].out, op->size);
+        } else {
+            *op->st = sts[best];
+        }
+    }
+    if (bufs != NULL) {
+        bufs = KFS_FREE(bufs);
+    }
+
+    KFS_RETURN(rets[best]);
+}
+
+/**
+ * Execute a read-only operation on one of the n given subvolumes, chosen by the
+ * read policy. If hedging is enabled, a second subvolume is asked too when the
+ * first one is slow. fhs holds the filehandle per subvolume if the operation
+ * needs fi (may be NULL otherwise). With write_quorum, subvolumes that are
+ * still busy with modifications are skipped; with read_quorum, metadata is
+ * compared between subvolumes (see read_voted()).
+ */
+static int
+read_op(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, const struct fuse_file_info *fi, const uint_t
+        *ids, const uint64_t *fhs, uint_t n)
+{
+    struct readpolicy * const rp = state->C.readpolicy;
+    struct kfs_brick *subv = NULL;
+    struct kfs_context myco = *co;
+    struct fuse_file_info myfi;
+    uint_t others[n];
+    uint_t rids[n];
+    uint64_t rfhs[n];
+    uint64_t delay = 0;
+    uint64_t start = 0;
+    uint_t ops = 0;
+    uint_t i = 0;
+    uint_t j = 0;
+    uint_t k = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(n > 0);
+    n = lane_readers(state, ids, fhs, n, rids, rfhs);
+    ids = rids;
+    fhs = fhs == NULL ? NULL : rfhs;
+    i = readpolicy_pick(rp, ids, n);
+    if (state->C.read_quorum > 1 && n > 1 && (op->id == MOP_GETATTR ||
+                op->id == MOP_READLINK)) {
+        ret = read_voted(state, co, op, ids, n, i);
+        if (ret != 1) {
+            KFS_RETURN(ret);
+        }
+    }
+    if (state->C.hedge_percentile != 0 && n > 1 &&
+            (op->id != MOP_READ || op->size <= HEDGE_MAX_READ)) {
+        ops = kfs_atomic_add(&state->hedge.ops, 1);
+        if (ops >= HEDGE_WINDOW) {
+            /* Start a new window (racy, but close enough). */
+            state->hedge.ops = 0;
+            state->hedge.hedges = 0;
+        }
+        delay = readpolicy_percentile(rp, ids[i], state->C.hedge_percentile);
+    }
+    if (delay != 0) {
+        for (j = 0, k = 0; j < n; j++) {
+            if (j != i) {
+                others[k] = ids[j];
+                k += 1;
+            }
+        }
+        j = readpolicy_pick(rp, others, k);
+        /* Index in ids. */
+        j += j >= i ? 1 : 0;
+        ret = hedge(state, co, op, fi, ids, fhs, i, j, delay);
+        if (ret != 1) {
+            KFS_RETURN(ret);
+        }
+    }
+    subv = C_get_subvol_by_ID(state, ids[i]);
+    if (fi != NULL) {
+        /* Leave the caller's filehandle intact. */
+        myfi = *fi;
+        myfi.fh = fhs[i];
+    }
+    start = readpolicy_start(rp, ids[i]);
+    ret = apply_op(subv, &myco, op, fi == NULL ? NULL : &myfi);
+    readpolicy_done(rp, ids[i], start, op->id == MOP_READ ? MAX(ret, 0) : 0);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Create new freshly allocated file handle, initialised and ready for use.
+ *
+ * If the num_subvols argument is 0, no initialisation is done, just the
+ * filehandle itself is allocated. Returns NULL on memory error. Do not forget
+ * to call del_fh() on this!
+ */
+static struct mirror_fh *
+new_fh(uint_t num_subvols)
+{
+    struct mirror_fh *my_fh = NULL;
+    uint64_t *subvols_fh = NULL;
+    uint_t *ids = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(num_subvols > 0);
+    my_fh = KFS_MALLOC(sizeof(*my_fh));
+    if (my_fh != NULL) {
+        subvols_fh = KFS_MALLOC(num_subvols * sizeof(*subvols_fh));
+        if (subvols_fh != NULL) {
+            my_fh->subvols_fh = subvols_fh;
+            ids = KFS_MALLOC(num_subvols * sizeof(*ids));
+            if (ids != NULL) {
+                my_fh->subvols_id = ids;
+                my_fh->num_subvols = num_subvols;
+                my_fh->hedging = 0;
+                my_fh->path = NULL;
+                my_fh->prev = my_fh->next = NULL;
+                KFS_RETURN(my_fh);
+            }
+            subvols_fh = KFS_FREE(subvols_fh);
+        }
+        my_fh = KFS_FREE(my_fh);
+    }
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Clean up and delete filehandle created with new_fh.
+ */
+static struct mirror_fh *
+del_fh(struct mirror_fh *fh)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(fh != NULL);
+    /* If subvols_... == NULL then num_subvols == 0. */
+    KFS_ASSERT(fh->subvols_fh != NULL || fh->num_subvols == 0);
+    KFS_ASSERT(fh->subvols_id != NULL || fh->num_subvols == 0);
+    if (fh->subvols_fh != NULL) {
+        fh->subvols_fh = KFS_FREE(fh->subvols_fh);
+    }
+    if (fh->subvols_id != NULL) {
+        fh->subvols_id = KFS_FREE(fh->subvols_id);
+    }
+    if (fh->path != NULL) {
+        fh->path = KFS_FREE(fh->path);
+    }
+    fh = KFS_FREE(fh);
+
+    KFS_RETURN(fh);
+}
+
+/**
+ * Add a newly opened file to the list of open files.
+ */
+static void
+fh_register(struct mirror_state * const state, struct mirror_fh *my_fh)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(my_fh->path != NULL);
+    kfs_mutex_lock(&state->files.lock);
+    my_fh->prev = NULL;
+    my_fh->next = state->files.head;
+    if (my_fh->next != NULL) {
+        my_fh->next->prev = my_fh;
+    }
+    state->files.head = my_fh;
+    kfs_mutex_unlock(&state->files.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Remove a file that is about to be closed from the list of open files.
+ */
+static void
+fh_unregister(struct mirror_state * const state, struct mirror_fh *my_fh)
+{
+    KFS_ENTER();
+
+    kfs_mutex_lock(&state->files.lock);
+    if (my_fh->prev != NULL) {
+        my_fh->prev->next = my_fh->next;
+    } else {
+        state->files.head = my_fh->next;
+    }
+    if (my_fh->next != NULL) {
+        my_fh->next->prev = my_fh->prev;
+    }
+    my_fh->prev = my_fh->next = NULL;
+    kfs_mutex_unlock(&state->files.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * The path for an operation on an open file: the one passed by the caller, or
+ * if there is none, a copy in buf (PATH_MAX bytes) of the one it was opened
+ * with.
+ */
+static const char *
+fh_path(struct mirror_state * const state, const struct mirror_fh *my_fh,
+        const char *path, char *buf)
+{
+    KFS_ENTER();
+
+    if (path != NULL) {
+        KFS_RETURN(path);
+    }
+    kfs_mutex_lock(&state->files.lock);
+    snprintf(buf, PATH_MAX, "%s", my_fh->path);
+    kfs_mutex_unlock(&state->files.lock);
+
+    KFS_RETURN(buf);
+}
+
+/**
+ * Follow a rename in the paths of the open files: the renamed file itself, or
+ * everything below it if it is a directory.
+ */
+static void
+fh_rename(struct mirror_state * const state, const char *from, const char *to)
+{
+    const size_t len = strlen(from);
+    struct mirror_fh *my_fh = NULL;
+    char *path = NULL;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&state->files.lock);
+    for (my_fh = state->files.head; my_fh != NULL; my_fh = my_fh->next) {
+        if (strncmp(my_fh->path, from, len) != 0 || (my_fh->path[len] != '\0'
+                    && my_fh->path[len] != '/')) {
+            continue;
+        }
+        path = KFS_MALLOC(strlen(to) + strlen(my_fh->path + len) + 1);
+        if (path == NULL) {
+            KFS_ERROR("Out of memory following the rename of `%s' to `%s'.",
+                    my_fh->path, to);
+            continue;
+        }
+        strcpy(path, to);
+        strcat(path, my_fh->path + len);
+        my_fh->path = KFS_FREE(my_fh->path);
+        my_fh->path = path;
+    }
+    kfs_mutex_unlock(&state->files.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Lock a (region of) a file.
+ *
+ * It is specified at the top of this file because other handlers use it.
+ * However, it is not implemented (always returns ENOSYS): TODO.
+ */
+static int
+mirror_lock(const kfs_context_t co, const char *path, struct fuse_file_info *fi,
+        int cmd, struct flock *lock)
+{
+    (void) co;
+    (void) path;
+    (void) fi;
+    (void) cmd;
+    (void) lock;
+
+    KFS_ENTER();
+
+    KFS_RETURN(-ENOSYS);
+}
+
+/**
+ * Lock this file or accept pending locks.
+ *
+ * Used to protect from race conditions in the backup, operate, rollback
+ * process, where a concurrent thread might update a file inbetween, causing a
+ * rollback to outdated data.
+ *
+ * Returns 0 when a new lock is acquired, 1 when an existing lock was
+ * encountered, -1 on error.
+ */
+static int
+ensure_lock(kfs_context_t co, const char *path, off_t offset, size_t size,
+        struct fuse_file_info *fi, struct flock *lock)
+{
+    uint64_t fh_backup = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    lock->l_type = F_WRLCK;
+    lock->l_whence = SEEK_SET; /* API requirement. */
+    lock->l_start = offset;
+    lock->l_len = size;
+    fh_backup = fi->fh; /* mirror_lock() might spoil this */
+    ret = mirror_lock(co, path, fi, F_SETLK, lock);
+    fi->fh = fh_backup;
+    switch (-ret) {
+    case 0:
+        /* Successfully acquired my own lock. */
+        ret = 0;
+    case EACCES:
+    case EAGAIN:
+        /* Some other process acquired the lock. Hope they called this func. */
+        ret = 1;
+        break;
+    /* TODO: What about EDEADLK? */
+    default:
+        ret = -1;
+        break;
+    }
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_getattr(const kfs_context_t co, const char *path, struct stat *stbuf)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_GETATTR, .what = "getattr", .path =
+        path, .st = stbuf};
+    const struct active_set *set = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    set = get_active_set(state);
+    if (set->num_active == 0) {
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    ret = read_op(state, co, &op, NULL, set->ids, NULL, set->num_active);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_readlink(const kfs_context_t co, const char *path, char *buf, size_t
+        size)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_READLINK, .what = "readlink", .path =
+        path, .out = buf, .size = size};
+    const struct active_set *set = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    set = get_active_set(state);
+    if (set->num_active == 0) {
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    ret = read_op(state, co, &op, NULL, set->ids, NULL, set->num_active);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_mknod(const kfs_context_t co, const char *path, mode_t mode, dev_t dev)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_MKNOD, .what = "new file", .path =
+        path, .mode = mode, .dev = dev};
+    const struct mirror_op undo = {.id = MOP_UNLINK, .what = "unlink", .path =
+        path};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fanout_active(state, co, &op, &undo);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Truncate a file on all subvolumes to given length.
+ *
+ * The current implementation has no option for rollback: if one subvolume fails
+ * to truncate it is immediately deactivated. Allowing rollback here could come
+ * in two flavours:
+ *
+ * - Read the rest of the file into a buffer before truncating it. If any
+ *   subvolume fails, try to restore the data on the other nodes with write().
+ *   If that worked on all nodes, rollback was succesful! Big downside: every
+ *   truncate() will cause a read() (which could be pretty big).
+ *
+ * - Copy the file on every node, and if all truncations succeeded delete the
+ *   copies. This is only reasonable if all subvolumes implement copy-on-write,
+ *   which is not exactly an assumption we can make here.
+ *
+ * Since both options have quite severe consequences, no rollback is possible
+ * for now.
+ */
+static int
+mirror_truncate(const kfs_context_t co, const char *path, off_t offset)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_TRUNCATE, .what = "truncate", .path =
+        path, .offset = offset};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Nodes that fail are dropped, see fanout_all(). */
+    ret = fanout_active(state, co, &op, NULL);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Open a file for reading on all subvolumes of my_fh and keep those where that
+ * worked. A read-only open that fails on some subvolume is no reason to eject
+ * it: the others can serve the reads. Returns 0 if it worked on at least one
+ * subvolume, the first error otherwise.
+ */
+static int
+open_readers(struct mirror_state * const state, const kfs_context_t co, const
+        struct mirror_op *op, struct fuse_file_info *fi, struct mirror_fh
+        *my_fh)
+{
+    int rets[my_fh->num_subvols];
+    uint_t i = 0;
+    uint_t n = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < my_fh->num_subvols; i++) {
+        my_fh->subvols_fh[i] = 0;
+    }
+    lanes_wait(state, my_fh->subvols_id, my_fh->num_subvols);
+    fanout(state, co, op, fi, my_fh->subvols_id, my_fh->subvols_fh, rets,
+            my_fh->num_subvols);
+    for (i = 0; i < my_fh->num_subvols; i++) {
+        if (rets[i] == 0) {
+            my_fh->subvols_id[n] = my_fh->subvols_id[i];
+            my_fh->subvols_fh[n] = my_fh->subvols_fh[i];
+            n += 1;
+        } else if (ret == 0) {
+            ret = rets[i];
+        }
+    }
+    if (n == 0) {
+        KFS_RETURN(ret);
+    }
+    my_fh->num_subvols = n;
+
+    KFS_RETURN(0);
+}
+
+static int
+mirror_open(const kfs_context_t co, const char *path, struct fuse_file_info *fi)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_OPEN, .what = "open", .path = path};
+    const struct mirror_op undo = {.id = MOP_RELEASE, .what = "close", .path =
+        path};
+    struct kfs_brick *subv = NULL;
+    struct mirror_fh *my_fh = NULL;
+    char *saved = NULL;
+    uint_t accessmode = fi->flags & (O_RDONLY | O_WRONLY | O_RDWR);
+    const struct active_set *set = NULL;
+    uint64_t start = 0;
+    uint_t id = 0;
+    uint_t i = 0;
+    uint_t n = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Kept in the filehandle, see fh_path(). */
+    saved = kfs_strcpy(path);
+    if (saved == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    switch (accessmode) {
+    case O_RDONLY:
+        if (state->C.stripe_threshold == 0 && state->C.hedge_percentile == 0) {
+            /* Read-only requires just one subvolume. */
+            my_fh = new_fh(1);
+            if (my_fh == NULL) {
+                saved = KFS_FREE(saved);
+                KFS_RETURN(-ENOMEM);
+            }
+            my_fh->path = saved;
+            subv = get_one_reader(state, &id);
+            if (subv == NULL) {
+                /* No more readers available. */
+                my_fh = del_fh(my_fh);
+                KFS_RETURN(-ENOSUBVOLS);
+            }
+            my_fh->subvols_id[0] = id;
+            start = readpolicy_start(state->C.readpolicy, id);
+            KFS_DO_OPER(ret = , subv, open, co, path, fi);
+            readpolicy_done(state->C.readpolicy, id, start, 0);
+            /* TODO: Try other subvolumes on failure. */
+            if (ret != 0) {
+                my_fh = del_fh(my_fh);
+                KFS_RETURN(ret);
+            }
+            /* Store the filehandle returned by the subvolume. */
+            my_fh->subvols_fh[0] = fi->fh;
+            break;
+        }
+        /* Striped and hedged reads need the file open on all subvolumes. */
+        set = get_active_set(state);
+        n = set->num_active;
+        if (n == 0) {
+            saved = KFS_FREE(saved);
+            KFS_RETURN(-ENOSUBVOLS);
+        }
+        my_fh = new_fh(n);
+        if (my_fh == NULL) {
+            saved = KFS_FREE(saved);
+            KFS_RETURN(-ENOMEM);
+        }
+        my_fh->path = saved;
+        memcpy(my_fh->subvols_id, set->ids, n * sizeof(*set->ids));
+        ret = open_readers(state, co, &op, fi, my_fh);
+        if (ret != 0) {
+            my_fh = del_fh(my_fh);
+            KFS_RETURN(ret);
+        }
+        break;
+    case O_RDWR:
+    case O_WRONLY:
+        /* All subvolumes must be available for modification. */
+        set = get_active_set(state);
+        n = set->num_active;
+        if (n == 0) {
+            saved = KFS_FREE(saved);
+            KFS_RETURN(-ENOSUBVOLS);
+        }
+        my_fh = new_fh(n);
+        if (my_fh == NULL) {
+            saved = KFS_FREE(saved);
+            KFS_RETURN(-ENOMEM);
+        }
+        my_fh->path = saved;
+        memcpy(my_fh->subvols_id, set->ids, n * sizeof(*set->ids));
+        /* Call open() on all subvolumes and store their filehandles. */
+        for (i = 0; i < n; i++) {
+            my_fh->subvols_fh[i] = 0;
+        }
+        lanes_wait(state, my_fh->subvols_id, n);
+        ret = fanout_all(state, co, &op, &undo, fi, my_fh->subvols_id,
+                my_fh->subvols_fh, n);
+        if (ret != 0) {
+            my_fh = del_fh(my_fh);
+            KFS_RETURN(ret);
+        }
+        break;
+    default:
+        KFS_ASSERT(0 && "Illegal flag.");
+        break;
+    }
+    fh_register(state, my_fh);
+    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
+    /* Return the filehandle of this brick to the caller. */
+    memcpy(&fi->fh, &my_fh, sizeof(my_fh));
+
+    KFS_RETURN(0);
+}
+
+static int
+mirror_mkdir(const kfs_context_t co, const char *path, mode_t mode)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_MKDIR, .what = "mkdir", .path =
+        path, .mode = mode};
+    const struct mirror_op undo = {.id = MOP_RMDIR, .what = "rmdir", .path =
+        path};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fanout_active(state, co, &op, &undo);
+
+    KFS_RETURN(ret);
+}
+static int
+mirror_unlink(const kfs_context_t co, const char *path)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_UNLINK, .what = "delete", .path =
+        path};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Nodes that fail are dropped, see fanout_all(). */
+    ret = fanout_active(state, co, &op, NULL);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_rmdir(const kfs_context_t co, const char *path)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_RMDIR, .what = "rmdir", .path =
+        path};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Nodes that fail are dropped, see fanout_all(). */
+    ret = fanout_active(state, co, &op, NULL);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_symlink(const kfs_context_t co, const char *path1, const char *path2)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_SYMLINK, .what = "new symlink",
+        .path = path1, .path2 = path2};
+    const struct mirror_op undo = {.id = MOP_UNLINK, .what = "unlink", .path =
+        path2};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fanout_active(state, co, &op, &undo);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_rename(const kfs_context_t co, const char *from, const char *to)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_RENAME, .what = "rename", .path =
+        from, .path2 = to};
+    const struct mirror_op undo = {.id = MOP_RENAME, .what = "rename back",
+        .path = to, .path2 = from};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fanout_active(state, co, &op, &undo);
+    if (ret == 0) {
+        fh_rename(state, from, to);
+    }
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_link(const kfs_context_t co, const char *from, const char *to)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_LINK, .what = "hardlink", .path =
+        from, .path2 = to};
+    const struct mirror_op undo = {.id = MOP_UNLINK, .what = "unlink", .path =
+        to};
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fanout_active(state, co, &op, &undo);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_chmod(const kfs_context_t co, const char *path, mode_t mode)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_CHMOD, .what = "chmod", .path =
+        path, .mode = mode};
+    /** Restores the old mode in case of rollback (if possible). */
+    struct mirror_op undo = {.id = MOP_CHMOD, .what = "chmod", .path = path};
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Backup old mode. */
+    ret = mirror_getattr(co, path, &stbuf);
+    if (ret == 0) {
+        undo.mode = stbuf.st_mode & PERM7777;
+    }
+    /* Perform mode change on all subvols. */
+    ret = fanout_active(state, co, &op, ret == 0 ? &undo : NULL);
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_chown(const kfs_context_t co, const char *path, uid_t uid, gid_t gid)
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_CHOWN, .what = "chown", .path =
+        path, .uid = uid, .gid = gid};
+    /** Restores the old ownership in case of rollback (if possible). */
+    struct mirror_op undo = {.id = MOP_CHOWN, .what = "chown", .path = path};
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Backup old permissions. */
+    ret = mirror_getattr(co, path, &stbuf);
+    if (ret == 0) {
+        undo.uid = stbuf.st_uid;
+        undo.gid = stbuf.st_gid;
+    }
+    /* Perform ownership change on all subvols. */
+    ret = fanout_active(state, co, &op, ret == 0 ? &undo : NULL);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Read a large range by splitting it into one chunk per subvolume, all fetched
+ * at the same time straight into buf. The size of every chunk is proportional
+ * to the measured throughput of its subvolume (equal if nothing is known yet),
+ * so all chunks should arrive at about the same time.
+ *
+ * Returns the number of bytes read or a negative error if any chunk failed, in
+ * which case the caller should retry on one subvolume.
+ */
+static int
+read_striped(struct mirror_state * const state, const kfs_context_t co, const
+        char *path, char *buf, size_t size, off_t offset, const struct
+        fuse_file_info *fi, const uint_t *ids, const uint64_t *fhs, uint_t n)
+{
+    struct mirror_op ops[n];
+    uint64_t tputs[n];
+    uint_t chunkids[n];
+    uint64_t chunkfhs[n];
+    int rets[n];
+    uint64_t known = 0;
+    uint64_t total = 0;
+    size_t chunk = 0;
+    size_t done = 0;
+    uint_t m = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Throughput in KiB/s, to keep size * tput within 64 bits. */
+    for (i = 0; i < n; i++) {
+        tputs[i] = readpolicy_throughput(state->C.readpolicy, ids[i]) / 1024;
+        known = MAX(known, tputs[i]);
+    }
+    /* Subvolumes without measurements are assumed to be as fast as the best. */
+    for (i = 0; i < n; i++) {
+        if (tputs[i] == 0) {
+            tputs[i] = MAX(known, 1);
+        }
+        total += tputs[i];
+    }
+    /* Divide the range, skipping subvolumes that would get nothing. */
+    for (i = 0, m = 0; i < n && done < size; i++) {
+        chunk = size * tputs[i] / total;
+        chunk -= chunk % STRIPE_ALIGN;
+        if (i == n - 1 || chunk > size - done) {
+            chunk = size - done;
+        }
+        if (chunk == 0) {
+            continue;
+        }
+        memset(&ops[m], 0, sizeof(ops[m]));
+        ops[m].id = MOP_READ;
+        ops[m].what = "read";
+        ops[m].path = path;
+        ops[m].out = buf + done;
+        ops[m].size = chunk;
+        ops[m].offset = offset + done;
+        chunkids[m] = ids[i];
+        chunkfhs[m] = fhs[i];
+        done += chunk;
+        m += 1;
+    }
+    KFS_ASSERT(done == size && m > 0);
+    fanout_ops(state, co, ops, m, fi, chunkids, chunkfhs, rets, m);
+    /* A short chunk means end of file: ignore everything after it. */
+    done = 0;
+    for (i = 0; i < m; i++) {
+        if (rets[i] < 0) {
+            KFS_RETURN(rets[i]);
+        }
+        done += rets[i];
+        if ((size_t) rets[i] < ops[i].size) {
+            break;
+        }
+    }
+    ret = done;
+
+    KFS_RETURN(ret);
+}
+
+static int
+mirror_read(const kfs_context_t co, const char *path, char *buf, size_t size,
+        off_t offset, struct fuse_file_info *fi)
+{
+    struct mirror_state * const state = co->priv;
+    struct mirror_op op = {.id = MOP_READ, .what = "read", .path = path,
+        .out = buf, .size = size, .offset = offset};
+    struct mirror_fh *my_fh = NULL;
+    char pathbuf[PATH_MAX];
+    uint_t n = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
+    memcpy(&my_fh, &fi->fh, sizeof(my_fh));
+    KFS_ASSERT(my_fh != NULL);
+    {
+        uint_t ids[my_fh->num_subvols];
+        uint64_t fhs[my_fh->num_subvols];
+
+        n = get_active_fh_subvols(state, my_fh, ids, fhs);
+        if (n == 0) {
+            KFS_RETURN(-ENOSUBVOLS);
+        }
+        n = lane_readers(state, ids, fhs, n, ids, fhs);
+        if (n > 1 && state->C.hedge_percentile != 0) {
+            /* A hedged operation keeps a copy of the path. */
+            op.path = fh_path(state, my_fh, path, pathbuf);
+        }
+        if (n > 1 && state->C.stripe_threshold != 0 &&
+                size >= state->C.stripe_threshold) {
+            ret = read_striped(state, co, path, buf, size, offset, fi, ids,
+                    fhs, n);
+            if (ret >= 0) {
+                KFS_RETURN(ret);
+            }
+            /* Some chunk failed: try it the old-fashioned way. */
+        }
+        ret = read_op(state, co, &op, fi, ids, fhs, n);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Check whether the resync of subvolume id should go on, after sleeping as long
+ * as needed to keep it within its bandwidth. Returns 0 if so, -EINTR if the
+ * brick is being halted and -ECANCELED if the resync was given up on.
+ */
+static int
+resync_continue(struct mirror_state * const state, uint_t id)
+{
+    const uint64_t bw = state->C.resync_bandwidth;
+    const uint64_t bytes = state->resync.bytes;
+    uint64_t due = 0;
+    uint64_t now = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (get_active_set(state)->resync != id) {
+        KFS_RETURN(-ECANCELED);
+    }
+    if (bw != 0) {
+        due = state->resync.started + bytes / bw * 1000000000 + bytes % bw *
+            1000000000 / bw;
+    }
+    kfs_mutex_lock(&state->resync.stoplock);
+    while (!state->resync.stop && (now = kfs_clock_ns()) < due) {
+        kfs_cond_timedwait(&state->resync.stopcond, &state->resync.stoplock,
+                due - now);
+    }
+    ret = state->resync.stop ? -EINTR : 0;
+    kfs_mutex_unlock(&state->resync.stoplock);
 
     KFS_RETURN(ret);
 }
 
 /**
- * Truncate a file on all subvolumes to given length.
- *
- * The current implementation has no option for rollback: if one subvolume fails
- * to truncate it is immediately deactivated. Allowing rollback here could come
- * in two flavours:
- *
- * - Read the rest of the file into a buffer before truncating it. If any
- *   subvolume fails, try to restore the data on the other nodes with write().
- *   If that worked on all nodes, rollback was succesful! Big downside: every
- *   truncate() will cause a read() (which could be pretty big).
- *
- * - Copy the file on every node, and if all truncations succeeded delete the
- *   copies. This is only reasonable if all subvolumes implement copy-on-write,
- *   which is not exactly an assumption we can make here.
+ * Copy size bytes at offset of path from subvolume src to subvolume dst. If the
+ * file on src ends before that range does, the file on dst is truncated to the
+ * same size. Returns 0 on success, -errno on error.
  *
- * Since both options have quite severe consequences, no rollback is possible
- * for now.
+ * If resync is set, this is part of the resync of dst: every chunk is copied
+ * without any modification getting in between and the speed is limited.
  */
 static int
-mirror_truncate(const kfs_context_t co, const char *path, off_t offset)
+copy_range(struct mirror_state * const state, const kfs_context_t co, const
+        char *path, uint_t src, uint_t dst, off_t offset, size_t size, uint_t
+        resync)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
+    struct kfs_brick * const srcv = C_get_subvol_by_ID(state, src);
+    struct kfs_brick * const dstv = C_get_subvol_by_ID(state, dst);
+    struct mirror_op op = {.id = MOP_OPEN, .what = "open", .path = path};
+    struct fuse_file_info srcfi;
+    struct fuse_file_info dstfi;
+    struct stat stbuf;
+    char *buf = NULL;
+    size_t chunk = 0;
+    off_t end = offset + size;
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, truncate, co, path, offset);
-        if (ret != 0) {
-            if (i == 0) {
-                /* Lucky: this was the first subvolume. Abort everything. */
+    if (size == 0) {
+        KFS_RETURN(0);
+    }
+    buf = KFS_MALLOC(MIN(size, COPY_CHUNK));
+    if (buf == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    memset(&srcfi, 0, sizeof(srcfi));
+    srcfi.flags = O_RDONLY;
+    ret = apply_op(srcv, co, &op, &srcfi);
+    if (ret != 0) {
+        buf = KFS_FREE(buf);
+        KFS_RETURN(ret);
+    }
+    memset(&dstfi, 0, sizeof(dstfi));
+    dstfi.flags = O_WRONLY;
+    ret = apply_op(dstv, co, &op, &dstfi);
+    if (ret != 0) {
+        op.id = MOP_RELEASE;
+        apply_op(srcv, co, &op, &srcfi);
+        buf = KFS_FREE(buf);
+        KFS_RETURN(ret);
+    }
+    while (offset < end) {
+        chunk = MIN((size_t) (end - offset), COPY_CHUNK);
+        op = (struct mirror_op) {.id = MOP_READ, .what = "read", .path = path,
+            .out = buf, .size = chunk, .offset = offset};
+        if (resync) {
+            resync_exclusive(state);
+            lane_wait(state, src);
+        }
+        ret = apply_op(srcv, co, &op, &srcfi);
+        if (ret > 0) {
+            op = (struct mirror_op) {.id = MOP_WRITE, .what = "write", .path =
+                path, .buf = buf, .size = ret, .offset = offset};
+            offset += ret;
+            ret = apply_op(dstv, co, &op, &dstfi);
+        }
+        if (resync) {
+            kfs_rwlock_unlock(&state->resync.lock);
+        }
+        if (ret <= 0) {
+            break;
+        }
+        if (resync) {
+            kfs_atomic_add(&state->resync.bytes, ret);
+            ret = resync_continue(state, dst);
+            if (ret != 0) {
                 break;
             }
-            KFS_ERROR("Could not truncate file %s on node %s: %s.", path,
-                    subv->name, strerror(-ret));
-            eject_subvolume(state, id);
-            ret = 0;
-            /* Try to stay consistent by truncating on other subvolumes too. */
-            continue;
+        }
+        ret = 0;
+    }
+    if (ret == 0 && offset < end) {
+        /* The file is shorter on src: make it as short on dst. */
+        op = (struct mirror_op) {.id = MOP_GETATTR, .what = "getattr", .path =
+            path, .st = &stbuf};
+        if (resync) {
+            resync_exclusive(state);
+            lane_wait(state, src);
+        }
+        ret = apply_op(srcv, co, &op, NULL);
+        if (ret == 0 && stbuf.st_size < end) {
+            op = (struct mirror_op) {.id = MOP_TRUNCATE, .what = "truncate",
+                .path = path, .offset = stbuf.st_size};
+            ret = apply_op(dstv, co, &op, NULL);
+        }
+        if (resync) {
+            kfs_rwlock_unlock(&state->resync.lock);
         }
     }
-    ids = KFS_FREE(ids);
+    op = (struct mirror_op) {.id = MOP_RELEASE, .what = "release", .path =
+        path};
+    apply_op(dstv, co, &op, &dstfi);
+    apply_op(srcv, co, &op, &srcfi);
+    buf = KFS_FREE(buf);
 
     KFS_RETURN(ret);
 }
 
+/**
+ * Make size bytes at offset of path the same on all subvolumes, by copying it
+ * from one that has the right data to those marked in dirty (all others if
+ * dirty is 0). Called by journal_replay() when the brick starts.
+ */
 static int
-mirror_open(const kfs_context_t co, const char *path, struct fuse_file_info *fi)
+repair_range(void *arg, const char *path, off_t offset, size_t size, uint64_t
+        dirty)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    struct mirror_fh *my_fh = NULL;
-    uint_t accessmode = fi->flags & (O_RDONLY | O_WRONLY | O_RDWR);
-    uint_t *ids = NULL;
-    uint_t id = 0;
+    struct mirror_state * const state = arg;
+    struct kfs_context co = {.uid = 0, .gid = 0, .priv = state};
+    const uint_t n = C_get_num_subvols(state);
+    uint_t src = 0;
     uint_t i = 0;
-    uint_t n = 0;
     int ret = 0;
-    int tmp = 0;
+    int firsterr = 0;
 
     KFS_ENTER();
 
-    switch (accessmode) {
-    case O_RDONLY:
-        /* Read-only requires just one subvolume. */
-        my_fh = new_fh(1);
-        if (my_fh == NULL) {
-            KFS_RETURN(-ENOMEM);
+    if (dirty == 0) {
+        /* Nobody knows who has the new data, any version will do. */
+        dirty = ~(uint64_t) 1;
+    }
+    for (src = 0; src < n && (dirty & ((uint64_t) 1 << src)); src++) {
+        /* Find the first subvolume that is not dirty. */
+    }
+    if (src == n) {
+        KFS_ERROR("No subvolume has the data of `%s' at %llu.", path,
+                (unsigned long long) offset);
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    for (i = 0; i < n; i++) {
+        if ((dirty & ((uint64_t) 1 << i)) == 0) {
+            continue;
         }
-        subv = get_one_reader(state, &(my_fh->subvols_id[0]));
-        if (subv == NULL) {
-            /* No more readers available. */
-            my_fh = del_fh(my_fh);
-            KFS_RETURN(-ENOSUBVOLS);
+        ret = copy_range(state, &co, path, src, i, offset, size, 0);
+        if (ret == -ENOENT) {
+            /* Removed (or never created) on either side: nothing to copy. */
+            ret = 0;
         }
-        KFS_DO_OPER(ret = , subv, open, co, path, fi);
-        /* TODO: Try other subvolumes on failure. */
         if (ret != 0) {
-            my_fh = del_fh(my_fh);
-            KFS_RETURN(ret);
+            KFS_ERROR("Could not repair `%s' on node `%s': %s", path,
+                    C_get_subvol_by_ID(state, i)->name, strerror(-ret));
+            if (firsterr == 0) {
+                firsterr = ret;
+            }
         }
-        /* Store the filehandle returned by the subvolume. */
-        my_fh->subvols_fh[0] = fi->fh;
-        break;
-    case O_RDWR:
-    case O_WRONLY:
-        /* All subvolumes must be available for modification. */
-        n = get_all_active_subvols(state, &ids);
-        if (n == 0) {
-            KFS_RETURN(-ENOSUBVOLS);
+    }
+
+    KFS_RETURN(firsterr);
+}
+
+/*
+ * Resynchronisation: bringing an ejected subvolume back in sync with the active
+ * ones while the brick is in use. See resync_thread().
+ */
+
+/** Names of the entries of a directory, see list_dir(). */
+struct name_list {
+    /** All names back-to-back, '\0'-delimited. */
+    char *names;
+    size_t used;
+    size_t size;
+    /** Set to 1 if memory ran out. */
+    uint_t failure;
+};
+
+static int
+list_filler(void *buf, const char *name, const struct stat *stbuf, off_t
+        offset)
+{
+    struct name_list * const list = buf;
+    const size_t len = strlen(name) + 1;
+    char *names = NULL;
+    size_t size = 0;
+
+    (void) stbuf;
+    (void) offset;
+
+    KFS_ENTER();
+
+    if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0) {
+        KFS_RETURN(0);
+    }
+    if (list->used + len > list->size) {
+        size = MAX(list->size * 2, list->used + len);
+        if (list->names == NULL) {
+            names = KFS_MALLOC(size);
+        } else {
+            names = KFS_REALLOC(list->names, size);
         }
-        my_fh = new_fh(n);
-        /*
-         * new_fh() also allocates space to store the ids, but we already have
-         * them from get_all_active_subvols().
-         */
-        my_fh->subvols_id = KFS_FREE(my_fh->subvols_id);
-        my_fh->subvols_id = ids;
-        /* Call open() on all subvolumes and store their filehandles. */
-        for (i = 0; i < n; i++) {
-            id = my_fh->subvols_id[i];
-            subv = C_get_subvol_by_ID(state, id);
-            fi->fh = 0;
-            KFS_DO_OPER(ret = , subv, open, co, path, fi);
-            if (ret == 0) {
-                my_fh->subvols_fh[i] = fi->fh;
-            } else {
-                /* An error occurred: try to rollback. */
-                while (i--) {
-                    id = my_fh->subvols_id[i];
-                    fi->fh = my_fh->subvols_fh[i];
-                    subv = C_get_subvol_by_ID(state, id);
-                    KFS_DO_OPER(tmp = , subv, release, co, path, fi);
-                    if (tmp != 0) {
-                        KFS_ERROR("While trying to roll back a failed `open' "
-                            "operation by closing it: could not close `%s' on "
-                            "node `%s': %s", path, subv->name, strerror(-tmp));
-                        eject_subvolume(state, id);
-                    }
-                }
-                my_fh = del_fh(my_fh);
-                KFS_RETURN(ret);
-            }
+        if (names == NULL) {
+            list->failure = 1;
+            KFS_RETURN(1);
         }
-        break;
-    default:
-        KFS_ASSERT(0 && "Illegal flag.");
-        break;
+        list->names = names;
+        list->size = size;
     }
-    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
-    /* Return the filehandle of this brick to the caller. */
-    memcpy(&fi->fh, &my_fh, sizeof(my_fh));
+    memcpy(list->names + list->used, name, len);
+    list->used += len;
 
     KFS_RETURN(0);
 }
 
+/**
+ * Get the names of all entries (except . and ..) of a directory on subvolume
+ * id. Returns 0 on success, -errno on error. On success, the caller must free
+ * list->names if it is not NULL.
+ */
 static int
-mirror_mkdir(const kfs_context_t co, const char *path, mode_t mode)
+list_dir(struct mirror_state * const state, const kfs_context_t co, uint_t id,
+        const char *path, struct name_list *list)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
+    struct fuse_file_info fi;
+    int ret = 0;
     int tmp = 0;
+
+    KFS_ENTER();
+
+    memset(list, 0, sizeof(*list));
+    memset(&fi, 0, sizeof(fi));
+    KFS_DO_OPER(ret = , subv, opendir, co, path, &fi);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    KFS_DO_OPER(ret = , subv, readdir, co, path, list, list_filler, 0, &fi);
+    KFS_DO_OPER(tmp = , subv, releasedir, co, path, &fi);
+    (void) tmp;
+    if (ret == 0 && list->failure) {
+        ret = -ENOMEM;
+    }
+    if (ret != 0 && list->names != NULL) {
+        list->names = KFS_FREE(list->names);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Store the path of entry name in directory dir in buf (PATH_MAX bytes).
+ */
+static int
+child_path(char *buf, const char *dir, const char *name)
+{
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, mkdir, co, path, mode);
+    ret = snprintf(buf, PATH_MAX, "%s/%s", strcmp(dir, "/") == 0 ? "" : dir,
+            name);
+    if (ret < 0 || ret >= PATH_MAX) {
+        KFS_RETURN(-ENAMETOOLONG);
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * The subvolume to copy from while resynchronising subvolume id, or NO_SUBVOL
+ * if that is no longer possible. Must be called with the resync lock held for
+ * writing: with write_quorum, the source has then finished every modification
+ * it was sent and gets no new ones.
+ */
+static uint_t
+resync_source(struct mirror_state * const state, uint_t id)
+{
+    const struct active_set * const set = get_active_set(state);
+    uint_t ids[set->num_active + 1];
+
+    KFS_ENTER();
+
+    if (set->resync != id || set->num_active == 0) {
+        KFS_RETURN(NO_SUBVOL);
+    }
+    lane_readers(state, set->ids, NULL, set->num_active, ids, NULL);
+
+    KFS_RETURN(ids[0]);
+}
+
+/**
+ * Remove path (recursively) from subvolume id.
+ */
+static int
+remove_tree(struct mirror_state * const state, const kfs_context_t co, uint_t
+        id, const char *path)
+{
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
+    struct mirror_op op = {.id = MOP_GETATTR, .what = "getattr", .path = path};
+    struct name_list list;
+    struct stat stbuf;
+    char child[PATH_MAX];
+    const char *name = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    op.st = &stbuf;
+    ret = apply_op(subv, co, &op, NULL);
+    if (ret != 0) {
+        KFS_RETURN(ret == -ENOENT ? 0 : ret);
+    }
+    if (!S_ISDIR(stbuf.st_mode)) {
+        op = (struct mirror_op) {.id = MOP_UNLINK, .what = "unlink", .path =
+            path};
+        KFS_RETURN(apply_op(subv, co, &op, NULL));
+    }
+    ret = list_dir(state, co, id, path, &list);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    for (name = list.names; ret == 0 && name < list.names + list.used;
+            name += strlen(name) + 1) {
+        ret = child_path(child, path, name);
+        if (ret == 0) {
+            ret = remove_tree(state, co, id, child);
+        }
+    }
+    if (list.names != NULL) {
+        list.names = KFS_FREE(list.names);
+    }
+    if (ret == 0) {
+        op = (struct mirror_op) {.id = MOP_RMDIR, .what = "rmdir", .path =
+            path};
+        ret = apply_op(subv, co, &op, NULL);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Create path on subvolume dst like it is on subvolume src, whose attributes
+ * are in stbuf. The contents are not copied.
+ */
+static int
+create_entry(struct mirror_state * const state, const kfs_context_t co, uint_t
+        src, uint_t dst, const char *path, const struct stat *stbuf)
+{
+    struct mirror_op op = {.path = path};
+    char target[PATH_MAX];
+    int ret = 0;
+
+    KFS_ENTER();
+
+    switch (stbuf->st_mode & S_IFMT) {
+    case S_IFDIR:
+        op.id = MOP_MKDIR;
+        op.what = "mkdir";
+        op.mode = stbuf->st_mode & PERM7777;
+        break;
+    case S_IFLNK:
+        op.id = MOP_READLINK;
+        op.what = "readlink";
+        op.out = target;
+        op.size = sizeof(target);
+        ret = apply_op(C_get_subvol_by_ID(state, src), co, &op, NULL);
         if (ret != 0) {
-            /* An error occurred: try to rollback. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, rmdir, co, path);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed mkdir "
-                        "operation by deleting it: could not delete `%s' from "
-                        "node `%s': %s", path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
+            KFS_RETURN(ret);
         }
+        op.id = MOP_SYMLINK;
+        op.what = "symlink";
+        op.path = target;
+        op.path2 = path;
+        break;
+    default:
+        op.id = MOP_MKNOD;
+        op.what = "new file";
+        op.mode = stbuf->st_mode;
+        op.dev = stbuf->st_rdev;
+        break;
     }
-    ids = KFS_FREE(ids);
+    ret = apply_op(C_get_subvol_by_ID(state, dst), co, &op, NULL);
 
     KFS_RETURN(ret);
 }
+
+static int resync_dir(struct mirror_state * const state, const kfs_context_t
+        co, uint_t id, const char *path);
+
+/**
+ * Bring path on subvolume id in sync with an active subvolume. What tells what
+ * changed (see the DIRTY_* flags): everything below path is only gone through
+ * for DIRTY_TREE. For DIRTY_DATA with ranges, only those ranges are copied;
+ * otherwise the entire file is, if its size or modification time differs.
+ * Returns 0 on success, -errno on error.
+ */
 static int
-mirror_unlink(const kfs_context_t co, const char *path)
+resync_entry(struct mirror_state * const state, const kfs_context_t co, uint_t
+        id, const char *path, uint_t what, const struct dirty_range *ranges,
+        uint_t num_ranges)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
+    struct kfs_brick * const dst = C_get_subvol_by_ID(state, id);
+    struct mirror_op op = {.id = MOP_GETATTR, .what = "getattr", .path = path};
+    struct timespec tv[2];
+    struct stat stbuf;
+    struct stat dststbuf;
+    uint_t src = 0;
+    uint_t copy = 0;
+    uint_t ranged = 0;
     uint_t i = 0;
-    uint_t n = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, unlink, co, path);
-        if (ret != 0) {
-            if (i == 0) {
-                /* Lucky: this was the first subvolume. Abort everything. */
-                break;
+    ret = resync_continue(state, id);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    resync_exclusive(state);
+    src = resync_source(state, id);
+    if (src == NO_SUBVOL) {
+        kfs_rwlock_unlock(&state->resync.lock);
+        KFS_RETURN(-ECANCELED);
+    }
+    op.st = &stbuf;
+    ret = apply_op(C_get_subvol_by_ID(state, src), co, &op, NULL);
+    if (ret == 0) {
+        op.st = &dststbuf;
+        ret = apply_op(dst, co, &op, NULL);
+        if (ret == 0 && (dststbuf.st_mode & S_IFMT) != (stbuf.st_mode &
+                    S_IFMT)) {
+            ret = remove_tree(state, co, id, path);
+            if (ret == 0) {
+                ret = -ENOENT;
             }
-            KFS_ERROR("Could not delete file %s on node %s: %s.", path,
-                    subv->name, strerror(-ret));
-            eject_subvolume(state, id);
-            ret = 0; /* The failed subvolume is gone, all others are OK. */
-            /* Try to stay consistent by deleting on other subvolumes too. */
-            continue;
+        }
+        if (ret == -ENOENT) {
+            ret = create_entry(state, co, src, id, path, &stbuf);
+            dststbuf.st_size = 0;
+            copy = 1;
+        } else if (ret == 0 && (what & DIRTY_DATA) && ranges != NULL) {
+            /* Growing it now takes care of gaps left by truncate. */
+            ranged = 1;
+            copy = 1;
+        } else if (ret == 0) {
+            copy = stbuf.st_size != dststbuf.st_size || stbuf.st_mtime !=
+                dststbuf.st_mtime;
+        }
+        if (ret == 0 && S_ISREG(stbuf.st_mode) && copy && (ranged ?
+                    dststbuf.st_size != stbuf.st_size : dststbuf.st_size >
+                    stbuf.st_size)) {
+            op = (struct mirror_op) {.id = MOP_TRUNCATE, .what = "truncate",
+                .path = path, .offset = stbuf.st_size};
+            ret = apply_op(dst, co, &op, NULL);
+        }
+        if (ret == 0 && !S_ISLNK(stbuf.st_mode)) {
+            op = (struct mirror_op) {.id = MOP_CHMOD, .what = "chmod", .path =
+                path, .mode = stbuf.st_mode & PERM7777};
+            ret = apply_op(dst, co, &op, NULL);
+        }
+        if (ret == 0) {
+            op = (struct mirror_op) {.id = MOP_CHOWN, .what = "chown", .path =
+                path, .uid = stbuf.st_uid, .gid = stbuf.st_gid};
+            ret = apply_op(dst, co, &op, NULL);
+        }
+    } else if (ret == -ENOENT || ret == -ENOTDIR) {
+        /* Removed (since it was listed, or while the subvolume was out). */
+        ret = remove_tree(state, co, id, path);
+        kfs_rwlock_unlock(&state->resync.lock);
+        KFS_RETURN(ret);
+    }
+    kfs_rwlock_unlock(&state->resync.lock);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    if (S_ISREG(stbuf.st_mode) && ranged) {
+        for (i = 0; ret == 0 && i < num_ranges; i++) {
+            if (ranges[i].offset < (uint64_t) stbuf.st_size) {
+                ret = copy_range(state, co, path, src, id, ranges[i].offset,
+                        MIN(ranges[i].end, (uint64_t) stbuf.st_size) -
+                        ranges[i].offset, 1);
+            }
+        }
+    } else if (S_ISREG(stbuf.st_mode) && copy) {
+        ret = copy_range(state, co, path, src, id, 0, stbuf.st_size, 1);
+    } else if (S_ISDIR(stbuf.st_mode) && (what & DIRTY_TREE)) {
+        ret = resync_dir(state, co, id, path);
+    }
+    if (ret == 0 && !S_ISLNK(stbuf.st_mode)) {
+        /* Last, because creating entries and writing data change the times. */
+        resync_exclusive(state);
+        lane_wait(state, src);
+        op = (struct mirror_op) {.id = MOP_GETATTR, .what = "getattr", .path =
+            path, .st = &stbuf};
+        ret = apply_op(C_get_subvol_by_ID(state, src), co, &op, NULL);
+        if (ret == 0) {
+            tv[0].tv_sec = stbuf.st_atime;
+            tv[0].tv_nsec = 0;
+            tv[1].tv_sec = stbuf.st_mtime;
+            tv[1].tv_nsec = 0;
+            op = (struct mirror_op) {.id = MOP_UTIMENS, .what = "utimens",
+                .path = path, .tvnano = tv};
+            ret = apply_op(dst, co, &op, NULL);
+        }
+        kfs_rwlock_unlock(&state->resync.lock);
+        if (ret == -ENOENT) {
+            /* Removed in the meantime. */
+            ret = 0;
         }
     }
-    ids = KFS_FREE(ids);
+    if (ret == 0) {
+        kfs_atomic_add(&state->resync.files, 1);
+    }
 
     KFS_RETURN(ret);
 }
 
+/**
+ * Bring the contents of directory path on subvolume id in sync with an active
+ * subvolume: remove what is not there and resync everything that is.
+ */
 static int
-mirror_rmdir(const kfs_context_t co, const char *path)
+resync_dir(struct mirror_state * const state, const kfs_context_t co, uint_t
+        id, const char *path)
 {
-    struct mirror_state *state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
+    struct mirror_op op = {.id = MOP_GETATTR, .what = "getattr"};
+    struct name_list list;
+    struct stat stbuf;
+    char child[PATH_MAX];
+    const char *name = NULL;
+    uint_t src = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, rmdir, co, path);
+    ret = list_dir(state, co, id, path, &list);
+    for (name = list.names; ret == 0 && name < list.names + list.used;
+            name += strlen(name) + 1) {
+        ret = child_path(child, path, name);
         if (ret != 0) {
-            if (i == 0) {
-                /* Lucky: this was the first subvolume. Abort everything. */
-                break;
+            break;
+        }
+        resync_exclusive(state);
+        src = resync_source(state, id);
+        if (src == NO_SUBVOL) {
+            ret = -ECANCELED;
+        } else {
+            op.path = child;
+            op.st = &stbuf;
+            ret = apply_op(C_get_subvol_by_ID(state, src), co, &op, NULL);
+            if (ret == -ENOENT) {
+                ret = remove_tree(state, co, id, child);
             }
-            KFS_ERROR("Could not delete directory %s on node %s: %s.", path,
-                    subv->name, strerror(-ret));
-            eject_subvolume(state, id);
-            ret = 0;
-            /* Try to stay consistent by deleting on other subvolumes too. */
-            continue;
         }
+        kfs_rwlock_unlock(&state->resync.lock);
+    }
+    if (list.names != NULL) {
+        list.names = KFS_FREE(list.names);
+    }
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    src = resync_source(state, id);
+    if (src == NO_SUBVOL) {
+        KFS_RETURN(-ECANCELED);
+    }
+    ret = list_dir(state, co, src, path, &list);
+    if (ret == -ENOENT) {
+        /* Removed in the meantime. */
+        KFS_RETURN(0);
+    }
+    for (name = list.names; ret == 0 && name < list.names + list.used;
+            name += strlen(name) + 1) {
+        ret = child_path(child, path, name);
+        if (ret == 0) {
+            ret = resync_entry(state, co, id, child, DIRTY_TREE, NULL, 0);
+        }
+    }
+    if (list.names != NULL) {
+        list.names = KFS_FREE(list.names);
     }
-    ids = KFS_FREE(ids);
 
     KFS_RETURN(ret);
 }
 
+/** Argument of resync_dirty(). */
+struct dirty_replay {
+    struct mirror_state *state;
+    kfs_context_t co;
+    uint_t id;
+};
+
+/**
+ * Resync one path from the dirty log, see dirtylog_replay().
+ */
 static int
-mirror_symlink(const kfs_context_t co, const char *path1, const char *path2)
+resync_dirty(void *arg, const char *path, uint_t what, const struct
+        dirty_range *ranges, uint_t num_ranges)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
+    const struct dirty_replay * const r = arg;
     int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, symlink, co, path1, path2);
-        if (ret != 0) {
-            /* An error occurred: try to rollback. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, unlink, co, path2);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `new symlink'"
-                        " operation by deleting it: could not delete `%s' from "
-                        "node `%s': %s", path2, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
-        }
-    }
-    ids = KFS_FREE(ids);
+    ret = resync_entry(r->state, r->co, r->id, path, what, ranges,
+            num_ranges);
 
     KFS_RETURN(ret);
 }
 
-static int
-mirror_rename(const kfs_context_t co, const char *from, const char *to)
+/**
+ * Resynchronise subvolume id and make it active again. If the dirty log holds
+ * everything the subvolume missed, only that is gone through; otherwise (or if
+ * that fails) the entire tree.
+ */
+static void
+resync_subvolume(struct mirror_state * const state, uint_t id)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
+    struct kfs_brick * const subv = C_get_subvol_by_ID(state, id);
+    struct kfs_context co = {.uid = 0, .gid = 0, .priv = state};
+    struct dirty_replay replay = {.state = state, .co = &co, .id = id};
+    uint_t incremental = 0;
     int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, rename, co, from, to);
-        if (ret != 0) {
-            /* An error occurred: try to rollback. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, rename, co, to, from);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `rename' "
-                        "operation: renaming back from `%s' to `%s' on node "
-                        "`%s' failed: %s", to, from, subv->name,
-                        strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
+    incremental = state->C.dirty != NULL && dirtylog_is_valid(state->C.dirty,
+            id);
+    KFS_INFO("Resynchronising subvolume %s (%s).", subv->name, incremental ?
+            "changes only" : "full");
+    state->resync.pass = 0;
+    state->resync.files = 0;
+    state->resync.bytes = 0;
+    state->resync.started = kfs_clock_ns();
+    ret = update_active_set(state, id, SUBVOL_INACTIVE, 1);
+    if (ret < 0) {
+        KFS_RETURN();
+    }
+    /* Wait for the modifications that started before it was included. */
+    resync_exclusive(state);
+    kfs_rwlock_unlock(&state->resync.lock);
+    lane_wait(state, id);
+    do {
+        kfs_atomic_store(&state->resync.again, 0);
+        state->resync.pass += 1;
+        if (incremental) {
+            ret = dirtylog_replay(state->C.dirty, resync_dirty, &replay);
+            if (ret != 0 && ret != -EINTR && ret != -ECANCELED) {
+                KFS_INFO("Could not resynchronise subvolume %s from the "
+                        "dirty log (%s), going through everything.",
+                        subv->name, strerror(-ret));
+                incremental = 0;
+                kfs_atomic_store(&state->resync.again, 1);
+                ret = 0;
             }
-            break;
+        } else {
+            ret = resync_entry(state, &co, id, "/", DIRTY_TREE, NULL, 0);
+        }
+    } while (ret == 0 && kfs_atomic_load(&state->resync.again));
+    if (ret == 0) {
+        resync_exclusive(state);
+        if (get_active_set(state)->resync == id) {
+            ret = repl_admit(state, id);
+        } else {
+            ret = -ECANCELED;
+        }
+        kfs_rwlock_unlock(&state->resync.lock);
+    }
+    if (ret == 0) {
+        KFS_INFO("Subvolume %s is in sync again: copied %llu entries and %llu "
+                "bytes in %u passes.", subv->name,
+                (unsigned long long) state->resync.files,
+                (unsigned long long) state->resync.bytes, state->resync.pass);
+    } else {
+        update_active_set(state, id, SUBVOL_INACTIVE, 0);
+        if (ret != -EINTR) {
+            KFS_ERROR("Could not resynchronise subvolume %s: %s", subv->name,
+                    strerror(-ret));
         }
     }
-    ids = KFS_FREE(ids);
 
-    KFS_RETURN(ret);
+    KFS_RETURN();
 }
 
-static int
-mirror_link(const kfs_context_t co, const char *from, const char *to)
+/**
+ * Resync thread: every resync_interval, look for an ejected subvolume and bring
+ * it back in sync with the active ones, one subvolume at a time.
+ *
+ * While a subvolume is being resynchronised it receives every modification (see
+ * resync_forward()), but no read-only operations. The thread walks the tree of
+ * an active subvolume and copies everything that differs: missing and
+ * superfluous entries, metadata and the contents of files whose size or
+ * modification time differ. It holds the resync lock for writing while it
+ * copies one entry or one chunk of data, every modification holds it for
+ * reading: a modification can never be overwritten with stale data. When a
+ * pass through the tree completes without any modification having failed on
+ * the subvolume, it is active again. If the dirty log has everything the
+ * subvolume missed, a pass only goes through what is in there. New
+ * modifications wait while the thread waits for the lock (resync_exclusive()),
+ * so a steady stream of them can not hold up the resync.
+ */
+static void *
+resync_thread(void *arg)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    uint_t *ids = NULL;
+    struct mirror_state * const state = arg;
+    const uint_t num_subvols = C_get_num_subvols(state);
+    const struct active_set *set = NULL;
+    uint_t next = 0;
     uint_t id = 0;
     uint_t i = 0;
-    uint_t n = 0;
-    int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, link, co, from, to);
-        if (ret != 0) {
-            /* An error occurred: try to rollback. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, unlink, co, to);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed hardlink "
-                        "operation by deleting it: could not delete `%s' from "
-                        "node `%s': %s", to, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
+    kfs_mutex_lock(&state->resync.stoplock);
+    while (!state->resync.stop) {
+        kfs_cond_timedwait(&state->resync.stopcond, &state->resync.stoplock,
+                state->C.resync_interval);
+        if (state->resync.stop) {
             break;
         }
+        kfs_mutex_unlock(&state->resync.stoplock);
+        set = get_active_set(state);
+        /* Take turns, in case one of them keeps failing. */
+        for (i = 0; i < num_subvols; i++) {
+            id = (next + i) % num_subvols;
+            if (set->map[id] == 0) {
+                break;
+            }
+        }
+        if (i < num_subvols && set->num_active != 0) {
+            resync_subvolume(state, id);
+            next = id + 1;
+        }
+        kfs_mutex_lock(&state->resync.stoplock);
     }
-    ids = KFS_FREE(ids);
+    kfs_mutex_unlock(&state->resync.stoplock);
 
-    KFS_RETURN(ret);
+    KFS_RETURN(NULL);
 }
 
+/**
+ * Start the resync thread. Returns 0 on success, -errno on error.
+ */
 static int
-mirror_chmod(const kfs_context_t co, const char *path, mode_t mode)
+resync_start(struct mirror_state * const state)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    /** Backup of the mode in case of rollback (if possible). */
-    struct {
-        struct stat stbuf;
-        mode_t mode;
-        uint_t valid;
-    } backup = {.mode = 0, .valid = 0};
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
-    uint_t one_success = 0;
     int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
-    /* Backup old mode. */
-    ret = mirror_getattr(co, path, &backup.stbuf);
+    state->resync.stop = 0;
+    state->resync.again = 0;
+    state->resync.pass = 0;
+    state->resync.files = 0;
+    state->resync.bytes = 0;
+    state->resync.started = 0;
+    ret = kfs_rwlock_init(&state->resync.lock);
     if (ret == 0) {
-        backup.mode = backup.stbuf.st_mode & PERM7777;
-        backup.valid = 1;
-    } else {
-        backup.valid = 0;
-    }
-    /* Perform mode change on all subvols. */
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, chmod, co, path, mode);
+        ret = kfs_mutex_init(&state->resync.stoplock);
         if (ret == 0) {
-            one_success = 1;
-        } else if (one_success && backup.valid == 0) {
-            /* No possibility to rollback: eject this node and continue. */
-            KFS_ERROR("Changing mode of `%s' failed midway at node `%s': "
-                "%s. Was unable to backup old mode; rollback impossible, "
-                "continuing with operation.",
-                path, subv->name, strerror(-errno));
-            eject_subvolume(state, id);
-            ret = 0;
-        } else {
-            /* Rollback succesful subvolumes and abort operation. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, chmod, co, path, backup.mode);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `chmod' "
-                        "operation by reverting it: could not chmod `%s' from "
-                        "node `%s': %s", path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
+            ret = kfs_cond_init(&state->resync.stopcond);
+            if (ret == 0) {
+                ret = kfs_mutex_init(&state->resync.gate);
+                if (ret == 0) {
+                    ret = kfs_thread_create(&state->resync.thread,
+                            resync_thread, state);
+                    if (ret == 0) {
+                        KFS_RETURN(0);
+                    }
+                    kfs_mutex_destroy(&state->resync.gate);
                 }
+                kfs_cond_destroy(&state->resync.stopcond);
             }
-            break;
+            kfs_mutex_destroy(&state->resync.stoplock);
         }
+        kfs_rwlock_destroy(&state->resync.lock);
     }
-    ids = KFS_FREE(ids);
 
-    KFS_RETURN(ret);
+    KFS_RETURN(-ret);
 }
 
-static int
-mirror_chown(const kfs_context_t co, const char *path, uid_t uid, gid_t gid)
+/**
+ * Stop the resync thread (interrupting a resync in progress) and wait for it.
+ */
+static void
+resync_stop(struct mirror_state * const state)
 {
-    struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    struct stat stbuf;
-    /** Backup in case of rollback. */
-    struct {
-        uid_t uid;
-        gid_t gid;
-        uint_t valid;
-    } backup = {.uid = 0, .gid = 0, .valid = 0};
-    uint_t *ids = NULL;
-    uint_t id = 0;
+    KFS_ENTER();
+
+    kfs_mutex_lock(&state->resync.stoplock);
+    state->resync.stop = 1;
+    kfs_cond_broadcast(&state->resync.stopcond);
+    kfs_mutex_unlock(&state->resync.stoplock);
+    kfs_thread_join(state->resync.thread);
+    kfs_mutex_destroy(&state->resync.gate);
+    kfs_cond_destroy(&state->resync.stopcond);
+    kfs_mutex_destroy(&state->resync.stoplock);
+    kfs_rwlock_destroy(&state->resync.lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Write the state of all subvolumes and the progress of the resync as text
+ * ("name=value" lines) to buf, like snprintf(): returns the length of the full
+ * text, excluding the terminating '\0', even if it did not fit.
+ */
+static size_t
+format_status(struct mirror_state * const state, char *buf, size_t size)
+{
+    const struct active_set * const set = get_active_set(state);
+    const char *status = NULL;
+    uint64_t lag = 0;
+    size_t len = 0;
     uint_t i = 0;
-    uint_t n = 0;
-    uint_t one_success = 0;
     int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
-    /* Backup old permissions. */
-    ret = mirror_getattr(co, path, &stbuf);
-    if (ret == 0) {
-        backup.uid = stbuf.st_uid;
-        backup.gid = stbuf.st_gid;
-        backup.valid = 1;
-    } else {
-        backup.valid = 0;
-    }
-    /* Perform mode change on all subvols. */
-    ret = -ENOSUBVOLS;
-    one_success = 0;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, chown, co, path, uid, gid);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (one_success && backup.valid == 0) {
-            /* No possibility to rollback: eject this node and continue. */
-            KFS_ERROR("Changing ownership of `%s' failed midway at node "
-                "`%s': %s. Was unable to backup old ownership; rollback "
-                "impossible, continuing with operation.",
-                path, subv->name, strerror(-errno));
-            eject_subvolume(state, id);
-            ret = 0;
+    for (i = 0; i < C_get_num_subvols(state); i++) {
+        if (set->map[i] == SUBVOL_ACTIVE) {
+            status = "active";
+        } else if (set->map[i] == SUBVOL_REPLICA) {
+            status = "replica";
+        } else if (set->resync == i) {
+            status = "resyncing";
         } else {
-            /* Rollback succesful subvolumes and abort operation. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, chown, co, path, backup.uid,
-                        backup.gid);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `chown' "
-                        "operation by reverting it: could not chown `%s' from "
-                        "node `%s': %s", path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
+            status = "inactive";
+        }
+        ret = snprintf(buf + MIN(len, size), size - MIN(len, size),
+                "subvolume.%s=%s\n", C_get_subvol_by_ID(state, i)->name,
+                status);
+        KFS_ASSERT(ret >= 0);
+        len += ret;
+        if (state->lanes == NULL) {
+            continue;
         }
+        ret = snprintf(buf + MIN(len, size), size - MIN(len, size),
+                "subvolume.%s.pending=%u\n", C_get_subvol_by_ID(state,
+                    i)->name, lane_pending(state, i));
+        KFS_ASSERT(ret >= 0);
+        len += ret;
+    }
+    if (state->C.resync_interval != 0) {
+        ret = snprintf(buf + MIN(len, size), size - MIN(len, size),
+                "resync.pass=%u\nresync.entries=%llu\nresync.bytes=%llu\n",
+                state->resync.pass, (unsigned long long) state->resync.files,
+                (unsigned long long) state->resync.bytes);
+        KFS_ASSERT(ret >= 0);
+        len += ret;
+    }
+    if (state->C.num_sync < C_get_num_subvols(state)) {
+        kfs_mutex_lock(&state->repl.lock);
+        lag = state->repl.head == NULL ? 0 : (kfs_clock_ns() -
+                state->repl.head->queued) / 1000000;
+        ret = snprintf(buf + MIN(len, size), size - MIN(len, size),
+                "replication.queued=%llu\nreplication.lag_bytes=%llu\n"
+                "replication.lag_seconds=%llu.%03llu\n",
+                (unsigned long long) state->repl.num_queued,
+                (unsigned long long) state->repl.bytes_queued,
+                (unsigned long long) lag / 1000,
+                (unsigned long long) lag % 1000);
+        kfs_mutex_unlock(&state->repl.lock);
+        KFS_ASSERT(ret >= 0);
+        len += ret;
     }
-    ids = KFS_FREE(ids);
 
-    KFS_RETURN(ret);
+    KFS_RETURN(len);
 }
 
+/**
+ * Write data (or fallocate) with consistency = journal: the intent has been
+ * recorded in the given journal slot. The write goes to all active subvolumes
+ * of the session at once; those where it fails are marked dirty for this range
+ * in the journal and ejected, the others are not rolled back. Returns the
+ * number of bytes written, or the first error if the write failed everywhere.
+ */
 static int
-mirror_read(const kfs_context_t co, const char *path, char *buf, size_t size,
-        off_t offset, struct fuse_file_info *fi)
+write_journaled(struct mirror_state * const state, const kfs_context_t co,
+        const struct mirror_op *op, const struct fuse_file_info *fi, const
+        struct mirror_fh *my_fh, int slot)
 {
-    struct mirror_state * const state = co->priv;
-    struct mirror_fh *my_fh = NULL;
+    int rets[my_fh->num_subvols];
+    uint_t ids[my_fh->num_subvols];
+    uint64_t fhs[my_fh->num_subvols];
     struct kfs_brick *subv = NULL;
-    uint_t id = 0;
+    uint64_t dirty = 0;
+    uint_t num_failed = 0;
+    uint_t n = 0;
     uint_t i = 0;
+    int firsterr = 0;
+    int firstok = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
-    memcpy(&my_fh, &fi->fh, sizeof(my_fh));
-    i = 0;
-    do {
-        if (i == my_fh->num_subvols) {
-            KFS_RETURN(-ENOSUBVOLS);
+    n = get_active_fh_subvols(state, my_fh, ids, fhs);
+    if (n == 0) {
+        journal_end(state->C.journal, slot);
+        KFS_RETURN(-ENOSUBVOLS);
+    }
+    fanout(state, co, op, fi, ids, fhs, rets, n);
+    for (i = 0; i < n; i++) {
+        if (rets[i] < 0) {
+            if (num_failed == 0) {
+                firsterr = rets[i];
+            }
+            num_failed += 1;
+            dirty |= (uint64_t) 1 << ids[i];
+        } else if (firstok == 0) {
+            firstok = rets[i];
         }
-        id = my_fh->subvols_id[i];
-    } while (is_active(state, id) == 0);
-    subv = C_get_subvol_by_ID(state, id);
-    fi->fh = my_fh->subvols_fh[i];
-    KFS_DO_OPER(ret = , subv, read, co, path, buf, size, offset, fi);
+    }
+    if (num_failed != 0 && num_failed != n) {
+        ret = journal_dirty(state->C.journal, slot, dirty);
+        for (i = 0; i < n; i++) {
+            if (rets[i] >= 0) {
+                continue;
+            }
+            subv = C_get_subvol_by_ID(state, ids[i]);
+            KFS_ERROR("Operation `%s' on `%s' failed on node `%s': %s. %s, "
+                    "dropping node and continuing with the rest.", op->what,
+                    op->path, subv->name, strerror(-rets[i]), ret == 0 ?
+                    "Marked the range as dirty in the journal" :
+                    "Could not even mark the range as dirty");
+            if (eject_subvolume(state, ids[i]) != 0) {
+                firstok = -EIO;
+            }
+        }
+    }
+    journal_end(state->C.journal, slot);
 
-    KFS_RETURN(ret);
+    KFS_RETURN(num_failed == n ? firsterr : firstok);
 }
 
 /**
@@ -1283,32 +4587,62 @@ mirror_read(const kfs_context_t co, const char *path, char *buf, size_t size,
  *
  * TODO: Actually, it is not: what if it is an evil process that forks and then
  * acts like both P1 and P2? It could DOS this brick. I have no idea how to deal
- * with that without removing the backup functionality altogether.
+ * with that without removing the backup functionality altogether. *
+ * With consistency = journal, there is no backup at all: see write_journaled().
+ * The backup is only made if the write can not be journaled (pathname too long
+ * or journal full of dirty records). Neither is there with write_quorum, which
+ * does not roll back: see fanout_quorum().
  */
 static int
 mirror_write(const kfs_context_t co, const char *path, const char *buf, size_t
         size, off_t offset, struct fuse_file_info *fi)
 {
     struct mirror_state * const state = co->priv;
+    struct mirror_op op = {.id = MOP_WRITE, .what = "write", .path = path,
+        .buf = buf, .size = size, .offset = offset};
+    struct mirror_op undo = {.id = MOP_WRITE, .what = "write back", .path =
+        path, .size = size, .offset = offset};
     struct mirror_fh *my_fh = NULL;
-    struct kfs_brick *subv = NULL;
     struct {
         struct flock lock;
         char *buf;
         uint_t mylock : 1; /* I acquired this lock! */
         uint_t valid : 1;
     } backup = {.buf = NULL, .mylock = 0, .valid = 0};
-    uint_t one_success = 0;
-    uint_t id = 0;
-    uint_t i = 0;
+    struct fuse_file_info myfi;
+    char pathbuf[PATH_MAX];
+    uint_t n = 0;
+    int slot = 0;
     int ret = 0;
     int tmp = 0;
 
     KFS_ENTER();
 
-    /* Backup the data first. */
+    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
+    memcpy(&my_fh, &fi->fh, sizeof(my_fh));
+    KFS_ASSERT(my_fh != NULL);
+    path = fh_path(state, my_fh, path, pathbuf);
+    op.path = undo.path = path;
+    repl_throttle(state);
+    resync_enter(state);
+    if (state->C.journal != NULL) {
+        slot = journal_begin(state->C.journal, path, offset, size);
+        if (slot >= 0) {
+            ret = write_journaled(state, co, &op, fi, my_fh, slot);
+            if (ret >= 0) {
+                repl_enqueue(state, co, &op);
+            }
+            dirty_track(state, &op);
+            resync_forward(state, co, &op, ret);
+            resync_leave(state);
+            KFS_RETURN(ret);
+        }
+    }
+    /* Backup the data first (useless without rollback). */
     backup.valid = 0;
-    backup.buf = KFS_MALLOC(size);
+    if (state->lanes == NULL) {
+        backup.buf = KFS_MALLOC(size);
+    }
     if (backup.buf != NULL) {
         /* Acquire the lock. */
         ret = ensure_lock(co, path, offset, size, fi, &backup.lock);
@@ -1329,58 +4663,34 @@ mirror_write(const kfs_context_t co, const char *path, const char *buf, size_t
             break;
         }
     }
-    /* Perform the actual backup. */
+    /* Perform the actual backup (on a copy: mirror_read() changes fh). */
     if (backup.valid) {
-        ret = mirror_read(co, path, backup.buf, size, offset, fi);
+        myfi = *fi;
+        ret = mirror_read(co, path, backup.buf, size, offset, &myfi);
         if (ret != size) {
             backup.valid = 0;
         }
     }
+    undo.buf = backup.buf;
     /* Write new data. */
-    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
-    memcpy(&my_fh, &fi->fh, sizeof(my_fh));
-    ret = -ENOSUBVOLS;
-    one_success = 0;
-    for (i = 0; i < my_fh->num_subvols; i++) {
-        id = my_fh->subvols_id[i];
-        if (is_active(state, id) == 0) {
-            continue;
-        }
-        subv = C_get_subvol_by_ID(state, id);
-        fi->fh = my_fh->subvols_fh[i];
-        KFS_DO_OPER(ret = , subv, write, co, path, buf, size, offset, fi);
-        KFS_ASSERT(ret == size || ret < 0);
-        if (ret == size) {
-            one_success = 1;
-        } else if (one_success && backup.valid == 0) {
-            KFS_ERROR("Writing new data to `%s' failed midway at node `%s': %s;"
-                " rollback impossible, continuing with operation.", path,
-                subv->name, strerror(-errno));
-            eject_subvolume(state, id);
-            ret = 0;
+    {
+        uint_t ids[my_fh->num_subvols];
+        uint64_t fhs[my_fh->num_subvols];
+
+        n = get_active_fh_subvols(state, my_fh, ids, fhs);
+        if (state->lanes != NULL) {
+            ret = fanout_quorum(state, co, &op, fi, ids, fhs, n);
         } else {
-            /* Rollback succesful subvolumes and abort operation. */
-            while (i--) {
-                id = my_fh->subvols_id[i];
-                if (is_active(state, id) == 0) {
-                    continue;
-                }
-                fi->fh = my_fh->subvols_fh[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, write, co, path, backup.buf, size,
-                        offset, fi);
-                if (tmp != size) {
-                    /* API requirement. */
-                    KFS_ASSERT(tmp < 0);
-                    KFS_ERROR("While trying to roll back a failed write "
-                        "operation by reverting it: could not write to %s on "
-                        "node `%s': %s", path, subv->name, strerror(-ret));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
+            ret = fanout_all(state, co, &op, backup.valid ? &undo : NULL, fi,
+                    ids, fhs, n);
         }
     }
+    if (ret >= 0) {
+        repl_enqueue(state, co, &op);
+    }
+    dirty_track(state, &op);
+    resync_forward(state, co, &op, ret);
+    resync_leave(state);
     if (backup.buf != NULL) {
         backup.buf = KFS_FREE(backup.buf);
     }
@@ -1398,6 +4708,60 @@ mirror_write(const kfs_context_t co, const char *path, const char *buf, size_t
     KFS_RETURN(ret);
 }
 
+/**
+ * Allocate disk space for (or punch a hole in) part of a file on all
+ * subvolumes. Like a write, but without rollback: there is nothing to restore
+ * after an allocation, and a punched hole could only be restored by reading
+ * all of it first.
+ */
+static int
+mirror_fallocate(const kfs_context_t co, const char *path, int mode, off_t
+        offset, off_t len, struct fuse_file_info *fi)
+{
+    struct mirror_state * const state = co->priv;
+    struct mirror_op op = {.id = MOP_FALLOCATE, .what = "fallocate", .path =
+        path, .flags = mode, .offset = offset, .size = len};
+    struct mirror_fh *my_fh = NULL;
+    char pathbuf[PATH_MAX];
+    uint_t n = 0;
+    int slot = -1;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
+    memcpy(&my_fh, &fi->fh, sizeof(my_fh));
+    KFS_ASSERT(my_fh != NULL);
+    op.path = path = fh_path(state, my_fh, path, pathbuf);
+    repl_throttle(state);
+    resync_enter(state);
+    if (state->C.journal != NULL) {
+        slot = journal_begin(state->C.journal, path, offset, len);
+    }
+    if (slot >= 0) {
+        ret = write_journaled(state, co, &op, fi, my_fh, slot);
+    } else {
+        uint_t ids[my_fh->num_subvols];
+        uint64_t fhs[my_fh->num_subvols];
+
+        n = get_active_fh_subvols(state, my_fh, ids, fhs);
+        if (state->lanes != NULL) {
+            ret = fanout_quorum(state, co, &op, fi, ids, fhs, n);
+        } else {
+            /* Nodes that fail are dropped, see fanout_all(). */
+            ret = fanout_all(state, co, &op, NULL, fi, ids, fhs, n);
+        }
+    }
+    if (ret >= 0) {
+        repl_enqueue(state, co, &op);
+    }
+    dirty_track(state, &op);
+    resync_forward(state, co, &op, ret);
+    resync_leave(state);
+
+    KFS_RETURN(ret);
+}
+
 static int
 mirror_statfs(const kfs_context_t co, const char *path, struct statvfs *stbuf)
 {
@@ -1437,13 +4801,12 @@ mirror_statfs(const kfs_context_t co, const char *path, struct statvfs *stbuf)
 static int
 mirror_flush(const kfs_context_t co, const char *path, struct fuse_file_info
         *fi)
-{
-    struct mirror_state * const state = co->priv;
-    struct mirror_fh *my_fh = NULL;
-    struct kfs_brick *subv = NULL;
-    uint_t one_success = 0;
-    uint_t id = 0;
-    uint_t i = 0;
+{
+    struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_FLUSH, .what = "flush", .path =
+        path};
+    struct mirror_fh *my_fh = NULL;
+    uint_t n = 0;
     int ret = 0;
 
     KFS_ENTER();
@@ -1451,27 +4814,15 @@ mirror_flush(const kfs_context_t co, const char *path, struct fuse_file_info
     KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
     memcpy(&my_fh, &fi->fh, sizeof(my_fh));
     KFS_ASSERT(my_fh != NULL);
-    ret = -ENOSUBVOLS;
-    one_success = 0;
-    for (i = 0; i < my_fh->num_subvols; i++) {
-        id = my_fh->subvols_id[i];
-        if (is_active(state, id) == 0) {
-            continue;
-        }
-        subv = C_get_subvol_by_ID(state, id);
-        fi->fh = my_fh->subvols_fh[i];
-        KFS_DO_OPER(ret = , subv, flush, co, path, fi);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (one_success == 0) {
-            break;
-        } else {
-            KFS_ERROR("Flushing `%s' failed on node `%s': %s. Already flushed "
-                "some other nodes; dropping this one and continuing with the "
-                "rest.", path, subv->name, strerror(-ret));
-            eject_subvolume(state, id);
-            ret = 0;
-        }
+    hedges_wait(state, my_fh);
+    {
+        uint_t ids[my_fh->num_subvols];
+        uint64_t fhs[my_fh->num_subvols];
+
+        n = get_active_fh_subvols(state, my_fh, ids, fhs);
+        lanes_wait(state, ids, n);
+        /* Nodes that fail are dropped, see fanout_all(). */
+        ret = fanout_all(state, co, &op, NULL, fi, ids, fhs, n);
     }
 
     KFS_RETURN(ret);
@@ -1497,6 +4848,8 @@ mirror_release(const kfs_context_t co, const char *path, struct fuse_file_info
         *fi)
 {
     struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_RELEASE, .what = "close", .path =
+        path};
     struct mirror_fh *my_fh = NULL;
     struct kfs_brick *subv = NULL;
     uint_t id = 0;
@@ -1511,26 +4864,39 @@ mirror_release(const kfs_context_t co, const char *path, struct fuse_file_info
     KFS_ASSERT(my_fh != NULL);
     ret = -ENOSUBVOLS;
     one_success = 0;
-    for (i = 0; i < my_fh->num_subvols; i++) {
-        id = my_fh->subvols_id[i];
-        fi->fh = my_fh->subvols_fh[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, release, co, path, fi);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (is_active(state, id)) {
-            /* If the first active node failed, forget about the whole thing. */
+    /* The slower attempt of a hedged read may still be using them. */
+    hedges_wait(state, my_fh);
+    {
+        int rets[my_fh->num_subvols];
+
+        lanes_wait(state, my_fh->subvols_id, my_fh->num_subvols);
+        fanout(state, co, &op, fi, my_fh->subvols_id, my_fh->subvols_fh, rets,
+                my_fh->num_subvols);
+        for (i = 0; i < my_fh->num_subvols; i++) {
+            if (rets[i] == 0) {
+                one_success = 1;
+            }
+        }
+        for (i = 0; i < my_fh->num_subvols; i++) {
+            id = my_fh->subvols_id[i];
+            ret = rets[i];
+            if (ret == 0 || is_active(state, id) == 0) {
+                continue;
+            }
+            /* If no node succeeded, forget about the whole thing. */
             if (one_success == 0) {
                 KFS_RETURN(ret);
             }
+            subv = C_get_subvol_by_ID(state, id);
             KFS_ERROR("Closing file `%s' on node `%s' failed: %s, dropping "
                     "node.", path, subv->name, strerror(-ret));
             eject_subvolume(state, id);
         }
     }
+    fh_unregister(state, my_fh);
     my_fh = del_fh(my_fh);
 
-    KFS_RETURN(ret);
+    KFS_RETURN(0);
 }
 
 static int
@@ -1538,11 +4904,10 @@ mirror_fsync(const kfs_context_t co, const char *path, int isdatasync, struct
         fuse_file_info *fi)
 {
     struct mirror_state * const state = co->priv;
+    const struct mirror_op op = {.id = MOP_FSYNC, .what = "fsync", .path =
+        path, .flags = isdatasync};
     struct mirror_fh *my_fh = NULL;
-    struct kfs_brick *subv = NULL;
-    uint_t one_success = 0;
-    uint_t id = 0;
-    uint_t i = 0;
+    uint_t n = 0;
     int ret = 0;
 
     KFS_ENTER();
@@ -1550,41 +4915,217 @@ mirror_fsync(const kfs_context_t co, const char *path, int isdatasync, struct
     KFS_ASSERT(sizeof(my_fh) <= sizeof(fi->fh));
     memcpy(&my_fh, &fi->fh, sizeof(my_fh));
     KFS_ASSERT(my_fh != NULL);
-    ret = -ENOSUBVOLS;
-    one_success = 0;
-    for (i = 0; i < my_fh->num_subvols; i++) {
-        id = my_fh->subvols_id[i];
-        if (is_active(state, id) == 0) {
-            continue;
+    {
+        uint_t ids[my_fh->num_subvols];
+        uint64_t fhs[my_fh->num_subvols];
+
+        n = get_active_fh_subvols(state, my_fh, ids, fhs);
+        lanes_wait(state, ids, n);
+        /* Nodes that fail are dropped, see fanout_all(). */
+        ret = fanout_all(state, co, &op, NULL, fi, ids, fhs, n);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Copy size bytes within one subvolume, by hand if it can not do it by itself.
+ * Returns 0 if all of it was copied, -errno otherwise.
+ */
+static int
+copy_on_subvol(struct kfs_brick *subv, const kfs_context_t co, const char
+        *path_in, struct fuse_file_info *fi_in, off_t offset_in, const char
+        *path_out, struct fuse_file_info *fi_out, off_t offset_out, size_t size)
+{
+    char *buf = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    while (size > 0) {
+        KFS_DO_OPER(ret = , subv, copy_file_range, co, path_in, fi_in,
+                offset_in, path_out, fi_out, offset_out, size, 0);
+        if (ret == -EXDEV || ret == -ENOSYS) {
+            break;
         }
-        fi->fh = my_fh->subvols_fh[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, fsync, co, path, isdatasync, fi);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (one_success == 0) {
+        if (ret <= 0) {
+            KFS_RETURN(ret == 0 ? -EIO : ret);
+        }
+        offset_in += ret;
+        offset_out += ret;
+        size -= ret;
+    }
+    if (size > 0) {
+        buf = KFS_MALLOC(MIN(size, COPY_CHUNK));
+        if (buf == NULL) {
+            KFS_RETURN(-ENOMEM);
+        }
+    }
+    ret = 0;
+    while (size > 0) {
+        KFS_DO_OPER(ret = , subv, read, co, path_in, buf, MIN(size,
+                    COPY_CHUNK), offset_in, fi_in);
+        if (ret <= 0) {
+            ret = ret == 0 ? -EIO : ret;
             break;
-        } else {
-            KFS_ERROR("Node `%s' failed to synchronise file `%s' to storage, "
-                      "deactivating it.", subv->name, path);
-            eject_subvolume(state, id);
-            ret = 0;
         }
+        KFS_DO_OPER(ret = , subv, write, co, path_out, buf, ret, offset_out,
+                fi_out);
+        if (ret < 0) {
+            break;
+        }
+        offset_in += ret;
+        offset_out += ret;
+        size -= ret;
+        ret = 0;
+    }
+    if (buf != NULL) {
+        buf = KFS_FREE(buf);
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Copy part of a file to another within every subvolume, so the data need not
+ * come up and go back down through this brick. The first subvolume decides how
+ * much is copied, the others copy exactly that much; those where that fails are
+ * ejected.
+ *
+ * The journal, the replication queue and the resync thread only know how to
+ * redo writes, so with consistency = journal, replicas or a resync in progress
+ * the caller has to copy the data itself.
+ */
+static int
+mirror_copy_file_range(const kfs_context_t co, const char *path_in, struct
+        fuse_file_info *fi_in, off_t offset_in, const char *path_out, struct
+        fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    struct mirror_state * const state = co->priv;
+    struct mirror_op op = {.id = MOP_WRITE, .what = "copy", .path = path_out,
+        .offset = offset_out};
+    struct mirror_fh *fh_in = NULL;
+    struct mirror_fh *fh_out = NULL;
+    struct fuse_file_info myfi_in;
+    struct fuse_file_info myfi_out;
+    struct kfs_brick *subv = NULL;
+    char pathbuf[PATH_MAX];
+    uint_t n = 0;
+    uint_t i = 0;
+    uint_t j = 0;
+    /* Set if a failed subvolume could not be ejected. */
+    uint_t stuck = 0;
+    int ret = -EXDEV;
+    int tmp = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(sizeof(fh_in) <= sizeof(fi_in->fh));
+    memcpy(&fh_in, &fi_in->fh, sizeof(fh_in));
+    memcpy(&fh_out, &fi_out->fh, sizeof(fh_out));
+    KFS_ASSERT(fh_in != NULL && fh_out != NULL);
+    op.path = fh_path(state, fh_out, path_out, pathbuf);
+    if (state->C.journal != NULL || state->lanes != NULL ||
+            state->C.num_sync < C_get_num_subvols(state)) {
+        KFS_RETURN(-EXDEV);
+    }
+    resync_enter(state);
+    if (get_active_set(state)->resync != NO_SUBVOL) {
+        resync_leave(state);
+        KFS_RETURN(-EXDEV);
+    }
+    {
+        uint_t ids[fh_out->num_subvols];
+        uint64_t fhs_in[fh_out->num_subvols];
+        uint64_t fhs_out[fh_out->num_subvols];
+
+        n = get_active_fh_subvols(state, fh_out, ids, fhs_out);
+        for (i = 0; i < n; i++) {
+            for (j = 0; j < fh_in->num_subvols; j++) {
+                if (fh_in->subvols_id[j] == ids[i]) {
+                    fhs_in[i] = fh_in->subvols_fh[j];
+                    break;
+                }
+            }
+            if (j == fh_in->num_subvols) {
+                /* Opened while different subvolumes were active. */
+                n = 0;
+                break;
+            }
+        }
+        myfi_in = *fi_in;
+        myfi_out = *fi_out;
+        for (i = 0; i < n; i++) {
+            subv = C_get_subvol_by_ID(state, ids[i]);
+            myfi_in.fh = fhs_in[i];
+            myfi_out.fh = fhs_out[i];
+            if (i == 0) {
+                KFS_DO_OPER(ret = , subv, copy_file_range, co, path_in,
+                        &myfi_in, offset_in, path_out, &myfi_out, offset_out,
+                        size, flags);
+                if (ret <= 0) {
+                    break;
+                }
+                continue;
+            }
+            tmp = copy_on_subvol(subv, co, path_in, &myfi_in, offset_in,
+                    path_out, &myfi_out, offset_out, ret);
+            if (tmp != 0) {
+                KFS_ERROR("Copying to `%s' failed on node `%s': %s. Dropping "
+                        "node and continuing with the rest.", op.path,
+                        subv->name, strerror(-tmp));
+                if (eject_subvolume(state, ids[i]) != 0) {
+                    stuck = 1;
+                }
+            }
+        }
+    }
+    if (ret > 0) {
+        op.size = ret;
+        dirty_track(state, &op);
+    }
+    resync_leave(state);
+    if (stuck) {
+        ret = -EIO;
     }
 
     KFS_RETURN(ret);
 }
 
+/**
+ * The state of the subvolumes is available as a virtual attribute of the root
+ * directory; everything else comes from one of the subvolumes.
+ */
 static int
 mirror_getxattr(const kfs_context_t co, const char *path, const char *name, char
         *value, size_t size)
 {
     struct mirror_state * const state = co->priv;
     struct kfs_brick *subv = NULL;
+    char *buf = NULL;
+    size_t len = 0;
     int ret = 0;
 
     KFS_ENTER();
 
+    if (strcmp(path, "/") == 0 && strcmp(name, STATUS_XATTR) == 0) {
+        len = format_status(state, NULL, 0);
+        if (size == 0) {
+            KFS_RETURN(len);
+        }
+        if (size < len) {
+            KFS_RETURN(-ERANGE);
+        }
+        /* The status can change in the meantime, keep what fits. */
+        buf = KFS_MALLOC(len + 1);
+        if (buf == NULL) {
+            KFS_RETURN(-ENOMEM);
+        }
+        len = MIN(format_status(state, buf, len + 1), len);
+        memcpy(value, buf, len);
+        buf = KFS_FREE(buf);
+        KFS_RETURN(len);
+    }
     subv = get_one_reader(state, NULL);
     if (subv == NULL) {
         KFS_RETURN(-ENOSUBVOLS);
@@ -1615,7 +5156,6 @@ mirror_setxattr(const kfs_context_t co, const char *path, const char *name,
         const char *value, size_t size, int flags)
 {
     struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
     struct {
         struct fuse_file_info fi;
         struct flock lock;
@@ -1625,11 +5165,11 @@ mirror_setxattr(const kfs_context_t co, const char *path, const char *name,
         uint_t opened : 1; /* File was opened succesfully. */
         uint_t valid : 1;
     } backup = {.buf = NULL, .size = 0, .mylock = 0, .opened = 0, .valid = 0};
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
-    uint_t one_success = 0;
+    const struct mirror_op op = {.id = MOP_SETXATTR, .what = "setxattr", .path =
+        path, .name = name, .buf = value, .size = size, .flags = flags};
+    /** Restores the backup on all subvolumes that did succeed. */
+    struct mirror_op undo = {.id = MOP_SETXATTR, .what = "setxattr", .path =
+        path, .name = name, .flags = XATTR_REPLACE};
     int ret = 0;
     int tmp = 0;
     /* Oh the humanity.. */
@@ -1694,37 +5234,9 @@ mirror_setxattr(const kfs_context_t co, const char *path, const char *name,
         }
     }
     /* (Hopefully) done backing up, now update the actual attribute. */
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    one_success = 0;
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, setxattr, co, path, name, value, size, flags);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (one_success && backup.valid == 0) {
-            KFS_ERROR("Set extended attribute `%s' for `%s' on node `%s' failed"
-                      ", could not rollback: dropping node.", name, path,
-                      subv->name);
-            eject_subvolume(state, id);
-        } else {
-            /* Restore the backup on all subvolumes that did succeed. */
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, setxattr, co, path, name, backup.buf,
-                        backup.size, XATTR_REPLACE);
-                if (tmp != 0) {
-                    KFS_ERROR("Could not rollback extended attribute `%s' for "
-                              "`%s' on node `%s' after error: %s. Deactivate.",
-                              name, path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
-        }
-    }
+    undo.buf = backup.buf;
+    undo.size = backup.size;
+    ret = fanout_active(state, co, &op, backup.valid ? &undo : NULL);
     /* Release all temporary resources. */
     if (backup.mylock) {
         backup.lock.l_type = F_UNLCK;
@@ -1746,7 +5258,6 @@ mirror_setxattr(const kfs_context_t co, const char *path, const char *name,
     if (backup.buf != NULL) {
         backup.buf = KFS_FREE(backup.buf);
     }
-    ids = KFS_FREE(ids);
 
     KFS_RETURN(ret);
 }
@@ -1765,6 +5276,8 @@ mirror_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
     struct mirror_state * const state = co->priv;
     struct mirror_dirfh *my_dirfh = NULL;
     struct kfs_brick *subv = NULL;
+    uint64_t start = 0;
+    uint_t id = 0;
     int ret = 0;
 
     KFS_ENTER();
@@ -1774,12 +5287,14 @@ mirror_opendir(const kfs_context_t co, const char *path, struct fuse_file_info
     if (my_dirfh == NULL) {
         KFS_RETURN(-ENOMEM);
     }
-    subv = get_one_reader(state, NULL);
+    subv = get_one_reader(state, &id);
     if (subv == NULL) {
         my_dirfh = KFS_FREE(my_dirfh);
         KFS_RETURN(-ENOSUBVOLS);
     }
+    start = readpolicy_start(state->C.readpolicy, id);
     KFS_DO_OPER(ret = , subv, opendir, co, path, fi);
+    readpolicy_done(state->C.readpolicy, id, start, 0);
     if (ret != 0) {
         my_dirfh = KFS_FREE(my_dirfh);
     } else {
@@ -1851,69 +5366,28 @@ mirror_utimens(const kfs_context_t co, const char *path, const struct timespec
         tvnano[2])
 {
     struct mirror_state * const state = co->priv;
-    struct kfs_brick *subv = NULL;
-    struct {
-        struct stat stbuf;
-        time_t mtime;
-        uint_t valid;
-        struct timespec tvnano[2];
-    } backup = {.mtime = 0, .valid = 0};
-    uint_t *ids = NULL;
-    uint_t id = 0;
-    uint_t i = 0;
-    uint_t n = 0;
-    uint_t one_success = 0;
+    const struct mirror_op op = {.id = MOP_UTIMENS, .what = "utimens", .path =
+        path, .tvnano = tvnano};
+    /** Restores the old mtime in case of rollback (if possible). */
+    struct mirror_op undo = {.id = MOP_UTIMENS, .what = "utimens", .path =
+        path};
+    struct stat stbuf;
+    struct timespec backup[2];
     int ret = 0;
-    int tmp = 0;
 
     KFS_ENTER();
 
     /* Backup mtime. */
-    ret = mirror_getattr(co, path, &backup.stbuf);
+    ret = mirror_getattr(co, path, &stbuf);
     if (ret == 0) {
-        backup.mtime = backup.stbuf.st_mtime;
-        backup.valid = 1;
-    } else {
-        backup.valid = 0;
+        backup[0].tv_sec = stbuf.st_mtime;
+        backup[0].tv_nsec = 0;
+        backup[1].tv_sec = stbuf.st_mtime;
+        backup[1].tv_nsec = 0;
+        undo.tvnano = backup;
     }
     /* Perform time change on all subvols. */
-    ret = -ENOSUBVOLS;
-    n = get_all_active_subvols(state, &ids);
-    for (i = 0; i < n; i++) {
-        id = ids[i];
-        subv = C_get_subvol_by_ID(state, id);
-        KFS_DO_OPER(ret = , subv, utimens, co, path, tvnano);
-        if (ret == 0) {
-            one_success = 1;
-        } else if (one_success && backup.valid == 0) {
-            /* No possibility to rollback: eject this node and continue. */
-            KFS_ERROR("Changing a/mtime of `%s' failed midway at node `%s': "
-                "%s. Was unable to backup old mtime; rollback impossible, "
-                "continuing with operation.",
-                path, subv->name, strerror(-errno));
-            eject_subvolume(state, id);
-            ret = 0;
-        } else {
-            /* Rollback succesful subvolumes and abort operation. */
-            backup.tvnano[0].tv_sec = backup.mtime;
-            backup.tvnano[0].tv_nsec = 0;
-            backup.tvnano[1].tv_sec = backup.mtime;
-            backup.tvnano[1].tv_nsec = 0;
-            while (i--) {
-                id = ids[i];
-                subv = C_get_subvol_by_ID(state, id);
-                KFS_DO_OPER(tmp = , subv, utimens, co, path, backup.tvnano);
-                if (tmp != 0) {
-                    KFS_ERROR("While trying to roll back a failed `utimens' "
-                        "operation by reverting it: failed on `%s' from "
-                        "node `%s': %s", path, subv->name, strerror(-tmp));
-                    eject_subvolume(state, id);
-                }
-            }
-            break;
-        }
-    }
-    ids = KFS_FREE(ids);
+    ret = fanout_active(state, co, &op, ret == 0 ? &undo : NULL);
 
     KFS_RETURN(ret);
 }
@@ -1957,6 +5431,8 @@ static const struct kfs_operations handlers = {
     .ioctl = nosys_ioctl,
     .poll = nosys_poll,
 #endif
+    .fallocate = mirror_fallocate,
+    .copy_file_range = mirror_copy_file_range,
 };
 
 /**
@@ -1979,18 +5455,47 @@ new_state(const struct kfs_brick subvols[], uint_t n)
         s->C.subvols = KFS_MALLOC(size);
         if (s->C.subvols != NULL) {
             s->C.subvols = memcpy(s->C.subvols, subvols, size);
-            size = sizeof(*s->L.subvol_active) * n;
-            s->L.subvol_active = KFS_MALLOC(size);
-            if (s->L.subvol_active != NULL) {
+            s->L.active = new_active_set(n);
+            s->L.newest = s->L.active;
+            if (s->L.active != NULL) {
                 for (i = 0; i < n; i++) {
-                    s->L.subvol_active[i] = 1;
+                    s->L.active->map[i] = SUBVOL_ACTIVE;
+                    s->L.active->ids[i] = i;
+                }
+                s->L.active->num_active = n;
+                ret = kfs_mutex_init(&s->lock);
+                if (ret == 0) {
+                    ret = kfs_mutex_init(&s->files.lock);
+                    if (ret != 0) {
+                        kfs_mutex_destroy(&s->lock);
+                    }
                 }
-                ret = kfs_rwlock_init(&s->lock);
                 if (ret == 0) {
                     s->C.num_subvols = n;
+                    s->C.pool = NULL;
+                    s->C.readpolicy = NULL;
+                    s->C.stripe_threshold = 0;
+                    s->C.hedge_percentile = 0;
+                    s->C.hedge_pool = NULL;
+                    s->C.hedge_threads = 0;
+                    s->C.hedge_budget = 0;
+                    s->C.journal = NULL;
+                    s->C.resync_interval = 0;
+                    s->C.resync_bandwidth = 0;
+                    s->C.dirty = NULL;
+                    s->C.num_sync = n;
+                    s->C.max_lag_bytes = 0;
+                    s->C.max_lag = 0;
+                    s->C.write_quorum = 0;
+                    s->C.read_quorum = 1;
+                    s->lanes = NULL;
+                    s->hedge.ops = 0;
+                    s->hedge.hedges = 0;
+                    s->hedge.running = 0;
+                    s->files.head = NULL;
                     KFS_RETURN(s);
                 }
-                s->L.subvol_active = KFS_FREE(s->L.subvol_active);
+                s->L.active = KFS_FREE(s->L.active);
             }
             s->C.subvols = KFS_FREE(s->C.subvols);
         }
@@ -2006,10 +5511,56 @@ new_state(const struct kfs_brick subvols[], uint_t n)
 static struct mirror_state *
 del_state(struct mirror_state *s)
 {
+    struct active_set *prev = NULL;
+    uint_t i = 0;
+
     KFS_ENTER();
 
-    KFS_ASSERT(s->L.subvol_active != NULL);
-    s->L.subvol_active = KFS_FREE(s->L.subvol_active);
+    if (s->lanes != NULL) {
+        for (i = 0; i < s->C.num_subvols; i++) {
+            lane_wait(s, i);
+        }
+    }
+    if (s->C.num_sync < s->C.num_subvols) {
+        repl_stop(s);
+    }
+    if (s->C.resync_interval != 0) {
+        resync_stop(s);
+    }
+    if (s->C.num_sync < s->C.num_subvols) {
+        repl_free(s);
+    }
+    if (s->C.pool != NULL) {
+        s->C.pool = kfs_workqueue_del(s->C.pool);
+    }
+    if (s->lanes != NULL) {
+        lanes_free(s);
+    }
+    if (s->C.hedge_pool != NULL) {
+        s->C.hedge_pool = kfs_workqueue_del(s->C.hedge_pool);
+    }
+    if (s->C.hedge_percentile != 0) {
+        kfs_cond_destroy(&s->hedge.idle);
+        kfs_mutex_destroy(&s->hedge.lock);
+    }
+    if (s->C.readpolicy != NULL) {
+        s->C.readpolicy = readpolicy_del(s->C.readpolicy);
+    }
+    if (s->C.journal != NULL) {
+        s->C.journal = journal_close(s->C.journal);
+    }
+    if (s->C.dirty != NULL) {
+        s->C.dirty = dirtylog_close(s->C.dirty);
+    }
+    kfs_mutex_destroy(&s->files.lock);
+    kfs_mutex_destroy(&s->lock);
+    KFS_ASSERT(s->L.newest != NULL);
+    while (s->L.newest != NULL) {
+        prev = s->L.newest->prev;
+        s->L.newest = KFS_FREE(s->L.newest);
+        s->L.newest = prev;
+    }
+    s->L.active = NULL;
     KFS_ASSERT(s->C.subvols != NULL);
     s->C.subvols = KFS_FREE(s->C.subvols);
     KFS_ASSERT(s != NULL);
@@ -2019,6 +5570,56 @@ del_state(struct mirror_state *s)
 }
     
 
+/**
+ * Parse the read_weights option (a comma-separated list with one positive
+ * weight per subvolume) into weights. All weights are 1 if it is not set.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+get_weights(const char *conffile, const char *section, uint_t *weights,
+        uint_t n)
+{
+    char *str = NULL;
+    char *p = NULL;
+    char *end = NULL;
+    unsigned long w = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < n; i++) {
+        weights[i] = 1;
+    }
+    str = kfs_ini_gets(conffile, section, "read_weights");
+    if (str == NULL) {
+        KFS_RETURN(0);
+    }
+    p = str;
+    for (i = 0; i < n; i++) {
+        w = strtoul(p, &end, 10);
+        if (end == p || w == 0 || w > UINT_MAX / n) {
+            break;
+        }
+        weights[i] = w;
+        p = end + strspn(end, " \t");
+        if (*p == ',') {
+            p += 1;
+        } else {
+            i += 1;
+            break;
+        }
+    }
+    if (i != n || *p != '\0') {
+        KFS_ERROR("Brick %s: read_weights needs one positive weight per "
+                "subvolume.", section);
+        ret = -1;
+    }
+    str = KFS_FREE(str);
+
+    KFS_RETURN(ret);
+}
+
 /**
  * Global initialization. Requires exactly two subvolumes: the first one is the
  * origin, the second one is the cache.
@@ -2027,10 +5628,30 @@ static void *
 kfs_mirror_init(const char *conffile, const char *section, uint_t
         num_subvolumes, const struct kfs_brick subvolumes[])
 {
-    KFS_NASSERT((void) conffile);
-    (void) section;
-
     struct mirror_state *s = NULL;
+    uint_t weights[num_subvolumes];
+    char *policy = NULL;
+    char *consistency = NULL;
+    char *journal_path = NULL;
+    char *dirty_path = NULL;
+    char *replication = NULL;
+    uint64_t inactive = 0;
+    uint_t i = 0;
+    long num_threads = 0;
+    long stripe_threshold = 0;
+    long hedge_percentile = 0;
+    long hedge_budget = 0;
+    long hedge_threads = 0;
+    long journal_slots = 0;
+    long resync_interval = 0;
+    long resync_bandwidth = 0;
+    long dirty_max = 0;
+    long sync_replicas = 0;
+    long max_lag_bytes = 0;
+    long max_lag_seconds = 0;
+    long write_quorum = 0;
+    long read_quorum = 0;
+    int ret = 0;
 
     KFS_ENTER();
 
@@ -2039,7 +5660,247 @@ kfs_mirror_init(const char *conffile, const char *section, uint_t
         KFS_ERROR("At least one subvolume required by brick %s.", section);
         KFS_RETURN(NULL);
     }
+    num_threads = ini_getl(section, "fanout_threads", 4 * (num_subvolumes - 1),
+            conffile);
+    stripe_threshold = ini_getl(section, "stripe_threshold", 0, conffile);
+    hedge_percentile = ini_getl(section, "hedge_percentile", 0, conffile);
+    hedge_budget = ini_getl(section, "hedge_budget", 5, conffile);
+    hedge_threads = ini_getl(section, "hedge_threads", HEDGE_THREADS_DEFAULT,
+            conffile);
+    journal_slots = ini_getl(section, "journal_slots", JOURNAL_SLOTS_DEFAULT,
+            conffile);
+    resync_interval = ini_getl(section, "resync_interval", 0, conffile);
+    resync_bandwidth = ini_getl(section, "resync_bandwidth", 0, conffile);
+    dirty_max = ini_getl(section, "dirty_max", DIRTY_MAX_DEFAULT, conffile);
+    sync_replicas = ini_getl(section, "sync_replicas", 0, conffile);
+    max_lag_bytes = ini_getl(section, "max_lag_bytes", MAX_LAG_BYTES_DEFAULT,
+            conffile);
+    max_lag_seconds = ini_getl(section, "max_lag_seconds",
+            MAX_LAG_SECONDS_DEFAULT, conffile);
+    write_quorum = ini_getl(section, "write_quorum", 0, conffile);
+    read_quorum = ini_getl(section, "read_quorum", 1, conffile);
+    if (num_threads < 0 || stripe_threshold < 0 || hedge_percentile < 0 ||
+            hedge_percentile > 100 || hedge_budget < 0 || hedge_budget > 100 ||
+            hedge_threads <= 0 || hedge_threads > UINT_MAX ||
+            journal_slots <= 0 || resync_interval < 0 || resync_bandwidth <
+            0 || dirty_max < 0 || dirty_max > UINT_MAX || sync_replicas < 0 ||
+            max_lag_bytes < 0 || max_lag_seconds < 0 || write_quorum < 0 ||
+            (unsigned long) write_quorum > num_subvolumes || read_quorum < 0 ||
+            (unsigned long) read_quorum > num_subvolumes) {
+        KFS_ERROR("Illegal numeric option value in brick %s.", section);
+        KFS_RETURN(NULL);
+    }
+    ret = get_weights(conffile, section, weights, num_subvolumes);
+    if (ret != 0) {
+        KFS_RETURN(NULL);
+    }
     s = new_state(subvolumes, num_subvolumes);
+    if (s == NULL) {
+        KFS_RETURN(NULL);
+    }
+    policy = kfs_ini_gets(conffile, section, "read_policy");
+    s->C.readpolicy = readpolicy_new(policy == NULL ? "first" : policy,
+            num_subvolumes, weights);
+    if (policy != NULL) {
+        policy = KFS_FREE(policy);
+    }
+    if (s->C.readpolicy == NULL) {
+        s = del_state(s);
+        KFS_RETURN(NULL);
+    }
+    if (num_subvolumes > 1) {
+        s->C.stripe_threshold = stripe_threshold;
+        s->C.hedge_budget = hedge_budget;
+    }
+    if (num_subvolumes > 1 && hedge_percentile != 0) {
+        ret = kfs_mutex_init(&s->hedge.lock);
+        if (ret == 0) {
+            ret = kfs_cond_init(&s->hedge.idle);
+            if (ret != 0) {
+                kfs_mutex_destroy(&s->hedge.lock);
+            }
+        }
+        if (ret != 0) {
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+        /* del_state() destroys them from here on. */
+        s->C.hedge_percentile = hedge_percentile;
+        s->C.hedge_threads = hedge_threads;
+        s->C.hedge_pool = kfs_workqueue_new(hedge_threads);
+        if (s->C.hedge_pool == NULL) {
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (num_threads != 0 && num_subvolumes > 1) {
+        s->C.pool = kfs_workqueue_new(num_threads);
+        if (s->C.pool == NULL) {
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    }
+    consistency = kfs_ini_gets(conffile, section, "consistency");
+    if (consistency != NULL && strcmp(consistency, "journal") == 0) {
+        journal_path = kfs_ini_gets(conffile, section, "journal_path");
+        if (journal_path == NULL) {
+            KFS_ERROR("Brick %s: consistency = journal requires "
+                    "journal_path.", section);
+        } else if (num_subvolumes > JOURNAL_MAX_SUBVOLS) {
+            KFS_ERROR("Brick %s: consistency = journal supports at most %d "
+                    "subvolumes.", section, JOURNAL_MAX_SUBVOLS);
+        } else {
+            s->C.journal = journal_open(journal_path, journal_slots);
+            if (s->C.journal != NULL) {
+                ret = journal_replay(s->C.journal, repair_range, s);
+                if (ret != 0) {
+                    KFS_ERROR("Could not replay mirror journal %s: %s",
+                            journal_path, strerror(-ret));
+                    s->C.journal = journal_close(s->C.journal);
+                }
+            }
+        }
+        if (journal_path != NULL) {
+            journal_path = KFS_FREE(journal_path);
+        }
+        if (s->C.journal == NULL) {
+            consistency = KFS_FREE(consistency);
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    } else if (consistency != NULL && strcmp(consistency, "backup") != 0) {
+        KFS_ERROR("Unknown consistency mode for brick %s: %s.", section,
+                consistency);
+        consistency = KFS_FREE(consistency);
+        s = del_state(s);
+        KFS_RETURN(NULL);
+    }
+    if (consistency != NULL) {
+        consistency = KFS_FREE(consistency);
+    }
+    if (resync_interval != 0 && num_subvolumes > 1 && dirty_max != 0) {
+        dirty_path = kfs_ini_gets(conffile, section, "dirty_log");
+        if (num_subvolumes > DIRTYLOG_MAX_SUBVOLS) {
+            KFS_INFO("Brick %s: not tracking changes for resync, that is "
+                    "supported for at most %d subvolumes.", section,
+                    DIRTYLOG_MAX_SUBVOLS);
+        } else {
+            s->C.dirty = dirtylog_open(dirty_path, dirty_max);
+            if (s->C.dirty == NULL) {
+                if (dirty_path != NULL) {
+                    dirty_path = KFS_FREE(dirty_path);
+                }
+                s = del_state(s);
+                KFS_RETURN(NULL);
+            }
+        }
+        if (dirty_path != NULL) {
+            dirty_path = KFS_FREE(dirty_path);
+        }
+    }
+    if (s->C.dirty != NULL) {
+        /* Subvolumes that were out when the brick was halted still are. */
+        inactive = dirtylog_get_inactive(s->C.dirty);
+        for (i = 0; i < DIRTYLOG_MAX_SUBVOLS; i++) {
+            if (!(inactive >> i & 1)) {
+                continue;
+            }
+            if (i >= num_subvolumes) {
+                dirtylog_admit(s->C.dirty, i);
+                continue;
+            }
+            KFS_INFO("Subvolume %s was ejected before the brick was halted, "
+                    "leaving it out until it is resynchronised.",
+                    subvolumes[i].name);
+            if (update_active_set(s, i, SUBVOL_INACTIVE, 0) < 0) {
+                s = del_state(s);
+                KFS_RETURN(NULL);
+            }
+        }
+    }
+    ret = 0;
+    replication = kfs_ini_gets(conffile, section, "replication");
+    if (replication != NULL && strcmp(replication, "async") == 0) {
+        if (resync_interval == 0 || (unsigned long) sync_replicas + 1 >=
+                num_subvolumes) {
+            KFS_ERROR("Brick %s: replication = async requires "
+                    "resync_interval and more than 1 + sync_replicas "
+                    "subvolumes.", section);
+            ret = -EINVAL;
+        } else {
+            s->C.num_sync = sync_replicas + 1;
+            s->C.max_lag_bytes = max_lag_bytes;
+            s->C.max_lag = (uint64_t) max_lag_seconds * 1000000000;
+            ret = repl_start(s);
+            if (ret != 0) {
+                KFS_ERROR("Could not start the replication thread of brick "
+                        "%s: %s", section, strerror(-ret));
+                s->C.num_sync = num_subvolumes;
+            }
+        }
+    } else if (replication != NULL && strcmp(replication, "sync") != 0) {
+        KFS_ERROR("Unknown replication mode for brick %s: %s.", section,
+                replication);
+        ret = -EINVAL;
+    }
+    if (replication != NULL) {
+        replication = KFS_FREE(replication);
+    }
+    if (ret != 0) {
+        s = del_state(s);
+        KFS_RETURN(NULL);
+    }
+    for (i = s->C.num_sync; i < num_subvolumes; i++) {
+        if (get_active_set(s)->map[i] == SUBVOL_INACTIVE) {
+            continue;
+        }
+        if (s->C.dirty != NULL && dirtylog_was_clean(s->C.dirty)) {
+            ret = update_active_set(s, i, SUBVOL_REPLICA, 0);
+        } else {
+            /* The modifications that were still queued are lost. */
+            KFS_INFO("Replica %s may have missed modifications, leaving it "
+                    "out until it is resynchronised.", subvolumes[i].name);
+            ret = update_active_set(s, i, SUBVOL_INACTIVE, 0);
+            if (ret >= 0 && s->C.dirty != NULL) {
+                dirtylog_invalidate(s->C.dirty, i);
+            }
+        }
+        if (ret < 0) {
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    }
+    s->C.read_quorum = MAX(read_quorum, 1);
+    if (write_quorum != 0 && num_subvolumes > 1) {
+        if (s->C.pool == NULL || s->C.journal != NULL ||
+                (unsigned long) write_quorum > s->C.num_sync) {
+            KFS_ERROR("Brick %s: write_quorum requires fanout_threads, "
+                    "consistency = backup and no more than the number of "
+                    "subvolumes that are written synchronously.", section);
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+        s->C.write_quorum = write_quorum;
+        ret = lanes_start(s);
+        if (ret != 0) {
+            KFS_ERROR("Could not set up the write quorum of brick %s: %s",
+                    section, strerror(-ret));
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (resync_interval != 0 && num_subvolumes > 1) {
+        s->C.resync_interval = (uint64_t) resync_interval * 1000000000;
+        s->C.resync_bandwidth = resync_bandwidth;
+        ret = resync_start(s);
+        if (ret != 0) {
+            KFS_ERROR("Could not start the resync thread of brick %s: %s",
+                    section, strerror(-ret));
+            s->C.resync_interval = 0;
+            s = del_state(s);
+            KFS_RETURN(NULL);
+        }
+    }
 
     KFS_RETURN(s);
 }
@@ -2068,7 +5929,6 @@ kfs_mirror_halt(void *private_data)
 
     KFS_ENTER();
 
-    kfs_rwlock_destroy(&state->lock);
     state = del_state(state);
 
     KFS_RETURN();
@@ -0,0 +1,430 @@
+/**
+ * Read selection policies for the mirror brick: decide which of the active
+ * subvolumes serves a read-only operation. Every subvolume holds the same data,
+ * so spreading reads over all of them makes read throughput scale with the
+ * number of replicas.
+ *
+ * Available policies:
+ *
+ * - first: always the lowest-numbered active subvolume (the historical
+ *   behaviour).
+ * - roundrobin: every active subvolume in turn.
+ * - leastload: the subvolume with the fewest reads in progress.
+ * - latency: the subvolume with the lowest expected waiting time: its average
+ *   (EWMA) latency times the number of reads in progress plus one.
+ * - weighted: every subvolume in turn, proportional to static weights.
+ *
+ * The bookkeeping (readpolicy_start() / readpolicy_done()) is done for every
+ * policy and uses atomic operations only: no locks on the read path. It also
+ * measures the throughput of every subvolume, which is used to divide striped
+ * reads (see readpolicy_throughput()), and keeps a latency histogram, which
+ * decides when a read is slow enough to hedge (see readpolicy_percentile()).
+ */
+
+#include "mirror_brick/readpolicy.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+/** Weight of a new sample in the latency average: 1 / 2^EWMA_SHIFT. */
+#define EWMA_SHIFT 3
+/**
+ * Latency histogram: four buckets per power of two nanoseconds, covering
+ * everything a uint64_t can hold.
+ */
+#define HIST_BUCKETS (64 * 4)
+/** Halve the histogram every this many samples, so old behaviour fades. */
+#define HIST_WINDOW 2048
+/** No percentiles are estimated from fewer samples than this. */
+#define HIST_MIN 64
+
+struct subvol_load {
+    /** Number of reads in progress. */
+    uint_t outstanding;
+    /** Exponentially weighted moving average of the latency (ns, 0: none). */
+    uint64_t ewma_ns;
+    /** Same, for the throughput of reads that returned data (bytes/s). */
+    uint64_t ewma_bps;
+    uint_t hist[HIST_BUCKETS];
+    /** Number of samples added to hist since startup. */
+    uint_t samples;
+    uint_t weight;
+};
+
+struct readpolicy_policy {
+    const char *name;
+    /** Return the index in ids of the subvolume to use (n > 0). */
+    uint_t (* pick)(struct readpolicy *rp, const uint_t *ids, uint_t n);
+};
+
+struct readpolicy {
+    const struct readpolicy_policy *policy;
+    struct subvol_load *subvols;
+    uint_t num_subvols;
+    /** Incremented on every pick, for policies that take turns. */
+    uint_t turn;
+};
+
+static uint_t
+first_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    (void) rp;
+    (void) ids;
+    (void) n;
+
+    KFS_ENTER();
+
+    KFS_RETURN(0);
+}
+
+static uint_t
+roundrobin_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    (void) ids;
+
+    KFS_ENTER();
+
+    KFS_RETURN(kfs_atomic_add(&rp->turn, 1) % n);
+}
+
+static uint_t
+leastload_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    uint_t start = 0;
+    uint_t best = 0;
+    uint_t load = 0;
+    uint_t i = 0;
+    uint_t j = 0;
+
+    KFS_ENTER();
+
+    /* Start at a different subvolume every time to spread ties. */
+    start = kfs_atomic_add(&rp->turn, 1) % n;
+    best = start;
+    for (i = 1; i < n; i++) {
+        j = (start + i) % n;
+        load = rp->subvols[ids[j]].outstanding;
+        if (load < rp->subvols[ids[best]].outstanding) {
+            best = j;
+        }
+    }
+
+    KFS_RETURN(best);
+}
+
+static uint_t
+latency_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    const struct subvol_load *s = NULL;
+    uint64_t cost = 0;
+    uint64_t bestcost = UINT64_MAX;
+    uint_t start = 0;
+    uint_t best = 0;
+    uint_t i = 0;
+    uint_t j = 0;
+
+    KFS_ENTER();
+
+    start = kfs_atomic_add(&rp->turn, 1) % n;
+    for (i = 0; i < n; i++) {
+        j = (start + i) % n;
+        s = &rp->subvols[ids[j]];
+        if (s->ewma_ns == 0) {
+            /* No measurements yet: try it. */
+            KFS_RETURN(j);
+        }
+        cost = s->ewma_ns * (s->outstanding + 1);
+        if (cost < bestcost) {
+            bestcost = cost;
+            best = j;
+        }
+    }
+
+    KFS_RETURN(best);
+}
+
+static uint_t
+weighted_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    uint_t total = 0;
+    uint_t x = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < n; i++) {
+        total += rp->subvols[ids[i]].weight;
+    }
+    if (total == 0) {
+        KFS_RETURN(0);
+    }
+    x = kfs_atomic_add(&rp->turn, 1) % total;
+    for (i = 0; i < n; i++) {
+        if (x < rp->subvols[ids[i]].weight) {
+            break;
+        }
+        x -= rp->subvols[ids[i]].weight;
+    }
+    KFS_ASSERT(i < n);
+
+    KFS_RETURN(i);
+}
+
+static const struct readpolicy_policy policies[] = {
+    {"first", first_pick},
+    {"roundrobin", roundrobin_pick},
+    {"leastload", leastload_pick},
+    {"latency", latency_pick},
+    {"weighted", weighted_pick},
+};
+
+/**
+ * Create a read selection policy by name for num_subvols subvolumes. The
+ * weights are only used by the weighted policy and default to 1 if NULL.
+ * Returns NULL on failure (including unknown policies).
+ */
+struct readpolicy *
+readpolicy_new(const char *policy, uint_t num_subvols, const uint_t *weights)
+{
+    struct readpolicy *rp = NULL;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(policy != NULL && num_subvols > 0);
+    rp = KFS_MALLOC(sizeof(*rp));
+    if (rp == NULL) {
+        KFS_RETURN(NULL);
+    }
+    rp->policy = NULL;
+    for (i = 0; i < NUMELEM(policies); i++) {
+        if (strcmp(policies[i].name, policy) == 0) {
+            rp->policy = &policies[i];
+            break;
+        }
+    }
+    if (rp->policy == NULL) {
+        KFS_ERROR("Unknown read policy: %s.", policy);
+        rp = KFS_FREE(rp);
+        KFS_RETURN(NULL);
+    }
+    rp->subvols = KFS_CALLOC(num_subvols, sizeof(*rp->subvols));
+    if (rp->subvols == NULL) {
+        rp = KFS_FREE(rp);
+        KFS_RETURN(NULL);
+    }
+    for (i = 0; i < num_subvols; i++) {
+        rp->subvols[i].weight = weights == NULL ? 1 : weights[i];
+    }
+    rp->num_subvols = num_subvols;
+    rp->turn = 0;
+
+    KFS_RETURN(rp);
+}
+
+struct readpolicy *
+readpolicy_del(struct readpolicy *rp)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(rp != NULL);
+    rp->subvols = KFS_FREE(rp->subvols);
+    rp = KFS_FREE(rp);
+
+    KFS_RETURN(rp);
+}
+
+/**
+ * Choose one of the n (> 0) given subvolume ids for a read. Returns its index
+ * in ids.
+ */
+uint_t
+readpolicy_pick(struct readpolicy *rp, const uint_t *ids, uint_t n)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(n > 0);
+    i = rp->policy->pick(rp, ids, n);
+    KFS_ASSERT(i < n);
+
+    KFS_RETURN(i);
+}
+
+/**
+ * Register the start of a read on given subvolume. Pass the return value to
+ * readpolicy_done() when it is finished.
+ */
+uint64_t
+readpolicy_start(struct readpolicy *rp, uint_t id)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(id < rp->num_subvols);
+    kfs_atomic_add(&rp->subvols[id].outstanding, 1);
+
+    KFS_RETURN(kfs_clock_ns());
+}
+
+/**
+ * Add a sample (> 0) to a moving average.
+ */
+static void
+ewma_update(uint64_t *ewma, uint64_t sample)
+{
+    uint64_t old = 0;
+    uint64_t avg = 0;
+
+    KFS_ENTER();
+
+    do {
+        old = *ewma;
+        if (old == 0) {
+            avg = sample;
+        } else {
+            avg = old - (old >> EWMA_SHIFT) + (sample >> EWMA_SHIFT);
+            avg = MAX(avg, 1);
+        }
+    } while (kfs_atomic_cas(ewma, old, avg) == 0);
+
+    KFS_RETURN();
+}
+
+/**
+ * Histogram bucket of given latency: the (floored) base 2 logarithm followed by
+ * the two bits after the most significant one.
+ */
+static uint_t
+hist_bucket(uint64_t ns)
+{
+    uint_t e = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(ns > 0);
+    e = 63 - __builtin_clzll(ns);
+    if (e < 2) {
+        KFS_RETURN(e * 4);
+    }
+
+    KFS_RETURN(e * 4 + ((ns >> (e - 2)) & 3));
+}
+
+/**
+ * Upper bound (inclusive) of the latencies in given bucket.
+ */
+static uint64_t
+hist_limit(uint_t bucket)
+{
+    const uint_t e = bucket / 4;
+
+    KFS_ENTER();
+
+    if (e < 2) {
+        KFS_RETURN(((uint64_t) 2 << e) - 1);
+    }
+    if (e == 63 && bucket % 4 == 3) {
+        KFS_RETURN(UINT64_MAX);
+    }
+
+    KFS_RETURN(((uint64_t) (4 + bucket % 4 + 1) << (e - 2)) - 1);
+}
+
+static void
+hist_add(struct subvol_load *s, uint64_t ns)
+{
+    uint_t samples = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    kfs_atomic_add(&s->hist[hist_bucket(ns)], 1);
+    samples = kfs_atomic_add(&s->samples, 1);
+    if (samples % HIST_WINDOW == 0) {
+        /* Not atomic as a whole, but the odd lost sample does not matter. */
+        for (i = 0; i < HIST_BUCKETS; i++) {
+            s->hist[i] /= 2;
+        }
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Register the end of a read on given subvolume that returned given number of
+ * bytes (0 for operations other than read(), or on error).
+ */
+void
+readpolicy_done(struct readpolicy *rp, uint_t id, uint64_t start, size_t bytes)
+{
+    struct subvol_load * const s = &rp->subvols[id];
+    uint64_t elapsed = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id < rp->num_subvols);
+    elapsed = kfs_clock_ns() - start;
+    elapsed = MAX(elapsed, 1);
+    ewma_update(&s->ewma_ns, elapsed);
+    hist_add(s, elapsed);
+    if (bytes != 0) {
+        ewma_update(&s->ewma_bps, (uint64_t) bytes * 1000000000 / elapsed + 1);
+    }
+    kfs_atomic_add(&s->outstanding, (uint_t) -1);
+
+    KFS_RETURN();
+}
+
+/**
+ * Measured read throughput of given subvolume in bytes per second, 0 if
+ * unknown.
+ */
+uint64_t
+readpolicy_throughput(struct readpolicy *rp, uint_t id)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(id < rp->num_subvols);
+
+    KFS_RETURN(rp->subvols[id].ewma_bps);
+}
+
+/**
+ * Estimate the latency (in ns) that pct percent of all reads on given subvolume
+ * stay below. Returns 0 if there are not enough measurements yet.
+ */
+uint64_t
+readpolicy_percentile(struct readpolicy *rp, uint_t id, uint_t pct)
+{
+    const struct subvol_load * const s = &rp->subvols[id];
+    uint64_t total = 0;
+    uint64_t target = 0;
+    uint64_t sum = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(id < rp->num_subvols && pct <= 100);
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        total += s->hist[i];
+    }
+    if (total < HIST_MIN) {
+        KFS_RETURN(0);
+    }
+    target = (total * pct + 99) / 100;
+    for (i = 0; i < HIST_BUCKETS; i++) {
+        sum += s->hist[i];
+        if (sum >= target) {
+            break;
+        }
+    }
+
+    KFS_RETURN(hist_limit(MIN(i, HIST_BUCKETS - 1)));
+}
@@ -0,0 +1,21 @@
+#ifndef KFS_MIRROR_BRICK_READPOLICY_H
+#define KFS_MIRROR_BRICK_READPOLICY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "kfs.h"
+
+struct readpolicy;
+
+struct readpolicy * readpolicy_new(const char *policy, uint_t num_subvols,
+        const uint_t *weights);
+struct readpolicy * readpolicy_del(struct readpolicy *rp);
+uint_t readpolicy_pick(struct readpolicy *rp, const uint_t *ids, uint_t n);
+uint64_t readpolicy_start(struct readpolicy *rp, uint_t id);
+void readpolicy_done(struct readpolicy *rp, uint_t id, uint64_t start, size_t
+        bytes);
+uint64_t readpolicy_throughput(struct readpolicy *rp, uint_t id);
+uint64_t readpolicy_percentile(struct readpolicy *rp, uint_t id, uint_t pct);
+
+#endif
@@ -526,6 +526,36 @@ pass_poll(const kfs_context_t co, const char *path, struct fuse_file_info *fi,
 }
 #endif
 
+static int
+pass_fallocate(const kfs_context_t co, const char *path, int mode, off_t
+        offset, off_t len, struct fuse_file_info *fi)
+{
+    struct kfs_brick * const subv = co->priv;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_DO_OPER(ret = , subv, fallocate, co, path, mode, offset, len, fi);
+
+    KFS_RETURN(ret);
+}
+
+static int
+pass_copy_file_range(const kfs_context_t co, const char *path_in, struct
+        fuse_file_info *fi_in, off_t offset_in, const char *path_out, struct
+        fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    struct kfs_brick * const subv = co->priv;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_DO_OPER(ret = , subv, copy_file_range, co, path_in, fi_in, offset_in,
+            path_out, fi_out, offset_out, size, flags);
+
+    KFS_RETURN(ret);
+}
+
 static const struct kfs_operations handlers = {
     .getattr = pass_getattr,
     .readlink = pass_readlink,
@@ -565,6 +595,8 @@ static const struct kfs_operations handlers = {
     .ioctl = pass_ioctl,
     .poll = pass_poll,
 #endif
+    .fallocate = pass_fallocate,
+    .copy_file_range = pass_copy_file_range,
 };
 
 /**
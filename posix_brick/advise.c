@@ -0,0 +1,306 @@
+/**
+ * Access pattern hints for the POSIX brick: watches the reads of every open
+ * file and tells the kernel what to expect with posix_fadvise() and
+ * readahead().
+ *
+ * - Sequential reads: the file is marked sequential (a larger read-ahead
+ *   window) and read ahead well before the reader gets there. With
+ *   drop_behind, if the stream started at the beginning and nothing was read
+ *   twice (a backup, a copy), what it leaves behind is dropped from the page
+ *   cache, so it does not push out everything else. That is not the default:
+ *   the pages are dropped for everybody reading the file, not just this
+ *   stream.
+ * - Reads with a fixed stride: the next few are announced with WILLNEED.
+ * - Reads without any pattern: read-ahead is turned off, it would only waste
+ *   I/O.
+ *
+ * The history is kept in a table indexed by file descriptor; higher file
+ * descriptors are not tracked. The system calls are made outside the locks.
+ */
+
+/* Macro is necessary to get readahead(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/advise.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+/** File descriptors below this have their reads tracked. */
+#define ADVISE_FDS 4096
+/** Number of locks the table is divided over. */
+#define ADVISE_LOCKS 64
+/** Consecutive sequential reads before a file is considered streamed. */
+#define SEQ_THRESHOLD 4
+/** Consecutive reads with the same stride before they are announced. */
+#define STRIDE_THRESHOLD 3
+/** Number of strided reads announced in advance. */
+#define STRIDE_AHEAD 4
+/** Consecutive reads without a pattern before read-ahead is turned off. */
+#define RANDOM_THRESHOLD 8
+/** How far ahead of a sequential reader the kernel is asked to read. */
+#define READAHEAD_WINDOW (4 << 20)
+/** What a one-shot stream leaves behind is dropped in chunks of this. */
+#define DROP_CHUNK (8 << 20)
+
+enum advice {
+    ADVICE_NORMAL,
+    ADVICE_SEQUENTIAL,
+    ADVICE_RANDOM,
+};
+
+/** A system call decided on under the lock, made after it. */
+struct hint {
+    /** POSIX_FADV_*, or -1 for readahead(). */
+    int advice;
+    off_t offset;
+    off_t len;
+};
+
+struct access_hist {
+    /** End of the last read: where a sequential read would start. */
+    off_t next;
+    /** Start of the last read, and its distance from the one before. */
+    off_t last;
+    off_t stride;
+    /** End of the furthest read so far. */
+    off_t high;
+    uint_t seq_run;
+    uint_t stride_run;
+    uint_t random_run;
+    /** Read from the start without ever going back. */
+    uint_t oneshot;
+    enum advice advice;
+    /** Read-ahead was requested up to here. */
+    off_t ra_end;
+    /** Everything before this was dropped from the page cache. */
+    off_t dropped;
+};
+
+struct advisor {
+    /** Drop what one-shot streams leave behind from the page cache. */
+    uint_t drop_behind;
+    struct access_hist hist[ADVISE_FDS];
+    kfs_mutex_t locks[ADVISE_LOCKS];
+};
+
+/**
+ * Returns NULL on failure.
+ */
+struct advisor *
+advisor_new(uint_t drop_behind)
+{
+    struct advisor *adv = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    adv = KFS_CALLOC(1, sizeof(*adv));
+    if (adv == NULL) {
+        KFS_RETURN(NULL);
+    }
+    for (i = 0; i < ADVISE_LOCKS; i++) {
+        ret = kfs_mutex_init(&adv->locks[i]);
+        if (ret != 0) {
+            while (i-- > 0) {
+                kfs_mutex_destroy(&adv->locks[i]);
+            }
+            adv = KFS_FREE(adv);
+            KFS_RETURN(NULL);
+        }
+    }
+    adv->drop_behind = drop_behind;
+
+    KFS_RETURN(adv);
+}
+
+struct advisor *
+advisor_del(struct advisor *adv)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(adv != NULL);
+    for (i = 0; i < ADVISE_LOCKS; i++) {
+        kfs_mutex_destroy(&adv->locks[i]);
+    }
+    adv = KFS_FREE(adv);
+
+    KFS_RETURN(NULL);
+}
+
+static void
+give_hints(int fd, const struct hint *hints, uint_t num_hints)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = 0; i < num_hints; i++) {
+#ifdef __linux__
+        if (hints[i].advice == -1) {
+            readahead(fd, hints[i].offset, hints[i].len);
+            continue;
+        }
+#endif
+        posix_fadvise(fd, hints[i].offset, hints[i].len,
+                hints[i].advice == -1 ? POSIX_FADV_WILLNEED : hints[i].advice);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Start tracking a newly opened file.
+ */
+void
+advise_open(struct advisor *adv, int fd)
+{
+    struct access_hist *h = NULL;
+
+    KFS_ENTER();
+
+    if (fd < 0 || fd >= ADVISE_FDS) {
+        KFS_RETURN();
+    }
+    h = &adv->hist[fd];
+    kfs_mutex_lock(&adv->locks[fd % ADVISE_LOCKS]);
+    memset(h, 0, sizeof(*h));
+    h->oneshot = 1;
+    h->advice = ADVICE_NORMAL;
+    kfs_mutex_unlock(&adv->locks[fd % ADVISE_LOCKS]);
+
+    KFS_RETURN();
+}
+
+/**
+ * Record a read that is about to be done, and give the kernel hints if a
+ * pattern shows.
+ */
+void
+advise_read(struct advisor *adv, int fd, off_t offset, size_t size)
+{
+    struct access_hist *h = NULL;
+    struct hint hints[STRIDE_AHEAD + 2];
+    const off_t end = offset + size;
+    off_t stride = 0;
+    uint_t num_hints = 0;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    if (fd < 0 || fd >= ADVISE_FDS) {
+        KFS_RETURN();
+    }
+    h = &adv->hist[fd];
+    kfs_mutex_lock(&adv->locks[fd % ADVISE_LOCKS]);
+    if (offset == h->next) {
+        h->seq_run++;
+        h->stride_run = h->random_run = 0;
+    } else {
+        stride = offset - h->last;
+        h->seq_run = 0;
+        if (stride != 0 && stride == h->stride) {
+            h->stride_run++;
+            h->random_run = 0;
+        } else {
+            h->stride = stride;
+            h->stride_run = 0;
+            h->random_run++;
+        }
+        if (offset < h->high) {
+            /* Read again: the pages are worth keeping. */
+            h->oneshot = 0;
+        }
+    }
+    h->last = offset;
+    h->next = end;
+    h->high = MAX(h->high, end);
+    if (h->seq_run >= SEQ_THRESHOLD) {
+        if (h->advice != ADVICE_SEQUENTIAL) {
+            hints[num_hints].advice = POSIX_FADV_SEQUENTIAL;
+            hints[num_hints].offset = hints[num_hints].len = 0;
+            num_hints++;
+            h->advice = ADVICE_SEQUENTIAL;
+            h->ra_end = end;
+        }
+        if (h->ra_end < end + READAHEAD_WINDOW / 2) {
+            h->ra_end = MAX(h->ra_end, end);
+            hints[num_hints].advice = -1;
+            hints[num_hints].offset = h->ra_end;
+            hints[num_hints].len = end + READAHEAD_WINDOW - h->ra_end;
+            num_hints++;
+            h->ra_end = end + READAHEAD_WINDOW;
+        }
+        if (adv->drop_behind && h->oneshot && offset - h->dropped >=
+                DROP_CHUNK) {
+            hints[num_hints].advice = POSIX_FADV_DONTNEED;
+            hints[num_hints].offset = h->dropped;
+            hints[num_hints].len = offset - h->dropped;
+            num_hints++;
+            h->dropped = offset;
+        }
+    } else if (h->stride_run >= STRIDE_THRESHOLD) {
+        /* Announce all of them at first, then one more every time. */
+        i = h->stride_run == STRIDE_THRESHOLD ? 1 : STRIDE_AHEAD;
+        for (; i <= STRIDE_AHEAD; i++) {
+            if (offset + (off_t) i * h->stride < 0) {
+                break;
+            }
+            hints[num_hints].advice = POSIX_FADV_WILLNEED;
+            hints[num_hints].offset = offset + (off_t) i * h->stride;
+            hints[num_hints].len = size;
+            num_hints++;
+        }
+    } else if (h->random_run >= RANDOM_THRESHOLD &&
+            h->advice != ADVICE_RANDOM) {
+        hints[num_hints].advice = POSIX_FADV_RANDOM;
+        hints[num_hints].offset = hints[num_hints].len = 0;
+        num_hints++;
+        h->advice = ADVICE_RANDOM;
+    }
+    kfs_mutex_unlock(&adv->locks[fd % ADVISE_LOCKS]);
+    give_hints(fd, hints, num_hints);
+
+    KFS_RETURN();
+}
+
+/**
+ * Stop tracking a file that is about to be closed. With drop_behind, the rest
+ * of a one-shot stream is dropped from the page cache.
+ */
+void
+advise_close(struct advisor *adv, int fd)
+{
+    struct access_hist *h = NULL;
+    struct hint hint;
+    uint_t num_hints = 0;
+
+    KFS_ENTER();
+
+    if (fd < 0 || fd >= ADVISE_FDS) {
+        KFS_RETURN();
+    }
+    h = &adv->hist[fd];
+    kfs_mutex_lock(&adv->locks[fd % ADVISE_LOCKS]);
+    if (adv->drop_behind && h->oneshot && h->advice == ADVICE_SEQUENTIAL) {
+        hint.advice = POSIX_FADV_DONTNEED;
+        hint.offset = h->dropped;
+        hint.len = 0;
+        num_hints = 1;
+    }
+    memset(h, 0, sizeof(*h));
+    kfs_mutex_unlock(&adv->locks[fd % ADVISE_LOCKS]);
+    give_hints(fd, &hint, num_hints);
+
+    KFS_RETURN();
+}
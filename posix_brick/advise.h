@@ -0,0 +1,17 @@
+#ifndef KFS_POSIX_BRICK_ADVISE_H
+#define KFS_POSIX_BRICK_ADVISE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+
+struct advisor;
+
+struct advisor * advisor_new(uint_t drop_behind);
+struct advisor * advisor_del(struct advisor *adv);
+void advise_open(struct advisor *adv, int fd);
+void advise_read(struct advisor *adv, int fd, off_t offset, size_t size);
+void advise_close(struct advisor *adv, int fd);
+
+#endif
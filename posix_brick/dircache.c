@@ -0,0 +1,531 @@
+/**
+ * Directory file descriptor cache: keeps the most recently used directories of
+ * a POSIX brick open (O_PATH where available), so operations can be done with
+ * the *at() system calls relative to their parent directory. That saves the
+ * kernel from walking the entire path again for every operation.
+ *
+ * Directories are opened relative to the root of the brick and may not go
+ * outside of it: ".." components that would leave the root and symbolic links
+ * that point outside of it are refused with EXDEV. That needs openat2(); on
+ * older kernels only ".." is refused, altogether. Only directories that
+ * were reached without following symbolic links are cached, so removing or
+ * replacing a symbolic link never leaves a stale entry. Directories that are
+ * removed or renamed through the brick must be forgotten by the caller; those
+ * changed behind the brick's back are not noticed.
+ *
+ * A hash table for lookups plus a doubly linked list in order of use. Entries
+ * are reference counted: one that is in use is never closed, the table simply
+ * grows past its maximum size until it is returned.
+ */
+
+/* Macro is necessary to get O_PATH and syscall(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/dircache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  ifdef SYS_openat2
+#    include <linux/openat2.h>
+#  endif
+#endif
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#ifndef O_PATH
+#  define O_PATH O_RDONLY
+#endif
+#ifndef O_CLOEXEC
+#  define O_CLOEXEC 0
+#endif
+
+struct dircache_entry {
+    /** Next entry in the same hash bucket. */
+    struct dircache_entry *next;
+    /** Neighbours in order of use. */
+    struct dircache_entry *newer;
+    struct dircache_entry *older;
+    uint64_t hash;
+    int fd;
+    /** Number of references handed out by dircache_get(). */
+    uint_t refs;
+    /** Removed from the cache while in use: closed by the last reference. */
+    uint_t dropped;
+    size_t len;
+    /** Path relative to the root of the brick, starting with a slash. */
+    char path[];
+};
+
+struct dircache {
+    int rootfd;
+    uint_t max_entries;
+    uint_t num_entries;
+    uint_t num_buckets;
+    struct dircache_entry **buckets;
+    struct dircache_entry *newest;
+    struct dircache_entry *oldest;
+    /** Set once openat2() turned out not to be supported by the kernel. */
+    uint_t no_openat2;
+    /**
+     * Bumped by every dircache_forget(). A directory opened without the lock
+     * is only inserted if this did not change in the meantime.
+     */
+    uint64_t changes;
+    kfs_mutex_t lock;
+};
+
+static uint64_t
+hash_path(const char *path, size_t len)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    KFS_ENTER();
+
+    while (len-- > 0) {
+        hash ^= (unsigned char) *path++;
+        hash *= 0x100000001b3ULL;
+    }
+
+    KFS_RETURN(hash);
+}
+
+/**
+ * Check if given relative path has a ".." component.
+ */
+static int
+has_dotdot(const char *path)
+{
+    KFS_ENTER();
+
+    while (*path != '\0') {
+        if (path[0] == '.' && path[1] == '.' &&
+                (path[2] == '/' || path[2] == '\0')) {
+            KFS_RETURN(1);
+        }
+        path = strchr(path, '/');
+        if (path == NULL) {
+            break;
+        }
+        path++;
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Open given directory relative to the root one component at a time, without
+ * following symbolic links. Returns the file descriptor or -errno: -ENOTDIR
+ * (or -ELOOP) if one of the components is a symbolic link.
+ */
+static int
+open_nofollow(int rootfd, const char *rel)
+{
+    char name[NAME_MAX + 1];
+    const char *end = NULL;
+    int dirfd = rootfd;
+    int fd = 0;
+    int err = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(*rel != '\0');
+    while (*rel != '\0') {
+        end = strchrnul(rel, '/');
+        if (end - rel > NAME_MAX) {
+            fd = -1;
+            err = ENAMETOOLONG;
+        } else {
+            memcpy(name, rel, end - rel);
+            name[end - rel] = '\0';
+            fd = openat(dirfd, name, O_PATH | O_DIRECTORY | O_NOFOLLOW |
+                    O_CLOEXEC);
+            err = errno;
+        }
+        if (dirfd != rootfd) {
+            close(dirfd);
+        }
+        if (fd == -1) {
+            KFS_RETURN(-err);
+        }
+        dirfd = fd;
+        rel = *end == '/' ? end + 1 : end;
+    }
+
+    KFS_RETURN(dirfd);
+}
+
+/**
+ * Open given directory (relative to the root, starting with a slash). Sets
+ * *cacheable if the directory was reached without following symbolic links.
+ * Returns the file descriptor or -errno.
+ */
+static int
+open_dir(struct dircache *dc, const char *path, uint_t *cacheable)
+{
+    const char *rel = path + 1;
+    int fd = 0;
+#ifdef SYS_openat2
+    struct open_how how;
+#endif
+
+    KFS_ENTER();
+
+    KFS_ASSERT(path[0] == '/');
+    *cacheable = 1;
+#ifdef SYS_openat2
+    if (!kfs_atomic_load(&dc->no_openat2)) {
+        memset(&how, 0, sizeof(how));
+        how.flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS |
+            RESOLVE_NO_SYMLINKS;
+        fd = syscall(SYS_openat2, dc->rootfd, rel, &how, sizeof(how));
+        if (fd == -1 && errno == ELOOP) {
+            *cacheable = 0;
+            how.resolve &= ~RESOLVE_NO_SYMLINKS;
+            fd = syscall(SYS_openat2, dc->rootfd, rel, &how, sizeof(how));
+        }
+        if (fd != -1) {
+            KFS_RETURN(fd);
+        }
+        if (errno != ENOSYS) {
+            KFS_RETURN(-errno);
+        }
+        kfs_atomic_store(&dc->no_openat2, 1);
+    }
+#endif
+    if (has_dotdot(rel)) {
+        KFS_RETURN(-EXDEV);
+    }
+    fd = open_nofollow(dc->rootfd, rel);
+    if (fd == -ENOTDIR || fd == -ELOOP) {
+        /* Without openat2() symbolic links are followed wherever they point. */
+        *cacheable = 0;
+        fd = openat(dc->rootfd, rel, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd == -1) {
+            KFS_RETURN(-errno);
+        }
+    }
+
+    KFS_RETURN(fd);
+}
+
+static struct dircache_entry *
+lookup(struct dircache *dc, const char *path, size_t len, uint64_t hash)
+{
+    struct dircache_entry *e = NULL;
+
+    KFS_ENTER();
+
+    for (e = dc->buckets[hash % dc->num_buckets]; e != NULL; e = e->next) {
+        if (e->hash == hash && e->len == len &&
+                memcmp(e->path, path, len) == 0) {
+            break;
+        }
+    }
+
+    KFS_RETURN(e);
+}
+
+/**
+ * Remove an entry from the list in order of use.
+ */
+static void
+unlink_lru(struct dircache *dc, struct dircache_entry *e)
+{
+    KFS_ENTER();
+
+    if (e->newer == NULL) {
+        dc->newest = e->older;
+    } else {
+        e->newer->older = e->older;
+    }
+    if (e->older == NULL) {
+        dc->oldest = e->newer;
+    } else {
+        e->older->newer = e->newer;
+    }
+    e->newer = e->older = NULL;
+
+    KFS_RETURN();
+}
+
+static void
+push_lru(struct dircache *dc, struct dircache_entry *e)
+{
+    KFS_ENTER();
+
+    e->older = dc->newest;
+    e->newer = NULL;
+    if (dc->newest == NULL) {
+        dc->oldest = e;
+    } else {
+        dc->newest->newer = e;
+    }
+    dc->newest = e;
+
+    KFS_RETURN();
+}
+
+/**
+ * Take an entry out of the cache, closing it unless it is in use. Caller must
+ * hold the lock.
+ */
+static void
+drop(struct dircache *dc, struct dircache_entry *e)
+{
+    struct dircache_entry **p = NULL;
+
+    KFS_ENTER();
+
+    for (p = &dc->buckets[e->hash % dc->num_buckets]; *p != e;
+            p = &(*p)->next) {
+        KFS_ASSERT(*p != NULL);
+    }
+    *p = e->next;
+    unlink_lru(dc, e);
+    dc->num_entries--;
+    if (e->refs == 0) {
+        close(e->fd);
+        e = KFS_FREE(e);
+    } else {
+        e->dropped = 1;
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Create a cache of at most max_entries directories below given root (which
+ * is not closed by dircache_del()). Returns NULL on failure.
+ */
+struct dircache *
+dircache_new(int rootfd, uint_t max_entries)
+{
+    struct dircache *dc = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    dc = KFS_MALLOC(sizeof(*dc));
+    if (dc == NULL) {
+        KFS_RETURN(NULL);
+    }
+    dc->num_buckets = MAX(max_entries, 1);
+    dc->buckets = KFS_CALLOC(dc->num_buckets, sizeof(*dc->buckets));
+    if (dc->buckets == NULL) {
+        dc = KFS_FREE(dc);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&dc->lock);
+    if (ret != 0) {
+        dc->buckets = KFS_FREE(dc->buckets);
+        dc = KFS_FREE(dc);
+        KFS_RETURN(NULL);
+    }
+    dc->rootfd = rootfd;
+    dc->max_entries = max_entries;
+    dc->num_entries = 0;
+    dc->newest = dc->oldest = NULL;
+    dc->no_openat2 = 0;
+    dc->changes = 0;
+
+    KFS_RETURN(dc);
+}
+
+/**
+ * Close all cached directories. None may be in use.
+ */
+struct dircache *
+dircache_del(struct dircache *dc)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(dc != NULL);
+    while (dc->oldest != NULL) {
+        KFS_ASSERT(dc->oldest->refs == 0);
+        drop(dc, dc->oldest);
+    }
+    kfs_mutex_destroy(&dc->lock);
+    dc->buckets = KFS_FREE(dc->buckets);
+    dc = KFS_FREE(dc);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Get a file descriptor for the directory in the first len bytes of dir, a
+ * path relative to the root that starts with a slash (the root itself is the
+ * empty string). It must be given back with dircache_put(). Returns 0 or
+ * -errno.
+ */
+int
+dircache_get(struct dircache *dc, const char *dir, size_t len, struct
+        dirfd_ref *ref)
+{
+    struct dircache_entry *e = NULL;
+    struct dircache_entry *found = NULL;
+    struct dircache_entry *newer = NULL;
+    uint64_t hash = 0;
+    uint64_t ticket = 0;
+    uint_t cacheable = 0;
+    int fd = 0;
+
+    KFS_ENTER();
+
+    ref->entry = NULL;
+    if (len == 0) {
+        ref->fd = dc->rootfd;
+        KFS_RETURN(0);
+    }
+    hash = hash_path(dir, len);
+    if (dc->max_entries != 0) {
+        kfs_mutex_lock(&dc->lock);
+        e = lookup(dc, dir, len, hash);
+        if (e != NULL) {
+            e->refs++;
+            unlink_lru(dc, e);
+            push_lru(dc, e);
+            kfs_mutex_unlock(&dc->lock);
+            ref->fd = e->fd;
+            ref->entry = e;
+            KFS_RETURN(0);
+        }
+        ticket = dc->changes;
+        kfs_mutex_unlock(&dc->lock);
+    }
+    e = KFS_MALLOC(sizeof(*e) + len + 1);
+    if (e == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    memcpy(e->path, dir, len);
+    e->path[len] = '\0';
+    fd = open_dir(dc, e->path, &cacheable);
+    if (fd < 0 || dc->max_entries == 0 || !cacheable) {
+        e = KFS_FREE(e);
+        ref->fd = fd;
+        KFS_RETURN(MIN(fd, 0));
+    }
+    e->hash = hash;
+    e->len = len;
+    e->fd = fd;
+    e->refs = 1;
+    e->dropped = 0;
+    kfs_mutex_lock(&dc->lock);
+    /* Somebody else may have opened it in the meantime. */
+    found = lookup(dc, dir, len, hash);
+    if (found != NULL) {
+        found->refs++;
+        unlink_lru(dc, found);
+        push_lru(dc, found);
+        kfs_mutex_unlock(&dc->lock);
+        close(fd);
+        e = KFS_FREE(e);
+        ref->fd = found->fd;
+        ref->entry = found;
+        KFS_RETURN(0);
+    }
+    if (dc->changes != ticket) {
+        /*
+         * It may have been renamed or removed while it was being opened: do
+         * not remember this descriptor under the path it was opened by.
+         */
+        kfs_mutex_unlock(&dc->lock);
+        e = KFS_FREE(e);
+        ref->fd = fd;
+        KFS_RETURN(0);
+    }
+    e->next = dc->buckets[hash % dc->num_buckets];
+    dc->buckets[hash % dc->num_buckets] = e;
+    push_lru(dc, e);
+    dc->num_entries++;
+    /* Close the least recently used ones that are not in use. */
+    found = dc->oldest;
+    while (found != NULL && dc->num_entries > dc->max_entries) {
+        newer = found->newer;
+        if (found->refs == 0) {
+            drop(dc, found);
+        }
+        found = newer;
+    }
+    kfs_mutex_unlock(&dc->lock);
+    ref->fd = fd;
+    ref->entry = e;
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Give back a file descriptor obtained with dircache_get().
+ */
+void
+dircache_put(struct dircache *dc, struct dirfd_ref *ref)
+{
+    struct dircache_entry *e = ref->entry;
+
+    KFS_ENTER();
+
+    if (e == NULL) {
+        if (ref->fd != dc->rootfd) {
+            close(ref->fd);
+        }
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&dc->lock);
+    KFS_ASSERT(e->refs > 0);
+    e->refs--;
+    if (e->refs == 0 && e->dropped) {
+        close(e->fd);
+        e = KFS_FREE(e);
+    }
+    kfs_mutex_unlock(&dc->lock);
+    ref->entry = NULL;
+
+    KFS_RETURN();
+}
+
+/**
+ * Forget given directory because it was removed or renamed. If tree is set,
+ * everything below it is forgotten as well.
+ */
+void
+dircache_forget(struct dircache *dc, const char *path, int tree)
+{
+    struct dircache_entry *e = NULL;
+    struct dircache_entry *older = NULL;
+    size_t len = 0;
+
+    KFS_ENTER();
+
+    if (dc->max_entries == 0) {
+        KFS_RETURN();
+    }
+    len = strlen(path);
+    kfs_mutex_lock(&dc->lock);
+    dc->changes++;
+    if (!tree) {
+        e = lookup(dc, path, len, hash_path(path, len));
+        if (e != NULL) {
+            drop(dc, e);
+        }
+    } else {
+        for (e = dc->newest; e != NULL; e = older) {
+            older = e->older;
+            if (e->len >= len && memcmp(e->path, path, len) == 0 &&
+                    (e->path[len] == '\0' || e->path[len] == '/')) {
+                drop(dc, e);
+            }
+        }
+    }
+    kfs_mutex_unlock(&dc->lock);
+
+    KFS_RETURN();
+}
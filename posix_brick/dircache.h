@@ -0,0 +1,24 @@
+#ifndef KFS_POSIX_BRICK_DIRCACHE_H
+#define KFS_POSIX_BRICK_DIRCACHE_H
+
+#include <stddef.h>
+
+#include "kfs.h"
+
+struct dircache;
+struct dircache_entry;
+
+/** A borrowed directory file descriptor, see dircache_get(). */
+struct dirfd_ref {
+    int fd;
+    struct dircache_entry *entry;
+};
+
+struct dircache * dircache_new(int rootfd, uint_t max_entries);
+struct dircache * dircache_del(struct dircache *dc);
+int dircache_get(struct dircache *dc, const char *dir, size_t len, struct
+        dirfd_ref *ref);
+void dircache_put(struct dircache *dc, struct dirfd_ref *ref);
+void dircache_forget(struct dircache *dc, const char *path, int tree);
+
+#endif
@@ -0,0 +1,489 @@
+/**
+ * Bulk directory listing for the POSIX brick: reads as many entries as fit in
+ * a large buffer with one getdents64() system call, instead of one readdir()
+ * and one fstatat() per entry.
+ *
+ * By default the attributes of an entry are only what the directory itself
+ * says about it: the inode number and the file type (d_type). That is all a
+ * directory listing needs. With full attributes ("readdirplus"), entries are
+ * stat'ed in batches, divided over the threads of a work queue, with statx()
+ * where available.
+ *
+ * Without getdents64() (not Linux) the buffer is filled with readdir(), which
+ * at least keeps the lazy attributes.
+ */
+
+/* Macro is necessary to get syscall(), statx() and fdopendir(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/dirlist.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  include <sys/sysmacros.h>
+#endif
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+#include "kfs_workqueue.h"
+
+/** Size of the buffer for one getdents64() call. */
+#define DIRLIST_BUFSIZE 65536
+/** Maximum number of entries stat'ed at once with full attributes. */
+#define DIRLIST_BATCH 256
+/** Number of entries stat'ed by one job in the work queue. */
+#define DIRLIST_JOB 32
+
+/** Layout of struct linux_dirent64, also used by the readdir() fallback. */
+struct dirlist_rec {
+    uint64_t ino;
+    int64_t off;
+    unsigned short reclen;
+    unsigned char type;
+    char name[];
+};
+
+struct stat_job {
+    struct dirlist *dl;
+    uint_t first;
+    uint_t count;
+};
+
+struct dirlist {
+    int fd;
+#ifndef SYS_getdents64
+    DIR *dir;
+#endif
+    char *buf;
+    /** Number of bytes of entries in the buffer. */
+    size_t len;
+    /** Position in the buffer of the next entry. */
+    size_t cursor;
+    /** Directory offset of the next entry. */
+    off_t pos;
+    /** Attributes of the entry returned by dirlist_peek(), if not full. */
+    struct stat stbuf;
+    /*
+     * Full attributes only: the entries from the cursor on that have been
+     * stat'ed, and the result for every one of them.
+     */
+    uint_t full;
+    struct kfs_workqueue *pool;
+    const struct dirlist_rec **batch;
+    struct stat *stats;
+    int *stat_ret;
+    uint_t batch_next;
+    uint_t batch_len;
+    struct stat_job jobs[DIRLIST_BATCH / DIRLIST_JOB];
+    /** Number of jobs not yet done. */
+    uint_t jobs_left;
+    kfs_mutex_t lock;
+    kfs_cond_t done;
+};
+
+/**
+ * File type bits of a mode_t for a d_type value, 0 if unknown.
+ */
+static mode_t
+type_to_mode(unsigned char type)
+{
+    mode_t mode = 0;
+
+    KFS_ENTER();
+
+    switch (type) {
+#ifdef DT_UNKNOWN
+    case DT_REG: mode = S_IFREG; break;
+    case DT_DIR: mode = S_IFDIR; break;
+    case DT_LNK: mode = S_IFLNK; break;
+    case DT_CHR: mode = S_IFCHR; break;
+    case DT_BLK: mode = S_IFBLK; break;
+    case DT_FIFO: mode = S_IFIFO; break;
+    case DT_SOCK: mode = S_IFSOCK; break;
+#endif
+    default: mode = 0; break;
+    }
+
+    KFS_RETURN(mode);
+}
+
+/**
+ * Get the attributes of one entry of the directory without following symbolic
+ * links. Returns 0 or -errno.
+ */
+static int
+stat_entry(int fd, const char *name, struct stat *stbuf)
+{
+#ifdef STATX_BASIC_STATS
+    struct statx stx;
+#endif
+    int ret = 0;
+
+    KFS_ENTER();
+
+#ifdef STATX_BASIC_STATS
+    ret = statx(fd, name, AT_SYMLINK_NOFOLLOW, STATX_BASIC_STATS, &stx);
+    if (ret == -1) {
+        KFS_RETURN(-errno);
+    }
+    memset(stbuf, 0, sizeof(*stbuf));
+    stbuf->st_dev = makedev(stx.stx_dev_major, stx.stx_dev_minor);
+    stbuf->st_ino = stx.stx_ino;
+    stbuf->st_mode = stx.stx_mode;
+    stbuf->st_nlink = stx.stx_nlink;
+    stbuf->st_uid = stx.stx_uid;
+    stbuf->st_gid = stx.stx_gid;
+    stbuf->st_rdev = makedev(stx.stx_rdev_major, stx.stx_rdev_minor);
+    stbuf->st_size = stx.stx_size;
+    stbuf->st_blksize = stx.stx_blksize;
+    stbuf->st_blocks = stx.stx_blocks;
+    stbuf->st_atim.tv_sec = stx.stx_atime.tv_sec;
+    stbuf->st_atim.tv_nsec = stx.stx_atime.tv_nsec;
+    stbuf->st_mtim.tv_sec = stx.stx_mtime.tv_sec;
+    stbuf->st_mtim.tv_nsec = stx.stx_mtime.tv_nsec;
+    stbuf->st_ctim.tv_sec = stx.stx_ctime.tv_sec;
+    stbuf->st_ctim.tv_nsec = stx.stx_ctime.tv_nsec;
+#else
+    ret = fstatat(fd, name, stbuf, AT_SYMLINK_NOFOLLOW);
+    if (ret == -1) {
+        KFS_RETURN(-errno);
+    }
+#endif
+
+    KFS_RETURN(0);
+}
+
+static void
+stat_job_run(void *arg)
+{
+    struct stat_job * const job = arg;
+    struct dirlist * const dl = job->dl;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    for (i = job->first; i < job->first + job->count; i++) {
+        dl->stat_ret[i] = stat_entry(dl->fd, dl->batch[i]->name,
+                &dl->stats[i]);
+    }
+    kfs_mutex_lock(&dl->lock);
+    dl->jobs_left--;
+    if (dl->jobs_left == 0) {
+        kfs_cond_broadcast(&dl->done);
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Stat the entries from the cursor on, up to the end of the buffer or
+ * DIRLIST_BATCH of them, divided over the work queue.
+ */
+static void
+stat_batch(struct dirlist *dl)
+{
+    const struct dirlist_rec *rec = NULL;
+    size_t cursor = dl->cursor;
+    uint_t num_jobs = 0;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    dl->batch_len = 0;
+    while (cursor < dl->len && dl->batch_len < DIRLIST_BATCH) {
+        rec = (const struct dirlist_rec *) (dl->buf + cursor);
+        dl->batch[dl->batch_len++] = rec;
+        cursor += rec->reclen;
+    }
+    dl->batch_next = 0;
+    num_jobs = (dl->batch_len + DIRLIST_JOB - 1) / DIRLIST_JOB;
+    dl->jobs_left = num_jobs;
+    for (i = 0; i < num_jobs; i++) {
+        dl->jobs[i].dl = dl;
+        dl->jobs[i].first = i * DIRLIST_JOB;
+        dl->jobs[i].count = MIN(DIRLIST_JOB, dl->batch_len - i * DIRLIST_JOB);
+    }
+    /* Keep the first job for this thread, it would only be waiting anyway. */
+    for (i = 1; i < num_jobs; i++) {
+        ret = -1;
+        if (dl->pool != NULL) {
+            ret = kfs_workqueue_push(dl->pool, stat_job_run, &dl->jobs[i]);
+        }
+        if (ret != 0) {
+            stat_job_run(&dl->jobs[i]);
+        }
+    }
+    if (num_jobs > 0) {
+        stat_job_run(&dl->jobs[0]);
+    }
+    kfs_mutex_lock(&dl->lock);
+    while (dl->jobs_left != 0) {
+        kfs_cond_wait(&dl->done, &dl->lock);
+    }
+    kfs_mutex_unlock(&dl->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Read the next entries into the buffer. Returns 0 or -errno, an empty buffer
+ * means the end of the directory.
+ */
+static int
+fill(struct dirlist *dl)
+{
+#ifdef SYS_getdents64
+    long ret = 0;
+#else
+    struct dirlist_rec *rec = NULL;
+    struct dirent *de = NULL;
+    size_t reclen = 0;
+    long prev = 0;
+#endif
+
+    KFS_ENTER();
+
+    dl->cursor = dl->len = 0;
+    dl->batch_next = dl->batch_len = 0;
+#ifdef SYS_getdents64
+    ret = syscall(SYS_getdents64, dl->fd, dl->buf, DIRLIST_BUFSIZE);
+    if (ret == -1) {
+        KFS_RETURN(-errno);
+    }
+    dl->len = ret;
+#else
+    for (;;) {
+        prev = telldir(dl->dir);
+        errno = 0;
+        de = readdir(dl->dir);
+        if (de == NULL) {
+            if (errno != 0 && dl->len == 0) {
+                KFS_RETURN(-errno);
+            }
+            break;
+        }
+        reclen = offsetof(struct dirlist_rec, name) + strlen(de->d_name) + 1;
+        reclen = (reclen + 7) & ~((size_t) 7);
+        if (dl->len + reclen > DIRLIST_BUFSIZE) {
+            seekdir(dl->dir, prev);
+            break;
+        }
+        rec = (struct dirlist_rec *) (dl->buf + dl->len);
+        rec->ino = de->d_ino;
+        rec->off = telldir(dl->dir);
+        rec->reclen = reclen;
+#  ifdef DT_UNKNOWN
+        rec->type = de->d_type;
+#  else
+        rec->type = 0;
+#  endif
+        strcpy(rec->name, de->d_name);
+        dl->len += reclen;
+    }
+#endif
+
+    KFS_RETURN(0);
+}
+
+/**
+ * List the directory open as fd, which is closed by dirlist_close() (but not
+ * if this fails). With full set, the attributes of the entries are stat'ed,
+ * using the threads of pool if it is not NULL. Returns NULL on failure.
+ */
+struct dirlist *
+dirlist_open(int fd, uint_t full, struct kfs_workqueue *pool)
+{
+    struct dirlist *dl = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    dl = KFS_CALLOC(1, sizeof(*dl));
+    if (dl == NULL) {
+        KFS_RETURN(NULL);
+    }
+    dl->buf = KFS_MALLOC(DIRLIST_BUFSIZE);
+    if (dl->buf == NULL) {
+        dl = KFS_FREE(dl);
+        KFS_RETURN(NULL);
+    }
+    if (full) {
+        dl->batch = KFS_MALLOC(DIRLIST_BATCH * sizeof(*dl->batch));
+        dl->stats = KFS_MALLOC(DIRLIST_BATCH * sizeof(*dl->stats));
+        dl->stat_ret = KFS_MALLOC(DIRLIST_BATCH * sizeof(*dl->stat_ret));
+        ret = -ENOMEM;
+        if (dl->batch != NULL && dl->stats != NULL && dl->stat_ret != NULL) {
+            ret = kfs_mutex_init(&dl->lock);
+        }
+        if (ret == 0) {
+            ret = kfs_cond_init(&dl->done);
+            if (ret != 0) {
+                kfs_mutex_destroy(&dl->lock);
+            }
+        }
+    }
+#ifndef SYS_getdents64
+    if (ret == 0) {
+        dl->dir = fdopendir(fd);
+        if (dl->dir == NULL) {
+            ret = -errno;
+            if (full) {
+                kfs_cond_destroy(&dl->done);
+                kfs_mutex_destroy(&dl->lock);
+            }
+        }
+    }
+#endif
+    if (ret != 0) {
+        if (dl->batch != NULL) {
+            dl->batch = KFS_FREE(dl->batch);
+        }
+        if (dl->stats != NULL) {
+            dl->stats = KFS_FREE(dl->stats);
+        }
+        if (dl->stat_ret != NULL) {
+            dl->stat_ret = KFS_FREE(dl->stat_ret);
+        }
+        dl->buf = KFS_FREE(dl->buf);
+        dl = KFS_FREE(dl);
+        KFS_RETURN(NULL);
+    }
+    dl->fd = fd;
+    dl->full = full;
+    dl->pool = pool;
+
+    KFS_RETURN(dl);
+}
+
+struct dirlist *
+dirlist_close(struct dirlist *dl)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(dl != NULL);
+#ifdef SYS_getdents64
+    close(dl->fd);
+#else
+    closedir(dl->dir);
+#endif
+    if (dl->full) {
+        kfs_cond_destroy(&dl->done);
+        kfs_mutex_destroy(&dl->lock);
+        dl->batch = KFS_FREE(dl->batch);
+        dl->stats = KFS_FREE(dl->stats);
+        dl->stat_ret = KFS_FREE(dl->stat_ret);
+    }
+    dl->buf = KFS_FREE(dl->buf);
+    dl = KFS_FREE(dl);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Continue the listing at given offset: 0 or the offset of an entry. Cheap if
+ * it is where the last listing stopped. Returns 0 or -errno.
+ */
+int
+dirlist_seek(struct dirlist *dl, off_t off)
+{
+    KFS_ENTER();
+
+    if (off == dl->pos) {
+        KFS_RETURN(0);
+    }
+    dl->cursor = dl->len = 0;
+    dl->batch_next = dl->batch_len = 0;
+#ifdef SYS_getdents64
+    if (lseek(dl->fd, off, SEEK_SET) == -1) {
+        KFS_RETURN(-errno);
+    }
+#else
+    seekdir(dl->dir, off);
+#endif
+    dl->pos = off;
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Get the next entry without moving past it. Returns 1 if there is one, 0 at
+ * the end of the directory or -errno.
+ */
+int
+dirlist_peek(struct dirlist *dl, struct dirlist_entry *entry)
+{
+    const struct dirlist_rec *rec = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    if (dl->cursor == dl->len) {
+        ret = fill(dl);
+        if (ret != 0) {
+            KFS_RETURN(ret);
+        }
+        if (dl->len == 0) {
+            KFS_RETURN(0);
+        }
+    }
+    rec = (const struct dirlist_rec *) (dl->buf + dl->cursor);
+    entry->name = rec->name;
+    entry->off = rec->off;
+    if (dl->full) {
+        if (dl->batch_next == dl->batch_len) {
+            stat_batch(dl);
+        }
+        KFS_ASSERT(dl->batch[dl->batch_next] == rec);
+        if (dl->stat_ret[dl->batch_next] == 0) {
+            entry->stbuf = &dl->stats[dl->batch_next];
+            KFS_RETURN(1);
+        }
+        KFS_WARNING("stat of %s: %s", rec->name,
+                strerror(-dl->stat_ret[dl->batch_next]));
+    }
+    memset(&dl->stbuf, 0, sizeof(dl->stbuf));
+    dl->stbuf.st_ino = rec->ino;
+    dl->stbuf.st_mode = type_to_mode(rec->type);
+    if (dl->stbuf.st_mode == 0 && !dl->full) {
+        /* The file system does not fill in d_type. */
+        ret = stat_entry(dl->fd, rec->name, &dl->stbuf);
+        if (ret != 0) {
+            KFS_WARNING("stat of %s: %s", rec->name, strerror(-ret));
+        }
+    }
+    entry->stbuf = &dl->stbuf;
+
+    KFS_RETURN(1);
+}
+
+/**
+ * Move past the entry returned by dirlist_peek().
+ */
+void
+dirlist_next(struct dirlist *dl)
+{
+    const struct dirlist_rec *rec = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(dl->cursor < dl->len);
+    rec = (const struct dirlist_rec *) (dl->buf + dl->cursor);
+    dl->cursor += rec->reclen;
+    dl->pos = rec->off;
+    if (dl->batch_next < dl->batch_len) {
+        dl->batch_next++;
+    }
+
+    KFS_RETURN();
+}
@@ -0,0 +1,30 @@
+#ifndef KFS_POSIX_BRICK_DIRLIST_H
+#define KFS_POSIX_BRICK_DIRLIST_H
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "kfs.h"
+#include "kfs_workqueue.h"
+
+struct dirlist;
+
+/** One directory entry, valid until the next call on its dirlist. */
+struct dirlist_entry {
+    const char *name;
+    /** Offset of the entry after this one, see dirlist_seek(). */
+    off_t off;
+    /**
+     * Full attributes if the dirlist was opened with full set. Otherwise (or
+     * if getting them failed) only the inode number and file type.
+     */
+    const struct stat *stbuf;
+};
+
+struct dirlist * dirlist_open(int fd, uint_t full, struct kfs_workqueue *pool);
+struct dirlist * dirlist_close(struct dirlist *dl);
+int dirlist_seek(struct dirlist *dl, off_t off);
+int dirlist_peek(struct dirlist *dl, struct dirlist_entry *entry);
+void dirlist_next(struct dirlist *dl);
+
+#endif
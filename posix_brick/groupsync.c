@@ -0,0 +1,255 @@
+/**
+ * Group commit for the POSIX brick: concurrent fsync() calls are combined into
+ * one syncfs() of the file system the brick is on, and everybody waiting for it
+ * is released together. The device sees one flush instead of a flood of them.
+ *
+ * Every caller takes a ticket. A flush covers all tickets taken before it
+ * started. Whoever finds no flush running becomes the leader: it waits up to
+ * the commit interval for others to join and then flushes for all of them.
+ * Callers that arrive while a flush is running are covered by the next one.
+ *
+ * Files on another file system (something mounted inside the directory) are
+ * not covered by the syncfs() and get an ordinary fsync().
+ */
+
+/* Macro is necessary to get syncfs(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/groupsync.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#if _POSIX_C_SOURCE >= 199309L || _XOPEN_SOURCE >= 500
+#  define KFS_USE_FDATASYNC
+#endif
+
+/**
+ * Like fsync() or fdatasync(), but returns -errno on failure.
+ */
+static int
+sync_one(int fd, int datasync)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+#ifdef KFS_USE_FDATASYNC
+    if (datasync) {
+        ret = fdatasync(fd);
+    } else
+#endif
+    {
+        ret = fsync(fd);
+    }
+    if (ret == -1) {
+        KFS_RETURN(-errno);
+    }
+
+    KFS_RETURN(0);
+}
+
+#ifdef __linux__
+
+struct groupsync {
+    /** Any file on the file system that is flushed. */
+    int fd;
+    dev_t dev;
+    /** How long a leader waits for others before flushing. */
+    uint64_t interval_ns;
+    kfs_mutex_t lock;
+    /** Broadcast whenever a flush is done. */
+    kfs_cond_t flushed;
+    /** The last ticket taken. */
+    uint64_t requested;
+    /** All tickets up to this one are flushed. */
+    uint64_t done;
+    /** The last ticket covered by a failed flush, and its error. */
+    uint64_t failed;
+    int error;
+    /** A leader is waiting for others or flushing. */
+    uint_t busy;
+};
+
+/**
+ * Group the flushes of files on the same file system as fd. Returns NULL on
+ * failure.
+ */
+struct groupsync *
+groupsync_new(int fd, uint64_t interval_ns)
+{
+    struct groupsync *gs = NULL;
+    struct stat st;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fstat(fd, &st);
+    if (ret == -1) {
+        KFS_ERROR("fstat: %s", strerror(errno));
+        KFS_RETURN(NULL);
+    }
+    gs = KFS_CALLOC(1, sizeof(*gs));
+    if (gs == NULL) {
+        KFS_RETURN(NULL);
+    }
+    gs->fd = fd;
+    gs->dev = st.st_dev;
+    gs->interval_ns = interval_ns;
+    ret = kfs_mutex_init(&gs->lock);
+    if (ret != 0) {
+        gs = KFS_FREE(gs);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_cond_init(&gs->flushed);
+    if (ret != 0) {
+        kfs_mutex_destroy(&gs->lock);
+        gs = KFS_FREE(gs);
+        KFS_RETURN(NULL);
+    }
+
+    KFS_RETURN(gs);
+}
+
+struct groupsync *
+groupsync_del(struct groupsync *gs)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(gs != NULL && !gs->busy);
+    kfs_cond_destroy(&gs->flushed);
+    kfs_mutex_destroy(&gs->lock);
+    gs = KFS_FREE(gs);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Flush everything that was requested until now, as the leader. The lock is
+ * held on entry and on return, but not while flushing.
+ */
+static void
+lead(struct groupsync *gs)
+{
+    uint64_t deadline = 0;
+    uint64_t now = 0;
+    uint64_t batch = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    gs->busy = 1;
+    if (gs->interval_ns != 0) {
+        deadline = kfs_clock_ns() + gs->interval_ns;
+        for (now = kfs_clock_ns(); now < deadline; now = kfs_clock_ns()) {
+            kfs_cond_timedwait(&gs->flushed, &gs->lock, deadline - now);
+        }
+    }
+    batch = gs->requested;
+    kfs_mutex_unlock(&gs->lock);
+    ret = syncfs(gs->fd);
+    if (ret == -1) {
+        ret = errno;
+    }
+    kfs_mutex_lock(&gs->lock);
+    gs->done = batch;
+    if (ret != 0) {
+        gs->failed = batch;
+        gs->error = ret;
+    }
+    gs->busy = 0;
+    kfs_cond_broadcast(&gs->flushed);
+
+    KFS_RETURN();
+}
+
+/**
+ * Like fsync() or fdatasync() (there is no difference here), but returns
+ * -errno on failure. An error is reported to everyone whose flush failed, and
+ * to be safe also to those that only woke up after a later flush failed.
+ */
+int
+groupsync_sync(struct groupsync *gs, int fd, int datasync)
+{
+    struct stat st;
+    uint64_t ticket = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fstat(fd, &st);
+    if (ret == -1) {
+        KFS_RETURN(-errno);
+    }
+    if (st.st_dev != gs->dev) {
+        KFS_RETURN(sync_one(fd, datasync));
+    }
+    kfs_mutex_lock(&gs->lock);
+    gs->requested += 1;
+    ticket = gs->requested;
+    while (gs->done < ticket) {
+        if (gs->busy) {
+            kfs_cond_wait(&gs->flushed, &gs->lock);
+        } else {
+            lead(gs);
+        }
+    }
+    ret = gs->failed >= ticket ? -gs->error : 0;
+    kfs_mutex_unlock(&gs->lock);
+
+    KFS_RETURN(ret);
+}
+
+#else
+
+/*
+ * No syncfs() on this system: groupsync_new() always fails, so the others are
+ * never called.
+ */
+
+struct groupsync *
+groupsync_new(int fd, uint64_t interval_ns)
+{
+    (void) fd;
+    (void) interval_ns;
+
+    KFS_ENTER();
+
+    KFS_WARNING("Group commit is not supported on this system.");
+
+    KFS_RETURN(NULL);
+}
+
+struct groupsync *
+groupsync_del(struct groupsync *gs)
+{
+    (void) gs;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(NULL);
+}
+
+int
+groupsync_sync(struct groupsync *gs, int fd, int datasync)
+{
+    (void) gs;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(sync_one(fd, datasync));
+}
+
+#endif
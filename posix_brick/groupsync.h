@@ -0,0 +1,14 @@
+#ifndef KFS_POSIX_BRICK_GROUPSYNC_H
+#define KFS_POSIX_BRICK_GROUPSYNC_H
+
+#include <stdint.h>
+
+#include "kfs.h"
+
+struct groupsync;
+
+struct groupsync * groupsync_new(int fd, uint64_t interval_ns);
+struct groupsync * groupsync_del(struct groupsync *gs);
+int groupsync_sync(struct groupsync *gs, int fd, int datasync);
+
+#endif
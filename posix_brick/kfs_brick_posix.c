@@ -1,15 +1,24 @@
 /**
  * KennyFS backend forwarding everything to a locally mounted POSIX-compliant
  * directory.
+ *
+ * The root of that directory is opened once, and every operation is done with
+ * the *at() system calls relative to the directory its path is in. Those
+ * directories are kept open in a cache (see dircache.c), so the kernel does
+ * not have to look up the entire path every time and paths can not lead
+ * outside of the root. Extended attributes have no such system calls and are
+ * still accessed by their full path.
  */
 
 #define FUSE_USE_VERSION 29
-/* Macro is necessary to get fstatat(). */
+/* Macro is necessary to get fstatat() and the other *at() functions. */
 #define _ATFILE_SOURCE
 /* Macro is necessary to get pread(). */
 #define _XOPEN_SOURCE 500
-/* Macro is necessary to get dirfd(). */
+/* Macro is necessary to get O_DIRECTORY. */
 #define _BSD_SOURCE
+/* Macro is necessary to get O_DIRECT. */
+#define _GNU_SOURCE
 
 #include "posix_brick/kfs_brick_posix.h"
 
@@ -35,23 +44,65 @@
 #include <fuse.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <unistd.h>
-#include <utime.h>
+#ifdef __linux__
+#  include <linux/fs.h>
+#  include <sys/ioctl.h>
+#  include <sys/syscall.h>
+#endif
 
 #include "minini/minini.h"
 
 #include "kfs.h"
 #include "kfs_api.h"
+#include "kfs_memory.h"
 #include "kfs_misc.h"
+#include "kfs_workqueue.h"
+#include "posix_brick/advise.h"
+#include "posix_brick/dircache.h"
+#include "posix_brick/dirlist.h"
+#include "posix_brick/groupsync.h"
+#include "posix_brick/mapcache.h"
+#include "posix_brick/uring.h"
+#include "posix_brick/warmup.h"
 
 #if _POSIX_C_SOURCE >= 199309L || _XOPEN_SOURCE >= 500
 #  define KFS_USE_FDATASYNC
 #endif
 
+/** Default number of directories kept open. */
+#define DIRFD_CACHE_DEFAULT 1024
+/** Default number of threads stat'ing directory entries for readdir. */
+#define STAT_THREADS_DEFAULT 4
+/** Default size of the io_uring. */
+#define URING_ENTRIES_DEFAULT 256
+/** Default number of threads walking directory trees to warm them up. */
+#define WARMUP_THREADS_DEFAULT 8
+/** Alignment of offsets, sizes and memory for O_DIRECT. */
+#define DIRECT_ALIGN 4096
+/** Most bytes copied by one copy_file_range: the result must fit an int. */
+#define COPY_MAX 0x7ffff000
+/** Virtual attribute of a directory: setting it warms up the tree below it. */
+#define WARMUP_XATTR KFS_XATTR_NS ".brick.posix.warmup"
+
+/*
+ * With io_mode = direct, the file handle of an open file holds two file
+ * descriptors: one opened with O_DIRECT in the low 32 bits and a buffered one
+ * (plus one) in the high 32 bits. Otherwise it is just the file descriptor,
+ * which is then also the "buffered" one.
+ */
+#define FH_MAKE(fd, buffered_fd) ((uint64_t) (fd) | \
+                                        ((uint64_t) ((buffered_fd) + 1) << 32))
+#define FH_FD(fh) ((int) ((fh) & 0xffffffff))
+#define FH_IS_DIRECT(fh) (((fh) >> 32) != 0)
+#define FH_BUFFERED_FD(fh) (FH_IS_DIRECT(fh) ? (int) ((fh) >> 32) - 1 \
+                                             : FH_FD(fh))
+
 /**
  * Free given string buffer if it does not equal given static buffer. Useful for
  * cleaning up potential allocations by kfs_bufstrcat(). Returns the strbuf,
@@ -61,6 +112,256 @@
                                                     ? (strbuf) \
                                                     : KFS_FREE(strbuf))
 
+struct posix_state {
+    char *mountroot;
+    /** The root directory, all paths are looked up relative to it. */
+    int rootfd;
+    struct dircache *dirs;
+    /** Pass full attributes to the readdir filler, stat'ed by stat_pool. */
+    uint_t full_stat;
+    struct kfs_workqueue *stat_pool;
+    /** Reads, writes and fsyncs go through this, unless it is NULL. */
+    struct uring *ring;
+    /** Open files with O_DIRECT as well (io_mode = direct). */
+    uint_t direct;
+    /** Gives the kernel hints about reads, unless it is NULL. */
+    struct advisor *advisor;
+    /** Combines concurrent fsyncs (group_commit), unless it is NULL. */
+    struct groupsync *commit;
+    /** Serves reads of small files from copies in memory, unless NULL. */
+    struct mapcache *maps;
+    /** Walks directory trees to get them cached, unless it is NULL. */
+    struct warmup *warm;
+};
+
+/**
+ * Split a path in the directory it is in, taken from the cache, and the name
+ * in that directory. The root itself is "." in the root. The directory must be
+ * given back with dircache_put(). Returns 0 or -errno.
+ */
+static int
+resolve(struct posix_state *state, const char *fusepath, struct dirfd_ref
+        *dir, const char **name)
+{
+    const char *slash = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(fusepath[0] == '/');
+    slash = strrchr(fusepath, '/');
+    if (slash[1] == '\0') {
+        *name = ".";
+    } else if (strcmp(slash + 1, "..") == 0) {
+        KFS_RETURN(-EXDEV);
+    } else {
+        *name = slash + 1;
+    }
+    ret = dircache_get(state->dirs, fusepath, slash - fusepath, dir);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Open a file and fill in fi->fh. With io_mode = direct, it is opened a second
+ * time with O_DIRECT, unless the file system does not support that. With
+ * mmap_max, a file that is opened to be changed is only truncated once its
+ * copy in memory is gone. Returns 0 or -errno.
+ */
+static int
+open_file(const struct posix_state *state, int dirfd, const char *name, int
+        flags, mode_t mode, struct fuse_file_info *fi)
+{
+    const int writable = (flags & O_ACCMODE) != O_RDONLY || (flags & O_TRUNC);
+    int trunc = 0;
+    int fd = 0;
+    int dfd = -1;
+
+    KFS_ENTER();
+
+    if (state->maps != NULL && (flags & O_ACCMODE) != O_RDONLY && (flags &
+                O_TRUNC)) {
+        trunc = 1;
+        flags &= ~O_TRUNC;
+    }
+    fd = openat(dirfd, name, flags, mode);
+    if (fd == -1) {
+        KFS_RETURN(-errno);
+    }
+    fi->fh = fd;
+    if (state->advisor != NULL) {
+        advise_open(state->advisor, fd);
+    }
+#ifdef O_DIRECT
+    if (state->direct && !(flags & O_DIRECT)) {
+        /* Created (and truncated) already. */
+        dfd = openat(dirfd, name, (flags & ~(O_CREAT | O_EXCL | O_TRUNC)) |
+                O_DIRECT);
+        if (dfd != -1) {
+            fi->fh = FH_MAKE(dfd, fd);
+        }
+    }
+#endif
+    /* Direct reads do not go through the copy. */
+    if (state->maps != NULL && (writable || dfd == -1)) {
+        mapcache_open(state->maps, fd, writable);
+    }
+    /* O_TRUNC does nothing to FIFOs and terminals, ftruncate() fails. */
+    if (trunc && ftruncate(fd, 0) == -1 && errno != EINVAL) {
+        trunc = -errno;
+        mapcache_close(state->maps, fd);
+        if (state->advisor != NULL) {
+            advise_close(state->advisor, fd);
+        }
+        if (dfd != -1) {
+            close(dfd);
+        }
+        close(fd);
+        KFS_RETURN(trunc);
+    }
+    if (state->ring != NULL) {
+        uring_register_fd(state->ring, fd);
+        if (dfd != -1) {
+            uring_register_fd(state->ring, dfd);
+        }
+    }
+
+    KFS_RETURN(0);
+}
+
+static ssize_t
+do_pread(const struct posix_state *state, int fd, void *buf, size_t size,
+        off_t offset)
+{
+    ssize_t ret = 0;
+
+    KFS_ENTER();
+
+    if (state->ring != NULL) {
+        KFS_RETURN(uring_pread(state->ring, fd, buf, size, offset));
+    }
+    ret = pread(fd, buf, size, offset);
+    if (ret == -1) {
+        ret = -errno;
+    }
+
+    KFS_RETURN(ret);
+}
+
+static ssize_t
+do_pwrite(const struct posix_state *state, int fd, const void *buf, size_t
+        size, off_t offset)
+{
+    ssize_t ret = 0;
+
+    KFS_ENTER();
+
+    if (state->ring != NULL) {
+        KFS_RETURN(uring_pwrite(state->ring, fd, buf, size, offset));
+    }
+    ret = pwrite(fd, buf, size, offset);
+    if (ret == -1) {
+        ret = -errno;
+    }
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Allocate a buffer aligned for O_DIRECT. The returned *base must be freed.
+ */
+static char *
+bounce_alloc(size_t size, void **base)
+{
+    uintptr_t p = 0;
+
+    KFS_ENTER();
+
+    *base = KFS_MALLOC(size + DIRECT_ALIGN - 1);
+    if (*base == NULL) {
+        KFS_RETURN(NULL);
+    }
+    p = ((uintptr_t) *base + DIRECT_ALIGN - 1) & ~(uintptr_t) (DIRECT_ALIGN - 1);
+
+    KFS_RETURN((char *) p);
+}
+
+/**
+ * Read from a file opened with O_DIRECT. Unaligned reads go through a bounce
+ * buffer that covers all blocks involved, reads of less than a block are not
+ * worth bypassing the page cache for.
+ */
+static ssize_t
+direct_read(const struct posix_state *state, uint64_t fh, char *buf, size_t
+        size, off_t offset)
+{
+    const size_t mask = DIRECT_ALIGN - 1;
+    char *bounce = NULL;
+    void *base = NULL;
+    off_t start = 0;
+    size_t len = 0;
+    ssize_t ret = 0;
+
+    KFS_ENTER();
+
+    if (((uintptr_t) buf & mask) == 0 && (offset & mask) == 0 &&
+            (size & mask) == 0) {
+        KFS_RETURN(do_pread(state, FH_FD(fh), buf, size, offset));
+    }
+    if (size < DIRECT_ALIGN) {
+        KFS_RETURN(do_pread(state, FH_BUFFERED_FD(fh), buf, size, offset));
+    }
+    start = offset & ~(off_t) mask;
+    len = (offset - start + size + mask) & ~mask;
+    bounce = bounce_alloc(len, &base);
+    if (bounce == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    ret = do_pread(state, FH_FD(fh), bounce, len, start);
+    if (ret >= 0) {
+        /* Whatever of it is at or after offset, up to size bytes. */
+        ret = MIN(MAX(ret - (offset - start), 0), (ssize_t) size);
+        memcpy(buf, bounce + (offset - start), ret);
+    }
+    base = KFS_FREE(base);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Write to a file opened with O_DIRECT. Writes that do not cover whole blocks
+ * go to the buffered file descriptor: Linux keeps the page cache coherent with
+ * direct I/O, and that way no two writers have to read, modify and write the
+ * same block.
+ */
+static ssize_t
+direct_write(const struct posix_state *state, uint64_t fh, const char *buf,
+        size_t size, off_t offset)
+{
+    const size_t mask = DIRECT_ALIGN - 1;
+    char *bounce = NULL;
+    void *base = NULL;
+    ssize_t ret = 0;
+
+    KFS_ENTER();
+
+    if ((offset & mask) != 0 || (size & mask) != 0) {
+        KFS_RETURN(do_pwrite(state, FH_BUFFERED_FD(fh), buf, size, offset));
+    }
+    if (((uintptr_t) buf & mask) == 0) {
+        KFS_RETURN(do_pwrite(state, FH_FD(fh), buf, size, offset));
+    }
+    bounce = bounce_alloc(size, &base);
+    if (bounce == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    memcpy(bounce, buf, size);
+    ret = do_pwrite(state, FH_FD(fh), bounce, size, offset);
+    base = KFS_FREE(base);
+
+    KFS_RETURN(ret);
+}
+
 /*
  * Operation handlers.
  */
@@ -68,24 +369,22 @@
 static int
 posix_getattr(const kfs_context_t co, const char *fusepath, struct stat *stbuf)
 {
-    const char * const mountroot = co->priv;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
-    /* On-stack buffer for paths of limited length. Otherwise: malloc(). */
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = lstat(fullpath, stbuf);
+    ret = fstatat(dir.fd, name, stbuf, AT_SYMLINK_NOFOLLOW);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -93,23 +392,22 @@ posix_getattr(const kfs_context_t co, const char *fusepath, struct stat *stbuf)
 static int
 posix_access(const kfs_context_t co, const char *fusepath, int mask)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = access(fullpath, mask);
+    ret = faccessat(dir.fd, name, mask, 0);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -118,27 +416,19 @@ static int
 posix_create(const kfs_context_t co, const char *fusepath, mode_t mode, struct
         fuse_file_info *fi)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    ret = 0;
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
-    }
-    ret = open(fullpath, fi->flags, mode);
-    if (ret == -1) {
-        ret = -errno;
-    } else {
-        fi->fh = ret;
-        ret = 0;
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    ret = open_file(state, dir.fd, name, fi->flags, mode, fi);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -155,7 +445,7 @@ posix_ftruncate(const kfs_context_t co, const char *fusepath, off_t off, struct
 
     KFS_ENTER();
 
-    ret = ftruncate(fi->fh, off);
+    ret = ftruncate(FH_FD(fi->fh), off);
     if (ret == -1) {
         KFS_RETURN(-errno);
     }
@@ -174,7 +464,7 @@ posix_fgetattr(const kfs_context_t co, const char *fusepath, struct stat *stbuf,
 
     KFS_ENTER();
 
-    ret = fstat(fi->fh, stbuf);
+    ret = fstat(FH_FD(fi->fh), stbuf);
     if (ret == -1) {
         KFS_RETURN(-errno);
     }
@@ -189,27 +479,26 @@ static int
 posix_readlink(const kfs_context_t co, const char *fusepath, char *buf, size_t
         size)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     ssize_t ret = 0;
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
     /* Save room for the \0 byte. */
-    ret = readlink(fullpath, buf, size - 1);
+    ret = readlinkat(dir.fd, name, buf, size - 1);
     if (ret == -1) {
         ret = -errno;
     } else {
         buf[ret] = '\0';
         ret = 0;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -218,48 +507,72 @@ static int
 posix_mknod(const kfs_context_t co, const char *fusepath, mode_t mode, dev_t
         dev)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        ret = -errno;
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = mknod(fullpath, mode, dev);
+    ret = mknodat(dir.fd, name, mode, dev);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
 
+/**
+ * There is no truncateat(): open the file and truncate that. Only regular
+ * files are opened, opening anything else could have side effects.
+ */
 static int
 posix_truncate(const kfs_context_t co, const char *fusepath, off_t offset)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    struct stat stbuf;
+    const char *name = NULL;
+    int fd = 0;
     int ret = 0;
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = truncate(fullpath, offset);
+    ret = fstatat(dir.fd, name, &stbuf, 0);
     if (ret == -1) {
         ret = -errno;
+    } else if (S_ISDIR(stbuf.st_mode)) {
+        ret = -EISDIR;
+    } else if (!S_ISREG(stbuf.st_mode)) {
+        ret = -EINVAL;
+    } else {
+        fd = openat(dir.fd, name, O_WRONLY | O_NONBLOCK | O_NOCTTY);
+        if (fd == -1) {
+            ret = -errno;
+        } else {
+            if (state->maps != NULL) {
+                mapcache_open(state->maps, fd, 1);
+            }
+            ret = ftruncate(fd, offset);
+            if (ret == -1) {
+                ret = -errno;
+            }
+            if (state->maps != NULL) {
+                mapcache_close(state->maps, fd);
+            }
+            close(fd);
+        }
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -268,26 +581,19 @@ static int
 posix_open(const kfs_context_t co, const char *fusepath, struct fuse_file_info
         *fi)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
-    }
-    ret = open(fullpath, fi->flags);
-    if (ret == -1) {
-        ret = -errno;
-    } else {
-        fi->fh = ret;
-        ret = 0;
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    ret = open_file(state, dir.fd, name, fi->flags, 0, fi);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -295,23 +601,22 @@ posix_open(const kfs_context_t co, const char *fusepath, struct fuse_file_info
 static int
 posix_unlink(const kfs_context_t co, const char *fusepath)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = unlink(fullpath);
+    ret = unlinkat(dir.fd, name, 0);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -319,23 +624,24 @@ posix_unlink(const kfs_context_t co, const char *fusepath)
 static int
 posix_rmdir(const kfs_context_t co, const char *fusepath)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = rmdir(fullpath);
+    ret = unlinkat(dir.fd, name, AT_REMOVEDIR);
     if (ret == -1) {
         ret = -errno;
+    } else {
+        dircache_forget(state->dirs, fusepath, 0);
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -346,47 +652,60 @@ posix_rmdir(const kfs_context_t co, const char *fusepath)
 static int
 posix_symlink(const kfs_context_t co, const char *path1, const char *path2)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(path2[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, path2, NUMELEM(pathbuf));
-    ret = symlink(path1, fullpath);
+    ret = resolve(state, path2, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    ret = symlinkat(path1, dir.fd, name);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
 
+/**
+ * Directories below the old and the new name (if any) are forgotten by the
+ * cache, whether a directory was renamed or not.
+ */
 static int
 posix_rename(const kfs_context_t co, const char *from, const char *to)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf_from[PATHBUF_SIZE];
-    char pathbuf_to[PATHBUF_SIZE];
-    char *fullpath_from = NULL;
-    char *fullpath_to = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir_from;
+    struct dirfd_ref dir_to;
+    const char *name_from = NULL;
+    const char *name_to = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(from[0] == '/' && to[0] == '/');
-    fullpath_from = kfs_bufstrcat(pathbuf_from, mountroot, from,
-            NUMELEM(pathbuf_from));
-    fullpath_to = kfs_bufstrcat(pathbuf_to, mountroot, to,
-            NUMELEM(pathbuf_to));
-    ret = rename(fullpath_from, fullpath_to);
+    ret = resolve(state, from, &dir_from, &name_from);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    ret = resolve(state, to, &dir_to, &name_to);
+    if (ret != 0) {
+        dircache_put(state->dirs, &dir_from);
+        KFS_RETURN(ret);
+    }
+    ret = renameat(dir_from.fd, name_from, dir_to.fd, name_to);
     if (ret == -1) {
         ret = -errno;
+    } else {
+        dircache_forget(state->dirs, from, 1);
+        dircache_forget(state->dirs, to, 1);
     }
-    fullpath_from = KFS_BUFSTRFREE(fullpath_from, pathbuf_from);
-    fullpath_to = KFS_BUFSTRFREE(fullpath_to, pathbuf_to);
+    dircache_put(state->dirs, &dir_from);
+    dircache_put(state->dirs, &dir_to);
 
     KFS_RETURN(ret);
 }
@@ -394,26 +713,30 @@ posix_rename(const kfs_context_t co, const char *from, const char *to)
 static int
 posix_link(const kfs_context_t co, const char *from, const char *to)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf_from[PATHBUF_SIZE];
-    char pathbuf_to[PATHBUF_SIZE];
-    char *fullpath_from = NULL;
-    char *fullpath_to = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir_from;
+    struct dirfd_ref dir_to;
+    const char *name_from = NULL;
+    const char *name_to = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(from[0] == '/' && to[0] == '/');
-    fullpath_from = kfs_bufstrcat(pathbuf_from, mountroot, from,
-            NUMELEM(pathbuf_from));
-    fullpath_to = kfs_bufstrcat(pathbuf_to, mountroot, to,
-            NUMELEM(pathbuf_to));
-    ret = link(fullpath_from, fullpath_to);
+    ret = resolve(state, from, &dir_from, &name_from);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    ret = resolve(state, to, &dir_to, &name_to);
+    if (ret != 0) {
+        dircache_put(state->dirs, &dir_from);
+        KFS_RETURN(ret);
+    }
+    ret = linkat(dir_from.fd, name_from, dir_to.fd, name_to, 0);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath_from = KFS_BUFSTRFREE(fullpath_from, pathbuf_from);
-    fullpath_to = KFS_BUFSTRFREE(fullpath_to, pathbuf_to);
+    dircache_put(state->dirs, &dir_from);
+    dircache_put(state->dirs, &dir_to);
 
     KFS_RETURN(ret);
 }
@@ -421,23 +744,22 @@ posix_link(const kfs_context_t co, const char *from, const char *to)
 static int
 posix_chmod(const kfs_context_t co, const char *fusepath, mode_t mode)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = chmod(fullpath, mode);
+    ret = fchmodat(dir.fd, name, mode, 0);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -445,23 +767,22 @@ posix_chmod(const kfs_context_t co, const char *fusepath, mode_t mode)
 static int
 posix_chown(const kfs_context_t co, const char *fusepath, uid_t uid, gid_t gid)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = lchown(fullpath, uid, gid);
+    ret = fchownat(dir.fd, name, uid, gid, AT_SYMLINK_NOFOLLOW);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -475,19 +796,27 @@ static int
 posix_read(const kfs_context_t co, const char *fusepath, char *buf, size_t size,
         off_t offset, struct fuse_file_info *fi)
 {
-    (void) co;
     (void) fusepath;
 
+    const struct posix_state * const state = co->priv;
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = pread(fi->fh, buf, size, offset);
-    if (ret == -1) {
-        ret = -errno;
+    if (FH_IS_DIRECT(fi->fh)) {
+        KFS_RETURN(direct_read(state, fi->fh, buf, size, offset));
+    }
+    if (state->maps != NULL) {
+        ret = mapcache_read(state->maps, FH_FD(fi->fh), buf, size, offset);
+        if (ret != -1) {
+            KFS_RETURN(ret);
+        }
+    }
+    if (state->advisor != NULL) {
+        advise_read(state->advisor, FH_FD(fi->fh), offset, size);
     }
 
-    KFS_RETURN(ret);
+    KFS_RETURN(do_pread(state, FH_FD(fi->fh), buf, size, offset));
 }
 
 /**
@@ -497,6 +826,27 @@ static int
 posix_write(const kfs_context_t co, const char *fusepath, const char *buf,
         size_t size, off_t offset,
         struct fuse_file_info *fi)
+{
+    (void) fusepath;
+
+    const struct posix_state * const state = co->priv;
+
+    KFS_ENTER();
+
+    if (FH_IS_DIRECT(fi->fh)) {
+        KFS_RETURN(direct_write(state, fi->fh, buf, size, offset));
+    }
+
+    KFS_RETURN(do_pwrite(state, FH_FD(fi->fh), buf, size, offset));
+}
+
+/**
+ * Allocate disk space for part of a file, or free it again (mode is as for
+ * fallocate(2)). Elsewhere than on Linux there is no such thing.
+ */
+static int
+posix_falloc(const kfs_context_t co, const char *fusepath, int mode, off_t
+        offset, off_t len, struct fuse_file_info *fi)
 {
     (void) co;
     (void) fusepath;
@@ -505,38 +855,138 @@ posix_write(const kfs_context_t co, const char *fusepath, const char *buf,
 
     KFS_ENTER();
 
-    ret = pwrite(fi->fh, buf, size, offset);
+#ifdef __linux__
+    ret = fallocate(FH_FD(fi->fh), mode, offset, len);
     if (ret == -1) {
-        KFS_RETURN(-errno);
+        ret = -errno;
     }
+#else
+    (void) mode;
+    (void) offset;
+    (void) len;
+    (void) fi;
+    ret = -EOPNOTSUPP;
+#endif
 
     KFS_RETURN(ret);
 }
 
+#ifdef FICLONERANGE
+/**
+ * Let the output file share the blocks of the input file (a reflink), if the
+ * file system supports that. Only whole blocks can be shared, except at the
+ * end of the input file. Returns the number of bytes cloned, or -1 if it can
+ * not be done this way.
+ */
+static ssize_t
+clone_range(int fd_in, off_t offset_in, int fd_out, off_t offset_out, size_t
+        size)
+{
+    struct file_clone_range fcr;
+    struct stat st;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = fstat(fd_in, &st);
+    if (ret == -1 || !S_ISREG(st.st_mode) || offset_in >= st.st_size ||
+            st.st_blksize <= 0) {
+        KFS_RETURN(-1);
+    }
+    if (offset_in % st.st_blksize != 0 || offset_out % st.st_blksize != 0) {
+        KFS_RETURN(-1);
+    }
+    if (size >= (size_t) (st.st_size - offset_in)) {
+        size = st.st_size - offset_in;
+    } else {
+        size -= size % st.st_blksize;
+        if (size == 0) {
+            KFS_RETURN(-1);
+        }
+    }
+    fcr.src_fd = fd_in;
+    fcr.src_offset = offset_in;
+    fcr.src_length = size;
+    fcr.dest_offset = offset_out;
+    ret = ioctl(fd_out, FICLONERANGE, &fcr);
+    if (ret == -1) {
+        KFS_RETURN(-1);
+    }
+
+    KFS_RETURN(size);
+}
+#endif
+
+/**
+ * Copy part of a file to another without the data leaving the kernel: by
+ * sharing the blocks where possible, with copy_file_range() otherwise.
+ */
 static int
-posix_statfs(const kfs_context_t co, const char *fusepath, struct statvfs *buf)
+posix_copy_file_range(const kfs_context_t co, const char *path_in, struct
+        fuse_file_info *fi_in, off_t offset_in, const char *path_out, struct
+        fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
 {
     (void) co;
+    (void) path_in;
+    (void) path_out;
+
+    const int fd_in = FH_BUFFERED_FD(fi_in->fh);
+    const int fd_out = FH_BUFFERED_FD(fi_out->fh);
+#ifdef __NR_copy_file_range
+    loff_t off_in = offset_in;
+    loff_t off_out = offset_out;
+#endif
+    ssize_t ret = 0;
 
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
+    KFS_ENTER();
+
+    size = MIN(size, COPY_MAX);
+#ifdef FICLONERANGE
+    if (flags == 0) {
+        ret = clone_range(fd_in, offset_in, fd_out, offset_out, size);
+        if (ret != -1) {
+            KFS_RETURN(ret);
+        }
+    }
+#endif
+#ifdef __NR_copy_file_range
+    ret = syscall(__NR_copy_file_range, fd_in, &off_in, fd_out, &off_out,
+            size, flags);
+    if (ret != -1) {
+        KFS_RETURN(ret);
+    }
+    if (errno != ENOSYS && errno != EOPNOTSUPP && errno != EXDEV) {
+        KFS_RETURN(-errno);
+    }
+#endif
+
+    KFS_RETURN(-EXDEV);
+}
+
+/**
+ * Statistics of the file system the directory of given path is on.
+ */
+static int
+posix_statfs(const kfs_context_t co, const char *fusepath, struct statvfs *buf)
+{
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = statvfs(fullpath, buf);
+    ret = fstatvfs(dir.fd, buf);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
-    KFS_RETURN(0);
+    KFS_RETURN(ret);
 }
 
 /**
@@ -557,7 +1007,7 @@ posix_flush(const kfs_context_t co, const char *fusepath, struct fuse_file_info
     KFS_ENTER();
 
     /** This is a POSIX equivalent to flushing data to a OS without closing. */
-    ret = dup(fi->fh);
+    ret = dup(FH_FD(fi->fh));
     if (ret != -1) {
         ret = close(ret);
         if (ret == 0) {
@@ -572,14 +1022,31 @@ static int
 posix_release(const kfs_context_t co, const char *fusepath, struct fuse_file_info
         *fi)
 {
-    (void) co;
     (void) fusepath;
 
+    const struct posix_state * const state = co->priv;
+    const int fd = FH_FD(fi->fh);
+    const int buffered_fd = FH_BUFFERED_FD(fi->fh);
     int ret = 0;
 
     KFS_ENTER();
 
-    ret = close(fi->fh);
+    if (state->ring != NULL) {
+        uring_unregister_fd(state->ring, fd);
+        if (buffered_fd != fd) {
+            uring_unregister_fd(state->ring, buffered_fd);
+        }
+    }
+    if (state->advisor != NULL) {
+        advise_close(state->advisor, buffered_fd);
+    }
+    if (state->maps != NULL) {
+        mapcache_close(state->maps, buffered_fd);
+    }
+    if (buffered_fd != fd) {
+        close(buffered_fd);
+    }
+    ret = close(fd);
     if (ret == -1) {
         KFS_RETURN(-errno);
     }
@@ -591,25 +1058,27 @@ static int
 posix_fsync(const kfs_context_t co, const char *fusepath, int datasync, struct
         fuse_file_info *fi)
 {
-    (void) co;
-#ifndef KFS_USE_FDATASYNC
-    (void) datasync;
-#endif
     (void) fusepath;
 
+    const struct posix_state * const state = co->priv;
     int ret = 0;
 
     KFS_ENTER();
 
+    if (state->commit != NULL) {
+        KFS_RETURN(groupsync_sync(state->commit, FH_FD(fi->fh), datasync));
+    }
+    if (state->ring != NULL) {
+        KFS_RETURN(uring_fsync(state->ring, FH_FD(fi->fh), datasync));
+    }
 #ifdef KFS_USE_FDATASYNC
     if (datasync) {
-        ret = fdatasync(fi->fh);
+        ret = fdatasync(FH_FD(fi->fh));
     } else
-#else
+#endif
     {
-        ret = fsync(fi->fh);
+        ret = fsync(FH_FD(fi->fh));
     }
-#endif
     if (ret == -1) {
         KFS_RETURN(-errno);
     }
@@ -619,14 +1088,50 @@ posix_fsync(const kfs_context_t co, const char *fusepath, int datasync, struct
 
 
 /*
- * Extended attributes.
+ * Extended attributes. There are no *at() variants of these, they take the
+ * full path.
  */
 
+/**
+ * Warm up the tree below given directory in the background. Only root and the
+ * owner of the directory may do this, it costs a lot of I/O. Returns 0 or
+ * -errno.
+ */
+static int
+start_warmup(const kfs_context_t co, const struct posix_state *state, const
+        char *fusepath)
+{
+    struct dirfd_ref dir;
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* Also makes sure it is a directory inside the root. */
+    ret = dircache_get(state->dirs, fusepath, strcmp(fusepath, "/") == 0 ? 0 :
+            strlen(fusepath), &dir);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+    ret = fstat(dir.fd, &stbuf);
+    if (ret == -1) {
+        ret = -errno;
+    } else if (co->uid != 0 && co->uid != stbuf.st_uid) {
+        ret = -EPERM;
+    }
+    dircache_put(state->dirs, &dir);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
+
+    KFS_RETURN(warmup_start(state->warm, fusepath));
+}
+
 static int
 posix_setxattr(const kfs_context_t co, const char *fusepath, const char *name,
         const char *value, size_t size, int flags)
 {
-    const char * const mountroot = co->priv;
+    const struct posix_state * const state = co->priv;
     char pathbuf[PATHBUF_SIZE];
     int ret = 0;
     char *fullpath = NULL;
@@ -634,7 +1139,11 @@ posix_setxattr(const kfs_context_t co, const char *fusepath, const char *name,
     KFS_ENTER();
 
     KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
+    if (state->warm != NULL && strcmp(name, WARMUP_XATTR) == 0) {
+        KFS_RETURN(start_warmup(co, state, fusepath));
+    }
+    fullpath = kfs_bufstrcat(pathbuf, state->mountroot, fusepath,
+            NUMELEM(pathbuf));
     if (fullpath == NULL) {
         KFS_RETURN(-errno);
     }
@@ -651,15 +1160,30 @@ static int
 posix_getxattr(const kfs_context_t co, const char *fusepath, const char *name,
         char *value, size_t size)
 {
-    const char * const mountroot = co->priv;
+    const struct posix_state * const state = co->priv;
     char pathbuf[PATHBUF_SIZE];
+    /* Room for both counters at their maximum. */
+    char status[96];
     int ret = 0;
     char *fullpath = NULL;
 
     KFS_ENTER();
 
     KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
+    if (state->warm != NULL && strcmp(name, WARMUP_XATTR) == 0) {
+        ret = MIN(warmup_status(state->warm, status, sizeof(status)),
+                sizeof(status) - 1);
+        if (size == 0) {
+            KFS_RETURN(ret);
+        }
+        if (size < (size_t) ret) {
+            KFS_RETURN(-ERANGE);
+        }
+        memcpy(value, status, ret);
+        KFS_RETURN(ret);
+    }
+    fullpath = kfs_bufstrcat(pathbuf, state->mountroot, fusepath,
+            NUMELEM(pathbuf));
     if (fullpath == NULL) {
         KFS_RETURN(-errno);
     }
@@ -676,7 +1200,7 @@ static int
 posix_listxattr(const kfs_context_t co, const char *fusepath, char *list, size_t
         size)
 {
-    const char * const mountroot = co->priv;
+    const struct posix_state * const state = co->priv;
     char pathbuf[PATHBUF_SIZE];
     ssize_t ret = 0;
     char *fullpath = NULL;
@@ -684,7 +1208,8 @@ posix_listxattr(const kfs_context_t co, const char *fusepath, char *list, size_t
     KFS_ENTER();
 
     KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
+    fullpath = kfs_bufstrcat(pathbuf, state->mountroot, fusepath,
+            NUMELEM(pathbuf));
     if (fullpath == NULL) {
         KFS_RETURN(-errno);
     }
@@ -701,7 +1226,7 @@ static int
 posix_removexattr(const kfs_context_t co, const char *fusepath, const char
         *name)
 {
-    const char * const mountroot = co->priv;
+    const struct posix_state * const state = co->priv;
     char pathbuf[PATHBUF_SIZE];
     int ret = 0;
     char *fullpath = NULL;
@@ -709,7 +1234,8 @@ posix_removexattr(const kfs_context_t co, const char *fusepath, const char
     KFS_ENTER();
 
     KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
+    fullpath = kfs_bufstrcat(pathbuf, state->mountroot, fusepath,
+            NUMELEM(pathbuf));
     if (fullpath == NULL) {
         ret = -errno;
     }
@@ -729,23 +1255,22 @@ posix_removexattr(const kfs_context_t co, const char *fusepath, const char
 static int
 posix_mkdir(const kfs_context_t co, const char *fusepath, mode_t mode)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    ret = mkdir(fullpath, mode);
+    ret = mkdirat(dir.fd, name, mode);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -754,33 +1279,40 @@ static int
 posix_opendir(const kfs_context_t co, const char *fusepath, struct
         fuse_file_info *fi)
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    char *fullpath = NULL;
-    DIR *dir = NULL;
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref parent;
+    const char *name = NULL;
+    struct dirlist *dl = NULL;
+    int fd = 0;
     int ret = 0;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &parent, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    dir = opendir(fullpath);
-    if (dir == NULL) {
+    fd = openat(parent.fd, name, O_RDONLY | O_DIRECTORY);
+    if (fd == -1) {
         ret = -errno;
     } else {
-        KFS_ASSERT(sizeof(dir) <= sizeof(fi->fh));
-        memcpy(&fi->fh, &dir, sizeof(dir));
+        dl = dirlist_open(fd, state->full_stat, state->stat_pool);
+        if (dl == NULL) {
+            ret = -ENOMEM;
+            close(fd);
+        } else {
+            KFS_ASSERT(sizeof(dl) <= sizeof(fi->fh));
+            memcpy(&fi->fh, &dl, sizeof(dl));
+        }
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &parent);
 
     KFS_RETURN(ret);
 }
 
 /**
- * List directory contents.
+ * List directory contents. Unless readdir_stat = full, the attributes passed
+ * to the filler are only the inode number and the file type.
  */
 static int
 posix_readdir(const kfs_context_t co, const char *fusepath, void *buf,
@@ -789,35 +1321,28 @@ posix_readdir(const kfs_context_t co, const char *fusepath, void *buf,
     (void) co;
     (void) fusepath;
 
-    struct stat stbuf;
-    struct stat *stbufp = NULL;
-    DIR *dir = NULL;
-    struct dirent *de = NULL;
+    struct dirlist *dl = NULL;
+    struct dirlist_entry de;
     int ret = 0;
 
     KFS_ENTER();
 
-    memcpy(&dir, &fi->fh, sizeof(dir));
-    seekdir(dir, offset);
+    memcpy(&dl, &fi->fh, sizeof(dl));
+    ret = dirlist_seek(dl, offset);
+    if (ret != 0) {
+        KFS_RETURN(ret);
+    }
     for (;;) {
-        /* Get an entry. */
-        errno = 0;
-        de = readdir(dir);
-        if (de == NULL) {
-            KFS_RETURN(-errno); /* This is probably 0, but that is just fine. */
+        ret = dirlist_peek(dl, &de);
+        if (ret <= 0) {
+            KFS_RETURN(ret);
         }
-        /* Stat that entry. TODO: this is not POSIX compliant. */
-        stbufp = &stbuf;
-        ret = fstatat(dirfd(dir), de->d_name, stbufp, AT_SYMLINK_NOFOLLOW);
-        if (ret == -1) {
-            stbufp = NULL;
-            KFS_WARNING("fstatat: %s", strerror(errno));
-        }
-        /* Add it to the return-buffer. */
-        ret = filler(buf, de->d_name, stbufp, telldir(dir));
+        /* A full buffer: the entry is returned again by the next call. */
+        ret = filler(buf, de.name, de.stbuf, de.off);
         if (ret == 1) {
             KFS_RETURN(0);
         }
+        dirlist_next(dl);
     }
 
     /* Control never reaches this point. */
@@ -832,16 +1357,12 @@ posix_releasedir(const kfs_context_t co, const char *fusepath, struct
     (void) co;
     (void) fusepath;
 
-    DIR *dir = NULL;
-    int ret = 0;
+    struct dirlist *dl = NULL;
 
     KFS_ENTER();
 
-    memcpy(&dir, &fi->fh, sizeof(dir));
-    ret = closedir(dir);
-    if (ret == -1) {
-        KFS_RETURN(-errno);
-    }
+    memcpy(&dl, &fi->fh, sizeof(dl));
+    dl = dirlist_close(dl);
 
     KFS_RETURN(0);
 }
@@ -853,29 +1374,22 @@ static int
 posix_utimens(const kfs_context_t co, const char *fusepath, const struct
         timespec tvnano[2])
 {
-    const char * const mountroot = co->priv;
-    char pathbuf[PATHBUF_SIZE];
-    struct timeval tvmicro[2];
+    struct posix_state * const state = co->priv;
+    struct dirfd_ref dir;
+    const char *name = NULL;
     int ret = 0;
-    char *fullpath = NULL;
 
     KFS_ENTER();
 
-    KFS_ASSERT(fusepath[0] == '/');
-    fullpath = kfs_bufstrcat(pathbuf, mountroot, fusepath, NUMELEM(pathbuf));
-    if (fullpath == NULL) {
-        KFS_RETURN(-errno);
+    ret = resolve(state, fusepath, &dir, &name);
+    if (ret != 0) {
+        KFS_RETURN(ret);
     }
-    /* This could also use gnulib.utimens, but gnulib is too big for now. */
-    tvmicro[0].tv_sec = tvnano[0].tv_sec;
-    tvmicro[0].tv_usec = tvnano[0].tv_nsec / 1000;
-    tvmicro[1].tv_sec = tvnano[1].tv_sec;
-    tvmicro[1].tv_usec = tvnano[1].tv_nsec / 1000;
-    ret = utimes(fullpath, tvmicro);
+    ret = utimensat(dir.fd, name, tvnano, 0);
     if (ret == -1) {
         ret = -errno;
     }
-    fullpath = KFS_BUFSTRFREE(fullpath, pathbuf);
+    dircache_put(state->dirs, &dir);
 
     KFS_RETURN(ret);
 }
@@ -919,8 +1433,50 @@ static const struct kfs_operations posix_oper = {
     .ioctl = nosys_ioctl,
     .poll = nosys_poll,
 #endif
+    .fallocate = posix_falloc,
+    .copy_file_range = posix_copy_file_range,
 };
 
+/**
+ * Free a (partially) initialised state.
+ */
+static struct posix_state *
+del_state(struct posix_state *state)
+{
+    KFS_ENTER();
+
+    if (state->warm != NULL) {
+        state->warm = warmup_del(state->warm);
+    }
+    if (state->maps != NULL) {
+        state->maps = mapcache_del(state->maps);
+    }
+    if (state->commit != NULL) {
+        state->commit = groupsync_del(state->commit);
+    }
+    if (state->advisor != NULL) {
+        state->advisor = advisor_del(state->advisor);
+    }
+    if (state->ring != NULL) {
+        state->ring = uring_del(state->ring);
+    }
+    if (state->stat_pool != NULL) {
+        state->stat_pool = kfs_workqueue_del(state->stat_pool);
+    }
+    if (state->dirs != NULL) {
+        state->dirs = dircache_del(state->dirs);
+    }
+    if (state->rootfd != -1) {
+        close(state->rootfd);
+    }
+    if (state->mountroot != NULL) {
+        state->mountroot = KFS_FREE(state->mountroot);
+    }
+    state = KFS_FREE(state);
+
+    KFS_RETURN(NULL);
+}
+
 /**
  * Global initialization.
  */
@@ -930,7 +1486,16 @@ kenny_init(const char *conffile, const char *section, size_t num_subvolumes,
 {
     (void) subvolumes;
 
-    char *mountroot = NULL;
+    struct posix_state *state = NULL;
+    char *readdir_stat = NULL;
+    char *io_engine = NULL;
+    char *io_mode = NULL;
+    long int cache_size = 0;
+    long int stat_threads = 0;
+    long int uring_entries = 0;
+    long int commit_interval = 0;
+    long int mmap_max = 0;
+    long int warmup_threads = 0;
 
     KFS_ENTER();
 
@@ -939,15 +1504,139 @@ kenny_init(const char *conffile, const char *section, size_t num_subvolumes,
         KFS_ERROR("Brick `%s' (POSIX) takes no subvolumes.", section);
         KFS_RETURN(NULL);
     }
-    mountroot = kfs_ini_gets(conffile, section, "path");
-    if (mountroot == NULL) {
+    cache_size = ini_getl(section, "dirfd_cache", DIRFD_CACHE_DEFAULT,
+            conffile);
+    stat_threads = ini_getl(section, "stat_threads", STAT_THREADS_DEFAULT,
+            conffile);
+    uring_entries = ini_getl(section, "uring_entries", URING_ENTRIES_DEFAULT,
+            conffile);
+    commit_interval = ini_getl(section, "commit_interval", 0, conffile);
+    mmap_max = ini_getl(section, "mmap_max", 0, conffile);
+    warmup_threads = ini_getl(section, "warmup_threads",
+            WARMUP_THREADS_DEFAULT, conffile);
+    if (cache_size < 0 || stat_threads < 0 || uring_entries <= 0 ||
+            commit_interval < 0 || mmap_max < 0 || warmup_threads < 0) {
+        KFS_ERROR("Illegal numeric option value in brick %s.", section);
+        KFS_RETURN(NULL);
+    }
+    state = KFS_MALLOC(sizeof(*state));
+    if (state == NULL) {
+        KFS_RETURN(NULL);
+    }
+    state->rootfd = -1;
+    state->dirs = NULL;
+    state->full_stat = 0;
+    state->stat_pool = NULL;
+    state->ring = NULL;
+    state->direct = 0;
+    state->advisor = NULL;
+    state->commit = NULL;
+    state->maps = NULL;
+    state->warm = NULL;
+    state->mountroot = kfs_ini_gets(conffile, section, "path");
+    if (state->mountroot == NULL) {
         KFS_ERROR("Missing value `path' in section [%s] of file %s.", section,
                 conffile);
+        state = del_state(state);
+        KFS_RETURN(NULL);
+    }
+    readdir_stat = kfs_ini_gets(conffile, section, "readdir_stat");
+    if (readdir_stat != NULL) {
+        if (strcmp(readdir_stat, "full") == 0) {
+            state->full_stat = 1;
+        } else if (strcmp(readdir_stat, "type") != 0) {
+            KFS_ERROR("Unknown readdir_stat `%s' in brick %s.", readdir_stat,
+                    section);
+            readdir_stat = KFS_FREE(readdir_stat);
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+        readdir_stat = KFS_FREE(readdir_stat);
+    }
+    state->rootfd = open(state->mountroot, O_RDONLY | O_DIRECTORY);
+    if (state->rootfd == -1) {
+        KFS_ERROR("Opening `%s' failed: %s", state->mountroot,
+                strerror(errno));
+        state = del_state(state);
         KFS_RETURN(NULL);
     }
-    KFS_INFO("Started POSIX brick `%s': mirroring `%s'.", section, mountroot);
+    state->dirs = dircache_new(state->rootfd, cache_size);
+    if (state->dirs == NULL) {
+        state = del_state(state);
+        KFS_RETURN(NULL);
+    }
+    if (state->full_stat && stat_threads > 0) {
+        state->stat_pool = kfs_workqueue_new(stat_threads);
+        if (state->stat_pool == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
+    io_engine = kfs_ini_gets(conffile, section, "io_engine");
+    if (io_engine != NULL) {
+        if (strcmp(io_engine, "uring") == 0) {
+            /* Without io_uring, just go on with ordinary system calls. */
+            state->ring = uring_new(uring_entries);
+        } else if (strcmp(io_engine, "sync") != 0) {
+            KFS_ERROR("Unknown io_engine `%s' in brick %s.", io_engine,
+                    section);
+            io_engine = KFS_FREE(io_engine);
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+        io_engine = KFS_FREE(io_engine);
+    }
+    io_mode = kfs_ini_gets(conffile, section, "io_mode");
+    if (io_mode != NULL) {
+        if (strcmp(io_mode, "direct") == 0) {
+#ifdef O_DIRECT
+            state->direct = 1;
+#else
+            KFS_WARNING("O_DIRECT is not supported, using io_mode = buffered.");
+#endif
+        } else if (strcmp(io_mode, "buffered") != 0) {
+            KFS_ERROR("Unknown io_mode `%s' in brick %s.", io_mode, section);
+            io_mode = KFS_FREE(io_mode);
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+        io_mode = KFS_FREE(io_mode);
+    }
+    if (ini_getl(section, "access_hints", 1, conffile) != 0) {
+        state->advisor = advisor_new(ini_getl(section, "drop_behind", 0,
+                    conffile) != 0);
+        if (state->advisor == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (ini_getl(section, "group_commit", 0, conffile) != 0) {
+        /* Without it, just go on with an fsync for every file. */
+        state->commit = groupsync_new(state->rootfd, (uint64_t)
+                commit_interval * 1000);
+    }
+    if (mmap_max > 0) {
+        state->maps = mapcache_new(mmap_max);
+        if (state->maps == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+    }
+    if (warmup_threads > 0) {
+        state->warm = warmup_new(state->rootfd, warmup_threads);
+        if (state->warm == NULL) {
+            state = del_state(state);
+            KFS_RETURN(NULL);
+        }
+        if (ini_getl(section, "warmup", 0, conffile) != 0 &&
+                warmup_start(state->warm, "/") != 0) {
+            KFS_WARNING("Could not start warming up brick %s.", section);
+        }
+    }
+    KFS_INFO("Started POSIX brick `%s': mirroring `%s'.", section,
+            state->mountroot);
 
-    KFS_RETURN(mountroot);
+    KFS_RETURN(state);
 }
 
 /*
@@ -969,7 +1658,7 @@ kenny_halt(void *private_data)
 {
     KFS_ENTER();
 
-    private_data = KFS_FREE(private_data);
+    private_data = del_state(private_data);
 
     KFS_RETURN();
 }
@@ -0,0 +1,468 @@
+/**
+ * Small files in memory for the POSIX brick: a file of at most mmap_max bytes
+ * that is opened for reading is read into memory once, and reads from it are a
+ * memcpy() instead of a system call.
+ *
+ * These are copies, not mappings of the file: a mapping would raise SIGBUS
+ * when the file is truncated behind the brick's back. A copy is only taken if
+ * the file did not change while it was read, and is shared by every handle on
+ * the same file (device and inode). It is kept for a while after the last one
+ * is closed, so a file that is opened over and over is only read once.
+ * Opening a file for writing (or truncating it) drops the copy, and none is
+ * taken again until all handles that can change it are closed. A copy is also
+ * replaced when the file has changed size or modification time by the next
+ * time it is opened; handles that were already open keep reading the old one.
+ *
+ * Handles are kept in a table indexed by file descriptor, higher file
+ * descriptors never get a copy. Should a writer ever get one, there would be
+ * no telling when it is closed, and copying is turned off for good.
+ */
+
+#include "posix_brick/mapcache.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+/** File descriptors below this can have a copy. */
+#define MAPCACHE_FDS 4096
+/** Number of buckets in the hash table of files. */
+#define MAPCACHE_BUCKETS 1024
+/** Copies kept after the last handle on their file was closed. */
+#define MAPCACHE_IDLE 1024
+
+struct map_entry {
+    dev_t dev;
+    ino_t ino;
+    /** The copy, or NULL. Only changed with the lock held for writing. */
+    char *data;
+    size_t size;
+    struct timespec mtime;
+    /** Handles on this file in the table, and how many of those can write. */
+    uint_t refs;
+    uint_t writers;
+    /** Incremented whenever a handle that can write is added. */
+    uint_t changes;
+    /** Held for reading while copying from data. */
+    kfs_rwlock_t lock;
+    struct map_entry *next;
+    /** Idle list, for entries without handles that still have a copy. */
+    struct map_entry *idle_prev;
+    struct map_entry *idle_next;
+};
+
+struct map_slot {
+    struct map_entry *entry;
+    uint_t writer;
+};
+
+struct mapcache {
+    size_t max_size;
+    /** Set when a writer got a file descriptor beyond the table. */
+    uint_t disabled;
+    /** Protects everything but the copies. */
+    kfs_mutex_t lock;
+    struct map_entry *buckets[MAPCACHE_BUCKETS];
+    /** Least recently used at the head. */
+    struct map_entry *idle_head;
+    struct map_entry *idle_tail;
+    uint_t num_idle;
+    struct map_slot slots[MAPCACHE_FDS];
+};
+
+/**
+ * Returns NULL on failure.
+ */
+struct mapcache *
+mapcache_new(size_t max_size)
+{
+    struct mapcache *mc = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    mc = KFS_CALLOC(1, sizeof(*mc));
+    if (mc == NULL) {
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&mc->lock);
+    if (ret != 0) {
+        mc = KFS_FREE(mc);
+        KFS_RETURN(NULL);
+    }
+    mc->max_size = max_size;
+
+    KFS_RETURN(mc);
+}
+
+static uint_t
+hash_file(dev_t dev, ino_t ino)
+{
+    KFS_ENTER();
+
+    KFS_RETURN(((uint64_t) ino * 0x9e3779b97f4a7c15ULL ^ (uint64_t) dev) %
+            MAPCACHE_BUCKETS);
+}
+
+static void
+drop_copy(struct map_entry *entry)
+{
+    KFS_ENTER();
+
+    kfs_rwlock_writelock(&entry->lock);
+    if (entry->data != NULL) {
+        entry->data = KFS_FREE(entry->data);
+    }
+    kfs_rwlock_unlock(&entry->lock);
+
+    KFS_RETURN();
+}
+
+static void
+idle_remove(struct mapcache *mc, struct map_entry *entry)
+{
+    KFS_ENTER();
+
+    if (entry->idle_prev != NULL) {
+        entry->idle_prev->idle_next = entry->idle_next;
+    } else {
+        mc->idle_head = entry->idle_next;
+    }
+    if (entry->idle_next != NULL) {
+        entry->idle_next->idle_prev = entry->idle_prev;
+    } else {
+        mc->idle_tail = entry->idle_prev;
+    }
+    entry->idle_prev = entry->idle_next = NULL;
+    mc->num_idle--;
+
+    KFS_RETURN();
+}
+
+/**
+ * Take an entry without handles out of the hash table and free it.
+ */
+static void
+free_entry(struct mapcache *mc, struct map_entry *entry)
+{
+    struct map_entry **p = NULL;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(entry->refs == 0);
+    p = &mc->buckets[hash_file(entry->dev, entry->ino)];
+    while (*p != entry) {
+        p = &(*p)->next;
+    }
+    *p = entry->next;
+    if (entry->data != NULL) {
+        entry->data = KFS_FREE(entry->data);
+    }
+    kfs_rwlock_destroy(&entry->lock);
+    entry = KFS_FREE(entry);
+
+    KFS_RETURN();
+}
+
+struct mapcache *
+mapcache_del(struct mapcache *mc)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(mc != NULL);
+    for (i = 0; i < MAPCACHE_FDS; i++) {
+        if (mc->slots[i].entry != NULL) {
+            mc->slots[i].entry->refs--;
+        }
+    }
+    for (i = 0; i < MAPCACHE_BUCKETS; i++) {
+        while (mc->buckets[i] != NULL) {
+            free_entry(mc, mc->buckets[i]);
+        }
+    }
+    kfs_mutex_destroy(&mc->lock);
+    mc = KFS_FREE(mc);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Find the entry for a file, or add one. Returns NULL on failure.
+ */
+static struct map_entry *
+get_entry(struct mapcache *mc, const struct stat *stbuf)
+{
+    struct map_entry *entry = NULL;
+    uint_t h = 0;
+
+    KFS_ENTER();
+
+    h = hash_file(stbuf->st_dev, stbuf->st_ino);
+    for (entry = mc->buckets[h]; entry != NULL; entry = entry->next) {
+        if (entry->dev == stbuf->st_dev && entry->ino == stbuf->st_ino) {
+            if (entry->refs == 0) {
+                idle_remove(mc, entry);
+            }
+            KFS_RETURN(entry);
+        }
+    }
+    entry = KFS_CALLOC(1, sizeof(*entry));
+    if (entry == NULL) {
+        KFS_RETURN(NULL);
+    }
+    if (kfs_rwlock_init(&entry->lock) != 0) {
+        entry = KFS_FREE(entry);
+        KFS_RETURN(NULL);
+    }
+    entry->dev = stbuf->st_dev;
+    entry->ino = stbuf->st_ino;
+    entry->next = mc->buckets[h];
+    mc->buckets[h] = entry;
+
+    KFS_RETURN(entry);
+}
+
+/**
+ * Stop copying anything: drop every copy and forget the idle files.
+ */
+static void
+disable(struct mapcache *mc)
+{
+    struct map_entry *entry = NULL;
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_WARNING("File descriptor beyond %d, no longer keeping files in "
+            "memory.", MAPCACHE_FDS);
+    mc->disabled = 1;
+    while (mc->idle_head != NULL) {
+        entry = mc->idle_head;
+        idle_remove(mc, entry);
+        free_entry(mc, entry);
+    }
+    for (i = 0; i < MAPCACHE_BUCKETS; i++) {
+        for (entry = mc->buckets[i]; entry != NULL; entry = entry->next) {
+            drop_copy(entry);
+        }
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Read all of a file that has the given attributes. Returns NULL if it can not
+ * be read, or if it changed in the meantime.
+ */
+static char *
+read_file(int fd, const struct stat *stbuf)
+{
+    struct stat after;
+    char *data = NULL;
+    size_t done = 0;
+    ssize_t ret = 0;
+
+    KFS_ENTER();
+
+    data = KFS_MALLOC(stbuf->st_size);
+    if (data == NULL) {
+        KFS_RETURN(NULL);
+    }
+    while (done < (size_t) stbuf->st_size) {
+        ret = pread(fd, data + done, stbuf->st_size - done, done);
+        if (ret == -1 && errno == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            break;
+        }
+        done += ret;
+    }
+    /* Even a byte more means it changed (and so would the mtime). */
+    if (done != (size_t) stbuf->st_size || fstat(fd, &after) == -1 ||
+            after.st_size != stbuf->st_size || after.st_mtim.tv_sec !=
+            stbuf->st_mtim.tv_sec || after.st_mtim.tv_nsec !=
+            stbuf->st_mtim.tv_nsec) {
+        data = KFS_FREE(data);
+        KFS_RETURN(NULL);
+    }
+
+    KFS_RETURN(data);
+}
+
+/**
+ * Register a newly opened file. If it can change the file, any copy of it is
+ * dropped first; otherwise the file is read into memory if it is small enough.
+ * Nothing is done if the file can not be examined or read: reads just fall
+ * back to the file descriptor.
+ */
+void
+mapcache_open(struct mapcache *mc, int fd, int writable)
+{
+    struct map_entry *entry = NULL;
+    struct stat stbuf;
+    char *data = NULL;
+    uint_t changes = 0;
+
+    KFS_ENTER();
+
+    if (fd < 0 || fstat(fd, &stbuf) == -1 || !S_ISREG(stbuf.st_mode)) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&mc->lock);
+    if (mc->disabled) {
+        kfs_mutex_unlock(&mc->lock);
+        KFS_RETURN();
+    }
+    if (fd >= MAPCACHE_FDS) {
+        if (writable) {
+            disable(mc);
+        }
+        kfs_mutex_unlock(&mc->lock);
+        KFS_RETURN();
+    }
+    if (!writable && (stbuf.st_size <= 0 || (uint64_t) stbuf.st_size >
+                mc->max_size)) {
+        /* Not going to be copied, no need to keep track of it. */
+        entry = NULL;
+    } else {
+        entry = get_entry(mc, &stbuf);
+    }
+    if (entry == NULL) {
+        kfs_mutex_unlock(&mc->lock);
+        KFS_RETURN();
+    }
+    entry->refs++;
+    mc->slots[fd].entry = entry;
+    mc->slots[fd].writer = writable;
+    if (writable) {
+        entry->writers++;
+        entry->changes++;
+        drop_copy(entry);
+    } else if (entry->data != NULL && (entry->size != (size_t)
+                stbuf.st_size || entry->mtime.tv_sec != stbuf.st_mtim.tv_sec ||
+                entry->mtime.tv_nsec != stbuf.st_mtim.tv_nsec)) {
+        /* Changed since it was copied, from outside this brick. */
+        drop_copy(entry);
+    }
+    if (entry->writers != 0 || entry->data != NULL) {
+        kfs_mutex_unlock(&mc->lock);
+        KFS_RETURN();
+    }
+    /*
+     * Read it without holding up everybody else. The entry stays, this handle
+     * has a reference to it.
+     */
+    changes = entry->changes;
+    kfs_mutex_unlock(&mc->lock);
+    data = read_file(fd, &stbuf);
+    if (data == NULL) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&mc->lock);
+    if (mc->disabled || entry->changes != changes || entry->data != NULL) {
+        /* Opened for writing meanwhile, or someone else was quicker. */
+        data = KFS_FREE(data);
+    } else {
+        kfs_rwlock_writelock(&entry->lock);
+        entry->data = data;
+        entry->size = stbuf.st_size;
+        entry->mtime = stbuf.st_mtim;
+        kfs_rwlock_unlock(&entry->lock);
+    }
+    kfs_mutex_unlock(&mc->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Unregister a file that is about to be closed. Its copy is kept around for a
+ * while if nobody else has it open.
+ */
+void
+mapcache_close(struct mapcache *mc, int fd)
+{
+    struct map_entry *entry = NULL;
+
+    KFS_ENTER();
+
+    if (fd < 0 || fd >= MAPCACHE_FDS) {
+        KFS_RETURN();
+    }
+    kfs_mutex_lock(&mc->lock);
+    entry = mc->slots[fd].entry;
+    if (entry == NULL) {
+        kfs_mutex_unlock(&mc->lock);
+        KFS_RETURN();
+    }
+    entry->refs--;
+    if (mc->slots[fd].writer) {
+        entry->writers--;
+    }
+    mc->slots[fd].entry = NULL;
+    mc->slots[fd].writer = 0;
+    if (entry->refs == 0) {
+        if (entry->data == NULL) {
+            free_entry(mc, entry);
+        } else {
+            entry->idle_prev = mc->idle_tail;
+            if (mc->idle_tail != NULL) {
+                mc->idle_tail->idle_next = entry;
+            } else {
+                mc->idle_head = entry;
+            }
+            mc->idle_tail = entry;
+            mc->num_idle++;
+            if (mc->num_idle > MAPCACHE_IDLE) {
+                entry = mc->idle_head;
+                idle_remove(mc, entry);
+                free_entry(mc, entry);
+            }
+        }
+    }
+    kfs_mutex_unlock(&mc->lock);
+
+    KFS_RETURN();
+}
+
+/**
+ * Read from the copy of an open file. Returns the number of bytes read, or -1
+ * if there is no copy and the file has to be read from the file descriptor.
+ */
+int
+mapcache_read(struct mapcache *mc, int fd, char *buf, size_t size, off_t
+        offset)
+{
+    struct map_entry *entry = NULL;
+    int ret = -1;
+
+    KFS_ENTER();
+
+    /* The slot of an open file is not touched until it is closed. */
+    if (fd < 0 || fd >= MAPCACHE_FDS || mc->slots[fd].entry == NULL ||
+            offset < 0) {
+        KFS_RETURN(-1);
+    }
+    entry = mc->slots[fd].entry;
+    kfs_rwlock_readlock(&entry->lock);
+    if (entry->data != NULL) {
+        if ((uint64_t) offset >= entry->size) {
+            ret = 0;
+        } else {
+            ret = MIN(size, entry->size - offset);
+            memcpy(buf, entry->data + offset, ret);
+        }
+    }
+    kfs_rwlock_unlock(&entry->lock);
+
+    KFS_RETURN(ret);
+}
@@ -0,0 +1,18 @@
+#ifndef KFS_POSIX_BRICK_MAPCACHE_H
+#define KFS_POSIX_BRICK_MAPCACHE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+
+struct mapcache;
+
+struct mapcache * mapcache_new(size_t max_size);
+struct mapcache * mapcache_del(struct mapcache *mc);
+void mapcache_open(struct mapcache *mc, int fd, int writable);
+void mapcache_close(struct mapcache *mc, int fd);
+int mapcache_read(struct mapcache *mc, int fd, char *buf, size_t size, off_t
+        offset);
+
+#endif
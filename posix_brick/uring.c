@@ -0,0 +1,634 @@
+/**
+ * io_uring I/O engine for the POSIX brick: reads, writes and fsyncs of all
+ * threads go through one shared submission ring, so the kernel sees the whole
+ * queue at once instead of one blocking system call per thread.
+ *
+ * A request is put in the ring and submitted together with whatever other
+ * threads queued in the meantime. One of the waiting threads at a time (the
+ * leader) waits in the kernel for completions and hands them out; the others
+ * sleep on a condition variable until the leader has seen theirs. Low file
+ * descriptors of open files are registered with the ring (as the same slot
+ * number), which spares the kernel from looking them up for every request.
+ *
+ * The raw system calls are used, liburing is not needed. Where the kernel has
+ * no io_uring, or not the operations this needs, uring_new() fails and the
+ * brick falls back to ordinary system calls.
+ */
+
+/* Macro is necessary to get syscall(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/uring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  ifdef __NR_io_uring_setup
+#    include <linux/io_uring.h>
+#  endif
+#endif
+
+#include "kfs.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+/** File descriptors below this are registered with the ring. */
+#define URING_FILES 1024
+
+#ifdef __NR_io_uring_setup
+
+/** One request, on the stack of the thread waiting for it. */
+struct uring_req {
+    int res;
+    uint_t done;
+};
+
+struct uring {
+    int fd;
+    /* The mapped rings. */
+    void *sq_ptr;
+    size_t sq_size;
+    void *cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe *sqes;
+    size_t sqes_size;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    uint_t entries;
+    /** Requests in the ring, at most entries so neither ring can overflow. */
+    uint_t inflight;
+    /** Requests in the submission ring not yet passed to the kernel. */
+    uint_t unsubmitted;
+    /** Set while a thread is waiting in the kernel for completions. */
+    uint_t leader;
+    /** Number of registered file slots, 0 if not supported. */
+    uint_t num_files;
+    /** For every slot: is the file descriptor of that number registered? */
+    unsigned char *registered;
+    kfs_mutex_t lock;
+    /** Signalled when the leader handed out completions. */
+    kfs_cond_t completed;
+};
+
+static int
+sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+        unsigned flags)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            NULL, 0);
+
+    KFS_RETURN(ret);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Check that the kernel supports all operations used here.
+ */
+static int
+probe(int fd)
+{
+    static const int ops[] = {IORING_OP_READ, IORING_OP_WRITE,
+        IORING_OP_FSYNC};
+    struct io_uring_probe *pr = NULL;
+    const size_t size = sizeof(*pr) + 256 * sizeof(pr->ops[0]);
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    pr = KFS_CALLOC(1, size);
+    if (pr == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    ret = sys_io_uring_register(fd, IORING_REGISTER_PROBE, pr, 256);
+    if (ret == -1) {
+        ret = -errno;
+    } else {
+        for (i = 0; i < NUMELEM(ops); i++) {
+            if (ops[i] > pr->last_op ||
+                    !(pr->ops[ops[i]].flags & IO_URING_OP_SUPPORTED)) {
+                ret = -EOPNOTSUPP;
+            }
+        }
+    }
+    pr = KFS_FREE(pr);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Register an empty table of files, to be filled by uring_register_fd().
+ * Older kernels do not allow empty slots: then files are not registered.
+ */
+static void
+register_files(struct uring *ring)
+{
+    int *fds = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ring->num_files = 0;
+    fds = KFS_MALLOC(URING_FILES * sizeof(*fds));
+    ring->registered = KFS_CALLOC(URING_FILES, sizeof(*ring->registered));
+    if (fds == NULL || ring->registered == NULL) {
+        if (fds != NULL) {
+            fds = KFS_FREE(fds);
+        }
+        KFS_RETURN();
+    }
+    for (i = 0; i < URING_FILES; i++) {
+        fds[i] = -1;
+    }
+    ret = sys_io_uring_register(ring->fd, IORING_REGISTER_FILES, fds,
+            URING_FILES);
+    if (ret == 0) {
+        ring->num_files = URING_FILES;
+    } else {
+        KFS_INFO("Not registering files with io_uring: %s", strerror(errno));
+    }
+    fds = KFS_FREE(fds);
+
+    KFS_RETURN();
+}
+
+/**
+ * Create a ring of given size. Returns NULL if io_uring can not be used.
+ */
+struct uring *
+uring_new(uint_t entries)
+{
+    struct io_uring_params p;
+    struct uring *ring = NULL;
+    unsigned *array = NULL;
+    uint_t i = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ring = KFS_CALLOC(1, sizeof(*ring));
+    if (ring == NULL) {
+        KFS_RETURN(NULL);
+    }
+    ring->sq_ptr = ring->cq_ptr = ring->sqes = MAP_FAILED;
+    memset(&p, 0, sizeof(p));
+    ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (ring->fd == -1) {
+        KFS_WARNING("io_uring is not available: %s", strerror(errno));
+        ring = KFS_FREE(ring);
+        KFS_RETURN(NULL);
+    }
+    ret = probe(ring->fd);
+    if (ret != 0) {
+        KFS_WARNING("io_uring can not be used: %s", strerror(-ret));
+        ring = uring_del(ring);
+        KFS_RETURN(NULL);
+    }
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->sq_size = ring->cq_size = MAX(ring->sq_size, ring->cq_size);
+    }
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_ptr != MAP_FAILED && (p.features & IORING_FEAT_SINGLE_MMAP)) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else if (ring->sq_ptr != MAP_FAILED) {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    }
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    if (ring->cq_ptr != MAP_FAILED) {
+        ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    }
+    if (ring->sqes == MAP_FAILED) {
+        KFS_WARNING("Mapping the io_uring failed: %s", strerror(errno));
+        ring = uring_del(ring);
+        KFS_RETURN(NULL);
+    }
+    ring->sq_head = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.head);
+    ring->sq_tail = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.tail);
+    ring->sq_mask = *(unsigned *) ((char *) ring->sq_ptr + p.sq_off.ring_mask);
+    array = (unsigned *) ((char *) ring->sq_ptr + p.sq_off.array);
+    ring->cq_head = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.head);
+    ring->cq_tail = (unsigned *) ((char *) ring->cq_ptr + p.cq_off.tail);
+    ring->cq_mask = *(unsigned *) ((char *) ring->cq_ptr + p.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *) ((char *) ring->cq_ptr +
+            p.cq_off.cqes);
+    /* Slot i of the submission ring always holds entry i. */
+    for (i = 0; i < p.sq_entries; i++) {
+        array[i] = i;
+    }
+    ring->entries = p.sq_entries;
+    ring->inflight = ring->unsubmitted = ring->leader = 0;
+    ret = kfs_mutex_init(&ring->lock);
+    if (ret == 0) {
+        ret = kfs_cond_init(&ring->completed);
+        if (ret != 0) {
+            kfs_mutex_destroy(&ring->lock);
+        }
+    }
+    if (ret != 0) {
+        ring = uring_del(ring);
+        KFS_RETURN(NULL);
+    }
+    register_files(ring);
+    KFS_INFO("Using io_uring with %u entries.", ring->entries);
+
+    KFS_RETURN(ring);
+}
+
+/**
+ * Tear down a ring. No requests may be in progress.
+ */
+struct uring *
+uring_del(struct uring *ring)
+{
+    KFS_ENTER();
+
+    KFS_ASSERT(ring != NULL && ring->inflight == 0);
+    if (ring->entries != 0) {
+        kfs_cond_destroy(&ring->completed);
+        kfs_mutex_destroy(&ring->lock);
+    }
+    if (ring->registered != NULL) {
+        ring->registered = KFS_FREE(ring->registered);
+    }
+    if (ring->sqes != MAP_FAILED) {
+        munmap(ring->sqes, ring->sqes_size);
+    }
+    if (ring->cq_ptr != MAP_FAILED && ring->cq_ptr != ring->sq_ptr) {
+        munmap(ring->cq_ptr, ring->cq_size);
+    }
+    if (ring->sq_ptr != MAP_FAILED) {
+        munmap(ring->sq_ptr, ring->sq_size);
+    }
+    close(ring->fd);
+    ring = KFS_FREE(ring);
+
+    KFS_RETURN(NULL);
+}
+
+static void
+update_file(struct uring *ring, int fd, int value)
+{
+    struct io_uring_files_update up;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    memset(&up, 0, sizeof(up));
+    up.offset = fd;
+    up.fds = (uintptr_t) &value;
+    ret = sys_io_uring_register(ring->fd, IORING_REGISTER_FILES_UPDATE, &up, 1);
+    if (ret == 1) {
+        kfs_atomic_store(&ring->registered[fd], value != -1);
+    } else if (value == -1) {
+        /* The ring would keep the file open. */
+        KFS_ERROR("Unregistering file %d from io_uring failed: %s", fd,
+                strerror(errno));
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Register a newly opened file with the ring, if its number is low enough.
+ */
+void
+uring_register_fd(struct uring *ring, int fd)
+{
+    KFS_ENTER();
+
+    if (fd >= 0 && (uint_t) fd < ring->num_files) {
+        update_file(ring, fd, fd);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Unregister a file before it is closed: the ring holds a reference to it.
+ */
+void
+uring_unregister_fd(struct uring *ring, int fd)
+{
+    KFS_ENTER();
+
+    if (fd >= 0 && (uint_t) fd < ring->num_files &&
+            kfs_atomic_load(&ring->registered[fd])) {
+        update_file(ring, fd, -1);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Hand out all completions that have arrived. Caller must hold the lock.
+ */
+static void
+reap(struct uring *ring)
+{
+    struct io_uring_cqe *cqe = NULL;
+    struct uring_req *req = NULL;
+    unsigned head = *ring->cq_head;
+    const unsigned tail = kfs_atomic_load(ring->cq_tail);
+
+    KFS_ENTER();
+
+    for (; head != tail; head++) {
+        cqe = &ring->cqes[head & ring->cq_mask];
+        req = (struct uring_req *) (uintptr_t) cqe->user_data;
+        req->res = cqe->res;
+        req->done = 1;
+        ring->inflight--;
+    }
+    kfs_atomic_store(ring->cq_head, head);
+
+    KFS_RETURN();
+}
+
+/**
+ * Pass n queued requests to the kernel, waiting for at least one completion if
+ * wait is set. Called without the lock, returns with it.
+ */
+static void
+enter(struct uring *ring, uint_t n, uint_t wait)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    ret = sys_io_uring_enter(ring->fd, n, wait ? 1 : 0,
+            wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        KFS_ERROR("io_uring_enter: %s", strerror(errno));
+    }
+    kfs_mutex_lock(&ring->lock);
+    /* Whatever the kernel did not take must be passed again. */
+    ring->unsubmitted += n - (ret > 0 ? MIN((uint_t) ret, n) : 0);
+
+    KFS_RETURN();
+}
+
+/**
+ * Queue a request prepared in sqe and wait for its result.
+ */
+static int
+run(struct uring *ring, const struct io_uring_sqe *sqe)
+{
+    struct uring_req req;
+    struct io_uring_sqe *slot = NULL;
+    unsigned tail = 0;
+    uint_t n = 0;
+
+    KFS_ENTER();
+
+    req.res = 0;
+    req.done = 0;
+    kfs_mutex_lock(&ring->lock);
+    while (ring->inflight == ring->entries) {
+        kfs_cond_wait(&ring->completed, &ring->lock);
+    }
+    ring->inflight++;
+    tail = *ring->sq_tail;
+    slot = &ring->sqes[tail & ring->sq_mask];
+    memcpy(slot, sqe, sizeof(*slot));
+    slot->user_data = (uintptr_t) &req;
+    kfs_atomic_store(ring->sq_tail, tail + 1);
+    ring->unsubmitted++;
+    if (ring->leader) {
+        /* The leader is in the kernel already: only submit. */
+        n = ring->unsubmitted;
+        ring->unsubmitted = 0;
+        kfs_mutex_unlock(&ring->lock);
+        enter(ring, n, 0);
+    }
+    while (!req.done) {
+        if (ring->leader) {
+            kfs_cond_wait(&ring->completed, &ring->lock);
+            continue;
+        }
+        ring->leader = 1;
+        n = ring->unsubmitted;
+        ring->unsubmitted = 0;
+        kfs_mutex_unlock(&ring->lock);
+        enter(ring, n, 1);
+        ring->leader = 0;
+        reap(ring);
+        kfs_cond_broadcast(&ring->completed);
+    }
+    kfs_mutex_unlock(&ring->lock);
+
+    KFS_RETURN(req.res);
+}
+
+static void
+prep(struct uring *ring, struct io_uring_sqe *sqe, int opcode, int fd)
+{
+    KFS_ENTER();
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    if (fd >= 0 && (uint_t) fd < ring->num_files &&
+            kfs_atomic_load(&ring->registered[fd])) {
+        sqe->flags = IOSQE_FIXED_FILE;
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Like pread(), but returns -errno on failure.
+ */
+ssize_t
+uring_pread(struct uring *ring, int fd, void *buf, size_t size, off_t off)
+{
+    struct io_uring_sqe sqe;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    prep(ring, &sqe, IORING_OP_READ, fd);
+    sqe.addr = (uintptr_t) buf;
+    sqe.len = MIN(size, (size_t) INT32_MAX);
+    sqe.off = off;
+    ret = run(ring, &sqe);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Like pwrite(), but returns -errno on failure.
+ */
+ssize_t
+uring_pwrite(struct uring *ring, int fd, const void *buf, size_t size, off_t
+        off)
+{
+    struct io_uring_sqe sqe;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    prep(ring, &sqe, IORING_OP_WRITE, fd);
+    sqe.addr = (uintptr_t) buf;
+    sqe.len = MIN(size, (size_t) INT32_MAX);
+    sqe.off = off;
+    ret = run(ring, &sqe);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Like fsync() or fdatasync(), but returns -errno on failure.
+ */
+int
+uring_fsync(struct uring *ring, int fd, int datasync)
+{
+    struct io_uring_sqe sqe;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    prep(ring, &sqe, IORING_OP_FSYNC, fd);
+    if (datasync) {
+        sqe.fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    ret = run(ring, &sqe);
+
+    KFS_RETURN(ret);
+}
+
+#else
+
+/*
+ * No io_uring on this system: uring_new() always fails, so the others are
+ * never called.
+ */
+
+struct uring *
+uring_new(uint_t entries)
+{
+    (void) entries;
+
+    KFS_ENTER();
+
+    KFS_WARNING("io_uring is not supported on this system.");
+
+    KFS_RETURN(NULL);
+}
+
+struct uring *
+uring_del(struct uring *ring)
+{
+    (void) ring;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(NULL);
+}
+
+void
+uring_register_fd(struct uring *ring, int fd)
+{
+    (void) ring;
+    (void) fd;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN();
+}
+
+void
+uring_unregister_fd(struct uring *ring, int fd)
+{
+    (void) ring;
+    (void) fd;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN();
+}
+
+ssize_t
+uring_pread(struct uring *ring, int fd, void *buf, size_t size, off_t off)
+{
+    (void) ring;
+    (void) fd;
+    (void) buf;
+    (void) size;
+    (void) off;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(-ENOSYS);
+}
+
+ssize_t
+uring_pwrite(struct uring *ring, int fd, const void *buf, size_t size, off_t
+        off)
+{
+    (void) ring;
+    (void) fd;
+    (void) buf;
+    (void) size;
+    (void) off;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(-ENOSYS);
+}
+
+int
+uring_fsync(struct uring *ring, int fd, int datasync)
+{
+    (void) ring;
+    (void) fd;
+    (void) datasync;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(0);
+
+    KFS_RETURN(-ENOSYS);
+}
+
+#endif
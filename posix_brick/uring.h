@@ -0,0 +1,21 @@
+#ifndef KFS_POSIX_BRICK_URING_H
+#define KFS_POSIX_BRICK_URING_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "kfs.h"
+
+struct uring;
+
+struct uring * uring_new(uint_t entries);
+struct uring * uring_del(struct uring *ring);
+void uring_register_fd(struct uring *ring, int fd);
+void uring_unregister_fd(struct uring *ring, int fd);
+ssize_t uring_pread(struct uring *ring, int fd, void *buf, size_t size, off_t
+        off);
+ssize_t uring_pwrite(struct uring *ring, int fd, const void *buf, size_t size,
+        off_t off);
+int uring_fsync(struct uring *ring, int fd, int datasync);
+
+#endif
@@ -0,0 +1,506 @@
+/**
+ * Directory tree warm-up for the POSIX brick: walks a subtree with a pool of
+ * threads and looks at every entry, so its directory blocks and inodes are in
+ * the kernel caches before anybody asks for them. Meant for the first minutes
+ * after a reboot, when every lookup would otherwise be a disk seek.
+ *
+ * Directories waiting to be walked are kept in a heap and taken in order of
+ * inode number, and the entries of a directory are examined in that order as
+ * well: on most file systems that is roughly the order they are on disk. The
+ * walk does not follow symbolic links and stays on the file system of the
+ * root.
+ */
+
+/* Macro is necessary to get O_DIRECTORY, O_NOFOLLOW and syscall(). */
+#define _GNU_SOURCE
+
+#include "posix_brick/warmup.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+#ifdef __linux__
+#  include <sys/syscall.h>
+#  ifdef SYS_openat2
+#    include <linux/openat2.h>
+#  endif
+#endif
+
+#include "kfs.h"
+#include "kfs_logging.h"
+#include "kfs_memory.h"
+#include "kfs_misc.h"
+#include "kfs_threading.h"
+
+#ifndef O_CLOEXEC
+#  define O_CLOEXEC 0
+#endif
+
+/** A directory waiting to be walked. */
+struct warm_dir {
+    ino_t ino;
+    /** Relative to the root, "." for the root itself. */
+    char path[];
+};
+
+/** An entry of the directory being walked. */
+struct warm_entry {
+    ino_t ino;
+    char *name;
+};
+
+struct warmup {
+    int rootfd;
+    dev_t rootdev;
+    uint_t num_threads;
+    /** The threads are only started by the first warm-up. */
+    kfs_threadid_t *threads;
+    uint_t num_started;
+    /** Set once openat2() turned out not to be supported by the kernel. */
+    uint_t no_openat2;
+    /** Protects everything below. */
+    kfs_mutex_t lock;
+    /** Signalled when a directory is queued or the threads must stop. */
+    kfs_cond_t cond;
+    /** Min-heap on inode number. */
+    struct warm_dir **heap;
+    size_t heap_len;
+    size_t heap_cap;
+    /** Directories being walked right now, and the ones done so far. */
+    uint_t busy;
+    uint64_t done;
+    uint_t stopping;
+};
+
+/**
+ * Returns NULL on failure.
+ */
+struct warmup *
+warmup_new(int rootfd, uint_t num_threads)
+{
+    struct warmup *wu = NULL;
+    struct stat stbuf;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(num_threads > 0);
+    ret = fstat(rootfd, &stbuf);
+    if (ret == -1) {
+        KFS_RETURN(NULL);
+    }
+    wu = KFS_CALLOC(1, sizeof(*wu));
+    if (wu == NULL) {
+        KFS_RETURN(NULL);
+    }
+    wu->threads = KFS_CALLOC(num_threads, sizeof(*wu->threads));
+    if (wu->threads == NULL) {
+        wu = KFS_FREE(wu);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_mutex_init(&wu->lock);
+    if (ret != 0) {
+        wu->threads = KFS_FREE(wu->threads);
+        wu = KFS_FREE(wu);
+        KFS_RETURN(NULL);
+    }
+    ret = kfs_cond_init(&wu->cond);
+    if (ret != 0) {
+        kfs_mutex_destroy(&wu->lock);
+        wu->threads = KFS_FREE(wu->threads);
+        wu = KFS_FREE(wu);
+        KFS_RETURN(NULL);
+    }
+    wu->rootfd = rootfd;
+    wu->rootdev = stbuf.st_dev;
+    wu->num_threads = num_threads;
+
+    KFS_RETURN(wu);
+}
+
+/**
+ * Stop walking (whatever is still queued is forgotten) and free all
+ * resources.
+ */
+struct warmup *
+warmup_del(struct warmup *wu)
+{
+    uint_t i = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(wu != NULL);
+    kfs_mutex_lock(&wu->lock);
+    kfs_atomic_store(&wu->stopping, 1);
+    kfs_cond_broadcast(&wu->cond);
+    kfs_mutex_unlock(&wu->lock);
+    for (i = 0; i < wu->num_started; i++) {
+        kfs_thread_join(wu->threads[i]);
+    }
+    while (wu->heap_len > 0) {
+        wu->heap_len--;
+        wu->heap[wu->heap_len] = KFS_FREE(wu->heap[wu->heap_len]);
+    }
+    if (wu->heap != NULL) {
+        wu->heap = KFS_FREE(wu->heap);
+    }
+    kfs_cond_destroy(&wu->cond);
+    kfs_mutex_destroy(&wu->lock);
+    wu->threads = KFS_FREE(wu->threads);
+    wu = KFS_FREE(wu);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Add a directory to the heap. Must be called with the lock held. Returns 0
+ * or -ENOMEM.
+ */
+static int
+heap_push(struct warmup *wu, struct warm_dir *dir)
+{
+    struct warm_dir **heap = NULL;
+    struct warm_dir *tmp = NULL;
+    size_t i = 0;
+
+    KFS_ENTER();
+
+    if (wu->heap_len == wu->heap_cap) {
+        if (wu->heap == NULL) {
+            heap = KFS_MALLOC(64 * sizeof(*heap));
+        } else {
+            heap = KFS_REALLOC(wu->heap, wu->heap_cap * 2 * sizeof(*heap));
+        }
+        if (heap == NULL) {
+            KFS_RETURN(-ENOMEM);
+        }
+        wu->heap = heap;
+        wu->heap_cap = MAX(wu->heap_cap * 2, 64);
+    }
+    i = wu->heap_len++;
+    wu->heap[i] = dir;
+    while (i > 0 && wu->heap[(i - 1) / 2]->ino > wu->heap[i]->ino) {
+        tmp = wu->heap[(i - 1) / 2];
+        wu->heap[(i - 1) / 2] = wu->heap[i];
+        wu->heap[i] = tmp;
+        i = (i - 1) / 2;
+    }
+
+    KFS_RETURN(0);
+}
+
+/**
+ * Take the directory with the lowest inode number from a non-empty heap. Must
+ * be called with the lock held.
+ */
+static struct warm_dir *
+heap_pop(struct warmup *wu)
+{
+    struct warm_dir * const top = wu->heap[0];
+    struct warm_dir *tmp = NULL;
+    size_t i = 0;
+    size_t child = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(wu->heap_len > 0);
+    wu->heap_len--;
+    wu->heap[0] = wu->heap[wu->heap_len];
+    for (;;) {
+        child = 2 * i + 1;
+        if (child >= wu->heap_len) {
+            break;
+        }
+        if (child + 1 < wu->heap_len &&
+                wu->heap[child + 1]->ino < wu->heap[child]->ino) {
+            child++;
+        }
+        if (wu->heap[i]->ino <= wu->heap[child]->ino) {
+            break;
+        }
+        tmp = wu->heap[i];
+        wu->heap[i] = wu->heap[child];
+        wu->heap[child] = tmp;
+        i = child;
+    }
+
+    KFS_RETURN(top);
+}
+
+static struct warm_dir *
+new_dir(const char *parent, const char *name, ino_t ino)
+{
+    struct warm_dir *dir = NULL;
+    size_t len = 0;
+
+    KFS_ENTER();
+
+    if (strcmp(parent, ".") == 0) {
+        parent = NULL;
+    }
+    len = (parent == NULL ? 0 : strlen(parent) + 1) + strlen(name);
+    dir = KFS_MALLOC(sizeof(*dir) + len + 1);
+    if (dir == NULL) {
+        KFS_RETURN(NULL);
+    }
+    dir->ino = ino;
+    if (parent == NULL) {
+        strcpy(dir->path, name);
+    } else {
+        sprintf(dir->path, "%s/%s", parent, name);
+    }
+
+    KFS_RETURN(dir);
+}
+
+/**
+ * Open a directory below the root for reading, without following symbolic
+ * links. Returns the file descriptor or -1.
+ */
+static int
+open_dir(struct warmup *wu, const char *path)
+{
+    int fd = 0;
+#ifdef SYS_openat2
+    struct open_how how;
+#endif
+
+    KFS_ENTER();
+
+#ifdef SYS_openat2
+    if (!kfs_atomic_load(&wu->no_openat2)) {
+        memset(&how, 0, sizeof(how));
+        how.flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        how.resolve = RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS |
+            RESOLVE_NO_SYMLINKS;
+        fd = syscall(SYS_openat2, wu->rootfd, path, &how, sizeof(how));
+        if (fd != -1 || errno != ENOSYS) {
+            KFS_RETURN(fd);
+        }
+        kfs_atomic_store(&wu->no_openat2, 1);
+    }
+#endif
+    /*
+     * The path was put together from directory entries, only its components
+     * could have been replaced by symbolic links since.
+     */
+    fd = openat(wu->rootfd, path, O_RDONLY | O_DIRECTORY | O_NOFOLLOW |
+            O_CLOEXEC);
+
+    KFS_RETURN(fd);
+}
+
+static int
+cmp_entry(const void *a, const void *b)
+{
+    const struct warm_entry * const ea = a;
+    const struct warm_entry * const eb = b;
+
+    KFS_ENTER();
+
+    KFS_RETURN(ea->ino < eb->ino ? -1 : ea->ino > eb->ino);
+}
+
+/**
+ * Look at every entry of a directory, in order of inode number, and queue its
+ * subdirectories.
+ */
+static void
+walk_dir(struct warmup *wu, const struct warm_dir *dir)
+{
+    struct warm_entry *entries = NULL;
+    struct warm_entry *tmp = NULL;
+    struct warm_dir **subdirs = NULL;
+    struct dirent *de = NULL;
+    struct stat stbuf;
+    DIR *dirp = NULL;
+    size_t num_entries = 0;
+    size_t cap = 0;
+    size_t num_subdirs = 0;
+    size_t i = 0;
+    int fd = 0;
+
+    KFS_ENTER();
+
+    fd = open_dir(wu, dir->path);
+    if (fd == -1) {
+        KFS_RETURN();
+    }
+    dirp = fdopendir(fd);
+    if (dirp == NULL) {
+        close(fd);
+        KFS_RETURN();
+    }
+    while ((de = readdir(dirp)) != NULL && !kfs_atomic_load(&wu->stopping)) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (num_entries == cap) {
+            if (entries == NULL) {
+                tmp = KFS_MALLOC(64 * sizeof(*tmp));
+            } else {
+                tmp = KFS_REALLOC(entries, cap * 2 * sizeof(*tmp));
+            }
+            if (tmp == NULL) {
+                break;
+            }
+            entries = tmp;
+            cap = MAX(cap * 2, 64);
+        }
+        entries[num_entries].name = kfs_strcpy(de->d_name);
+        if (entries[num_entries].name == NULL) {
+            break;
+        }
+        entries[num_entries].ino = de->d_ino;
+        num_entries++;
+    }
+    qsort(entries, num_entries, sizeof(*entries), cmp_entry);
+    subdirs = KFS_MALLOC(MAX(num_entries, 1) * sizeof(*subdirs));
+    for (i = 0; i < num_entries; i++) {
+        if (!kfs_atomic_load(&wu->stopping) && fstatat(dirfd(dirp),
+                    entries[i].name, &stbuf, AT_SYMLINK_NOFOLLOW) == 0 &&
+                S_ISDIR(stbuf.st_mode) && stbuf.st_dev == wu->rootdev &&
+                subdirs != NULL) {
+            subdirs[num_subdirs] = new_dir(dir->path, entries[i].name,
+                    stbuf.st_ino);
+            if (subdirs[num_subdirs] != NULL) {
+                num_subdirs++;
+            }
+        }
+        entries[i].name = KFS_FREE(entries[i].name);
+    }
+    closedir(dirp);
+    if (entries != NULL) {
+        entries = KFS_FREE(entries);
+    }
+    kfs_mutex_lock(&wu->lock);
+    for (i = 0; i < num_subdirs; i++) {
+        if (heap_push(wu, subdirs[i]) != 0) {
+            subdirs[i] = KFS_FREE(subdirs[i]);
+        }
+    }
+    if (num_subdirs > 0) {
+        kfs_cond_broadcast(&wu->cond);
+    }
+    kfs_mutex_unlock(&wu->lock);
+    if (subdirs != NULL) {
+        subdirs = KFS_FREE(subdirs);
+    }
+
+    KFS_RETURN();
+}
+
+/**
+ * Main loop of every thread.
+ */
+static void *
+worker(void *arg)
+{
+    struct warmup * const wu = arg;
+    struct warm_dir *dir = NULL;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&wu->lock);
+    for (;;) {
+        while (wu->heap_len == 0 && !wu->stopping) {
+            kfs_cond_wait(&wu->cond, &wu->lock);
+        }
+        if (wu->stopping) {
+            break;
+        }
+        dir = heap_pop(wu);
+        wu->busy++;
+        kfs_mutex_unlock(&wu->lock);
+        walk_dir(wu, dir);
+        dir = KFS_FREE(dir);
+        kfs_mutex_lock(&wu->lock);
+        wu->busy--;
+        wu->done++;
+        if (wu->busy == 0 && wu->heap_len == 0) {
+            KFS_INFO("Warm-up done: %llu directories.", (unsigned long long)
+                    wu->done);
+        }
+    }
+    kfs_mutex_unlock(&wu->lock);
+
+    KFS_RETURN(NULL);
+}
+
+/**
+ * Warm up the tree below given directory (relative to the root, starting with
+ * a slash, and known to stay inside of it) in the background. The threads are
+ * started the first time. Returns 0, -EBUSY while an earlier walk is not done
+ * yet, or another -errno.
+ */
+int
+warmup_start(struct warmup *wu, const char *path)
+{
+    struct warm_dir *dir = NULL;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    KFS_ASSERT(path[0] == '/');
+    dir = new_dir(".", path[1] == '\0' ? "." : path + 1, 0);
+    if (dir == NULL) {
+        KFS_RETURN(-ENOMEM);
+    }
+    kfs_mutex_lock(&wu->lock);
+    /* One walk at a time, starting another would mostly repeat it. */
+    if (wu->heap_len + wu->busy > 0) {
+        kfs_mutex_unlock(&wu->lock);
+        dir = KFS_FREE(dir);
+        KFS_RETURN(-EBUSY);
+    }
+    while (wu->num_started < wu->num_threads) {
+        ret = kfs_thread_create(&wu->threads[wu->num_started], worker, wu);
+        if (ret != 0) {
+            KFS_ERROR("Could not start warm-up thread: %s", strerror(ret));
+            break;
+        }
+        wu->num_started++;
+    }
+    if (wu->num_started == 0) {
+        kfs_mutex_unlock(&wu->lock);
+        dir = KFS_FREE(dir);
+        KFS_RETURN(-ret);
+    }
+    ret = heap_push(wu, dir);
+    if (ret != 0) {
+        dir = KFS_FREE(dir);
+    } else {
+        kfs_cond_signal(&wu->cond);
+    }
+    kfs_mutex_unlock(&wu->lock);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Describe the progress in buf, like snprintf(): returns the length of the
+ * whole description.
+ */
+size_t
+warmup_status(struct warmup *wu, char *buf, size_t size)
+{
+    int ret = 0;
+
+    KFS_ENTER();
+
+    kfs_mutex_lock(&wu->lock);
+    ret = snprintf(buf, size, "warmup.pending=%lu\nwarmup.done=%llu\n",
+            (unsigned long) (wu->heap_len + wu->busy), (unsigned long long)
+            wu->done);
+    kfs_mutex_unlock(&wu->lock);
+    KFS_ASSERT(ret >= 0);
+
+    KFS_RETURN(ret);
+}
@@ -0,0 +1,15 @@
+#ifndef KFS_POSIX_BRICK_WARMUP_H
+#define KFS_POSIX_BRICK_WARMUP_H
+
+#include <stddef.h>
+
+#include "kfs.h"
+
+struct warmup;
+
+struct warmup * warmup_new(int rootfd, uint_t num_threads);
+struct warmup * warmup_del(struct warmup *wu);
+int warmup_start(struct warmup *wu, const char *path);
+size_t warmup_status(struct warmup *wu, char *buf, size_t size);
+
+#endif
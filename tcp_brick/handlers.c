@@ -858,6 +858,69 @@ tcpc_utimens(const kfs_context_t co, const char *path, const struct timespec
     KFS_RETURN(ret);
 }
 
+static int
+tcpc_fallocate(const kfs_context_t co, const char *path, int mode, off_t
+        offset, off_t len, struct fuse_file_info *ffi)
+{
+    (void) co;
+    (void) path;
+
+    char operbuf[28 + 6];
+    uint64_t val64 = 0;
+    uint32_t val32 = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* The file handle. */
+    memcpy(operbuf + 6, &ffi->fh, 8);
+    val32 = htonl(mode);
+    memcpy(operbuf + 14, &val32, 4);
+    val64 = htonll(offset);
+    memcpy(operbuf + 18, &val64, 8);
+    val64 = htonll(len);
+    memcpy(operbuf + 26, &val64, 8);
+    ret = do_operation_wrapper(KFS_OPID_FALLOCATE, operbuf, 28, NULL, 0, NULL);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * The server copies the data, it does not go over the network.
+ */
+static int
+tcpc_copy_file_range(const kfs_context_t co, const char *path_in, struct
+        fuse_file_info *fi_in, off_t offset_in, const char *path_out, struct
+        fuse_file_info *fi_out, off_t offset_out, size_t size, int flags)
+{
+    (void) co;
+    (void) path_in;
+    (void) path_out;
+
+    char operbuf[40 + 6];
+    uint64_t val64 = 0;
+    uint32_t val32 = 0;
+    int ret = 0;
+
+    KFS_ENTER();
+
+    /* The file handles, offsets and number of bytes. */
+    memcpy(operbuf + 6, &fi_in->fh, 8);
+    val64 = htonll(offset_in);
+    memcpy(operbuf + 14, &val64, 8);
+    memcpy(operbuf + 22, &fi_out->fh, 8);
+    val64 = htonll(offset_out);
+    memcpy(operbuf + 30, &val64, 8);
+    val32 = htonl(MIN(size, INT32_MAX));
+    memcpy(operbuf + 38, &val32, 4);
+    val32 = htonl(flags);
+    memcpy(operbuf + 42, &val32, 4);
+    ret = do_operation_wrapper(KFS_OPID_COPY_FILE_RANGE, operbuf, 40, NULL, 0,
+            NULL);
+
+    KFS_RETURN(ret);
+}
+
 static const struct kfs_operations handlers = {
     .getattr = tcpc_getattr,
     .readlink = tcpc_readlink,
@@ -897,6 +960,8 @@ static const struct kfs_operations handlers = {
     .ioctl = nosys_ioctl,
     .poll = nosys_poll,
 #endif
+    .fallocate = tcpc_fallocate,
+    .copy_file_range = tcpc_copy_file_range,
 };
 
 int
@@ -90,6 +90,9 @@ enum fuse_op_id {
     KFS_OPID_IOCTL,
     KFS_OPID_POLL,
     KFS_OPID_QUIT,
+    /* After QUIT, to keep the older identifiers the same. */
+    KFS_OPID_COPY_FILE_RANGE,
+    KFS_OPID_FALLOCATE,
     KFS_OPID_MAX_
 };
 
@@ -1056,6 +1056,100 @@ handle_utimens(client_t c, const char *rawop, size_t opsize)
     KFS_RETURN(ret);
 }
 
+/**
+ * Handle a fallocate operation. The argument message is built up as follows:
+ *
+ * - filehandle (8 bytes).
+ * - mode (4 bytes, network order).
+ * - offset in the file (8 bytes, network order).
+ * - length of the range (8 bytes, network order).
+ *
+ * The return message is empty.
+ */
+static int
+handle_fallocate(client_t c, const char *rawop, size_t opsize)
+{
+    char resultbuf[8];
+    struct fuse_file_info ffi;
+    uint64_t offset = 0;
+    uint64_t len = 0;
+    uint32_t mode = 0;
+    int ret = 0;
+    struct kfs_context context;
+
+    KFS_ENTER();
+
+    if (opsize != 28) {
+        report_error(c, EINVAL);
+        KFS_RETURN(-1);
+    }
+    kfs_init_context(&context);
+    memset(&ffi, 0, sizeof(ffi));
+    memcpy(&ffi.fh, rawop, 8);
+    memcpy(&mode, rawop + 8, 4);
+    mode = ntohl(mode);
+    memcpy(&offset, rawop + 12, 8);
+    offset = ntohll(offset);
+    memcpy(&len, rawop + 20, 8);
+    len = ntohll(len);
+    ret = oper->fallocate(&context, NULL, mode, offset, len, &ffi);
+    ret = send_reply(c, ret, resultbuf, 0);
+
+    KFS_RETURN(ret);
+}
+
+/**
+ * Handle a copy_file_range operation. The argument message is built up as
+ * follows:
+ *
+ * - filehandle of the input file (8 bytes).
+ * - offset in the input file (8 bytes, network order).
+ * - filehandle of the output file (8 bytes).
+ * - offset in the output file (8 bytes, network order).
+ * - number of bytes to copy (4 bytes, network order).
+ * - flags (4 bytes, network order).
+ *
+ * The return value is the number of bytes copied, the return message is empty.
+ */
+static int
+handle_copy_file_range(client_t c, const char *rawop, size_t opsize)
+{
+    char resultbuf[8];
+    struct fuse_file_info ffi_in;
+    struct fuse_file_info ffi_out;
+    uint64_t offset_in = 0;
+    uint64_t offset_out = 0;
+    uint32_t size = 0;
+    uint32_t flags = 0;
+    int ret = 0;
+    struct kfs_context context;
+
+    KFS_ENTER();
+
+    if (opsize != 40) {
+        report_error(c, EINVAL);
+        KFS_RETURN(-1);
+    }
+    kfs_init_context(&context);
+    memset(&ffi_in, 0, sizeof(ffi_in));
+    memset(&ffi_out, 0, sizeof(ffi_out));
+    memcpy(&ffi_in.fh, rawop, 8);
+    memcpy(&offset_in, rawop + 8, 8);
+    offset_in = ntohll(offset_in);
+    memcpy(&ffi_out.fh, rawop + 16, 8);
+    memcpy(&offset_out, rawop + 24, 8);
+    offset_out = ntohll(offset_out);
+    memcpy(&size, rawop + 32, 4);
+    size = ntohl(size);
+    memcpy(&flags, rawop + 36, 4);
+    flags = ntohl(flags);
+    ret = oper->copy_file_range(&context, NULL, &ffi_in, offset_in, NULL,
+            &ffi_out, offset_out, size, flags);
+    ret = send_reply(c, ret, resultbuf, 0);
+
+    KFS_RETURN(ret);
+}
+
 /**
  * Handles a QUIT message.
  */
@@ -1121,6 +1215,8 @@ static const handler_t handlers[KFS_OPID_MAX_] = {
     [KFS_OPID_POLL] = NULL,
 #endif
     [KFS_OPID_QUIT] = handle_quit,
+    [KFS_OPID_COPY_FILE_RANGE] = handle_copy_file_range,
+    [KFS_OPID_FALLOCATE] = handle_fallocate,
 };
 
 void